@@ -77,6 +77,8 @@ binary = 'ninja.bootstrap'
 if sys.platform.startswith('win32'):
     binary = 'ninja.bootstrap.exe'
 args.extend(sources)
+if not sys.platform.startswith('win32'):
+    args.append('-lpthread')
 if vcdir:
     args.extend(['/link', '/out:' + binary])
 else:
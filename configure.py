@@ -205,26 +205,49 @@ n.build(src('lexer.cc'), 're2c', src('lexer.in.cc'))
 n.newline()
 
 n.comment('Core source files all build into ninja library.')
-for name in ['build',
+for name in ['affected',
+             'arena',
+             'auto_parallelism',
+             'build',
              'build_log',
+             'byte_scan',
              'clean',
+             'command_output',
+             'deps_log',
              'depfile_parser',
              'disk_interface',
              'edit_distance',
              'eval_env',
              'graph',
              'graphviz',
+             'jobserver',
              'lexer',
+             'manifest_snapshot',
+             'memory_stats',
              'metrics',
+             'output_cache',
              'parsers',
+             'path_index',
+             'profile',
+             'query',
+             'session',
+             'shard',
+             'simulate',
+             'stat_cache',
              'state',
+             'threads',
+             'trace',
              'util']:
     objs += cxx(name)
 if platform == 'mingw' or platform == 'windows':
     objs += cxx('subprocess-win32')
     objs += cc('getopt')
 else:
+    objs += cxx('remote')
+    objs += cxx('serve')
     objs += cxx('subprocess')
+if platform == 'linux':
+    objs += cxx('change_journal')
 if platform == 'windows':
     ninja_lib = n.build(built('ninja.lib'), 'ar', objs)
 else:
@@ -235,6 +258,8 @@ if platform == 'windows':
     libs.append('ninja.lib')
 else:
     libs.append('-lninja')
+if platform not in ('mingw', 'windows'):
+    libs.append('-lpthread')
 
 all_targets = []
 
@@ -270,36 +295,68 @@ elif platform == 'windows':
 else:
     test_libs.extend(['-lgtest_main', '-lgtest'])
 
-for name in ['build_log_test',
+for name in ['affected_test',
+             'arena_test',
+             'auto_parallelism_test',
+             'build_log_test',
              'build_test',
+             'byte_scan_test',
              'clean_test',
+             'command_output_test',
              'depfile_parser_test',
+             'deps_log_test',
              'disk_interface_test',
              'edit_distance_test',
+             'eval_env_test',
              'graph_test',
+             'graphviz_test',
+             'hash_map_test',
+             'jobserver_test',
              'lexer_test',
+             'manifest_snapshot_test',
+             'memory_stats_test',
+             'metrics_test',
+             'output_cache_test',
              'parsers_test',
+             'path_index_test',
+             'profile_test',
+             'query_test',
+             'session_test',
+             'shard_test',
+             'simulate_test',
+             'stat_cache_test',
              'state_test',
              'subprocess_test',
              'test',
+             'threads_test',
+             'trace_test',
              'util_test']:
     objs += cxx(name, variables=[('cflags', test_cflags)])
+if platform not in ('mingw', 'windows'):
+    objs += cxx('remote_test', variables=[('cflags', test_cflags)])
+    objs += cxx('serve_test', variables=[('cflags', test_cflags)])
+if platform == 'linux':
+    objs += cxx('change_journal_test', variables=[('cflags', test_cflags)])
 
-if platform != 'mingw' and platform != 'windows':
-    test_libs.append('-lpthread')
 ninja_test = n.build(binary('ninja_test'), 'link', objs, implicit=ninja_lib,
                      variables=[('ldflags', test_ldflags),
                                 ('libs', test_libs)])
 n.newline()
 all_targets += ninja_test
 
-n.comment('Perftest executable.')
-objs = cxx('parser_perftest')
-parser_perftest = n.build(binary('parser_perftest'), 'link', objs,
-                          implicit=ninja_lib,
-                          variables=[('libs', '-L$builddir -lninja')])
+n.comment('Perftest executables.')
+perftest_libs = '-L$builddir -lninja'
+if platform not in ('mingw', 'windows'):
+    perftest_libs += ' -lpthread'
+for name in ['build_perftest',
+             'hash_map_perftest',
+             'parser_perftest',
+             'canon_perftest']:
+    objs = cxx(name)
+    all_targets += n.build(binary(name), 'link', objs,
+                           implicit=ninja_lib,
+                           variables=[('libs', perftest_libs)])
 n.newline()
-all_targets += parser_perftest
 
 n.comment('Generate a graph using the "graph" tool.')
 n.rule('gendot',
@@ -0,0 +1,147 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "affected.h"
+
+#include <algorithm>
+
+#include "deps_log.h"
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+bool PathLess(const Node* a, const Node* b) {
+  return a->path() < b->path();
+}
+
+}  // namespace
+
+AffectedTargets::AffectedTargets(State* state, DepsLog* deps_log,
+                                 DiskInterface* disk_interface)
+    : state_(state) {
+  METRIC_RECORD("load recorded deps");
+  vector<pair<Node*, Edge*> > uses;
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    Edge* edge = *e;
+    if (edge->outputs_.empty())
+      continue;
+
+    const DepsLog::Deps* deps =
+        deps_log ? deps_log->GetDeps(edge->outputs_[0]) : NULL;
+    if (deps) {
+      for (int i = 0; i < deps->node_count; ++i)
+        uses.push_back(make_pair(deps_log->node(deps->node_ids[i]), edge));
+    } else if (edge->rule().deps().empty() &&
+               !edge->rule().depfile().empty()) {
+      vector<Node*> nodes;
+      string err;
+      if (!edge->ReadDepFile(state, disk_interface, &nodes, &err)) {
+        Warning("%s", err.c_str());
+        continue;
+      }
+      for (vector<Node*>::iterator n = nodes.begin(); n != nodes.end(); ++n)
+        uses.push_back(make_pair(*n, edge));
+    }
+  }
+
+  // Reading depfiles may have added nodes, so size the index last.
+  recorded_users_.resize(state->nodes_.size());
+  for (size_t i = 0; i < uses.size(); ++i)
+    recorded_users_[uses[i].first->index()].push_back(uses[i].second);
+}
+
+void AffectedTargets::Compute(const vector<Node*>& changed) {
+  METRIC_RECORD("affected walk");
+  affected_.assign(state_->nodes_.size(), false);
+  edges_.clear();
+  vector<bool> edge_seen(state_->edges_.size());
+
+  vector<Node*> stack;
+  for (vector<Node*>::const_iterator i = changed.begin(); i != changed.end();
+       ++i) {
+    if (!affected_[(*i)->index()]) {
+      affected_[(*i)->index()] = true;
+      stack.push_back(*i);
+    }
+  }
+
+  while (!stack.empty()) {
+    Node* node = stack.back();
+    stack.pop_back();
+
+    vector<Edge*> users = node->out_edges();
+    if (const vector<Edge*>* recorded = RecordedUsers(node))
+      users.insert(users.end(), recorded->begin(), recorded->end());
+    for (vector<Edge*>::iterator e = users.begin(); e != users.end(); ++e) {
+      if (edge_seen[(*e)->index_])
+        continue;
+      edge_seen[(*e)->index_] = true;
+      edges_.push_back(*e);
+      for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+           o != (*e)->outputs_.end(); ++o) {
+        if (!affected_[(*o)->index()]) {
+          affected_[(*o)->index()] = true;
+          stack.push_back(*o);
+        }
+      }
+    }
+  }
+}
+
+bool AffectedTargets::affected(Node* node) const {
+  return (size_t)node->index() < affected_.size() &&
+      affected_[node->index()];
+}
+
+void AffectedTargets::All(vector<Node*>* nodes) const {
+  size_t start = nodes->size();
+  for (vector<Edge*>::const_iterator e = edges_.begin(); e != edges_.end();
+       ++e) {
+    if (!(*e)->is_phony())
+      nodes->insert(nodes->end(), (*e)->outputs_.begin(), (*e)->outputs_.end());
+  }
+  sort(nodes->begin() + start, nodes->end(), PathLess);
+}
+
+void AffectedTargets::Minimal(vector<Node*>* nodes) const {
+  vector<Node*> all;
+  All(&all);
+  for (vector<Node*>::iterator n = all.begin(); n != all.end(); ++n) {
+    // Every user of an affected node is affected too.
+    vector<Edge*> users = (*n)->out_edges();
+    if (const vector<Edge*>* recorded = RecordedUsers(*n))
+      users.insert(users.end(), recorded->begin(), recorded->end());
+    bool used = false;
+    for (vector<Edge*>::iterator e = users.begin(); e != users.end(); ++e) {
+      if (!(*e)->is_phony()) {
+        used = true;
+        break;
+      }
+    }
+    if (!used)
+      nodes->push_back(*n);
+  }
+}
+
+const vector<Edge*>* AffectedTargets::RecordedUsers(Node* node) const {
+  if ((size_t)node->index() >= recorded_users_.size() ||
+      recorded_users_[node->index()].empty())
+    return NULL;
+  return &recorded_users_[node->index()];
+}
@@ -0,0 +1,73 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_AFFECTED_H_
+#define NINJA_AFFECTED_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+struct DepsLog;
+struct DiskInterface;
+struct Edge;
+struct Node;
+struct State;
+
+/// Works out which outputs a set of changed files affects, for
+/// -t affected: everything built from them, directly or not.
+///
+/// Besides the inputs the manifest lists, the dependencies last recorded
+/// in the deps log or, for rules without "deps", left in depfiles on disk
+/// count too, so that a changed header affects what includes it without
+/// a dirty scan having loaded them.
+struct AffectedTargets {
+  /// Gather the recorded dependencies of the edges of \a state from
+  /// \a deps_log (which may be NULL) and depfiles read through
+  /// \a disk_interface.  Depfiles that can't be parsed are warned about
+  /// and skipped.
+  AffectedTargets(State* state, DepsLog* deps_log,
+                  DiskInterface* disk_interface);
+
+  /// Mark everything built from any of \a changed as affected, in a single
+  /// walk over the part of the graph that is.
+  void Compute(const vector<Node*>& changed);
+
+  /// Whether \a node is built from any of the changed files.
+  bool affected(Node* node) const;
+
+  /// Append the affected outputs of commands (not phony edges) to
+  /// \a nodes, sorted by path.
+  void All(vector<Node*>* nodes) const;
+
+  /// Like All(), but leave out outputs that are inputs of other affected
+  /// commands: building just these rebuilds everything affected.
+  void Minimal(vector<Node*>* nodes) const;
+
+ private:
+  /// Edges that use \a node through recorded dependencies.
+  const vector<Edge*>* RecordedUsers(Node* node) const;
+
+  State* state_;
+  /// For each Node::index(), the edges using it through a recorded
+  /// dependency.
+  vector<vector<Edge*> > recorded_users_;
+  /// For each Node::index(), whether it is affected.
+  vector<bool> affected_;
+  /// The affected edges, in the order they were found.
+  vector<Edge*> edges_;
+};
+
+#endif  // NINJA_AFFECTED_H_
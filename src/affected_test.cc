@@ -0,0 +1,110 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "affected.h"
+
+#include "deps_log.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char kTestFilename[] = "AffectedTest-tempfile";
+
+struct AffectedTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in > $out\n"
+"  depfile = $out.d\n"
+"rule cxx\n"
+"  command = cxx $in > $out\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"build a.o: cc a.c\n"
+"build b.o: cxx b.cc\n"
+"build c.o: cat c.c\n"
+"build lib: cat a.o b.o\n"
+"build app: cat lib c.o\n"
+"build tool: cat c.o\n"
+"build all: phony app tool\n"
+"default app\n"));
+    fs_.Create("a.o.d", 1, "a.o: a.c a.h\n");
+    unlink(kTestFilename);
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+
+  string Affected(const char* path, bool all, DepsLog* deps_log = NULL) {
+    AffectedTargets affected(&state_, deps_log, &fs_);
+    vector<Node*> changed(1, GetNode(path));
+    affected.Compute(changed);
+    vector<Node*> nodes;
+    if (all)
+      affected.All(&nodes);
+    else
+      affected.Minimal(&nodes);
+    string result;
+    for (size_t i = 0; i < nodes.size(); ++i)
+      result += (i ? " " : "") + nodes[i]->path();
+    return result;
+  }
+
+  VirtualFileSystem fs_;
+};
+
+TEST_F(AffectedTest, ManifestInputs) {
+  EXPECT_EQ("app c.o tool", Affected("c.c", true));
+  EXPECT_EQ("app tool", Affected("c.c", false));
+  EXPECT_EQ("app", Affected("lib", false));
+  EXPECT_EQ("", Affected("app", true));
+}
+
+TEST_F(AffectedTest, DepFile) {
+  EXPECT_EQ("a.o app lib", Affected("a.h", true));
+  EXPECT_EQ("app", Affected("a.h", false));
+}
+
+TEST_F(AffectedTest, DepsLog) {
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  vector<Node*> deps;
+  deps.push_back(GetNode("b.h"));
+  ASSERT_TRUE(log.RecordDeps(GetNode("b.o"), 1, deps));
+  log.Close();
+
+  EXPECT_EQ("app b.o lib", Affected("b.h", true, &log));
+  // Without the log there's nothing to go by: "deps" rules' depfiles are
+  // removed once they're in it.
+  EXPECT_EQ("", Affected("b.h", true));
+}
+
+TEST_F(AffectedTest, Defaults) {
+  AffectedTargets affected(&state_, NULL, &fs_);
+  vector<Node*> changed(1, GetNode("c.c"));
+  affected.Compute(changed);
+  EXPECT_TRUE(affected.affected(GetNode("app")));
+  EXPECT_TRUE(affected.affected(GetNode("all")));
+  EXPECT_FALSE(affected.affected(GetNode("lib")));
+}
+
+}  // namespace
@@ -0,0 +1,46 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+
+#include <stdlib.h>
+
+#include "util.h"
+
+Arena::~Arena() {
+  for (vector<char*>::iterator i = blocks_.begin(); i != blocks_.end(); ++i)
+    free(*i);
+}
+
+void* Arena::AllocSlow(size_t size) {
+  // Big requests get a block of their own, so they don't waste the rest
+  // of the current one.
+  if (size > kBlockSize / 4) {
+    char* block = (char*)malloc(size);
+    if (!block)
+      Fatal("out of memory");
+    blocks_.push_back(block);
+    allocated_bytes_ += size;
+    return block;
+  }
+
+  char* block = (char*)malloc(kBlockSize);
+  if (!block)
+    Fatal("out of memory");
+  blocks_.push_back(block);
+  allocated_bytes_ += kBlockSize;
+  next_ = block + size;
+  remaining_ = kBlockSize - size;
+  return block;
+}
@@ -0,0 +1,60 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ARENA_H_
+#define NINJA_ARENA_H_
+
+#include <stddef.h>
+
+#include <vector>
+using namespace std;
+
+/// A bump allocator for objects that live as long as the arena.
+/// Allocating is a pointer increment; nothing is freed individually, and
+/// destructors of objects placed in the arena are up to their owner.
+struct Arena {
+  Arena() : next_(NULL), remaining_(0), allocated_bytes_(0) {}
+  ~Arena();
+
+  /// Return \a size bytes of memory aligned for any type.
+  void* Alloc(size_t size) {
+    size = (size + kAlignment - 1) & ~(kAlignment - 1);
+    if (size > remaining_)
+      return AllocSlow(size);
+    void* result = next_;
+    next_ += size;
+    remaining_ -= size;
+    return result;
+  }
+
+  /// Bytes obtained from the system so far.
+  size_t allocated_bytes() const { return allocated_bytes_; }
+
+ private:
+  static const size_t kAlignment = 16;
+  static const size_t kBlockSize = 64 << 10;
+
+  void* AllocSlow(size_t size);
+
+  char* next_;
+  size_t remaining_;
+  vector<char*> blocks_;
+  size_t allocated_bytes_;
+
+  // Not copyable.
+  Arena(const Arena&);
+  void operator=(const Arena&);
+};
+
+#endif  // NINJA_ARENA_H_
@@ -0,0 +1,41 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+TEST(Arena, Alignment) {
+  Arena arena;
+  for (size_t size = 1; size < 100; ++size) {
+    void* p = arena.Alloc(size);
+    EXPECT_EQ(0u, (uintptr_t)p % 16) << size;
+    memset(p, 0xAB, size);
+  }
+}
+
+TEST(Arena, Distinct) {
+  Arena arena;
+  char* a = (char*)arena.Alloc(8);
+  char* b = (char*)arena.Alloc(8);
+  EXPECT_GE(b - a, 8);
+  // Another block, then a large block of its own.
+  arena.Alloc(64 << 10);
+  char* c = (char*)arena.Alloc(8);
+  EXPECT_EQ(a + 32, c);
+  EXPECT_GE(arena.allocated_bytes(), (size_t)(128 << 10));
+}
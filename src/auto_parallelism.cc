@@ -0,0 +1,109 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "auto_parallelism.h"
+
+#include <algorithm>
+using namespace std;
+
+#include "metrics.h"
+#include "trace.h"
+
+AutoParallelism::AutoParallelism(int initial, int floor, int ceiling,
+                                 int processors)
+    : limit_(initial), floor_(max(floor, 1)), ceiling_(max(ceiling, 1)),
+      processors_(max(processors, 1)), largest_rss_(0), have_last_(false),
+      saturated_(false) {
+  if (ceiling_ < floor_)
+    ceiling_ = floor_;
+  limit_ = min(max(limit_, floor_), ceiling_);
+}
+
+// static
+AutoParallelism::Sample AutoParallelism::TakeSample() {
+  Sample sample;
+  sample.millis = GetTimeMillis();
+  if (!GetCpuTimes(&sample.cpu_busy, &sample.cpu_total)) {
+    sample.cpu_busy = -1;
+    sample.cpu_total = -1;
+  }
+  sample.run_queue = GetRunQueueLength();
+  sample.available_memory = GetAvailableMemory();
+  return sample;
+}
+
+void AutoParallelism::Update(int running) {
+  NoteRunning(running);
+  if (have_last_ && GetTimeMillis() - last_.millis < kIntervalMillis)
+    return;
+  Adjust(TakeSample());
+}
+
+void AutoParallelism::NoteRunning(int running) {
+  // The builder asks for a slot right after a command finishes, so one
+  // is usually free by then; a full house at any point counts.
+  if (running >= limit_)
+    saturated_ = true;
+}
+
+void AutoParallelism::Adjust(const Sample& sample) {
+  Sample last = last_;
+  bool have_last = have_last_;
+  bool saturated = saturated_;
+  last_ = sample;
+  have_last_ = true;
+  saturated_ = false;
+
+  // Memory comes first: swapping slows everything down far more than an
+  // idle processor does.
+  bool memory_known = sample.available_memory >= 0 && largest_rss_ > 0;
+  if (memory_known && sample.available_memory < largest_rss_) {
+    if (SetLimit(limit_ - max(1, limit_ / 4)))
+      METRIC_COUNT("-j auto lowered for memory", 1);
+    return;
+  }
+
+  if (!have_last || last.cpu_total < 0 || sample.cpu_total < 0 ||
+      sample.cpu_total <= last.cpu_total) {
+    return;
+  }
+  double busy = (double)(sample.cpu_busy - last.cpu_busy) /
+      (sample.cpu_total - last.cpu_total);
+  bool queued = sample.run_queue >= 0 ?
+      sample.run_queue > processors_ + processors_ / 2 : busy > 0.98;
+
+  if (busy > 0.95 && queued) {
+    if (SetLimit(limit_ - 1))
+      METRIC_COUNT("-j auto lowered for cpu", 1);
+  } else if (busy < 0.85 && saturated &&
+             (sample.run_queue < 0 || sample.run_queue < processors_) &&
+             (!memory_known || sample.available_memory > 2 * largest_rss_)) {
+    if (SetLimit(limit_ + max(1, limit_ / 8)))
+      METRIC_COUNT("-j auto raised", 1);
+  }
+}
+
+void AutoParallelism::CommandFinished(int64_t max_rss) {
+  largest_rss_ = max(largest_rss_, max_rss);
+}
+
+bool AutoParallelism::SetLimit(int limit) {
+  limit = min(max(limit, floor_), ceiling_);
+  if (limit == limit_)
+    return false;
+  limit_ = limit;
+  if (g_trace)
+    g_trace->JobLimit(limit_);
+  return true;
+}
@@ -0,0 +1,85 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_AUTO_PARALLELISM_H_
+#define NINJA_AUTO_PARALLELISM_H_
+
+#include "util.h"  // For int64_t.
+
+/// Tunes how many commands run at once during a build, for "-j auto".
+///
+/// Every kIntervalMillis it looks at how busy the processors were since
+/// the last look, how many threads are waiting for one, and how much
+/// memory is left.  It raises the limit while the processors sit idle
+/// with all job slots taken, as they do in I/O bound phases like code
+/// generation, and lowers it while threads queue for the processors or
+/// when another command as large as the largest seen so far might not
+/// fit in memory, as in link phases.  The limit stays within
+/// [floor, ceiling].
+struct AutoParallelism {
+  AutoParallelism(int initial, int floor, int ceiling, int processors);
+
+  static const int kIntervalMillis = 500;
+
+  /// What the system looked like at one point in time.
+  struct Sample {
+    Sample() : millis(0), cpu_busy(-1), cpu_total(-1), run_queue(-1),
+               available_memory(-1) {}
+    int64_t millis;
+    /// GetCpuTimes(), or -1 if unknown.
+    int64_t cpu_busy;
+    int64_t cpu_total;
+    /// GetRunQueueLength(), negative if unknown.
+    int run_queue;
+    /// GetAvailableMemory(), negative if unknown.
+    int64_t available_memory;
+  };
+  /// Look at the system now.
+  static Sample TakeSample();
+
+  /// The number of commands that may run at once.
+  int limit() const { return limit_; }
+
+  /// Note that \a running commands are running, and adjust the limit if
+  /// it's time to.
+  void Update(int running);
+  /// Note that \a running commands are running.
+  void NoteRunning(int running);
+  /// Adjust the limit to \a sample.  Update() calls this with a fresh
+  /// sample.
+  void Adjust(const Sample& sample);
+
+  /// Note that a command finished whose largest process took up
+  /// \a max_rss bytes (0 if unknown).
+  void CommandFinished(int64_t max_rss);
+
+ private:
+  /// Set the limit to \a limit, clamped.  Returns true if that changed
+  /// it.
+  bool SetLimit(int limit);
+
+  int limit_;
+  int floor_;
+  int ceiling_;
+  int processors_;
+  /// The peak RSS of the largest command so far.
+  int64_t largest_rss_;
+  /// The sample the next one is compared with, if have_last_.
+  Sample last_;
+  bool have_last_;
+  /// Whether all the slots were taken at some point since then.
+  bool saturated_;
+};
+
+#endif  // NINJA_AUTO_PARALLELISM_H_
@@ -0,0 +1,138 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "auto_parallelism.h"
+
+#include "test.h"
+
+namespace {
+
+/// A sample \a busy_percent busy since the one \a last, with \a run_queue
+/// threads waiting and \a available bytes of memory.
+AutoParallelism::Sample Next(const AutoParallelism::Sample& last,
+                             int busy_percent, int run_queue,
+                             int64_t available) {
+  AutoParallelism::Sample sample;
+  sample.millis = last.millis + AutoParallelism::kIntervalMillis;
+  sample.cpu_busy = last.cpu_busy + busy_percent;
+  sample.cpu_total = last.cpu_total + 100;
+  sample.run_queue = run_queue;
+  sample.available_memory = available;
+  return sample;
+}
+
+AutoParallelism::Sample First() {
+  AutoParallelism::Sample sample;
+  sample.millis = 0;
+  sample.cpu_busy = 0;
+  sample.cpu_total = 0;
+  return sample;
+}
+
+const int64_t kGB = 1 << 30;
+
+TEST(AutoParallelismTest, Clamped) {
+  EXPECT_EQ(4, AutoParallelism(10, 1, 4, 8).limit());
+  EXPECT_EQ(2, AutoParallelism(1, 2, 4, 8).limit());
+  // A ceiling below the floor is the floor.
+  EXPECT_EQ(3, AutoParallelism(10, 3, 2, 8).limit());
+}
+
+TEST(AutoParallelismTest, RaiseWhileIdle) {
+  AutoParallelism jobs(8, 1, 16, 8);
+  AutoParallelism::Sample sample = First();
+  jobs.Adjust(sample);
+  EXPECT_EQ(8, jobs.limit());
+
+  sample = Next(sample, 40, 3, 8 * kGB);
+  jobs.NoteRunning(8);
+  jobs.Adjust(sample);
+  EXPECT_EQ(9, jobs.limit());
+
+  // Not while fewer commands run than may: that's a lack of work.
+  sample = Next(sample, 40, 3, 8 * kGB);
+  jobs.NoteRunning(5);
+  jobs.Adjust(sample);
+  EXPECT_EQ(9, jobs.limit());
+
+  // Up to the ceiling.
+  for (int i = 0; i < 20; ++i) {
+    sample = Next(sample, 40, 3, 8 * kGB);
+    jobs.NoteRunning(jobs.limit());
+    jobs.Adjust(sample);
+  }
+  EXPECT_EQ(16, jobs.limit());
+}
+
+TEST(AutoParallelismTest, LowerWhileQueued) {
+  AutoParallelism jobs(8, 6, 16, 8);
+  AutoParallelism::Sample sample = First();
+  jobs.Adjust(sample);
+
+  sample = Next(sample, 100, 20, -1);
+  jobs.NoteRunning(8);
+  jobs.Adjust(sample);
+  EXPECT_EQ(7, jobs.limit());
+
+  // Busy but keeping up isn't a reason.
+  sample = Next(sample, 100, 8, -1);
+  jobs.NoteRunning(7);
+  jobs.Adjust(sample);
+  EXPECT_EQ(7, jobs.limit());
+
+  // Down to the floor.
+  for (int i = 0; i < 5; ++i) {
+    sample = Next(sample, 100, 20, -1);
+    jobs.NoteRunning(jobs.limit());
+    jobs.Adjust(sample);
+  }
+  EXPECT_EQ(6, jobs.limit());
+}
+
+TEST(AutoParallelismTest, MemoryPressure) {
+  AutoParallelism jobs(8, 1, 16, 8);
+  jobs.CommandFinished(2 * kGB);
+  AutoParallelism::Sample sample = First();
+  jobs.Adjust(sample);
+
+  // Idle, but another command like the largest wouldn't fit twice.
+  sample = Next(sample, 40, 1, 3 * kGB);
+  jobs.NoteRunning(8);
+  jobs.Adjust(sample);
+  EXPECT_EQ(8, jobs.limit());
+
+  // It wouldn't fit at all.
+  sample = Next(sample, 40, 1, 1 * kGB);
+  jobs.NoteRunning(8);
+  jobs.Adjust(sample);
+  EXPECT_EQ(6, jobs.limit());
+
+  sample = Next(sample, 40, 1, 5 * kGB);
+  jobs.NoteRunning(6);
+  jobs.Adjust(sample);
+  EXPECT_EQ(7, jobs.limit());
+}
+
+TEST(AutoParallelismTest, Unknown) {
+  // Without figures nothing changes.
+  AutoParallelism jobs(8, 1, 16, 8);
+  AutoParallelism::Sample sample;
+  jobs.Adjust(sample);
+  sample.millis += AutoParallelism::kIntervalMillis;
+  jobs.NoteRunning(8);
+  jobs.Adjust(sample);
+  EXPECT_EQ(8, jobs.limit());
+}
+
+}  // namespace
@@ -15,33 +15,122 @@
 #include "build.h"
 
 #include <assert.h>
+#include <algorithm>
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #else
+#include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/termios.h>
 #endif
 
+#include "auto_parallelism.h"
 #include "build_log.h"
+#include "depfile_parser.h"
+#include "deps_log.h"
 #include "disk_interface.h"
 #include "graph.h"
+#include "jobserver.h"
+#include "metrics.h"
+#include "output_cache.h"
+#ifndef _WIN32
+#include "remote.h"
+#endif
 #include "state.h"
 #include "subprocess.h"
+#include "threads.h"
+#include "trace.h"
 #include "util.h"
 
+namespace {
+
+#ifndef _WIN32
+/// Set by SIGWINCH when the terminal may have been resized.
+volatile sig_atomic_t g_window_changed = 1;
+
+void WindowChanged(int) {
+  g_window_changed = 1;
+}
+#endif
+
+/// Return how many directories deep \a dir lies.
+int DirDepth(const string& dir) {
+#ifdef _WIN32
+  return count(dir.begin(), dir.end(), '/') +
+      count(dir.begin(), dir.end(), '\\');
+#else
+  return count(dir.begin(), dir.end(), '/');
+#endif
+}
+
+#ifndef _WIN32
+/// Quote \a arg as a single word for /bin/sh.
+string ShellQuote(const string& arg) {
+  string quoted = "'";
+  for (string::const_iterator i = arg.begin(); i != arg.end(); ++i) {
+    if (*i == '\'')
+      quoted += "'\\''";
+    else
+      quoted += *i;
+  }
+  return quoted + "'";
+}
+#endif
+
+/// Hashes an output as DiskInterface::ReadFileBlocks() reads it.
+struct ContentsHasher : public BlockSink {
+  ContentsHasher() : hash_(0) {}
+  virtual void Block(StringPiece block) {
+    hash_ = BuildLog::LogEntry::HashContentsBlock(hash_, block);
+  }
+  uint64_t hash_;
+};
+
+/// The hash of the contents of \a path as the build log records it for
+/// "restat = hash", or 0 if it can't be read.
+uint64_t HashOutput(DiskInterface* disk_interface, const string& path) {
+  ContentsHasher hasher;
+  string err;
+  disk_interface->ReadFileBlocks(path, BuildLog::LogEntry::kContentsBlockSize,
+                                 &hasher, &err);
+  return err.empty() ? hasher.hash_ : 0;
+}
+
+}  // namespace
+
 /// Tracks the status of a build: completion fraction, printing updates.
+///
+/// On a smart terminal, the status line is redrawn at most once every
+/// kRefreshMillis: with thousands of tiny commands a second, the
+/// terminal would otherwise take a good share of the build time.  A
+/// line held back is drawn once due, see RefreshTimeoutMillis().
 struct BuildStatus {
   BuildStatus(const BuildConfig& config);
+  ~BuildStatus();
   void PlanHasTotalEdges(int total);
   void BuildEdgeStarted(Edge* edge);
   void BuildEdgeFinished(Edge* edge, bool success, const string& output,
                          int* start_time, int* end_time);
 
+  /// How long until a held back status line is due, or -1 if there is
+  /// none.
+  int RefreshTimeoutMillis() const;
+  /// Draw the held back status line, if it's due.
+  void Refresh();
+
+  static const int kRefreshMillis = 100;
+
  private:
-  void PrintStatus(Edge* edge);
+  /// Show \a edge in the status line, unless it was redrawn too recently
+  /// and \a force is false.
+  void PrintStatus(Edge* edge, bool force);
+  /// The width of the terminal, or 0 if unknown.
+  int TerminalWidth();
 
   const BuildConfig& config_;
 
@@ -58,16 +147,38 @@ struct BuildStatus {
 
   /// Whether we can do fancy terminal control codes.
   bool smart_terminal_;
+
+  /// The edge to show in the status line once due, if any.
+  Edge* pending_edge_;
+  /// Time we last drew the status line.
+  int64_t last_status_millis_;
+  /// The width of the terminal as of the last SIGWINCH.
+  int terminal_width_;
+#ifndef _WIN32
+  /// Whether we handle SIGWINCH, and the handler we replaced, to put
+  /// back for programs that build in-process.
+  bool handles_winch_;
+  struct sigaction old_winch_action_;
+#endif
 };
 
 BuildStatus::BuildStatus(const BuildConfig& config)
     : config_(config),
       start_time_millis_(GetTimeMillis()),
       last_update_millis_(start_time_millis_),
-      started_edges_(0), finished_edges_(0), total_edges_(0) {
+      started_edges_(0), finished_edges_(0), total_edges_(0),
+      pending_edge_(NULL), last_status_millis_(0), terminal_width_(0) {
 #ifndef _WIN32
   const char* term = getenv("TERM");
   smart_terminal_ = isatty(1) && term && string(term) != "dumb";
+  handles_winch_ = smart_terminal_;
+  if (smart_terminal_) {
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = WindowChanged;
+    act.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &act, &old_winch_action_);
+  }
 #else
   smart_terminal_ = false;
   // Disable output buffer.  It'd be nice to use line buffering but
@@ -82,6 +193,13 @@ BuildStatus::BuildStatus(const BuildConfig& config)
     smart_terminal_ = false;
 }
 
+BuildStatus::~BuildStatus() {
+#ifndef _WIN32
+  if (handles_winch_)
+    sigaction(SIGWINCH, &old_winch_action_, NULL);
+#endif
+}
+
 void BuildStatus::PlanHasTotalEdges(int total) {
   total_edges_ = total;
 }
@@ -90,8 +208,10 @@ void BuildStatus::BuildEdgeStarted(Edge* edge) {
   int start_time = (int)(GetTimeMillis() - start_time_millis_);
   running_edges_.insert(make_pair(edge, start_time));
   ++started_edges_;
+  if (g_trace)
+    g_trace->EdgeStarted(edge);
 
-  PrintStatus(edge);
+  PrintStatus(edge, false);
 }
 
 void BuildStatus::BuildEdgeFinished(Edge* edge,
@@ -107,14 +227,19 @@ void BuildStatus::BuildEdgeFinished(Edge* edge,
   *end_time = (int)(now - start_time_millis_);
   int total_time = end_time - start_time;
   running_edges_.erase(i);
+  if (g_trace)
+    g_trace->EdgeFinished(edge, success);
 
   if (config_.verbosity == BuildConfig::QUIET)
     return;
 
+  // Anything printed below must follow the status line of its edge, as
+  // must the end of the build.
+  bool quiet = success && output.empty();
   if (smart_terminal_)
-    PrintStatus(edge);
+    PrintStatus(edge, !quiet || finished_edges_ == total_edges_);
 
-  if (success && output.empty()) {
+  if (quiet) {
     if (smart_terminal_) {
       if (finished_edges_ == total_edges_)
         printf("\n");
@@ -126,12 +251,14 @@ void BuildStatus::BuildEdgeFinished(Edge* edge,
       }
     }
   } else {
+    // Write it all at once, rather than in bits to an unbuffered stdout.
+    string to_print;
     if (smart_terminal_)
-      printf("\n");
+      to_print = "\n";
 
     // Print the command that is spewing before printing its output.
     if (!success)
-      printf("FAILED: %s\n", edge->EvaluateCommand().c_str());
+      to_print += "FAILED: " + edge->EvaluateCommand() + "\n";
 
     // ninja sets stdout and stderr of subprocesses to a pipe, to be able to
     // check if the output is empty. Some compilers, e.g. clang, check
@@ -145,63 +272,101 @@ void BuildStatus::BuildEdgeFinished(Edge* edge,
     // only a few hundred available on some systems, and ninja can launch
     // thousands of parallel compile commands.)
     // TODO: There should be a flag to disable escape code stripping.
-    string final_output;
     if (!smart_terminal_)
-      final_output = StripAnsiEscapeCodes(output);
+      to_print += StripAnsiEscapeCodes(output);
     else
-      final_output = output;
+      to_print += output;
+
+    fwrite(to_print.data(), 1, to_print.size(), stdout);
+    fflush(stdout);
+  }
+}
+
+int BuildStatus::RefreshTimeoutMillis() const {
+  if (!pending_edge_)
+    return -1;
+  int64_t due = last_status_millis_ + kRefreshMillis - GetTimeMillis();
+  return due > 0 ? (int)due : 0;
+}
 
-    if (!final_output.empty())
-      printf("%s", final_output.c_str());
+void BuildStatus::Refresh() {
+  if (pending_edge_ && RefreshTimeoutMillis() == 0)
+    PrintStatus(pending_edge_, true);
+}
+
+int BuildStatus::TerminalWidth() {
+#ifndef _WIN32
+  if (g_window_changed) {
+    g_window_changed = 0;
+    winsize size;
+    if (ioctl(0, TIOCGWINSZ, &size) == 0)
+      terminal_width_ = size.ws_col;
+    else
+      terminal_width_ = 0;
   }
+#endif
+  return terminal_width_;
 }
 
-void BuildStatus::PrintStatus(Edge* edge) {
+void BuildStatus::PrintStatus(Edge* edge, bool force) {
   if (config_.verbosity == BuildConfig::QUIET)
     return;
 
   bool force_full_command = config_.verbosity == BuildConfig::VERBOSE;
+  bool overprint = smart_terminal_ && !force_full_command;
+
+  if (overprint) {
+    int64_t now = GetTimeMillis();
+    if (!force && now - last_status_millis_ < kRefreshMillis) {
+      pending_edge_ = edge;
+      return;
+    }
+    pending_edge_ = NULL;
+    last_status_millis_ = now;
+  }
 
   string to_print = edge->GetDescription();
   if (to_print.empty() || force_full_command)
     to_print = edge->EvaluateCommand();
 
-  if (smart_terminal_)
-    printf("\r");  // Print over previous line, if any.
-
-  int progress_chars = printf("[%d/%d] ", started_edges_, total_edges_);
+  char progress[64];
+  snprintf(progress, sizeof(progress), "[%d/%d] ", started_edges_,
+           total_edges_);
+  string line = smart_terminal_ ? "\r" : "";  // Print over previous line.
+  line += progress;
 
-#ifndef _WIN32
-  if (smart_terminal_ && !force_full_command) {
-    // Limit output to width of the terminal if provided so we don't cause
+  if (overprint) {
+    // Limit output to width of the terminal if known so we don't cause
     // line-wrapping.
-    winsize size;
-    if ((ioctl(0, TIOCGWINSZ, &size) == 0) && size.ws_col) {
-      const int kMargin = progress_chars + 3;  // Space for [xx/yy] and "...".
-      if (to_print.size() + kMargin > size.ws_col) {
-        int elide_size = (size.ws_col - kMargin) / 2;
-        to_print = to_print.substr(0, elide_size)
-          + "..."
-          + to_print.substr(to_print.size() - elide_size, elide_size);
-      }
+    size_t width = TerminalWidth();
+    const size_t kMargin = strlen(progress) + 3;  // For [xx/yy] and "...".
+    if (width && to_print.size() + kMargin > width) {
+      size_t elide_size = width > kMargin ? (width - kMargin) / 2 : 0;
+      to_print = to_print.substr(0, elide_size)
+        + "..."
+        + to_print.substr(to_print.size() - elide_size, elide_size);
     }
   }
-#else
-  NINJA_UNUSED_ARG(progress_chars);
-#endif
+  line += to_print;
 
-  printf("%s", to_print.c_str());
-
-  if (smart_terminal_ && !force_full_command) {
-    printf("\x1B[K");  // Clear to end of line.
-    fflush(stdout);
+  if (overprint) {
+    line += "\x1B[K";  // Clear to end of line.
   } else {
-    printf("\n");
+    line += "\n";
   }
+  fwrite(line.data(), 1, line.size(), stdout);
+  if (overprint)
+    fflush(stdout);
 }
 
 Plan::Plan() : command_edges_(0), wanted_edges_(0) {}
 
+Plan::~Plan() {
+  // Leave the edges ready for another plan.
+  for (vector<Edge*>::iterator i = edges_.begin(); i != edges_.end(); ++i)
+    (*i)->set_want(Edge::kNotInPlan);
+}
+
 bool Plan::AddTarget(Node* node, string* err) {
   vector<Node*> stack;
   return AddSubTarget(node, &stack, err);
@@ -226,24 +391,26 @@ bool Plan::AddSubTarget(Node* node, vector<Node*>* stack, string* err) {
   if (edge->outputs_ready())
     return false;  // Don't need to do anything.
 
-  // If an entry in want_ does not already exist for edge, create an entry which
-  // maps to false, indicating that we do not want to build this entry itself.
-  pair<map<Edge*, bool>::iterator, bool> want_ins =
-    want_.insert(make_pair(edge, false));
-  bool& want = want_ins.first->second;
+  // If the edge isn't in the plan yet, add it, indicating that we do not
+  // want to build this edge itself.
+  bool first_visit = edge->want() == Edge::kNotInPlan;
+  if (first_visit) {
+    edge->set_want(Edge::kWantNothing);
+    edges_.push_back(edge);
+  }
 
   // If we do need to build edge and we haven't already marked it as wanted,
   // mark it now.
-  if (node->dirty() && !want) {
-    want = true;
+  if (node->dirty() && edge->want() == Edge::kWantNothing) {
+    edge->set_want(Edge::kWantToStart);
     ++wanted_edges_;
     if (edge->AllInputsReady())
-      ready_.insert(edge);
+      ScheduleWork(edge);
     if (!edge->is_phony())
       ++command_edges_;
   }
 
-  if (!want_ins.second)
+  if (!first_visit)
     return true;  // We've already processed the inputs.
 
   stack->push_back(node);
@@ -279,21 +446,153 @@ bool Plan::CheckDependencyCycle(Node* node, vector<Node*>* stack, string* err) {
 }
 
 Edge* Plan::FindWork() {
+  // Finishing a phony edge can make more of them ready.
+  while (!ready_phony_.empty()) {
+    Edge* edge = ready_phony_.back();
+    ready_phony_.pop_back();
+    EdgeFinished(edge);
+  }
   if (ready_.empty())
     return NULL;
-  set<Edge*>::iterator i = ready_.begin();
-  Edge* edge = *i;
-  ready_.erase(i);
-  return edge;
+  return ready_.pop();
+}
+
+void Plan::CommandEdges(vector<Edge*>* edges) const {
+  for (vector<Edge*>::const_iterator i = edges_.begin(); i != edges_.end();
+       ++i) {
+    if ((*i)->want() != Edge::kWantNothing && !(*i)->is_phony())
+      edges->push_back(*i);
+  }
+}
+
+namespace {
+
+/// Return how long, in milliseconds, \a edge took when it last ran, or -1
+/// if that isn't known.
+int64_t PreviousDuration(BuildLog* build_log, Edge* edge) {
+  if (!build_log || edge->outputs_.empty())
+    return -1;
+  BuildLog::LogEntry* entry =
+      build_log->LookupByOutput(edge->outputs_[0]->path());
+  if (!entry)
+    return -1;
+  return entry->end_time - entry->start_time;
+}
+
+}  // namespace
+
+void Plan::ComputeCriticalPath(BuildLog* build_log) {
+  METRIC_RECORD("critical path");
+  // Edges that have never run are guessed to take as long as the average
+  // of those that have; without any history, every command counts the
+  // same and the longest chain of commands goes first.
+  int64_t total_duration = 0;
+  int64_t known_durations = 0;
+  for (vector<Edge*>::iterator i = edges_.begin(); i != edges_.end(); ++i) {
+    (*i)->critical_time_ = -1;
+    (*i)->failed_before_ = false;
+    if ((*i)->want() == Edge::kNotInPlan || (*i)->want() == Edge::kWantNothing ||
+        (*i)->is_phony())
+      continue;
+    int64_t duration = PreviousDuration(build_log, *i);
+    if (duration >= 0) {
+      total_duration += duration;
+      ++known_durations;
+    }
+  }
+  int64_t default_duration = 1;
+  if (known_durations > 0 && total_duration / known_durations > 0)
+    default_duration = total_duration / known_durations;
+
+  set<Pool*> pools;
+  for (vector<Edge*>::iterator i = edges_.begin(); i != edges_.end(); ++i) {
+    if ((*i)->want() == Edge::kNotInPlan)
+      continue;
+    CriticalTime(*i, build_log, default_duration);
+    pools.insert((*i)->pool());
+    if (build_log && (*i)->want() != Edge::kWantNothing &&
+        build_log->FailedBefore(*i)) {
+      MarkFailedBefore(*i);
+    }
+  }
+
+  // Edges may already be queued from AddTarget().
+  ready_.Reorder();
+  for (set<Pool*>::iterator i = pools.begin(); i != pools.end(); ++i)
+    (*i)->ReorderDelayedEdges();
+}
+
+int64_t Plan::CriticalTime(Edge* edge, BuildLog* build_log,
+                           int64_t default_duration) {
+  if (edge->critical_time_ >= 0)
+    return edge->critical_time_;
+
+  int64_t longest = 0;
+  for (vector<Node*>::iterator o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o) {
+    for (vector<Edge*>::const_iterator e = (*o)->out_edges().begin();
+         e != (*o)->out_edges().end(); ++e) {
+      if ((*e)->want() == Edge::kNotInPlan)
+        continue;
+      longest = max(longest, CriticalTime(*e, build_log, default_duration));
+    }
+  }
+
+  // Edges we don't need to run take no time.
+  int64_t duration = 0;
+  if (edge->want() != Edge::kWantNothing && !edge->is_phony()) {
+    duration = PreviousDuration(build_log, edge);
+    if (duration < 0)
+      duration = default_duration;
+  }
+  edge->critical_time_ = duration + longest;
+  return edge->critical_time_;
+}
+
+void Plan::MarkFailedBefore(Edge* edge) {
+  if (edge->failed_before_)
+    return;
+  edge->failed_before_ = true;
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    Edge* in_edge = (*i)->in_edge();
+    if (in_edge && in_edge->want() != Edge::kNotInPlan &&
+        in_edge->want() != Edge::kWantNothing) {
+      MarkFailedBefore(in_edge);
+    }
+  }
+}
+
+void Plan::ScheduleWork(Edge* edge) {
+  if (edge->want() == Edge::kWantToFinish)
+    return;
+  assert(edge->want() == Edge::kWantToStart);
+  edge->set_want(Edge::kWantToFinish);
+
+  Pool* pool = edge->pool();
+  if (pool->ShouldDelayEdge()) {
+    pool->DelayEdge(edge);
+    pool->RetrieveReadyEdges(&ready_);
+  } else if (edge->is_phony()) {
+    // There's nothing to run, so it needn't wait behind commands.
+    ready_phony_.push_back(edge);
+  } else {
+    pool->EdgeScheduled(edge);
+    ready_.push(edge);
+  }
 }
 
 void Plan::EdgeFinished(Edge* edge) {
-  map<Edge*, bool>::iterator i = want_.find(edge);
-  assert(i != want_.end());
-  if (i->second)
+  assert(edge->want() != Edge::kNotInPlan);
+  if (edge->want() != Edge::kWantNothing)
     --wanted_edges_;
-  want_.erase(i);
-  edge->outputs_ready_ = true;
+  // Only scheduled edges hold a pool slot.
+  if (edge->want() == Edge::kWantToFinish) {
+    edge->pool()->EdgeFinished(edge);
+    edge->pool()->RetrieveReadyEdges(&ready_);
+  }
+  edge->set_want(Edge::kNotInPlan);
+  edge->set_outputs_ready(true);
 
   // Check off any nodes we were waiting for with this edge.
   for (vector<Node*>::iterator i = edge->outputs_.begin();
@@ -302,18 +601,22 @@ void Plan::EdgeFinished(Edge* edge) {
   }
 }
 
+void Plan::EdgeFailed(Edge* edge) {
+  edge->pool()->EdgeFinished(edge);
+  edge->pool()->RetrieveReadyEdges(&ready_);
+}
+
 void Plan::NodeFinished(Node* node) {
   // See if we we want any edges from this node.
   for (vector<Edge*>::const_iterator i = node->out_edges().begin();
        i != node->out_edges().end(); ++i) {
-    map<Edge*, bool>::iterator want_i = want_.find(*i);
-    if (want_i == want_.end())
+    if ((*i)->want() == Edge::kNotInPlan)
       continue;
 
     // See if the edge is now ready.
     if ((*i)->AllInputsReady()) {
-      if (want_i->second) {
-        ready_.insert(*i);
+      if ((*i)->want() != Edge::kWantNothing) {
+        ScheduleWork(*i);
       } else {
         // We do not need to build this edge, but we might need to build one of
         // its dependents.
@@ -329,21 +632,16 @@ void Plan::CleanNode(BuildLog* build_log, Node* node) {
   for (vector<Edge*>::const_iterator ei = node->out_edges().begin();
        ei != node->out_edges().end(); ++ei) {
     // Don't process edges that we don't actually want.
-    map<Edge*, bool>::iterator want_i = want_.find(*ei);
-    if (want_i == want_.end() || !want_i->second)
+    if ((*ei)->want() == Edge::kNotInPlan ||
+        (*ei)->want() == Edge::kWantNothing)
       continue;
 
     // If all non-order-only inputs for this edge are now clean,
     // we might have changed the dirty state of the outputs.
-    vector<Node*>::iterator begin = (*ei)->inputs_.begin(),
-                            end = (*ei)->inputs_.end() - (*ei)->order_only_deps_;
-    if (find_if(begin, end, mem_fun(&Node::dirty)) == end) {
-      // Recompute most_recent_input and command.
-      TimeStamp most_recent_input = 1;
-      for (vector<Node*>::iterator ni = begin; ni != end; ++ni)
-        if ((*ni)->mtime() > most_recent_input)
-          most_recent_input = (*ni)->mtime();
-      string command = (*ei)->EvaluateCommand();
+    if (!(*ei)->HasDirtyInputs()) {
+      // Both were already worked out when the edge was scanned.
+      TimeStamp most_recent_input = (*ei)->most_recent_input_;
+      uint64_t command_hash = build_log ? (*ei)->GetCommandHash() : 0;
 
       // Now, recompute the dirty state of each output.
       bool all_outputs_clean = true;
@@ -352,8 +650,8 @@ void Plan::CleanNode(BuildLog* build_log, Node* node) {
         if (!(*ni)->dirty())
           continue;
 
-        if ((*ei)->RecomputeOutputDirty(build_log, most_recent_input, command,
-                                        *ni)) {
+        if ((*ei)->RecomputeOutputDirty(build_log, most_recent_input,
+                                        command_hash, *ni)) {
           (*ni)->MarkDirty();
           all_outputs_clean = false;
         } else {
@@ -363,7 +661,7 @@ void Plan::CleanNode(BuildLog* build_log, Node* node) {
 
       // If we cleaned all outputs, mark the node as not wanted.
       if (all_outputs_clean) {
-        want_i->second = false;
+        (*ei)->set_want(Edge::kWantNothing);
         --wanted_edges_;
         if (!(*ei)->is_phony())
           --command_edges_;
@@ -373,35 +671,129 @@ void Plan::CleanNode(BuildLog* build_log, Node* node) {
 }
 
 void Plan::Dump() {
-  printf("pending: %d\n", (int)want_.size());
-  for (map<Edge*, bool>::iterator i = want_.begin(); i != want_.end(); ++i) {
-    if (i->second)
+  int pending = 0;
+  for (vector<Edge*>::iterator i = edges_.begin(); i != edges_.end(); ++i) {
+    if ((*i)->want() != Edge::kNotInPlan)
+      ++pending;
+  }
+  printf("pending: %d\n", pending);
+  for (vector<Edge*>::iterator i = edges_.begin(); i != edges_.end(); ++i) {
+    if ((*i)->want() == Edge::kNotInPlan)
+      continue;
+    if ((*i)->want() != Edge::kWantNothing)
       printf("want ");
-    i->first->Dump();
+    (*i)->Dump();
   }
-  printf("ready: %d\n", (int)ready_.size());
+  printf("ready: %d\n", (int)(ready_.size() + ready_phony_.size()));
 }
 
 struct RealCommandRunner : public CommandRunner {
-  RealCommandRunner(const BuildConfig& config) : config_(config) {}
-  virtual ~RealCommandRunner() {}
+  RealCommandRunner(const BuildConfig& config, BuildStatus* status)
+      : config_(config), status_(status), auto_parallelism_(NULL),
+        tokens_(0), woken_(false) {
+    subprocs_.set_direct_exec(config_.direct_exec);
+    subprocs_.set_output_limit(config_.output_limit, config_.spill_dir);
+    subprocs_.set_stream_after(config_.stream_after_millis);
+    if (config_.max_parallelism > 0) {
+      auto_parallelism_ = new AutoParallelism(
+          config_.parallelism, config_.min_parallelism,
+          config_.max_parallelism, GetProcessorCount());
+    }
+  }
+  virtual ~RealCommandRunner() {
+    ReleaseTokens(0);
+    delete auto_parallelism_;
+    for (multimap<string, Subprocess*>::iterator i = idle_workers_.begin();
+         i != idle_workers_.end(); ++i) {
+      delete i->second;
+    }
+  }
   virtual bool CanRunMore();
   virtual bool StartCommand(Edge* edge);
-  virtual Edge* WaitForCommand(bool* success, string* output);
+  virtual Edge* WaitForCommand(bool* success, string* output,
+                               ResourceUsage* usage);
+  virtual void Wake() { subprocs_.Wake(); }
+  virtual bool Woken() { return woken_; }
+
+  /// Whether another local command may start while \a running are.
+  bool CanRunMoreLocally(size_t running);
+  /// Start running \a command for \a edge.
+  bool Start(Edge* edge, const string& command);
+  /// Send \a edge's command to a persistent worker started by \a worker.
+  /// Returns false if workers aren't supported.
+  bool StartOnWorker(Edge* edge, const string& worker);
+  /// Give back the jobserver tokens that \a running local commands don't
+  /// need: all but the first hold one.
+  void ReleaseTokens(size_t running);
 
   const BuildConfig& config_;
+  /// Whose held back status line to draw while waiting.
+  BuildStatus* status_;
   SubprocessSet subprocs_;
   map<Subprocess*, Edge*> subproc_to_edge_;
+  /// Tunes the number of local commands, if the config asks for it.
+  AutoParallelism* auto_parallelism_;
+  /// How many tokens we hold from config_.jobserver.
+  size_t tokens_;
+  /// Persistent workers waiting for a request (at most -j of them), and
+  /// the ones running one, by the command that started them.
+  multimap<string, Subprocess*> idle_workers_;
+  map<Subprocess*, string> busy_workers_;
+  /// What Woken() returns.
+  bool woken_;
 };
 
 bool RealCommandRunner::CanRunMore() {
-  return ((int)subprocs_.running_.size()) < config_.parallelism;
+  return CanRunMoreLocally(subprocs_.running_.size());
+}
+
+bool RealCommandRunner::CanRunMoreLocally(size_t running) {
+  int parallelism = config_.parallelism;
+  if (auto_parallelism_) {
+    auto_parallelism_->Update(running);
+    parallelism = auto_parallelism_->limit();
+  }
+  if ((int)running >= parallelism)
+    return false;
+  // However loaded the machine is, the build must make progress.
+  if (running == 0)
+    return true;
+  if (config_.max_load_average > 0.0 &&
+      GetLoadAverage() > config_.max_load_average)
+    return false;
+  if (config_.min_available_memory > 0) {
+    int64_t available = GetAvailableMemory();
+    if (available >= 0 && available < config_.min_available_memory)
+      return false;
+  }
+  // Each command after the first needs a token, which we keep until
+  // fewer commands run.
+  if (config_.jobserver && tokens_ < running) {
+    if (!config_.jobserver->Acquire())
+      return false;
+    ++tokens_;
+  }
+  return true;
+}
+
+void RealCommandRunner::ReleaseTokens(size_t running) {
+  size_t needed = running > 0 ? running - 1 : 0;
+  for (; tokens_ > needed; --tokens_)
+    config_.jobserver->Release();
 }
 
 bool RealCommandRunner::StartCommand(Edge* edge) {
-  string command = edge->EvaluateCommand();
+  string worker = edge->EvaluateWorker();
+  if (!worker.empty() && StartOnWorker(edge, worker))
+    return true;
+  return Start(edge, edge->EvaluateCommand());
+}
+
+bool RealCommandRunner::Start(Edge* edge, const string& command) {
   Subprocess* subproc = new Subprocess;
   subproc_to_edge_.insert(make_pair(subproc, edge));
+  const string& description = edge->GetDescription();
+  subproc->set_label(description.empty() ? command : description);
   if (!subproc->Start(&subprocs_, command))
     return false;
 
@@ -409,23 +801,211 @@ bool RealCommandRunner::StartCommand(Edge* edge) {
   return true;
 }
 
-Edge* RealCommandRunner::WaitForCommand(bool* success, string* output) {
+bool RealCommandRunner::StartOnWorker(Edge* edge, const string& worker) {
+  const string& command = edge->EvaluateCommand();
+  for (;;) {
+    Subprocess* subproc;
+    bool fresh = false;
+    multimap<string, Subprocess*>::iterator i = idle_workers_.find(worker);
+    if (i != idle_workers_.end()) {
+      subproc = i->second;
+      idle_workers_.erase(i);
+    } else {
+      subproc = new Subprocess;
+      if (!subproc->StartWorker(&subprocs_, worker)) {
+        delete subproc;
+        return false;
+      }
+      METRIC_COUNT("workers started", 1);
+      fresh = true;
+    }
+
+    const string& description = edge->GetDescription();
+    subproc->set_label(description.empty() ? command : description);
+    if (subproc->Request(command)) {
+      subprocs_.Add(subproc);
+      subproc_to_edge_.insert(make_pair(subproc, edge));
+      busy_workers_.insert(make_pair(subproc, worker));
+      return true;
+    }
+    // It exited while idle; if it was just started, run the command the
+    // usual way rather than spin.
+    delete subproc;
+    if (fresh)
+      return false;
+  }
+}
+
+Edge* RealCommandRunner::WaitForCommand(bool* success, string* output,
+                                        ResourceUsage* usage) {
   Subprocess* subproc;
+  woken_ = false;
   while ((subproc = subprocs_.NextFinished()) == NULL) {
-    subprocs_.DoWork();
+    if (subprocs_.Woken()) {
+      woken_ = true;
+      return NULL;
+    }
+    // Don't sit on tokens that other builds could use meanwhile.
+    ReleaseTokens(subprocs_.running_.size());
+    subprocs_.DoWork(status_->RefreshTimeoutMillis());
+    status_->Refresh();
   }
 
   *success = subproc->Finish();
   *output = subproc->GetOutput();
+  *usage = subproc->usage();
+  if (auto_parallelism_)
+    auto_parallelism_->CommandFinished(usage->max_rss);
 
   map<Subprocess*, Edge*>::iterator i = subproc_to_edge_.find(subproc);
   Edge* edge = i->second;
   subproc_to_edge_.erase(i);
 
+  map<Subprocess*, string>::iterator w = busy_workers_.find(subproc);
+  if (w != busy_workers_.end()) {
+    if (subproc->Idle()) {
+      // No more can be busy at once than commands run at once, whatever
+      // their kind, so that's all that is worth keeping idle.  A worker of
+      // another kind makes room, if there is one.
+      if ((int)idle_workers_.size() >= max(config_.parallelism, 1)) {
+        multimap<string, Subprocess*>::iterator evict = idle_workers_.begin();
+        if (evict->first == w->second)
+          evict = idle_workers_.upper_bound(w->second);
+        if (evict == idle_workers_.end())
+          evict = idle_workers_.begin();
+        delete evict->second;
+        idle_workers_.erase(evict);
+      }
+      idle_workers_.insert(make_pair(w->second, subproc));
+      subproc = NULL;
+    }
+    busy_workers_.erase(w);
+  }
   delete subproc;
   return edge;
 }
 
+#ifndef _WIN32
+/// A CommandRunner that runs what it can on remote workers, and the rest
+/// locally.  See remote.h.
+struct RemoteCommandRunner : public RealCommandRunner {
+  RemoteCommandRunner(const BuildConfig& config, BuildStatus* status,
+                      State* state, DiskInterface* disk_interface)
+      : RealCommandRunner(config, status), state_(state),
+        disk_interface_(disk_interface),
+        worker_jobs_(config.remote_workers.size()), local_running_(0) {}
+  virtual bool CanRunMore();
+  virtual bool StartCommand(Edge* edge);
+  virtual Edge* WaitForCommand(bool* success, string* output,
+                               ResourceUsage* usage);
+
+ private:
+  /// For reading depfiles in RemoteJob::FromEdge().
+  State* state_;
+  DiskInterface* disk_interface_;
+
+  /// A remote job in progress.
+  struct Running {
+    size_t worker;
+    string job_path;
+  };
+  map<Edge*, Running> remote_;
+  vector<int> worker_jobs_;
+  int local_running_;
+  /// Local-only edges waiting for a local slot.
+  queue<Edge*> local_waiting_;
+  /// Edges from local_waiting_ that failed to start.
+  queue<Edge*> failed_;
+};
+
+bool RemoteCommandRunner::CanRunMore() {
+  if ((int)remote_.size() < config_.remote_parallelism)
+    return local_waiting_.size() < (size_t)config_.parallelism;
+  return local_waiting_.empty() && CanRunMoreLocally(local_running_);
+}
+
+bool RemoteCommandRunner::StartCommand(Edge* edge) {
+  RemoteJob job;
+  if ((int)remote_.size() >= config_.remote_parallelism ||
+      !RemoteJob::FromEdge(edge, state_, disk_interface_, &job)) {
+    if (!CanRunMoreLocally(local_running_)) {
+      local_waiting_.push(edge);
+      return true;
+    }
+    if (!RealCommandRunner::StartCommand(edge))
+      return false;
+    ++local_running_;
+    return true;
+  }
+
+  // Send it to the least busy worker.
+  size_t worker = 0;
+  for (size_t i = 1; i < worker_jobs_.size(); ++i) {
+    if (worker_jobs_[i] < worker_jobs_[worker])
+      worker = i;
+  }
+  job.worker = config_.remote_workers[worker];
+
+  string job_path = GetTempDir() + "/ninja-job-XXXXXX";
+  int fd = mkstemp(&job_path[0]);
+  if (fd < 0)
+    return false;
+  close(fd);
+  string err;
+  if (!job.Save(job_path, &err)) {
+    unlink(job_path.c_str());
+    return false;
+  }
+
+  if (!Start(edge, ShellQuote(config_.ninja_path) + " -t remote-run " +
+                   ShellQuote(job_path))) {
+    unlink(job_path.c_str());
+    return false;
+  }
+  Running& running = remote_[edge];
+  running.worker = worker;
+  running.job_path = job_path;
+  ++worker_jobs_[worker];
+  return true;
+}
+
+Edge* RemoteCommandRunner::WaitForCommand(bool* success, string* output,
+                                          ResourceUsage* usage) {
+  if (!failed_.empty()) {
+    Edge* edge = failed_.front();
+    failed_.pop();
+    *success = false;
+    *output = "ninja: couldn't start command\n";
+    return edge;
+  }
+
+  // For a remote job, that's what the local end used.
+  Edge* edge = RealCommandRunner::WaitForCommand(success, output, usage);
+  if (!edge)
+    return NULL;
+  map<Edge*, Running>::iterator i = remote_.find(edge);
+  if (i != remote_.end()) {
+    --worker_jobs_[i->second.worker];
+    unlink(i->second.job_path.c_str());
+    remote_.erase(i);
+  } else {
+    --local_running_;
+  }
+  ReleaseTokens(local_running_);
+
+  while (!local_waiting_.empty() && CanRunMoreLocally(local_running_)) {
+    Edge* next = local_waiting_.front();
+    local_waiting_.pop();
+    if (RealCommandRunner::StartCommand(next))
+      ++local_running_;
+    else
+      failed_.push(next);
+  }
+  return edge;
+}
+
+#endif  // _WIN32
+
 /// A CommandRunner that doesn't actually run the commands.
 struct DryRunCommandRunner : public CommandRunner {
   virtual ~DryRunCommandRunner() {}
@@ -436,7 +1016,8 @@ struct DryRunCommandRunner : public CommandRunner {
     finished_.push(edge);
     return true;
   }
-  virtual Edge* WaitForCommand(bool* success, string* output) {
+  virtual Edge* WaitForCommand(bool* success, string* output,
+                               ResourceUsage* usage) {
     if (finished_.empty())
       return NULL;
     *success = true;
@@ -448,15 +1029,132 @@ struct DryRunCommandRunner : public CommandRunner {
   queue<Edge*> finished_;
 };
 
+/// Hashes the outputs of "restat = hash" edges on a thread of its own,
+/// so that the build loop carries on starting and reaping commands
+/// meanwhile.  The runner is woken when a job is done.
+struct OutputHasher : public Thread {
+  OutputHasher(DiskInterface* disk_interface, CommandRunner* runner)
+      : disk_interface_(disk_interface), runner_(runner), pending_(0),
+        stop_(false) {}
+  virtual ~OutputHasher();
+
+  /// An edge whose outputs are being hashed, with what FinishOutputs()
+  /// needs to finish it.
+  struct Job {
+    Edge* edge;
+    string output;
+    bool has_usage;
+    ResourceUsage usage;
+    vector<TimeStamp> mtimes;
+    /// Filled in by the thread, for the outputs that exist.
+    vector<uint64_t> hashes;
+  };
+
+  /// Hash the outputs of \a job, taking ownership of it.
+  void Add(Job* job);
+  /// Move the jobs that are done to \a done, for the caller to delete.
+  void TakeDone(vector<Job*>* done);
+  /// Wait until a job may be done.
+  void WaitForDone() { done_event_.Wait(); }
+  /// The jobs added and not taken back yet.
+  int pending() const { return pending_; }
+
+ protected:
+  virtual void Run();
+
+ private:
+  DiskInterface* disk_interface_;
+  CommandRunner* runner_;
+  int pending_;
+  /// Guards the members below it.
+  Mutex lock_;
+  queue<Job*> todo_;
+  vector<Job*> done_;
+  bool stop_;
+  Event work_event_;
+  Event done_event_;
+};
+
+OutputHasher::~OutputHasher() {
+  {
+    ScopedLock lock(&lock_);
+    stop_ = true;
+  }
+  work_event_.Signal();
+  Join();
+  for (; !todo_.empty(); todo_.pop())
+    delete todo_.front();
+  for (vector<Job*>::iterator i = done_.begin(); i != done_.end(); ++i)
+    delete *i;
+}
+
+void OutputHasher::Add(Job* job) {
+  ++pending_;
+  {
+    ScopedLock lock(&lock_);
+    todo_.push(job);
+  }
+  work_event_.Signal();
+}
+
+void OutputHasher::TakeDone(vector<Job*>* done) {
+  ScopedLock lock(&lock_);
+  pending_ -= done_.size();
+  done->swap(done_);
+  done_.clear();
+}
+
+void OutputHasher::Run() {
+  for (;;) {
+    Job* job = NULL;
+    {
+      ScopedLock lock(&lock_);
+      if (stop_)
+        return;
+      if (!todo_.empty()) {
+        job = todo_.front();
+        todo_.pop();
+      }
+    }
+    if (!job) {
+      work_event_.Wait();
+      continue;
+    }
+
+    job->hashes.resize(job->mtimes.size());
+    for (size_t i = 0; i < job->mtimes.size(); ++i) {
+      if (job->mtimes[i] > 0) {
+        job->hashes[i] = HashOutput(disk_interface_,
+                                    job->edge->outputs_[i]->path());
+      }
+    }
+    {
+      ScopedLock lock(&lock_);
+      done_.push_back(job);
+    }
+    done_event_.Signal();
+    runner_->Wake();
+  }
+}
+
 Builder::Builder(State* state, const BuildConfig& config)
-    : state_(state), config_(config) {
-  disk_interface_ = new RealDiskInterface;
-  if (config.dry_run)
-    command_runner_ = new DryRunCommandRunner;
-  else
-    command_runner_ = new RealCommandRunner(config);
+    : state_(state), config_(config), command_runner_(NULL),
+      own_command_runner_(NULL) {
+  disk_interface_ = own_disk_interface_ = new RealDiskInterface;
   status_ = new BuildStatus(config);
+  observer_ = NULL;
   log_ = state->build_log_;
+  cache_ = NULL;
+  hasher_ = NULL;
+}
+
+Builder::~Builder() {
+  // The hasher may still wake the runner, which may still refer to the
+  // status.
+  delete hasher_;
+  delete own_command_runner_;
+  delete status_;
+  delete own_disk_interface_;
 }
 
 Node* Builder::AddTarget(const string& name, string* err) {
@@ -471,9 +1169,14 @@ Node* Builder::AddTarget(const string& name, string* err) {
 }
 
 bool Builder::AddTarget(Node* node, string* err) {
+  METRIC_RECORD("dirty scan");
+  StatReachableNodes(node);
   node->StatIfNecessary(disk_interface_);
   if (Edge* in_edge = node->in_edge()) {
-    if (!in_edge->RecomputeDirty(state_, disk_interface_, err))
+    // An edge scanned earlier, e.g. for another target, keeps its result
+    // until the State is reset.
+    if (!in_edge->scanned() &&
+        !in_edge->RecomputeDirty(state_, disk_interface_, err))
       return false;
     if (in_edge->outputs_ready())
       return true;  // Nothing to do.
@@ -485,6 +1188,52 @@ bool Builder::AddTarget(Node* node, string* err) {
   return true;
 }
 
+void Builder::StatReachableNodes(Node* target) {
+  METRIC_RECORD("stat pre-pass");
+  DepsLog* deps_log = state_->deps_log_;
+  vector<Node*> nodes;
+  set<Edge*> seen;
+  vector<Node*> stack(1, target);
+  while (!stack.empty()) {
+    Node* node = stack.back();
+    stack.pop_back();
+    if (!node->status_known())
+      nodes.push_back(node);
+
+    // Everything a scanned edge depends on was scanned along with it.
+    Edge* edge = node->in_edge();
+    if (!edge || edge->scanned() || !seen.insert(edge).second)
+      continue;
+
+    stack.insert(stack.end(), edge->outputs_.begin(), edge->outputs_.end());
+    stack.insert(stack.end(), edge->inputs_.begin(), edge->inputs_.end());
+
+    // Dependencies in the deps log will be loaded by the dirty scan; stat
+    // them now too.  (Those only found in depfiles aren't known yet.)
+    if (deps_log && !edge->rule().deps().empty()) {
+      if (const DepsLog::Deps* deps = deps_log->GetDeps(edge->outputs_[0])) {
+        for (int i = 0; i < deps->node_count; ++i)
+          stack.push_back(deps_log->node(deps->node_ids[i]));
+      }
+    }
+  }
+
+  // Inputs shared by several edges were collected more than once.
+  sort(nodes.begin(), nodes.end());
+  nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+  if (nodes.empty())
+    return;
+
+  vector<const string*> paths;
+  paths.reserve(nodes.size());
+  for (vector<Node*>::iterator i = nodes.begin(); i != nodes.end(); ++i)
+    paths.push_back(&(*i)->path());
+  vector<TimeStamp> mtimes;
+  disk_interface_->StatBatch(paths, &mtimes);
+  for (size_t i = 0; i < nodes.size(); ++i)
+    nodes[i]->set_mtime(mtimes[i]);
+}
+
 bool Builder::AlreadyUpToDate() const {
   return !plan_.more_to_do();
 }
@@ -492,7 +1241,25 @@ bool Builder::AlreadyUpToDate() const {
 bool Builder::Build(string* err) {
   assert(!AlreadyUpToDate());
 
+  if (!command_runner_) {
+    if (config_.dry_run)
+      own_command_runner_ = new DryRunCommandRunner;
+#ifndef _WIN32
+    else if (!config_.remote_workers.empty())
+      own_command_runner_ = new RemoteCommandRunner(config_, status_, state_,
+                                                   disk_interface_);
+#endif
+    else
+      own_command_runner_ = new RealCommandRunner(config_, status_);
+    command_runner_ = own_command_runner_;
+  }
+
+  plan_.ComputeCriticalPath(log_);
   status_->PlanHasTotalEdges(plan_.command_edge_count());
+  if (observer_)
+    observer_->PlanHasTotalEdges(plan_.command_edge_count());
+  if (config_.make_dirs_first)
+    MakeAllOutputDirs();
   int pending_commands = 0;
   int failures_allowed = config_.swallow_failures;
 
@@ -504,36 +1271,58 @@ bool Builder::Build(string* err) {
   // If we can do neither of those, the build is stuck, and we report
   // an error.
   while (plan_.more_to_do()) {
+    // Finish the edges whose outputs were hashed meanwhile.
+    if (hasher_ && hasher_->pending() && FinishHashedEdges())
+      continue;
+
     // See if we can start any more commands.
     if (command_runner_->CanRunMore()) {
       if (Edge* edge = plan_.FindWork()) {
-        if (!StartEdge(edge, err))
+        bool restored = false;
+        if (!StartEdge(edge, &restored, err)) {
+          FinishAllHashedEdges();
           return false;
+        }
 
-        if (edge->is_phony())
-          FinishEdge(edge, true, "");
-        else
+        if (edge->is_phony() || restored) {
+          if (!FinishEdge(edge, true, restored, "", NULL, err)) {
+            FinishAllHashedEdges();
+            return false;
+          }
+        } else {
           ++pending_commands;
+        }
 
         // We made some progress; go back to the main loop.
         continue;
       }
+
+      // Finding work finishes phony edges, which may have been all that
+      // was left.
+      if (!plan_.more_to_do())
+        break;
     }
 
     // See if we can reap any finished commands.
     if (pending_commands) {
       bool success;
       string output;
+      ResourceUsage usage;
       Edge* edge;
-      if ((edge = command_runner_->WaitForCommand(&success, &output))) {
+      if ((edge = command_runner_->WaitForCommand(&success, &output,
+                                                  &usage))) {
         --pending_commands;
-        FinishEdge(edge, success, output);
+        if (!FinishEdge(edge, success, false, output, &usage, err)) {
+          FinishAllHashedEdges();
+          return false;
+        }
         if (!success) {
           if (failures_allowed-- == 0) {
             if (config_.swallow_failures != 0)
               *err = "subcommands failed";
             else
               *err = "subcommand failed";
+            FinishAllHashedEdges();
             return false;
           }
         }
@@ -541,20 +1330,29 @@ bool Builder::Build(string* err) {
         // We made some progress; start the main loop over.
         continue;
       }
+      // Woken up by the hasher, possibly for a job that was taken since.
+      if (command_runner_->Woken())
+        continue;
+    } else if (hasher_ && hasher_->pending()) {
+      hasher_->WaitForDone();
+      continue;
     }
 
     // If we get here, we can neither enqueue new commands nor are any running.
     if (pending_commands) {
       *err = "stuck: pending commands but none to wait for? [this is a bug]";
+      FinishAllHashedEdges();
       return false;
     }
 
     // If we get here, we cannot make any more progress.
     if (failures_allowed < config_.swallow_failures) {
       *err = "cannot make progress due to previous errors";
+      FinishAllHashedEdges();
       return false;
     } else {
       *err = "stuck [this is a bug]";
+      FinishAllHashedEdges();
       return false;
     }
   }
@@ -562,22 +1360,30 @@ bool Builder::Build(string* err) {
   return true;
 }
 
-bool Builder::StartEdge(Edge* edge, string* err) {
+bool Builder::StartEdge(Edge* edge, bool* restored, string* err) {
   if (edge->is_phony())
     return true;
+  edge->set_ran(true);
 
   status_->BuildEdgeStarted(edge);
+  if (observer_)
+    observer_->EdgeStarted(edge);
 
-  // Create directories necessary for outputs.
-  // XXX: this will block; do we care?
-  for (vector<Node*>::iterator i = edge->outputs_.begin();
-       i != edge->outputs_.end(); ++i) {
-    if (!disk_interface_->MakeDirs((*i)->path()))
-      return false;
+  if (!MakeOutputDirs(edge))
+    return false;
+
+  if (Cacheable(edge)) {
+    vector<string> files;
+    CachedFiles(edge, &files);
+    uint64_t key;
+    if (CacheKey(edge, false, files, &key) && cache_->Restore(key, files)) {
+      *restored = true;
+      return true;
+    }
   }
 
   // Compute command and start it.
-  string command = edge->EvaluateCommand();
+  const string& command = edge->EvaluateCommand();
   if (!command_runner_->StartCommand(edge)) {
     err->assign("command '" + command + "' failed.");
     return false;
@@ -586,54 +1392,195 @@ bool Builder::StartEdge(Edge* edge, string* err) {
   return true;
 }
 
-void Builder::FinishEdge(Edge* edge, bool success, const string& output) {
-  TimeStamp restat_mtime = 0;
+bool Builder::MakeOutputDirs(Edge* edge) {
+  for (vector<Node*>::iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i) {
+    string dir = DirName((*i)->path());
+    if (dir.empty() || made_dirs_.count(dir))
+      continue;
+    if (!disk_interface_->MakeDirs((*i)->path()))
+      return false;
+    // MakeDirs() made sure the parents exist as well.
+    for (; !dir.empty() && made_dirs_.insert(dir).second; dir = DirName(dir))
+      ;
+  }
+  return true;
+}
 
+void Builder::MakeAllOutputDirs() {
+  METRIC_RECORD("make output dirs");
+
+  // Every directory an output goes into, and their parents.
+  set<string> dirs;
+  vector<Edge*> edges;
+  plan_.CommandEdges(&edges);
+  for (vector<Edge*>::iterator e = edges.begin(); e != edges.end(); ++e) {
+    for (vector<Node*>::iterator i = (*e)->outputs_.begin();
+         i != (*e)->outputs_.end(); ++i) {
+      for (string dir = DirName((*i)->path());
+           !dir.empty() && dirs.insert(dir).second; dir = DirName(dir))
+        ;
+    }
+  }
+
+  vector<const string*> paths;
+  for (set<string>::iterator i = dirs.begin(); i != dirs.end(); ++i)
+    paths.push_back(&*i);
+  vector<TimeStamp> mtimes;
+  disk_interface_->StatBatch(paths, &mtimes);
+
+  // Group the missing ones by depth: once a level exists, the next one
+  // can be created all at once.
+  map<int, vector<const string*> > missing;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (mtimes[i] > 0)
+      made_dirs_.insert(*paths[i]);
+    else if (mtimes[i] == 0)
+      missing[DirDepth(*paths[i])].push_back(paths[i]);
+  }
+  for (map<int, vector<const string*> >::iterator level = missing.begin();
+       level != missing.end(); ++level) {
+    vector<int> results;
+    disk_interface_->MakeDirBatch(level->second, &results);
+    for (size_t i = 0; i < results.size(); ++i) {
+      if (results[i])
+        made_dirs_.insert(*level->second[i]);
+    }
+  }
+}
+
+bool Builder::FinishEdge(Edge* edge, bool success, bool restored,
+                         const string& output, const ResourceUsage* usage,
+                         string* err) {
+  // The command may have rewritten its outputs in place, which wouldn't be
+  // visible to a cache of file mtimes.
+  if (!edge->is_phony()) {
+    for (vector<Node*>::iterator i = edge->outputs_.begin();
+         i != edge->outputs_.end(); ++i) {
+      disk_interface_->Invalidate((*i)->path());
+    }
+    if (!edge->rule().depfile().empty())
+      disk_interface_->Invalidate(edge->EvaluateDepFile());
+  }
+
+  bool deps_logged = !edge->rule().deps().empty() && state_->deps_log_ &&
+      !config_.dry_run;
+
+  vector<TimeStamp> mtimes;
+  vector<uint64_t> hashes;
   if (success) {
-    if (edge->rule().restat() && !config_.dry_run) {
-      bool node_cleaned = false;
+    // Before ExtractDeps() consumes the depfile.
+    if (!restored && Cacheable(edge)) {
+      vector<string> files;
+      CachedFiles(edge, &files);
+      uint64_t key;
+      if (CacheKey(edge, true, files, &key))
+        cache_->Store(key, files);
+    }
 
+    if (deps_logged && !ExtractDeps(edge, err))
+      return false;
+
+    if (edge->rule().restat() && !config_.dry_run) {
       for (vector<Node*>::iterator i = edge->outputs_.begin();
            i != edge->outputs_.end(); ++i) {
-        TimeStamp new_mtime = disk_interface_->Stat((*i)->path());
-        if ((*i)->mtime() == new_mtime) {
-          // The rule command did not change the output.  Propagate the clean
-          // state through the build graph.
-          // Note that this also applies to nonexistent outputs (mtime == 0).
-          plan_.CleanNode(log_, *i);
-          node_cleaned = true;
-        }
+        mtimes.push_back(disk_interface_->Stat((*i)->path()));
       }
+    }
+  }
 
-      if (node_cleaned) {
-        // If any output was cleaned, find the most recent mtime of any
-        // (existing) non-order-only input or the depfile.
-        for (vector<Node*>::iterator i = edge->inputs_.begin();
-             i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
-          TimeStamp input_mtime = disk_interface_->Stat((*i)->path());
-          if (input_mtime == 0) {
-            restat_mtime = 0;
-            break;
-          }
-          if (input_mtime > restat_mtime)
-            restat_mtime = input_mtime;
-        }
+  if (!mtimes.empty() && edge->rule().hash_restat()) {
+    if (!hasher_ && disk_interface_->ReadsInBackground()) {
+      hasher_ = new OutputHasher(disk_interface_, command_runner_);
+      if (!hasher_->Start()) {
+        delete hasher_;
+        hasher_ = NULL;
+      }
+    }
+    if (hasher_) {
+      OutputHasher::Job* job = new OutputHasher::Job;
+      job->edge = edge;
+      job->output = output;
+      job->has_usage = usage != NULL;
+      if (usage)
+        job->usage = *usage;
+      job->mtimes.swap(mtimes);
+      hasher_->Add(job);
+      return true;
+    }
+
+    hashes.resize(mtimes.size());
+    for (size_t i = 0; i < mtimes.size(); ++i) {
+      if (mtimes[i] > 0)
+        hashes[i] = HashOutput(disk_interface_, edge->outputs_[i]->path());
+    }
+  }
+
+  FinishOutputs(edge, success, output, usage, mtimes, hashes);
+  return true;
+}
+
+void Builder::FinishOutputs(Edge* edge, bool success, const string& output,
+                            const ResourceUsage* usage,
+                            const vector<TimeStamp>& mtimes,
+                            const vector<uint64_t>& hashes) {
+  TimeStamp restat_mtime = 0;
+  if (success) {
+    bool node_cleaned = false;
+    for (size_t i = 0; i < mtimes.size(); ++i) {
+      Node* node = edge->outputs_[i];
+      TimeStamp new_mtime = mtimes[i];
+      if (!hashes.empty() && new_mtime > 0 &&
+          OutputContentsUnchanged(node, new_mtime, hashes[i])) {
+        new_mtime = node->mtime();
+      }
+      if (node->mtime() == new_mtime) {
+        // The rule command did not change the output.  Propagate the clean
+        // state through the build graph.
+        // Note that this also applies to nonexistent outputs (mtime == 0).
+        plan_.CleanNode(log_, node);
+        node_cleaned = true;
+      }
+    }
 
-        if (restat_mtime != 0 && !edge->rule().depfile().empty()) {
-          TimeStamp depfile_mtime = disk_interface_->Stat(edge->EvaluateDepFile());
-          if (depfile_mtime == 0)
-            restat_mtime = 0;
-          else if (depfile_mtime > restat_mtime)
-            restat_mtime = depfile_mtime;
+    if (node_cleaned) {
+      // If any output was cleaned, find the most recent mtime of any
+      // (existing) non-order-only input or the depfile.
+      for (size_t i = 0; i < edge->inputs_.size(); ++i) {
+        if (edge->is_order_only(i))
+          continue;
+        TimeStamp input_mtime =
+            disk_interface_->Stat(edge->inputs_[i]->path());
+        if (input_mtime == 0) {
+          restat_mtime = 0;
+          break;
         }
+        if (input_mtime > restat_mtime)
+          restat_mtime = input_mtime;
+      }
 
-        // The total number of edges in the plan may have changed as a result
-        // of a restat.
-        status_->PlanHasTotalEdges(plan_.command_edge_count());
+      // An ingested depfile is gone by now; its contents live on in the
+      // deps log, which carries its own mtime.
+      bool deps_logged = !edge->rule().deps().empty() && state_->deps_log_;
+      if (restat_mtime != 0 && !edge->rule().depfile().empty() &&
+          !deps_logged) {
+        TimeStamp depfile_mtime = disk_interface_->Stat(edge->EvaluateDepFile());
+        if (depfile_mtime == 0)
+          restat_mtime = 0;
+        else if (depfile_mtime > restat_mtime)
+          restat_mtime = depfile_mtime;
       }
+
+      // The total number of edges in the plan may have changed as a result
+      // of a restat.
+      status_->PlanHasTotalEdges(plan_.command_edge_count());
+      if (observer_)
+        observer_->PlanHasTotalEdges(plan_.command_edge_count());
     }
 
     plan_.EdgeFinished(edge);
+  } else {
+    plan_.EdgeFailed(edge);
   }
 
   if (edge->is_phony())
@@ -641,6 +1588,133 @@ void Builder::FinishEdge(Edge* edge, bool success, const string& output) {
 
   int start_time, end_time;
   status_->BuildEdgeFinished(edge, success, output, &start_time, &end_time);
-  if (success && log_)
-    log_->RecordCommand(edge, start_time, end_time, restat_mtime);
+  if (observer_)
+    observer_->EdgeFinished(edge, success, output);
+  if (success && log_) {
+    log_->RecordCommand(edge, start_time, end_time, restat_mtime,
+                        hashes.empty() ? NULL : &hashes, usage);
+  } else if (!success && log_) {
+    log_->RecordFailure(edge);
+  }
+  // The edge won't run again in this build.
+  edge->ForgetEvaluatedStrings();
+}
+
+void Builder::FinishAllHashedEdges() {
+  if (!hasher_)
+    return;
+  while (hasher_->pending()) {
+    if (!FinishHashedEdges())
+      hasher_->WaitForDone();
+  }
+}
+
+bool Builder::FinishHashedEdges() {
+  vector<OutputHasher::Job*> done;
+  hasher_->TakeDone(&done);
+  for (vector<OutputHasher::Job*>::iterator i = done.begin(); i != done.end();
+       ++i) {
+    OutputHasher::Job* job = *i;
+    FinishOutputs(job->edge, true, job->output,
+                  job->has_usage ? &job->usage : NULL, job->mtimes,
+                  job->hashes);
+    delete job;
+  }
+  return !done.empty();
+}
+
+bool Builder::Cacheable(Edge* edge) const {
+  // Generator rules regenerate the manifest from sources the manifest
+  // doesn't know about.
+  return cache_ && !config_.dry_run && !edge->rule().generator();
+}
+
+void Builder::CachedFiles(Edge* edge, vector<string>* files) {
+  for (vector<Node*>::iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i) {
+    files->push_back((*i)->path());
+  }
+  if (!edge->rule().depfile().empty())
+    files->push_back(edge->EvaluateDepFile());
+}
+
+bool Builder::CacheKey(Edge* edge, bool after_run,
+                       const vector<string>& files, uint64_t* key) {
+  vector<Node*> inputs(edge->inputs_.begin(),
+                       edge->inputs_.begin() + edge->order_only_begin());
+  // Deps from the deps log are complete, but those loaded from a depfile
+  // for the dirty scan may only be the ones that are built (see
+  // Edge::LoadDepFile()), so the depfile itself is read again.
+  bool deps_logged = !edge->rule().deps().empty() && state_->deps_log_;
+  if (!edge->rule().depfile().empty() && (after_run || !deps_logged)) {
+    // Before a run, what the command read the time before; after it, what
+    // it read this time.  If the two differ, so will the keys.
+    string err;
+    if (!edge->ReadDepFile(state_, disk_interface_, &inputs, &err))
+      return false;
+  } else if (!after_run) {
+    inputs.insert(inputs.end(),
+                  edge->inputs_.begin() + edge->order_only_end(),
+                  edge->inputs_.end());
+  }
+  return cache_->Key(edge->EvaluateCommand(), inputs, files, key);
+}
+
+bool Builder::OutputContentsUnchanged(Node* node, TimeStamp new_mtime,
+                                      uint64_t hash) {
+  if (!hash)
+    return false;
+  BuildLog::LogEntry* entry = log_ ? log_->LookupByOutput(node->path()) : NULL;
+  if (!entry || entry->content_hash != hash)
+    return false;
+  TimeStamp old_mtime = node->mtime();
+  if (old_mtime <= 0)
+    return false;
+  // Put the old mtime back, so that outputs depending on this one are up to
+  // date in later builds too.
+  return old_mtime == new_mtime ||
+      disk_interface_->SetMTime(node->path(), old_mtime);
+}
+
+bool Builder::ExtractDeps(Edge* edge, string* err) {
+  Node* output = edge->outputs_[0];
+  const string& depfile_path = edge->EvaluateDepFile();
+  string content = disk_interface_->ReadFile(depfile_path, err);
+  if (!err->empty())
+    return false;
+
+  vector<Node*> deps_nodes;
+  if (!content.empty()) {
+    DepfileParser depfile;
+    string depfile_err;
+    if (!depfile.Parse(&content, &depfile_err)) {
+      *err = depfile_path + ": " + depfile_err;
+      return false;
+    }
+
+    // Check that this depfile matches our output.
+    if (StringPiece(output->path()) != depfile.out_) {
+      *err = "expected depfile '" + depfile_path + "' to mention '" +
+        output->path() + "', got '" + depfile.out_.AsString() + "'";
+      return false;
+    }
+
+    deps_nodes.reserve(depfile.ins_.size());
+    for (vector<StringPiece>::iterator i = depfile.ins_.begin();
+         i != depfile.ins_.end(); ++i) {
+      if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, err))
+        return false;
+      deps_nodes.push_back(state_->GetNode(*i));
+    }
+  }
+
+  TimeStamp mtime = disk_interface_->Stat(output->path());
+  if (!state_->deps_log_->RecordDeps(output, mtime, deps_nodes)) {
+    *err = string("error writing to deps log: ") + strerror(errno);
+    return false;
+  }
+
+  // The depfile has served its purpose.
+  disk_interface_->RemoveFile(depfile_path);
+  return true;
 }
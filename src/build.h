@@ -17,21 +17,26 @@
 
 #include <map>
 #include <set>
+#include <stdint.h>
 #include <string>
 #include <queue>
 #include <vector>
 using namespace std;
 
+#include "graph.h"
+
 struct BuildLog;
-struct Edge;
 struct DiskInterface;
-struct Node;
+struct Jobserver;
+struct OutputCache;
+struct ResourceUsage;
 struct State;
 
 /// Plan stores the state of a build plan: what we intend to build,
 /// which steps we're ready to execute.
 struct Plan {
   Plan();
+  ~Plan();
 
   /// Add a target to our plan (including all its dependencies).
   /// Returns false if we don't need to build this target; may
@@ -39,9 +44,21 @@ struct Plan {
   bool AddTarget(Node* node, string* err);
 
   // Pop a ready edge off the queue of edges to build.
-  // Returns NULL if there's no work to do.
+  // Returns NULL if there's no work to do.  Ready phony edges are
+  // finished here, along with the ones that become ready as a result, so
+  // what's returned usually has a command; only a phony edge in a pool
+  // with a depth, which must wait its turn, comes out of here.  As this
+  // finishes edges, there may be no more to do once it returns NULL.
   Edge* FindWork();
 
+  /// Estimate each wanted edge's critical path from the durations in
+  /// \a build_log (which may be NULL), so that FindWork() starts the
+  /// longest chains of work first.  Edges that failed in the previous
+  /// build, and what they wait for, go before anything else, so that the
+  /// error that's likely being fixed shows up early if it's still there.
+  /// Call once all targets are added.
+  void ComputeCriticalPath(BuildLog* build_log);
+
   /// Returns true if there's more work to be done.
   bool more_to_do() const { return wanted_edges_; }
 
@@ -52,25 +69,43 @@ struct Plan {
   /// tests.
   void EdgeFinished(Edge* edge);
 
+  /// Note that an edge's command failed.  It frees the edge's slot in its
+  /// pool, but the edge and its dependents remain unfinished.
+  void EdgeFailed(Edge* edge);
+
   /// Clean the given node during the build.
   void CleanNode(BuildLog* build_log, Node* node);
 
   /// Number of edges with commands to run.
   int command_edge_count() const { return command_edges_; }
 
+  /// Append the edges with commands that are yet to finish to \a edges.
+  void CommandEdges(vector<Edge*>* edges) const;
+
 private:
   bool AddSubTarget(Node* node, vector<Node*>* stack, string* err);
   bool CheckDependencyCycle(Node* node, vector<Node*>* stack, string* err);
   void NodeFinished(Node* node);
+  /// Compute and return \a edge->critical_time_, and that of everything
+  /// wanted that depends on it.
+  int64_t CriticalTime(Edge* edge, BuildLog* build_log,
+                       int64_t default_duration);
+  /// Set failed_before_ on \a edge and the wanted edges it waits for.
+  void MarkFailedBefore(Edge* edge);
 
-  /// Keep track of which edges we want to build in this plan.  If this map does
-  /// not contain an entry for an edge, we do not want to build the entry or its
-  /// dependents.  If an entry maps to false, we do not want to build it, but we
-  /// might want to build one of its dependents.  If the entry maps to true, we
-  /// want to build it.
-  map<Edge*, bool> want_;
+  /// Submit an edge whose inputs are ready, which goes into ready_ right
+  /// away unless its pool is full.  Does nothing if it was already
+  /// submitted, e.g. through another of its inputs.
+  void ScheduleWork(Edge* edge);
 
-  set<Edge*> ready_;
+  /// Every edge ever added to the plan, finished ones included.  Which of
+  /// them we want to build, and how far along they are, is kept in each
+  /// Edge::want() so that scheduling needs no lookups.
+  vector<Edge*> edges_;
+
+  EdgePriorityQueue ready_;
+  /// Phony edges ready to be finished by FindWork().
+  vector<Edge*> ready_phony_;
 
   /// Total number of edges that have commands (not phony).
   int command_edges_;
@@ -86,14 +121,39 @@ struct CommandRunner {
   virtual ~CommandRunner() {}
   virtual bool CanRunMore() = 0;
   virtual bool StartCommand(Edge* edge) = 0;
-  /// Wait for a command to complete.
-  virtual Edge* WaitForCommand(bool* success, string* output) = 0;
+  /// Wait for a command to complete, filling in what it used in \a usage
+  /// if known.
+  virtual Edge* WaitForCommand(bool* success, string* output,
+                               ResourceUsage* usage) = 0;
+  /// Make a WaitForCommand() in progress, or the next one, return soon,
+  /// with NULL if no command finished meanwhile.  May be called from any
+  /// thread.
+  virtual void Wake() {}
+  /// Whether the last WaitForCommand() returned NULL because of Wake().
+  virtual bool Woken() { return false; }
+};
+
+/// BuildObserver is told how a build is going, for programs that run
+/// builds in-process (see Session) and want more than the status line.
+struct BuildObserver {
+  virtual ~BuildObserver() {}
+  /// The plan now holds \a total edges with commands; called when the
+  /// build starts and again whenever a restat changes the count.
+  virtual void PlanHasTotalEdges(int total) {}
+  virtual void EdgeStarted(Edge* edge) {}
+  /// \a edge finished, with \a output what its command printed.
+  virtual void EdgeFinished(Edge* edge, bool success, const string& output) {}
 };
 
 /// Options (e.g. verbosity, parallelism) passed to a build.
 struct BuildConfig {
   BuildConfig() : verbosity(NORMAL), dry_run(false), parallelism(1),
-                  swallow_failures(0) {}
+                  min_parallelism(0), max_parallelism(0),
+                  swallow_failures(0), direct_exec(false),
+                  max_load_average(-1.0), min_available_memory(-1),
+                  remote_parallelism(0), output_limit(16 << 20),
+                  stream_after_millis(0), make_dirs_first(false),
+                  jobserver(NULL) {}
 
   enum Verbosity {
     NORMAL,
@@ -103,12 +163,49 @@ struct BuildConfig {
   Verbosity verbosity;
   bool dry_run;
   int parallelism;
+  /// If \a max_parallelism is positive, \a parallelism is only where it
+  /// starts, and it's tuned to the load of the machine within these
+  /// bounds as the build goes; see AutoParallelism.
+  int min_parallelism;
+  int max_parallelism;
   int swallow_failures;
+  /// Whether to skip the shell for commands that don't need it.
+  bool direct_exec;
+  /// Don't start more commands while the load average is at least this
+  /// high.  Ignored if not positive.
+  double max_load_average;
+  /// Don't start more commands while fewer than this many bytes of memory
+  /// are available.  Ignored if not positive.
+  int64_t min_available_memory;
+  /// Workers ("host:port") to run commands on; see remote.h.  Empty to
+  /// run everything locally.
+  vector<string> remote_workers;
+  /// How many commands may run on remote workers at once, regardless of
+  /// \a parallelism.
+  int remote_parallelism;
+  /// How to run Ninja itself, which ships remote commands to workers.
+  string ninja_path;
+  /// Keep about this many bytes of each command's output (0 for all of
+  /// it); see CommandOutput.
+  size_t output_limit;
+  /// If not empty, where to write the full output of commands exceeding
+  /// \a output_limit.
+  string spill_dir;
+  /// Stream the output of a command running longer than this; see
+  /// SubprocessSet::set_stream_after().
+  int stream_after_millis;
+  /// Whether to create the output directories of the whole plan up front,
+  /// in parallel, rather than one edge at a time as it starts.
+  bool make_dirs_first;
+  /// If not NULL, where to take a token for each local command run
+  /// alongside another, on top of the limits above.
+  Jobserver* jobserver;
 };
 
 /// Builder wraps the build process: starting commands, updating status.
 struct Builder {
   Builder(State* state, const BuildConfig& config);
+  ~Builder();
 
   Node* AddTarget(const string& name, string* err);
 
@@ -116,6 +213,10 @@ struct Builder {
   /// @return false on error.
   bool AddTarget(Node* target, string* err);
 
+  /// Stat every not-yet-stat()ed node the target (transitively) depends
+  /// on in one batch, so the dirty scan only has to read cached mtimes.
+  void StatReachableNodes(Node* target);
+
   /// Returns true if the build targets are already up to date.
   bool AlreadyUpToDate() const;
 
@@ -123,16 +224,88 @@ struct Builder {
   /// It is an error to call this function when AlreadyUpToDate() is true.
   bool Build(string* err);
 
-  bool StartEdge(Edge* edge, string* err);
-  void FinishEdge(Edge* edge, bool success, const string& output);
+  /// Start running \a edge's command, unless its outputs could be
+  /// restored from cache_, in which case \a restored is set and the edge
+  /// is ready for FinishEdge().
+  bool StartEdge(Edge* edge, bool* restored, string* err);
+  /// Returns false if recording the edge's dependencies failed.  \a usage
+  /// is what the command used, if it ran.  The outputs of a
+  /// "restat = hash" edge may be left to hasher_ to hash, in which case
+  /// FinishHashedEdges() finishes the edge later.
+  bool FinishEdge(Edge* edge, bool success, bool restored,
+                  const string& output, const ResourceUsage* usage,
+                  string* err);
+  /// The rest of FinishEdge() once the outputs of a restat edge were
+  /// stat()ed into \a mtimes and, for "restat = hash", hashed into
+  /// \a hashes (0 for those that couldn't be).
+  void FinishOutputs(Edge* edge, bool success, const string& output,
+                     const ResourceUsage* usage,
+                     const vector<TimeStamp>& mtimes,
+                     const vector<uint64_t>& hashes);
+  /// Finish the edges hasher_ is done with.  Returns false if there were
+  /// none.
+  bool FinishHashedEdges();
+  /// Wait for hasher_ to be done with every edge and finish them, so that
+  /// a failed build still logs the edges that succeeded.
+  void FinishAllHashedEdges();
+
+  /// Create the directories \a edge's outputs go into, unless that was
+  /// done earlier in the build.  Returns false on failure.
+  bool MakeOutputDirs(Edge* edge);
+  /// Create the output directories of every edge in the plan, a level of
+  /// the directory tree at a time, using the disk interface's batches.
+  /// Failures are left for MakeOutputDirs() to report.
+  void MakeAllOutputDirs();
+
+  /// Move the dependencies in \a edge's depfile into the deps log.
+  bool ExtractDeps(Edge* edge, string* err);
+
+  /// For "restat = hash": whether \a hash, that of the contents of
+  /// \a node, an output that was just rewritten with \a new_mtime, matches
+  /// the one recorded in the build log, in which case the output's old
+  /// mtime has been restored.
+  bool OutputContentsUnchanged(Node* node, TimeStamp new_mtime,
+                               uint64_t hash);
+
+  /// Whether \a edge's outputs may come from cache_.
+  bool Cacheable(Edge* edge) const;
+  /// The files cache_ keeps for \a edge: its outputs and its depfile.
+  void CachedFiles(Edge* edge, vector<string>* files);
+  /// Fill in the cache key of \a edge, with the implicit dependencies its
+  /// depfile names now rather than those loaded before it ran if
+  /// \a after_run.  Returns false if the edge can't be cached.
+  bool CacheKey(Edge* edge, bool after_run, const vector<string>& files,
+                uint64_t* key);
 
   State* state_;
   const BuildConfig& config_;
   Plan plan_;
   DiskInterface* disk_interface_;
+  /// Runs the commands.  If NULL when the build starts, the Builder
+  /// makes one suited to config_.
   CommandRunner* command_runner_;
   struct BuildStatus* status_;
+  /// Told about the build alongside status_, if not NULL.
+  BuildObserver* observer_;
   struct BuildLog* log_;
+  /// Where to find and keep outputs built before, or NULL.
+  OutputCache* cache_;
+  /// Hashes outputs for "restat = hash" in the background, if the disk
+  /// interface can read files from another thread; made when first needed.
+  struct OutputHasher* hasher_;
+
+  /// Directories known to exist, so that MakeOutputDirs() needn't ask the
+  /// disk again.
+  set<string> made_dirs_;
+
+ private:
+  /// What the Builder made itself, in case the above were replaced.
+  DiskInterface* own_disk_interface_;
+  CommandRunner* own_command_runner_;
+
+  // Not copyable.
+  Builder(const Builder&);
+  void operator=(const Builder&);
 };
 
 #endif  // NINJA_BUILD_H_
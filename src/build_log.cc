@@ -14,12 +14,19 @@
 
 #include "build_log.h"
 
+#include <algorithm>
 #include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "build.h"
+#include "disk_interface.h"
 #include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "subprocess.h"
+#include "threads.h"
 #include "util.h"
 
 // Implementation details:
@@ -32,25 +39,340 @@
 namespace {
 
 const char kFileSignature[] = "# ninja log v%d\n";
-const int kCurrentVersion = 4;
+const int kCurrentVersion = 7;
+
+/// Size of the fixed part of a record: start and end time, restat mtime,
+/// the command hash, the content hash, user and system time and max RSS.
+const uint32_t kRecordHeaderSize = 4 + 4 + 4 + 8 + 8 + 4 + 4 + 8;
+/// The same for version 6, which lacks the resource usage.
+const uint32_t kV6RecordHeaderSize = 4 + 4 + 4 + 8 + 8;
+/// The same for version 5, which also lacks the content hash.
+const uint32_t kV5RecordHeaderSize = 4 + 4 + 4 + 8;
+/// Record size is limited so a corrupt size field can't make us walk off
+/// into the weeds.
+const uint32_t kMaxRecordSize = (1 << 19) - 1;
+
+// 64bit MurmurHash2, by Austin Appleby
+inline uint64_t MurmurHash64A(const void* key, size_t len) {
+  static const uint64_t seed = 0xDECAFBADDECAFBADull;
+  const uint64_t m = 0xc6a4a7935bd1e995ull;
+  const int r = 47;
+  uint64_t h = seed ^ (len * m);
+  const unsigned char* data = (const unsigned char*)key;
+  while (len >= 8) {
+    uint64_t k;
+    memcpy(&k, data, sizeof k);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+    data += 8;
+    len -= 8;
+  }
+  if (len > 0) {
+    for (size_t i = 0; i < len; ++i)
+      h ^= uint64_t(data[i]) << (8 * i);
+    h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+/// Append the record for \a entry to \a out.
+void AppendRecord(string* out, const BuildLog::LogEntry& entry) {
+  uint32_t record_size = kRecordHeaderSize + entry.output.len_;
+  out->append((const char*)&record_size, 4);
+  out->append((const char*)&entry.start_time, 4);
+  out->append((const char*)&entry.end_time, 4);
+  out->append((const char*)&entry.restat_mtime, 4);
+  out->append((const char*)&entry.command_hash, 8);
+  out->append((const char*)&entry.content_hash, 8);
+  out->append((const char*)&entry.user_time, 4);
+  out->append((const char*)&entry.system_time, 4);
+  out->append((const char*)&entry.max_rss, 8);
+  out->append(entry.output.str_, entry.output.len_);
+}
+
+/// Set once a signal is killing us; see BuildLog::LogWriter::OnSignal().
+volatile sig_atomic_t g_interrupted = 0;
 
 }  // namespace
 
+/// Appends records to the log on a thread of its own.  Whatever is queued
+/// while it writes one batch goes out as the next, with a single write
+/// and flush.  Batches hold whole records, so a crash can at worst cut
+/// the last one short, which Load() discards.
+struct BuildLog::LogWriter : public Thread {
+  explicit LogWriter(FILE* file)
+      : file_(file), queued_(0), written_(0), stopping_(false), error_(0) {}
+
+  /// Queue \a records to be written.
+  void Append(const string& records);
+  /// Wait until everything queued so far is written.
+  void Flush();
+  /// Write what's left and wait for the thread to end.
+  void Stop();
+
+  /// Have the signals that would kill us first let this writer finish.
+  void WatchSignals();
+  void UnwatchSignals();
+
+  FILE* file_;
+  Mutex mutex_;
+  /// Guarded by mutex_: records not yet written, how many Append() calls
+  /// there were, how many of those are written, and whether to stop.
+  string pending_;
+  uint64_t queued_;
+  uint64_t written_;
+  bool stopping_;
+  /// The errno of the first failed write, once the thread has ended.
+  int error_;
+  Event wake_;
+  Event done_;
+  /// Signaled when the thread ends.
+  Event exited_;
+
+ protected:
+  virtual void Run();
+
+ private:
+#ifdef _WIN32
+  static BOOL WINAPI OnConsoleCtrl(DWORD type);
+#else
+  static void OnSignal(int signum);
+  static const int kSignals[];
+  static const int kSignalCount;
+  static struct sigaction old_actions_[];
+#endif
+  /// The writer signals wait for, if any.
+  static LogWriter* volatile signal_writer_;
+};
+
+BuildLog::LogWriter* volatile BuildLog::LogWriter::signal_writer_ = NULL;
+#ifndef _WIN32
+const int BuildLog::LogWriter::kSignals[] = { SIGINT, SIGTERM, SIGHUP };
+const int BuildLog::LogWriter::kSignalCount = 3;
+struct sigaction BuildLog::LogWriter::old_actions_[3];
+#endif
+
+void BuildLog::LogWriter::Append(const string& records) {
+  {
+    ScopedLock lock(&mutex_);
+    pending_.append(records);
+    ++queued_;
+  }
+  wake_.Signal();
+}
+
+void BuildLog::LogWriter::Flush() {
+  uint64_t target;
+  {
+    ScopedLock lock(&mutex_);
+    target = queued_;
+  }
+  for (;;) {
+    {
+      ScopedLock lock(&mutex_);
+      if (written_ >= target)
+        return;
+    }
+    done_.Wait();
+  }
+}
+
+void BuildLog::LogWriter::Stop() {
+  {
+    ScopedLock lock(&mutex_);
+    stopping_ = true;
+  }
+  wake_.Signal();
+  Join();
+}
+
+void BuildLog::LogWriter::Run() {
+#ifndef _WIN32
+  // Leave the signals to the other threads, whose handler waits for us.
+  sigset_t set;
+  sigemptyset(&set);
+  for (int i = 0; i < kSignalCount; ++i)
+    sigaddset(&set, kSignals[i]);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+#endif
+
+  bool stopping = false;
+  while (!stopping) {
+    wake_.Wait();
+    string batch;
+    uint64_t queued;
+    {
+      ScopedLock lock(&mutex_);
+      batch.swap(pending_);
+      queued = queued_;
+      stopping = stopping_ || g_interrupted;
+    }
+    if (!batch.empty() && !error_ &&
+        (fwrite(batch.data(), batch.size(), 1, file_) != 1 ||
+         fflush(file_) != 0)) {
+      error_ = errno;
+    }
+    {
+      ScopedLock lock(&mutex_);
+      written_ = queued;
+    }
+    done_.Signal();
+  }
+  exited_.Signal();
+}
+
+void BuildLog::LogWriter::WatchSignals() {
+  if (signal_writer_)
+    return;
+  signal_writer_ = this;
+#ifdef _WIN32
+  SetConsoleCtrlHandler(OnConsoleCtrl, TRUE);
+#else
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = OnSignal;
+  sigemptyset(&act.sa_mask);
+  for (int i = 0; i < kSignalCount; ++i) {
+    // Leave alone signals that are ignored or handled by someone else.
+    sigaction(kSignals[i], NULL, &old_actions_[i]);
+    if (old_actions_[i].sa_handler == SIG_DFL)
+      sigaction(kSignals[i], &act, NULL);
+  }
+#endif
+}
+
+void BuildLog::LogWriter::UnwatchSignals() {
+  if (signal_writer_ != this)
+    return;
+#ifdef _WIN32
+  SetConsoleCtrlHandler(OnConsoleCtrl, FALSE);
+#else
+  for (int i = 0; i < kSignalCount; ++i) {
+    if (old_actions_[i].sa_handler == SIG_DFL)
+      sigaction(kSignals[i], &old_actions_[i], NULL);
+  }
+#endif
+  signal_writer_ = NULL;
+}
+
+#ifdef _WIN32
+// static
+BOOL WINAPI BuildLog::LogWriter::OnConsoleCtrl(DWORD type) {
+  // This runs on a thread of its own, and the process ends once it and
+  // any other handlers return.
+  g_interrupted = 1;
+  if (LogWriter* writer = signal_writer_) {
+    writer->wake_.Signal();
+    writer->exited_.Wait(2000);
+  }
+  return FALSE;
+}
+#else
+// static
+void BuildLog::LogWriter::OnSignal(int signum) {
+  // Only async-signal-safe calls here.  The wait is bounded in case the
+  // signal interrupted this very thread while it held the writer's lock:
+  // then the records still queued are lost, as in a crash.
+  g_interrupted = 1;
+  if (LogWriter* writer = signal_writer_) {
+    writer->wake_.Signal();
+    writer->exited_.Wait(2000);
+  }
+  // Die of the signal, as we would have without the handler.
+  signal(signum, SIG_DFL);
+  raise(signum);
+}
+#endif
+
+/// Writes a snapshot of the log to a new file, so the build need not wait
+/// for it.  Entries' outputs point into storage that outlives the thread.
+struct BuildLog::RecompactThread : public Thread {
+  RecompactThread(const string& temp_path, const vector<LogEntry>& entries)
+      : temp_path_(temp_path), entries_(entries), ok_(false) {}
+
+  virtual void Run() {
+    ok_ = WriteLogFile(temp_path_, entries_, &err_);
+  }
+
+  string temp_path_;
+  vector<LogEntry> entries_;
+  bool ok_;
+  string err_;
+};
+
+// static
+uint64_t BuildLog::LogEntry::HashCommand(StringPiece command) {
+  return MurmurHash64A(command.str_, command.len_);
+}
+
+const size_t BuildLog::LogEntry::kContentsBlockSize;
+
+// static
+uint64_t BuildLog::LogEntry::HashContents(StringPiece contents) {
+  uint64_t hash = 0;
+  size_t size = contents.len_, start = 0;
+  do {
+    size_t len = min(kContentsBlockSize, size - start);
+    hash = HashContentsBlock(hash, StringPiece(contents.str_ + start, len));
+    start += len;
+  } while (start < size);
+  return hash;
+}
+
+// static
+uint64_t BuildLog::LogEntry::HashContentsBlock(uint64_t hash,
+                                               StringPiece block) {
+  uint64_t block_hash = MurmurHash64A(block.str_, block.len_);
+  if (hash) {
+    // Chain the blocks, so that an output that fits in one block hashes
+    // the same as it did before outputs were hashed in blocks.
+    uint64_t pair[2] = { hash, block_hash };
+    block_hash = MurmurHash64A(pair, sizeof(pair));
+  }
+  return block_hash ? block_hash : 1;
+}
+
+bool StateBuildLogUser::IsPathDead(StringPiece path) const {
+  Node* node = state_->LookupNode(path);
+  if (node && node->in_edge())
+    return false;
+  // A Stat() error keeps the entry.
+  return disk_interface_->Stat(path.AsString()) == 0;
+}
+
 BuildLog::BuildLog()
-  : log_file_(NULL), config_(NULL), needs_recompaction_(false) {}
+  : log_file_(NULL), writer_(NULL), commands_file_(NULL), config_(NULL),
+    keep_commands_(false), needs_recompaction_(false),
+    recompact_thread_(NULL) {}
 
 BuildLog::~BuildLog() {
   Close();
 }
 
-bool BuildLog::OpenForWrite(const string& path, string* err) {
+bool BuildLog::OpenForWrite(const string& path, string* err,
+                            const BuildLogUser* user) {
   if (config_ && config_->dry_run)
     return true;  // Do nothing, report success.
 
   if (needs_recompaction_) {
     Close();
-    if (!Recompact(path, err))
-      return false;
+    log_path_ = path;
+    recompact_thread_ = new RecompactThread(path + ".recompact",
+                                            Snapshot(user));
+    if (recompact_thread_->Start()) {
+      needs_recompaction_ = false;
+    } else {
+      delete recompact_thread_;
+      recompact_thread_ = NULL;
+      if (!Recompact(path, err, user))
+        return false;
+    }
   }
 
   log_file_ = fopen(path.c_str(), "ab");
@@ -58,63 +380,262 @@ bool BuildLog::OpenForWrite(const string& path, string* err) {
     *err = strerror(errno);
     return false;
   }
-  setvbuf(log_file_, NULL, _IOLBF, BUFSIZ);
   SetCloseOnExec(fileno(log_file_));
 
+  // Opening a file in append mode doesn't set the file pointer to the
+  // file's end on all platforms; do so explicitly.
+  fseek(log_file_, 0, SEEK_END);
+
   if (ftell(log_file_) == 0) {
     if (fprintf(log_file_, kFileSignature, kCurrentVersion) < 0) {
       *err = strerror(errno);
       return false;
     }
+    fflush(log_file_);
+  }
+
+  // If no thread can be had, we write the log ourselves.
+  writer_ = new LogWriter(log_file_);
+  if (writer_->Start()) {
+    writer_->WatchSignals();
+  } else {
+    delete writer_;
+    writer_ = NULL;
+  }
+
+  failed_path_ = path + ".failed";
+
+  if (keep_commands_) {
+    string commands_path = path + ".commands";
+    commands_file_ = fopen(commands_path.c_str(), "ab");
+    if (!commands_file_) {
+      *err = strerror(errno);
+      return false;
+    }
+    SetCloseOnExec(fileno(commands_file_));
   }
 
   return true;
 }
 
 void BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
-                             TimeStamp restat_mtime) {
-  const string command = edge->EvaluateCommand();
+                             TimeStamp restat_mtime,
+                             const vector<uint64_t>* content_hashes,
+                             const ResourceUsage* usage) {
+  uint64_t command_hash = edge->GetCommandHash();
+  string records;
   for (vector<Node*>::iterator out = edge->outputs_.begin();
        out != edge->outputs_.end(); ++out) {
-    const string& path = (*out)->path();
-    Log::iterator i = log_.find(path);
-    LogEntry* log_entry;
-    if (i != log_.end()) {
-      log_entry = i->second;
-    } else {
-      log_entry = new LogEntry;
-      log_entry->output = path;
-      log_.insert(Log::value_type(log_entry->output, log_entry));
-    }
-    log_entry->command = command;
+    bool created;
+    LogEntry* log_entry = GetEntry((*out)->path(), true, &created);
+    log_entry->command_hash = command_hash;
     log_entry->start_time = start_time;
     log_entry->end_time = end_time;
     log_entry->restat_mtime = restat_mtime;
+    log_entry->content_hash =
+        content_hashes ? (*content_hashes)[out - edge->outputs_.begin()] : 0;
+    log_entry->user_time = usage ? usage->user_millis : 0;
+    log_entry->system_time = usage ? usage->system_millis : 0;
+    log_entry->max_rss = usage ? usage->max_rss : 0;
 
     if (log_file_)
-      WriteEntry(log_file_, *log_entry);
+      AppendRecord(&records, *log_entry);
+    if (recompact_thread_)
+      recorded_.push_back(*log_entry);
+  }
+  if (writer_) {
+    writer_->Append(records);
+  } else if (log_file_) {
+    fwrite(records.data(), records.size(), 1, log_file_);
+    fflush(log_file_);
+  }
+
+  if (!failed_.empty() && !edge->outputs_.empty() &&
+      failed_.erase(edge->outputs_[0]->path())) {
+    SaveFailures();
+  }
+
+  if (commands_file_) {
+    const string& command = edge->EvaluateCommand();
+    for (vector<Node*>::iterator out = edge->outputs_.begin();
+         out != edge->outputs_.end(); ++out) {
+      fprintf(commands_file_, "%s\t%s\n", (*out)->path().c_str(),
+              command.c_str());
+    }
+    fflush(commands_file_);
   }
 }
 
+void BuildLog::RecordFailure(Edge* edge) {
+  if (edge->outputs_.empty())
+    return;
+  if (failed_.insert(edge->outputs_[0]->path()).second)
+    SaveFailures();
+}
+
+bool BuildLog::FailedBefore(Edge* edge) const {
+  return !failed_.empty() && !edge->outputs_.empty() &&
+      failed_.count(edge->outputs_[0]->path()) != 0;
+}
+
+void BuildLog::SaveFailures() {
+  if (failed_path_.empty())
+    return;
+  if (failed_.empty()) {
+    unlink(failed_path_.c_str());
+    return;
+  }
+  // It's short, and rewritten only when an edge starts or stops failing.
+  FILE* file = fopen(failed_path_.c_str(), "wb");
+  if (!file)
+    return;
+  for (set<string>::iterator i = failed_.begin(); i != failed_.end(); ++i)
+    fprintf(file, "%s\n", i->c_str());
+  fclose(file);
+}
+
+void BuildLog::Flush() {
+  if (writer_)
+    writer_->Flush();
+}
+
 void BuildLog::Close() {
+  if (writer_) {
+    writer_->UnwatchSignals();
+    writer_->Stop();
+    if (writer_->error_)
+      Warning("writing build log: %s", strerror(writer_->error_));
+    delete writer_;
+    writer_ = NULL;
+  }
   if (log_file_)
     fclose(log_file_);
   log_file_ = NULL;
+  if (commands_file_)
+    fclose(commands_file_);
+  commands_file_ = NULL;
+  if (recompact_thread_)
+    FinishRecompaction();
 }
 
 bool BuildLog::Load(const string& path, string* err) {
-  FILE* file = fopen(path.c_str(), "r");
-  if (!file) {
-    if (errno == ENOENT)
-      return true;
-    *err = strerror(errno);
-    return false;
+  METRIC_RECORD(".ninja_log load");
+  failed_.clear();
+  if (FILE* failed = fopen((path + ".failed").c_str(), "rb")) {
+    char buf[4 << 10];
+    while (fgets(buf, sizeof(buf), failed)) {
+      size_t len = strlen(buf);
+      if (len > 0 && buf[len - 1] == '\n')
+        failed_.insert(string(buf, len - 1));
+    }
+    fclose(failed);
+  }
+
+  int ret = mapped_.Open(path, err);
+  if (ret == -ENOENT) {
+    err->clear();
+    return true;
   }
+  if (ret < 0)
+    return false;
+
+  const char* data = mapped_.data();
+  size_t size = mapped_.size();
 
+  // The signature line is text in all versions.
   int log_version = 0;
+  const char* newline = NULL;
+  if (size > 0)
+    newline = (const char*)memchr(data, '\n', min(size, (size_t)64));
+  if (newline) {
+    string signature(data, newline + 1 - data);
+    if (sscanf(signature.c_str(), kFileSignature, &log_version) < 1)
+      log_version = 0;
+  }
+
   int unique_entry_count = 0;
   int total_entry_count = 0;
 
+  if (log_version < 5) {
+    // An older text log; read it and upgrade it on open.
+    mapped_.Close();
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+      *err = strerror(errno);
+      return false;
+    }
+    LoadText(file, log_version, &unique_entry_count, &total_entry_count);
+    fclose(file);
+    METRIC_COUNT(".ninja_log entries loaded", total_entry_count);
+    if (size > 0)
+      needs_recompaction_ = true;
+    return true;
+  }
+
+  if (log_version > kCurrentVersion) {
+    // Written by a newer ninja; we can't use it, so start over.
+    mapped_.Close();
+    needs_recompaction_ = true;
+    return true;
+  }
+
+  // Version 5 and 6 logs are read as they are, then upgraded.
+  uint32_t header_size = kRecordHeaderSize;
+  if (log_version < kCurrentVersion) {
+    header_size = log_version == 5 ? kV5RecordHeaderSize : kV6RecordHeaderSize;
+    needs_recompaction_ = true;
+  }
+
+  size_t offset = newline + 1 - data;
+  while (offset + 4 <= size) {
+    uint32_t record_size;
+    memcpy(&record_size, data + offset, 4);
+    if (record_size < header_size || record_size > kMaxRecordSize ||
+        record_size > size - offset - 4) {
+      break;
+    }
+
+    const char* record = data + offset + 4;
+    StringPiece output(record + header_size, record_size - header_size);
+    bool created;
+    LogEntry* entry = GetEntry(output, false, &created);
+    if (created)
+      ++unique_entry_count;
+    ++total_entry_count;
+
+    memcpy(&entry->start_time, record, 4);
+    memcpy(&entry->end_time, record + 4, 4);
+    memcpy(&entry->restat_mtime, record + 8, 4);
+    memcpy(&entry->command_hash, record + 12, 8);
+    if (header_size >= kV6RecordHeaderSize)
+      memcpy(&entry->content_hash, record + 20, 8);
+    if (header_size >= kRecordHeaderSize) {
+      memcpy(&entry->user_time, record + 28, 4);
+      memcpy(&entry->system_time, record + 32, 4);
+      memcpy(&entry->max_rss, record + 36, 8);
+    }
+    offset += 4 + record_size;
+  }
+
+  METRIC_COUNT(".ninja_log entries loaded", total_entry_count);
+
+  // Decide whether it's time to rebuild the log:
+  // - if the last record is incomplete (e.g. we crashed while writing)
+  // - if it's getting large
+  int kMinCompactionEntryCount = 100;
+  int kCompactionRatio = 3;
+  if (offset != size) {
+    needs_recompaction_ = true;
+  } else if (total_entry_count > kMinCompactionEntryCount &&
+             total_entry_count > unique_entry_count * kCompactionRatio) {
+    needs_recompaction_ = true;
+  }
+
+  return true;
+}
+
+void BuildLog::LoadText(FILE* file, int log_version, int* unique_entry_count,
+                        int* total_entry_count) {
   char buf[256 << 10];
   while (fgets(buf, sizeof(buf), file)) {
     if (!log_version) {
@@ -154,46 +675,44 @@ bool BuildLog::Load(const string& path, string* err) {
     end = strchr(start, field_separator);
     if (!end)
       continue;
-    string output = string(start, end - start);
+    StringPiece output(start, end - start);
 
     start = end + 1;
     end = strchr(start, '\n');
     if (!end)
       continue;
 
-    LogEntry* entry;
-    Log::iterator i = log_.find(output);
-    if (i != log_.end()) {
-      entry = i->second;
-    } else {
-      entry = new LogEntry;
-      entry->output = output;
-      log_.insert(Log::value_type(entry->output, entry));
-      ++unique_entry_count;
-    }
-    ++total_entry_count;
+    bool created;
+    LogEntry* entry = GetEntry(output, true, &created);
+    if (created)
+      ++*unique_entry_count;
+    ++*total_entry_count;
 
     entry->start_time = start_time;
     entry->end_time = end_time;
     entry->restat_mtime = restat_mtime;
-    entry->command = string(start, end - start);
+    entry->command_hash = LogEntry::HashCommand(StringPiece(start, end - start));
   }
+}
 
-  // Decide whether it's time to rebuild the log:
-  // - if we're upgrading versions
-  // - if it's getting large
-  int kMinCompactionEntryCount = 100;
-  int kCompactionRatio = 3;
-  if (log_version < kCurrentVersion) {
-    needs_recompaction_ = true;
-  } else if (total_entry_count > kMinCompactionEntryCount &&
-             total_entry_count > unique_entry_count * kCompactionRatio) {
-    needs_recompaction_ = true;
+BuildLog::LogEntry* BuildLog::GetEntry(StringPiece output, bool copy,
+                                       bool* created) {
+  Log::iterator i = log_.find(output);
+  if (i != log_.end()) {
+    *created = false;
+    return i->second;
   }
 
-  fclose(file);
-
-  return true;
+  if (copy) {
+    owned_outputs_.push_back(output.AsString());
+    output = owned_outputs_.back();
+  }
+  entries_.push_back(LogEntry());
+  LogEntry* entry = &entries_.back();
+  entry->output = output;
+  log_.insert(Log::value_type(entry->output, entry));
+  *created = true;
+  return entry;
 }
 
 BuildLog::LogEntry* BuildLog::LookupByOutput(const string& path) {
@@ -203,17 +722,27 @@ BuildLog::LogEntry* BuildLog::LookupByOutput(const string& path) {
   return NULL;
 }
 
-void BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
-  fprintf(f, "%d\t%d\t%ld\t%s\t%s\n",
-          entry.start_time, entry.end_time, (long) entry.restat_mtime,
-          entry.output.c_str(), entry.command.c_str());
+bool BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
+  string record;
+  AppendRecord(&record, entry);
+  return fwrite(record.data(), record.size(), 1, f) == 1;
 }
 
-bool BuildLog::Recompact(const string& path, string* err) {
-  printf("Recompacting log...\n");
+vector<BuildLog::LogEntry> BuildLog::Snapshot(
+    const BuildLogUser* user) const {
+  vector<LogEntry> entries;
+  entries.reserve(log_.size());
+  for (Log::const_iterator i = log_.begin(); i != log_.end(); ++i) {
+    if (!user || !user->IsPathDead(i->second->output))
+      entries.push_back(*i->second);
+  }
+  return entries;
+}
 
-  string temp_path = path + ".recompact";
-  FILE* f = fopen(temp_path.c_str(), "wb");
+// static
+bool BuildLog::WriteLogFile(const string& path,
+                            const vector<LogEntry>& entries, string* err) {
+  FILE* f = fopen(path.c_str(), "wb");
   if (!f) {
     *err = strerror(errno);
     return false;
@@ -221,15 +750,30 @@ bool BuildLog::Recompact(const string& path, string* err) {
 
   if (fprintf(f, kFileSignature, kCurrentVersion) < 0) {
     *err = strerror(errno);
+    fclose(f);
     return false;
   }
 
-  for (Log::iterator i = log_.begin(); i != log_.end(); ++i) {
-    WriteEntry(f, *i->second);
+  for (vector<LogEntry>::const_iterator i = entries.begin();
+       i != entries.end(); ++i) {
+    if (!WriteEntry(f, *i)) {
+      *err = strerror(errno);
+      fclose(f);
+      return false;
+    }
+  }
+
+  if (fclose(f) != 0) {
+    *err = strerror(errno);
+    return false;
   }
+  return true;
+}
 
-  fclose(f);
-  if (unlink(path.c_str()) < 0) {
+// static
+bool BuildLog::ReplaceLog(const string& temp_path, const string& path,
+                          string* err) {
+  if (unlink(path.c_str()) < 0 && errno != ENOENT) {
     *err = strerror(errno);
     return false;
   }
@@ -238,6 +782,52 @@ bool BuildLog::Recompact(const string& path, string* err) {
     *err = strerror(errno);
     return false;
   }
+  return true;
+}
+
+bool BuildLog::Recompact(const string& path, string* err,
+                         const BuildLogUser* user) {
+  printf("Recompacting log...\n");
 
+  string temp_path = path + ".recompact";
+  if (!WriteLogFile(temp_path, Snapshot(user), err))
+    return false;
+  if (!ReplaceLog(temp_path, path, err))
+    return false;
+
+  needs_recompaction_ = false;
   return true;
 }
+
+void BuildLog::FinishRecompaction() {
+  METRIC_RECORD(".ninja_log recompact wait");
+  recompact_thread_->Join();
+  const string& temp_path = recompact_thread_->temp_path_;
+  string err = recompact_thread_->err_;
+  bool ok = recompact_thread_->ok_;
+
+  if (ok && !recorded_.empty()) {
+    // Catch up with what the build recorded in the meantime.
+    FILE* f = fopen(temp_path.c_str(), "ab");
+    ok = f != NULL;
+    for (vector<LogEntry>::iterator i = recorded_.begin();
+         ok && i != recorded_.end(); ++i) {
+      ok = WriteEntry(f, *i);
+    }
+    if (f && fclose(f) != 0)
+      ok = false;
+    if (!ok)
+      err = strerror(errno);
+  }
+  if (ok)
+    ok = ReplaceLog(temp_path, log_path_, &err);
+  if (!ok) {
+    // The old log is still intact; we'll try again next time.
+    unlink(temp_path.c_str());
+    Warning("recompacting build log: %s", err.c_str());
+  }
+
+  delete recompact_thread_;
+  recompact_thread_ = NULL;
+  recorded_.clear();
+}
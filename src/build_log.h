@@ -15,16 +15,43 @@
 #ifndef NINJA_BUILD_LOG_H_
 #define NINJA_BUILD_LOG_H_
 
-#include <map>
+#include <deque>
+#include <set>
 #include <string>
+#include <vector>
 #include <stdio.h>
 using namespace std;
 
 #include "hash_map.h"
 #include "timestamp.h"
+#include "util.h"
 
 struct BuildConfig;
+struct DiskInterface;
 struct Edge;
+struct ResourceUsage;
+struct State;
+
+/// Tells recompaction which outputs' entries it may drop.
+struct BuildLogUser {
+  virtual ~BuildLogUser() {}
+  /// Return true if \a path is no longer part of the build.  Only called
+  /// when recompacting, so it needn't be fast.
+  virtual bool IsPathDead(StringPiece path) const = 0;
+};
+
+/// The usual BuildLogUser: a path is dead if no edge of \a state builds
+/// it and it's gone from disk.  Entries for files that still exist are
+/// kept, for generators that look them up.
+struct StateBuildLogUser : public BuildLogUser {
+  StateBuildLogUser(State* state, DiskInterface* disk_interface)
+      : state_(state), disk_interface_(disk_interface) {}
+  virtual bool IsPathDead(StringPiece path) const;
+
+ private:
+  State* state_;
+  DiskInterface* disk_interface_;
+};
 
 /// Store a log of every command ran for every build.
 /// It has a few uses:
@@ -34,31 +61,88 @@ struct Edge;
 /// 2) historical timing information
 /// 3) maybe we can generate some sort of build overview output
 ///    from it
+///
+/// Since version 5 the log is binary: after the text signature line
+/// comes a series of records, each a 4-byte payload size followed by the
+/// start time, end time and restat mtime (4 bytes each), a 64-bit hash of
+/// the command, since version 6 a 64-bit hash of the output's contents,
+/// since version 7 the command's user and system time (4 bytes each) and
+/// its 64-bit peak resident set size, and finally the output path.  The
+/// log is mapped into memory on load and entries point into it.  Older
+/// text logs are read and then rewritten in the new format.
+///
+/// Records are appended by a background thread, so that the build doesn't
+/// wait on the disk; see Flush().
 struct BuildLog {
   BuildLog();
   ~BuildLog();
 
   void SetConfig(BuildConfig* config) { config_ = config; }
-  bool OpenForWrite(const string& path, string* err);
+  /// Also append the full text of each recorded command, for debugging,
+  /// to a text file named after the log with a ".commands" suffix.  The
+  /// log itself only ever stores command hashes.
+  void set_keep_commands(bool keep_commands) { keep_commands_ = keep_commands; }
+  /// Open the log at \a path for appending, first recompacting it if
+  /// needs_recompaction(), which drops the entries of the paths \a user
+  /// (if given) says are dead.
+  bool OpenForWrite(const string& path, string* err,
+                    const BuildLogUser* user = NULL);
+  /// Record a run of \a edge.  If given, \a content_hashes holds the
+  /// HashContents() of each of its outputs, and \a usage what the
+  /// command used.
   void RecordCommand(Edge* edge, int start_time, int end_time,
-                     TimeStamp restat_mtime = 0);
+                     TimeStamp restat_mtime = 0,
+                     const vector<uint64_t>* content_hashes = NULL,
+                     const ResourceUsage* usage = NULL);
+  /// Note that \a edge's command failed.  Until it succeeds, its first
+  /// output is listed in a text file named after the log with a
+  /// ".failed" suffix, so that the next build can run it early.
+  void RecordFailure(Edge* edge);
+  /// Whether \a edge's command failed when it last ran.
+  bool FailedBefore(Edge* edge) const;
+  /// Wait until everything recorded so far is written out.  Close() does
+  /// so too, as does a SIGINT, SIGTERM or SIGHUP that would otherwise
+  /// kill ninja (or a Ctrl-C on Windows) while the log is open.
+  void Flush();
   void Close();
 
   /// Load the on-disk log.
   bool Load(const string& path, string* err);
 
   struct LogEntry {
-    string output;
-    string command;
+    /// Points into the mapped log, or into storage owned by the BuildLog.
+    StringPiece output;
+    uint64_t command_hash;
     int start_time;
     int end_time;
     TimeStamp restat_mtime;
+    /// The HashContents() of the output after the command ran, for rules
+    /// with "restat = hash"; 0 if unknown.
+    uint64_t content_hash;
+    /// The CPU time the command took, in milliseconds, and its peak
+    /// resident set size in bytes; see ResourceUsage.  0 if unknown.
+    int user_time;
+    int system_time;
+    int64_t max_rss;
+
+    static uint64_t HashCommand(StringPiece command);
+    /// Hash the contents of an output.  Never returns 0.
+    static uint64_t HashContents(StringPiece contents);
+    /// Contents are hashed in blocks of this size, so that a large output
+    /// can be hashed without reading it whole.
+    static const size_t kContentsBlockSize = 1 << 20;
+    /// Fold the next \a block of an output, kContentsBlockSize bytes
+    /// unless it is the last, into \a hash, which starts out as 0.  Gives
+    /// HashContents() once the last block is in.
+    static uint64_t HashContentsBlock(uint64_t hash, StringPiece block);
 
     // Used by tests.
     bool operator==(const LogEntry& o) {
-      return output == o.output && command == o.command &&
+      return output == o.output && command_hash == o.command_hash &&
           start_time == o.start_time && end_time == o.end_time &&
-          restat_mtime == o.restat_mtime;
+          restat_mtime == o.restat_mtime && content_hash == o.content_hash &&
+          user_time == o.user_time && system_time == o.system_time &&
+          max_rss == o.max_rss;
     }
   };
 
@@ -66,18 +150,74 @@ struct BuildLog {
   LogEntry* LookupByOutput(const string& path);
 
   /// Serialize an entry into a log file.
-  void WriteEntry(FILE* f, const LogEntry& entry);
+  static bool WriteEntry(FILE* f, const LogEntry& entry);
+
+  /// Rewrite the known log entries, throwing away old data and the
+  /// entries of the paths \a user (if given) says are dead.
+  bool Recompact(const string& path, string* err,
+                 const BuildLogUser* user = NULL);
 
-  /// Rewrite the known log entries, throwing away old data.
-  bool Recompact(const string& path, string* err);
+  /// Whether Load() found the log worth rewriting.  OpenForWrite() then
+  /// rewrites it on a background thread while the build runs, and Close()
+  /// swaps the new file in.
+  bool needs_recompaction() const { return needs_recompaction_; }
 
   // TODO: make these private.
   typedef ExternalStringHashMap<LogEntry*>::Type Log;
   Log log_;
 private:
+  friend struct MemoryStats;
+
+  struct RecompactThread;
+  struct LogWriter;
+
+  /// Load a pre-version-5 text log.
+  void LoadText(FILE* file, int log_version, int* unique_entry_count,
+                int* total_entry_count);
+  /// Return the entry for \a output, creating it if needed.  \a output
+  /// must outlive the log if \a copy is false.
+  LogEntry* GetEntry(StringPiece output, bool copy, bool* created);
+  /// Copy out all current entries, but for those of paths \a user says
+  /// are dead.
+  vector<LogEntry> Snapshot(const BuildLogUser* user) const;
+  /// Write a complete log holding \a entries to \a path.
+  static bool WriteLogFile(const string& path, const vector<LogEntry>& entries,
+                           string* err);
+  /// Replace the log at \a path with the one at \a temp_path.
+  static bool ReplaceLog(const string& temp_path, const string& path,
+                         string* err);
+  /// Wait for a background recompaction, bring it up to date and swap it
+  /// in for the log.
+  void FinishRecompaction();
+  /// Rewrite the list of failed edges, if the log is open.
+  void SaveFailures();
+
   FILE* log_file_;
+  /// The thread writing to log_file_, or NULL to write it directly.
+  LogWriter* writer_;
+  FILE* commands_file_;
   BuildConfig* config_;
+  bool keep_commands_;
   bool needs_recompaction_;
+
+  /// The background recompaction, if one is running.
+  RecompactThread* recompact_thread_;
+  /// The path OpenForWrite() was given.
+  string log_path_;
+  /// The first outputs of the edges whose commands last failed, and
+  /// where to keep them (empty while the log isn't open for writing).
+  set<string> failed_;
+  string failed_path_;
+  /// Entries recorded since the background recompaction took its
+  /// snapshot, to be appended to the new log.
+  vector<LogEntry> recorded_;
+
+  /// The loaded log; most entries' outputs point into it.
+  MappedFile mapped_;
+  /// Storage for entries; deque never moves its elements.
+  deque<LogEntry> entries_;
+  /// Storage for outputs that don't live in the mapped log.
+  deque<string> owned_outputs_;
 };
 
 #endif // NINJA_BUILD_LOG_H_
@@ -14,6 +14,7 @@
 
 #include "build_log.h"
 
+#include "subprocess.h"
 #include "test.h"
 
 #ifdef _WIN32
@@ -28,12 +29,14 @@
 #endif
 
 static const char kTestFilename[] = "BuildLogTest-tempfile";
+static const char kFailedFilename[] = "BuildLogTest-tempfile.failed";
 
 struct BuildLogTest : public StateTestWithBuiltinRules {
   virtual void SetUp() {
   }
   virtual void TearDown() {
     unlink(kTestFilename);
+    unlink(kFailedFilename);
   }
 };
 
@@ -62,7 +65,36 @@ TEST_F(BuildLogTest, WriteRead) {
   ASSERT_TRUE(e2);
   ASSERT_TRUE(*e1 == *e2);
   ASSERT_EQ(15, e1->start_time);
-  ASSERT_EQ("out", e1->output);
+  ASSERT_EQ("out", e1->output.AsString());
+}
+
+TEST_F(BuildLogTest, Flush) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.Flush();
+
+  // Everything is on disk while the log is still open.
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(2u, log2.log_.size());
+  EXPECT_FALSE(log2.needs_recompaction());
+
+  log1.RecordCommand(state_.edges_[0], 30, 35);
+  log1.Close();
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  BuildLog::LogEntry* e = log3.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
 }
 
 TEST_F(BuildLogTest, DoubleEntry) {
@@ -79,7 +111,7 @@ TEST_F(BuildLogTest, DoubleEntry) {
 
   BuildLog::LogEntry* e = log.LookupByOutput("out");
   ASSERT_TRUE(e);
-  ASSERT_EQ("command def", e->command);
+  ASSERT_EQ(BuildLog::LogEntry::HashCommand("command def"), e->command_hash);
 }
 
 TEST_F(BuildLogTest, Truncate) {
@@ -133,7 +165,7 @@ TEST_F(BuildLogTest, UpgradeV3) {
   ASSERT_EQ(123, e->start_time);
   ASSERT_EQ(456, e->end_time);
   ASSERT_EQ(0, e->restat_mtime);
-  ASSERT_EQ("command", e->command);
+  ASSERT_EQ(BuildLog::LogEntry::HashCommand("command"), e->command_hash);
 }
 
 TEST_F(BuildLogTest, SpacesInOutputV4) {
@@ -152,5 +184,345 @@ TEST_F(BuildLogTest, SpacesInOutputV4) {
   ASSERT_EQ(123, e->start_time);
   ASSERT_EQ(456, e->end_time);
   ASSERT_EQ(456, e->restat_mtime);
-  ASSERT_EQ("command", e->command);
+  ASSERT_EQ(BuildLog::LogEntry::HashCommand("command"), e->command_hash);
+}
+
+TEST_F(BuildLogTest, RewriteV4) {
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v4\n");
+  fprintf(f, "123\t456\t789\tout\tcommand\n");
+  fclose(f);
+
+  // Opening an old log for writing rewrites it in the binary format.
+  string err;
+  BuildLog log1;
+  EXPECT_TRUE(log1.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.Close();
+
+  f = fopen(kTestFilename, "rb");
+  char buf[64];
+  ASSERT_TRUE(fgets(buf, sizeof(buf), f));
+  fclose(f);
+  ASSERT_EQ("# ninja log v7\n", string(buf));
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(123, e->start_time);
+  ASSERT_EQ(456, e->end_time);
+  ASSERT_EQ(789, e->restat_mtime);
+  ASSERT_EQ(BuildLog::LogEntry::HashCommand("command"), e->command_hash);
+}
+
+TEST_F(BuildLogTest, ContentHash) {
+  AssertParse(&state_,
+"build out: cat mid\n");
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    vector<uint64_t> hashes(1, BuildLog::LogEntry::HashContents("contents"));
+    log.RecordCommand(state_.edges_[0], 15, 18, 0, &hashes);
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(BuildLog::LogEntry::HashContents("contents"), e->content_hash);
+  EXPECT_NE(0u, BuildLog::LogEntry::HashContents(""));
+}
+
+TEST_F(BuildLogTest, HashContentsInBlocks) {
+  const size_t kBlock = BuildLog::LogEntry::kContentsBlockSize;
+  string contents(kBlock + 10, 'x');
+  uint64_t hash = BuildLog::LogEntry::HashContentsBlock(
+      0, StringPiece(contents.data(), kBlock));
+  hash = BuildLog::LogEntry::HashContentsBlock(
+      hash, StringPiece(contents.data() + kBlock, 10));
+  EXPECT_EQ(BuildLog::LogEntry::HashContents(contents), hash);
+
+  // A change in any block changes the hash.
+  string changed = contents;
+  changed[0] = 'y';
+  EXPECT_NE(hash, BuildLog::LogEntry::HashContents(changed));
+  changed = contents;
+  changed[kBlock + 9] = 'y';
+  EXPECT_NE(hash, BuildLog::LogEntry::HashContents(changed));
+}
+
+TEST_F(BuildLogTest, ResourceUsage) {
+  AssertParse(&state_,
+"build out: cat mid\n");
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    ResourceUsage usage;
+    usage.user_millis = 1200;
+    usage.system_millis = 300;
+    usage.max_rss = 5LL << 30;
+    log.RecordCommand(state_.edges_[0], 15, 18, 0, NULL, &usage);
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(1200, e->user_time);
+  EXPECT_EQ(300, e->system_time);
+  EXPECT_EQ(5LL << 30, e->max_rss);
+}
+
+TEST_F(BuildLogTest, Failures) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+  Edge* out = state_.edges_[0];
+  Edge* mid = state_.edges_[1];
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    log.RecordFailure(out);
+    log.RecordFailure(mid);
+    EXPECT_TRUE(log.FailedBefore(mid));
+  }
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(log.FailedBefore(out));
+    EXPECT_TRUE(log.FailedBefore(mid));
+    // An edge is forgotten once it succeeds.
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    log.RecordCommand(mid, 15, 18);
+    EXPECT_FALSE(log.FailedBefore(mid));
+  }
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    EXPECT_TRUE(log.FailedBefore(out));
+    EXPECT_FALSE(log.FailedBefore(mid));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    log.RecordCommand(out, 20, 25);
+  }
+  // With nothing failing, there's no list left behind.
+  FILE* failed = fopen(kFailedFilename, "rb");
+  EXPECT_FALSE(failed);
+  if (failed)
+    fclose(failed);
+}
+
+TEST_F(BuildLogTest, UpgradeV6) {
+  // A version 6 record has no resource usage.
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v6\n");
+  uint32_t size = 4 + 4 + 4 + 8 + 8 + 3;
+  int32_t start = 123, end = 456, restat = 789;
+  uint64_t command_hash = BuildLog::LogEntry::HashCommand("command");
+  uint64_t content_hash = BuildLog::LogEntry::HashContents("contents");
+  fwrite(&size, 4, 1, f);
+  fwrite(&start, 4, 1, f);
+  fwrite(&end, 4, 1, f);
+  fwrite(&restat, 4, 1, f);
+  fwrite(&command_hash, 8, 1, f);
+  fwrite(&content_hash, 8, 1, f);
+  fwrite("out", 3, 1, f);
+  fclose(f);
+
+  string err;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.needs_recompaction());
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(123, e->start_time);
+  ASSERT_EQ(789, e->restat_mtime);
+  ASSERT_EQ(content_hash, e->content_hash);
+  ASSERT_EQ(0, e->user_time);
+  ASSERT_EQ(0, e->max_rss);
+}
+
+TEST_F(BuildLogTest, UpgradeV5) {
+  // A version 5 record has no content hash.
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v5\n");
+  uint32_t size = 4 + 4 + 4 + 8 + 3;
+  int32_t start = 123, end = 456, restat = 789;
+  uint64_t command_hash = BuildLog::LogEntry::HashCommand("command");
+  fwrite(&size, 4, 1, f);
+  fwrite(&start, 4, 1, f);
+  fwrite(&end, 4, 1, f);
+  fwrite(&restat, 4, 1, f);
+  fwrite(&command_hash, 8, 1, f);
+  fwrite("out", 3, 1, f);
+  fclose(f);
+
+  string err;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(123, e->start_time);
+  ASSERT_EQ(456, e->end_time);
+  ASSERT_EQ(789, e->restat_mtime);
+  ASSERT_EQ(command_hash, e->command_hash);
+  ASSERT_EQ(0u, e->content_hash);
+}
+
+TEST_F(BuildLogTest, AppendAfterLoad) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    log.RecordCommand(state_.edges_[0], 15, 18);
+  }
+  {
+    // Entries loaded from the mapped log can be updated and appended to.
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    log.RecordCommand(state_.edges_[0], 30, 35);
+    log.RecordCommand(state_.edges_[1], 20, 25);
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, log.log_.size());
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(30, e->start_time);
+  ASSERT_EQ(BuildLog::LogEntry::HashCommand("cat mid > out"), e->command_hash);
+}
+
+TEST_F(BuildLogTest, KeepCommands) {
+  AssertParse(&state_,
+"build out: cat mid\n");
+
+  string err;
+  BuildLog log;
+  log.set_keep_commands(true);
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log.RecordCommand(state_.edges_[0], 15, 18);
+  log.Close();
+
+  string commands_path = string(kTestFilename) + ".commands";
+  FILE* f = fopen(commands_path.c_str(), "rb");
+  ASSERT_TRUE(f);
+  char buf[64];
+  ASSERT_TRUE(fgets(buf, sizeof(buf), f));
+  fclose(f);
+  unlink(commands_path.c_str());
+  ASSERT_EQ("out\tcat mid > out\n", string(buf));
+}
+
+TEST_F(BuildLogTest, RecompactDropsDeadPaths) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n"
+"build gone: cat in\n"
+"build kept: cat in\n");
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    for (size_t i = 0; i < state_.edges_.size(); ++i)
+      log.RecordCommand(state_.edges_[i], 15, 18);
+  }
+
+  // "gone" and "kept" are no longer built, but "kept" is still on disk.
+  State state;
+  AssertParse(&state,
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build out: cat mid\n"
+"build mid: cat in\n");
+  VirtualFileSystem fs;
+  fs.Create("kept", 1, "");
+  StateBuildLogUser user(&state, &fs);
+  EXPECT_FALSE(user.IsPathDead("mid"));
+  EXPECT_TRUE(user.IsPathDead("gone"));
+  EXPECT_FALSE(user.IsPathDead("kept"));
+
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(log.Recompact(kTestFilename, &err, &user));
+    ASSERT_EQ("", err);
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.LookupByOutput("out"));
+  EXPECT_TRUE(log.LookupByOutput("mid"));
+  EXPECT_FALSE(log.LookupByOutput("gone"));
+  EXPECT_TRUE(log.LookupByOutput("kept"));
+}
+
+TEST_F(BuildLogTest, BackgroundRecompact) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    for (int i = 0; i < 200; ++i)
+      log.RecordCommand(state_.edges_[0], i, i + 1);
+  }
+
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    ASSERT_TRUE(log.needs_recompaction());
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    // Recorded while the recompaction may still be running.
+    log.RecordCommand(state_.edges_[1], 300, 301);
+    log.RecordCommand(state_.edges_[0], 400, 401);
+    log.Close();
+  }
+
+  struct stat statbuf;
+  ASSERT_EQ(0, stat(kTestFilename, &statbuf));
+  // The signature, then up to one record per output for each of the
+  // snapshot and the records appended to it.
+  EXPECT_LT(statbuf.st_size, 200);
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(log.needs_recompaction());
+  ASSERT_EQ(2u, log.log_.size());
+  EXPECT_EQ(400, log.LookupByOutput("out")->start_time);
+  EXPECT_EQ(300, log.LookupByOutput("mid")->start_time);
 }
@@ -0,0 +1,369 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Time the work a no-op build does on a large synthetic project: parsing
+// the manifest, loading and recompacting the build log, scanning for
+// dirty files, plus path canonicalization and spellchecking.  Files are
+// kept in memory and stat() is faked wherever possible, so that the
+// numbers measure Ninja rather than the machine's disk.
+//
+// Each line of output is a benchmark name followed by the minimum,
+// average and maximum time over the rounds, in milliseconds, separated
+// by tabs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "build.h"
+#include "build_log.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "metrics.h"
+#include "parsers.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+const char kLogPath[] = "build_perftest.log";
+
+/// Manifests, by file name.
+struct MemoryFileReader : public ManifestParser::FileReader {
+  virtual bool ReadFile(const string& path, string* content, string* err) {
+    map<string, string>::iterator i = files_.find(path);
+    if (i == files_.end()) {
+      *err = "not found";
+      return false;
+    }
+    *content = i->second;
+    return true;
+  }
+  map<string, string> files_;
+};
+
+/// A disk on which every output is newer than every source.
+struct NoOpDisk : public DiskInterface {
+  virtual TimeStamp Stat(const string& path) {
+    return path.compare(0, 4, "out/") == 0 ? 2 : 1;
+  }
+  virtual bool MakeDir(const string& path) { return true; }
+  virtual string ReadFile(const string& path, string* err) { return ""; }
+  virtual int RemoveFile(const string& path) { return 1; }
+};
+
+struct Options {
+  Options() : edges(100000), depth(4), command_length(1000), rounds(3) {}
+  int edges;
+  int depth;
+  int command_length;
+  int rounds;
+};
+
+/// Print the times (in micros) a benchmark took.
+void Report(const char* name, const vector<int64_t>& times) {
+  int64_t min = times[0], max = times[0], total = 0;
+  for (size_t i = 0; i < times.size(); ++i) {
+    min = std::min(min, times[i]);
+    max = std::max(max, times[i]);
+    total += times[i];
+  }
+  printf("%s\t%.1f\t%.1f\t%.1f\n", name, min / 1000.0,
+         total / 1000.0 / times.size(), max / 1000.0);
+  fflush(stdout);
+}
+
+/// Return the edges of source file \a i: its compile step.
+string CompileEdge(int i) {
+  char buf[128];
+  snprintf(buf, sizeof(buf),
+           "build out/dir%d/file%d.o: cc src/dir%d/file%d.cc | "
+           "src/dir%d/common.h\n", i / 1000, i, i / 1000, i, i / 1000);
+  return buf;
+}
+
+/// Return the rules and variables shared by all generated manifests.
+string Rules(const Options& options) {
+  string cflags;
+  while ((int)cflags.size() < options.command_length)
+    cflags += " -Isome/long/include/path/" +
+        string(1, 'a' + cflags.size() % 26);
+  return "cflags =" + cflags + "\n"
+      "rule cc\n"
+      "  command = cc $cflags -c $in -o $out\n"
+      "  description = CC $out\n"
+      "rule ar\n"
+      "  command = ar rcs $out $in\n";
+}
+
+/// Return edges archiving each directory's objects, and a default
+/// target depending on all of them.
+string ArchiveEdges(const Options& options) {
+  string text;
+  string all = "build all: phony";
+  for (int dir = 0; dir * 1000 < options.edges; ++dir) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "build out/lib%d.a: ar", dir);
+    text += buf;
+    for (int i = dir * 1000; i < min((dir + 1) * 1000, options.edges); ++i) {
+      snprintf(buf, sizeof(buf), " out/dir%d/file%d.o", dir, i);
+      text += buf;
+    }
+    snprintf(buf, sizeof(buf), " out/lib%d.a", dir);
+    all += buf;
+    text += "\n";
+  }
+  return text + all + "\ndefault all\n";
+}
+
+/// Generate a single flat manifest.
+void GenerateFlat(const Options& options, MemoryFileReader* files) {
+  string text = Rules(options);
+  for (int i = 0; i < options.edges; ++i)
+    text += CompileEdge(i);
+  text += ArchiveEdges(options);
+  files->files_["flat.ninja"] = text;
+}
+
+/// Add manifest \a name at \a depth of a tree of subninjas, each with
+/// four children, whose leaves compile sources [begin, end).
+void GenerateSubtree(const Options& options, const string& name, int depth,
+                     int begin, int end, MemoryFileReader* files) {
+  string text;
+  if (depth == options.depth) {
+    for (int i = begin; i < end; ++i)
+      text += CompileEdge(i);
+  } else {
+    const int kFanOut = 4;
+    for (int child = 0; child < kFanOut; ++child) {
+      char suffix[16];
+      snprintf(suffix, sizeof(suffix), "_%d", child);
+      string child_name = name + suffix;
+      GenerateSubtree(options, child_name, depth + 1,
+                      begin + (end - begin) * child / kFanOut,
+                      begin + (end - begin) * (child + 1) / kFanOut, files);
+      text += "subninja " + child_name + ".ninja\n";
+    }
+  }
+  files->files_[name + ".ninja"] = text;
+}
+
+/// Generate the same project as GenerateFlat(), split into a tree.
+void GenerateTree(const Options& options, MemoryFileReader* files) {
+  GenerateSubtree(options, "tree", 0, 0, options.edges, files);
+  files->files_["top.ninja"] = Rules(options) + "subninja tree.ninja\n" +
+      ArchiveEdges(options);
+}
+
+bool Parse(State* state, MemoryFileReader* files, const char* name) {
+  ManifestParser parser(state, files);
+  string err;
+  if (!parser.Load(name, &err)) {
+    fprintf(stderr, "build_perftest: %s: %s\n", name, err.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool BenchParse(const Options& options, MemoryFileReader* files,
+                const char* benchmark, const char* name) {
+  vector<int64_t> times;
+  for (int round = 0; round < options.rounds; ++round) {
+    State state;
+    int64_t start = GetTimeMicros();
+    if (!Parse(&state, files, name))
+      return false;
+    times.push_back(GetTimeMicros() - start);
+  }
+  Report(benchmark, times);
+  return true;
+}
+
+/// Write a build log saying every edge of \a state was built with its
+/// current command.  Half the entries are superseded by later ones, as
+/// in a log that's been appended to across builds.
+bool WriteLog(State* state) {
+  BuildLog log;
+  string err;
+  if (!log.OpenForWrite(kLogPath, &err)) {
+    fprintf(stderr, "build_perftest: %s\n", err.c_str());
+    return false;
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = pass * state->edges_.size() / 2;
+         i < state->edges_.size(); ++i) {
+      Edge* edge = state->edges_[i];
+      if (!edge->is_phony())
+        log.RecordCommand(edge, 0, 1);
+    }
+  }
+  log.Close();
+  return true;
+}
+
+bool BenchLog(const Options& options) {
+  vector<int64_t> load_times, recompact_times;
+  for (int round = 0; round < options.rounds; ++round) {
+    BuildLog log;
+    string err;
+    int64_t start = GetTimeMicros();
+    if (!log.Load(kLogPath, &err)) {
+      fprintf(stderr, "build_perftest: %s\n", err.c_str());
+      return false;
+    }
+    load_times.push_back(GetTimeMicros() - start);
+
+    start = GetTimeMicros();
+    if (!log.Recompact(kLogPath, &err)) {
+      fprintf(stderr, "build_perftest: %s\n", err.c_str());
+      return false;
+    }
+    recompact_times.push_back(GetTimeMicros() - start);
+  }
+  Report("build_log_load", load_times);
+  Report("build_log_recompact", recompact_times);
+  return true;
+}
+
+bool BenchDirtyScan(const Options& options, State* state) {
+  BuildLog log;
+  string err;
+  if (!log.Load(kLogPath, &err)) {
+    fprintf(stderr, "build_perftest: %s\n", err.c_str());
+    return false;
+  }
+  state->build_log_ = &log;
+  NoOpDisk disk;
+  BuildConfig config;
+  config.verbosity = BuildConfig::QUIET;
+
+  vector<int64_t> times;
+  for (int round = 0; round < options.rounds; ++round) {
+    state->Reset();
+    Builder builder(state, config);
+    builder.disk_interface_ = &disk;
+    vector<Node*> targets = state->DefaultNodes(&err);
+    int64_t start = GetTimeMicros();
+    for (vector<Node*>::iterator i = targets.begin(); i != targets.end();
+         ++i) {
+      if (!builder.AddTarget(*i, &err) && !err.empty()) {
+        fprintf(stderr, "build_perftest: %s\n", err.c_str());
+        return false;
+      }
+    }
+    times.push_back(GetTimeMicros() - start);
+    if (!builder.AlreadyUpToDate()) {
+      fprintf(stderr, "build_perftest: no-op build has work to do\n");
+      return false;
+    }
+  }
+  state->build_log_ = NULL;
+  Report("dirty_scan", times);
+  return true;
+}
+
+void BenchSpellcheck(const Options& options, State* state) {
+  const char* kMisspellings[] = {
+    "out/dir0/file1.oo", "out/lib1.aa", "src/dir1/comon.h", "al",
+  };
+  vector<int64_t> times;
+  for (int round = 0; round < options.rounds; ++round) {
+    int64_t start = GetTimeMicros();
+    for (size_t i = 0; i < sizeof(kMisspellings) / sizeof(kMisspellings[0]);
+         ++i)
+      state->SpellcheckNode(kMisspellings[i]);
+    times.push_back(GetTimeMicros() - start);
+  }
+  Report("spellcheck", times);
+}
+
+void BenchCanonicalize(const Options& options, State* state) {
+  vector<string> paths;
+  for (State::Paths::iterator i = state->paths_.begin();
+       i != state->paths_.end(); ++i)
+    paths.push_back("./" + i->first.AsString());
+
+  vector<int64_t> times;
+  for (int round = 0; round < options.rounds; ++round) {
+    string err;
+    int64_t start = GetTimeMicros();
+    for (size_t i = 0; i < paths.size(); ++i) {
+      string path = paths[i];
+      CanonicalizePath(&path, &err);
+    }
+    times.push_back(GetTimeMicros() - start);
+  }
+  Report("canonicalize_path", times);
+}
+
+void Usage(const char* program) {
+  printf("usage: %s [options]\n"
+"\n"
+"options:\n"
+"  -n N   generate a project of N sources [default=100000]\n"
+"  -d N   split it into subninjas N levels deep [default=4]\n"
+"  -l N   make command lines about N characters long [default=1000]\n"
+"  -r N   time N rounds of each benchmark [default=3]\n",
+         program);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    if (i + 1 >= argc || argv[i][0] != '-' || strlen(argv[i]) != 2) {
+      Usage(argv[0]);
+      return 1;
+    }
+    int value = atoi(argv[++i]);
+    switch (argv[i - 1][1]) {
+    case 'n': options.edges = value; break;
+    case 'd': options.depth = value; break;
+    case 'l': options.command_length = value; break;
+    case 'r': options.rounds = value; break;
+    default:
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+  if (options.edges < 1 || options.depth < 0 || options.rounds < 1) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  MemoryFileReader files;
+  GenerateFlat(options, &files);
+  GenerateTree(options, &files);
+
+  State state;
+  bool ok = BenchParse(options, &files, "manifest_parse", "flat.ninja") &&
+      BenchParse(options, &files, "manifest_parse_subninja", "top.ninja") &&
+      Parse(&state, &files, "flat.ninja") &&
+      WriteLog(&state) &&
+      BenchLog(options) &&
+      BenchDirtyScan(options, &state);
+  remove(kLogPath);
+  if (!ok)
+    return 1;
+  BenchSpellcheck(options, &state);
+  BenchCanonicalize(options, &state);
+  return 0;
+}
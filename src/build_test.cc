@@ -14,9 +14,14 @@
 
 #include "build.h"
 
+#include <stdio.h>
+
 #include "build_log.h"
+#include "deps_log.h"
 #include "graph.h"
+#include "output_cache.h"
 #include "test.h"
+#include "threads.h"
 
 /// Fixture for tests involving Plan.
 // Though Plan doesn't use State, it's useful to have one around
@@ -176,9 +181,218 @@ TEST_F(PlanTest, DependencyCycle) {
   ASSERT_EQ("dependency cycle: out -> mid -> in -> pre -> out", err);
 }
 
+TEST_F(PlanTest, PoolWithDepthOne) {
+  AssertParse(&state_,
+"pool foobar\n"
+"  depth = 1\n"
+"rule poolcat\n"
+"  command = cat $in > $out\n"
+"  pool = foobar\n"
+"build out1: poolcat in\n"
+"build out2: poolcat in\n"
+"build out3: cat in\n"
+"build allTheThings: phony out1 out2 out3\n");
+  GetNode("out1")->MarkDirty();
+  GetNode("out2")->MarkDirty();
+  GetNode("out3")->MarkDirty();
+  GetNode("allTheThings")->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("allTheThings"), &err));
+  ASSERT_EQ("", err);
+
+  // Only one of the pool's edges is handed out, but other work isn't
+  // held back.
+  Edge* first = plan_.FindWork();
+  ASSERT_TRUE(first);
+  Edge* second = plan_.FindWork();
+  ASSERT_TRUE(second);
+  ASSERT_FALSE(plan_.FindWork());
+  Edge* pooled = first->pool()->name() == "foobar" ? first : second;
+  Edge* other = pooled == first ? second : first;
+  EXPECT_EQ("foobar", pooled->pool()->name());
+  EXPECT_EQ(&State::kDefaultPool, other->pool());
+  EXPECT_EQ(1, pooled->pool()->current_use());
+
+  plan_.EdgeFinished(other);
+  ASSERT_FALSE(plan_.FindWork());
+
+  // A failure frees the slot as well as success does.
+  plan_.EdgeFailed(pooled);
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("foobar", edge->pool()->name());
+  EXPECT_NE(pooled, edge);
+  EXPECT_EQ(1, edge->pool()->current_use());
+  plan_.EdgeFinished(edge);
+  EXPECT_EQ(0, edge->pool()->current_use());
+  ASSERT_FALSE(plan_.FindWork());
+}
+
+TEST_F(PlanTest, PoolsWithDepthTwo) {
+  AssertParse(&state_,
+"pool two\n"
+"  depth = 2\n"
+"rule link\n"
+"  command = link $out\n"
+"  pool = two\n"
+"build a: link\n"
+"build b: link\n"
+"build c: link\n"
+"build d: cat\n"
+"  pool = two\n"
+"build all: phony a b c d\n");
+  const char* kOutputs[] = { "a", "b", "c", "d", "all" };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+
+  // Two at a time, until all four are done.
+  for (int round = 0; round < 2; ++round) {
+    Edge* first = plan_.FindWork();
+    Edge* second = plan_.FindWork();
+    ASSERT_TRUE(first);
+    ASSERT_TRUE(second);
+    ASSERT_FALSE(plan_.FindWork());
+    EXPECT_EQ(2, first->pool()->current_use());
+    plan_.EdgeFinished(first);
+    plan_.EdgeFinished(second);
+  }
+
+  // The phony edge needs no command; looking for work finishes it.
+  ASSERT_FALSE(plan_.FindWork());
+  ASSERT_FALSE(plan_.more_to_do());
+}
+
+TEST_F(PlanTest, PhonyChain) {
+  AssertParse(&state_,
+"build mid: cat in\n"
+"build alias1: phony mid\n"
+"build alias2: phony alias1\n"
+"build out: cat alias2\n"
+"build all: phony out\n");
+  const char* kOutputs[] = { "mid", "alias1", "alias2", "out", "all" };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+
+  // Only the commands come out, and the phony edges between them are
+  // finished in one go.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("mid", edge->outputs_[0]->path());
+  plan_.EdgeFinished(edge);
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("out", edge->outputs_[0]->path());
+  EXPECT_TRUE(GetNode("alias2")->in_edge()->outputs_ready());
+  plan_.EdgeFinished(edge);
+  EXPECT_TRUE(plan_.more_to_do());
+  ASSERT_FALSE(plan_.FindWork());
+  ASSERT_FALSE(plan_.more_to_do());
+}
+
+// Edges keep their plan state, which must be reset for the next plan.
+TEST_F(PlanTest, EdgesOutliveAPlan) {
+  AssertParse(&state_,
+"build out: cat in\n");
+  GetNode("out")->MarkDirty();
+  string err;
+  {
+    Plan plan;
+    EXPECT_TRUE(plan.AddTarget(GetNode("out"), &err));
+    ASSERT_EQ("", err);
+    ASSERT_TRUE(plan.FindWork());
+  }
+
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  ASSERT_TRUE(plan_.more_to_do());
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  plan_.EdgeFinished(edge);
+  ASSERT_FALSE(plan_.more_to_do());
+}
+
+TEST_F(PlanTest, CriticalPathFirst) {
+  AssertParse(&state_,
+"build b: cat in\n"
+"build a1: cat in\n"
+"build a2: cat a1\n"
+"build a3: cat a2\n"
+"build all: phony a3 b\n");
+  const char* kOutputs[] = { "b", "a1", "a2", "a3", "all" };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+
+  // Without any history, the longer chain goes first.
+  plan_.ComputeCriticalPath(NULL);
+  EXPECT_EQ(3, GetNode("a1")->in_edge()->critical_time_);
+  EXPECT_EQ(1, GetNode("b")->in_edge()->critical_time_);
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a1", edge->outputs_[0]->path());
+  plan_.EdgeFinished(edge);
+
+  // But a single step that took longer last time beats it.
+  BuildLog log;
+  log.RecordCommand(GetNode("b")->in_edge(), 0, 100);
+  log.RecordCommand(GetNode("a2")->in_edge(), 0, 10);
+  plan_.ComputeCriticalPath(&log);
+  // a3 has no history, so it's assumed to take the average.
+  EXPECT_EQ(65, GetNode("a2")->in_edge()->critical_time_);
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a2", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+}
+
+TEST_F(PlanTest, FailedBeforeFirst) {
+  AssertParse(&state_,
+"build b: cat in\n"
+"build a1: cat in\n"
+"build a2: cat a1\n"
+"build c: cat in\n"
+"build d: cat c\n"
+"build all: phony a2 b d\n");
+  const char* kOutputs[] = { "b", "a1", "a2", "c", "d", "all" };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+
+  // d failed last time, so it and what it needs go ahead of the longer
+  // a1 -> a2 chain.
+  BuildLog log;
+  log.RecordFailure(GetNode("d")->in_edge());
+  plan_.ComputeCriticalPath(&log);
+  EXPECT_TRUE(GetNode("c")->in_edge()->failed_before_);
+  EXPECT_FALSE(GetNode("a1")->in_edge()->failed_before_);
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("c", edge->outputs_[0]->path());
+  plan_.EdgeFinished(edge);
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("d", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a1", edge->outputs_[0]->path());
+}
+
 struct BuildTest : public StateTestWithBuiltinRules,
                    public CommandRunner {
-  BuildTest() : config_(MakeConfig()), builder_(&state_, config_), now_(1),
+  BuildTest() : config_(QuietBuildConfig()), builder_(&state_, config_), now_(1),
                 last_command_(NULL) {
     builder_.disk_interface_ = &fs_;
     builder_.command_runner_ = this;
@@ -197,13 +411,8 @@ struct BuildTest : public StateTestWithBuiltinRules,
   // CommandRunner impl
   virtual bool CanRunMore();
   virtual bool StartCommand(Edge* edge);
-  virtual Edge* WaitForCommand(bool* success, string* output);
-
-  BuildConfig MakeConfig() {
-    BuildConfig config;
-    config.verbosity = BuildConfig::QUIET;
-    return config;
-  }
+  virtual Edge* WaitForCommand(bool* success, string* output,
+                               ResourceUsage* usage);
 
   BuildConfig config_;
   Builder builder_;
@@ -251,7 +460,8 @@ bool BuildTest::StartCommand(Edge* edge) {
   return true;
 }
 
-Edge* BuildTest::WaitForCommand(bool* success, string* output) {
+Edge* BuildTest::WaitForCommand(bool* success, string* output,
+                                ResourceUsage* usage) {
   if (Edge* edge = last_command_) {
     if (edge->rule().name() == "fail")
       *success = false;
@@ -439,6 +649,42 @@ TEST_F(BuildTest, MakeDirs) {
 #endif
 }
 
+TEST_F(BuildTest, MakeDirsOnce) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build subdir/a: cat in1\n"
+"build subdir/b: cat in1\n"));
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("subdir/a", &err));
+  EXPECT_TRUE(builder_.AddTarget("subdir/b", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  // The second edge doesn't look for the directory again.
+  ASSERT_EQ(1u, fs_.directories_made_.size());
+  EXPECT_EQ("subdir", fs_.directories_made_[0]);
+}
+
+TEST_F(BuildTest, MakeDirsFirst) {
+  config_.make_dirs_first = true;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out/x/a: cat in1\n"
+"build out/y/b: cat in1\n"
+"build c: cat in1\n"));
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out/x/a", &err));
+  EXPECT_TRUE(builder_.AddTarget("out/y/b", &err));
+  EXPECT_TRUE(builder_.AddTarget("c", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+
+  // Parents first; nothing more once commands run.
+  ASSERT_EQ(3u, fs_.directories_made_.size());
+  EXPECT_EQ("out", fs_.directories_made_[0]);
+  EXPECT_EQ("out/x", fs_.directories_made_[1]);
+  EXPECT_EQ("out/y", fs_.directories_made_[2]);
+}
+
 TEST_F(BuildTest, DepFileMissing) {
   string err;
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -461,6 +707,8 @@ TEST_F(BuildTest, DepFileOK) {
   Edge* edge = state_.edges_.back();
 
   fs_.Create("foo.c", now_, "");
+  // An up-to-date output, so that the depfile decides.
+  fs_.Create("foo.o", now_, "");
   GetNode("bar.h")->MarkDirty();  // Mark bar.h as missing.
   fs_.Create("foo.o.d", now_, "foo.o: blah.h bar.h\n");
   EXPECT_TRUE(builder_.AddTarget("foo.o", &err));
@@ -490,6 +738,91 @@ TEST_F(BuildTest, DepFileParseError) {
             err);
 }
 
+TEST_F(BuildTest, DepsLogIngest) {
+  DepsLog deps_log;
+  state_.deps_log_ = &deps_log;
+
+  string err;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n  command = cc $in\n  depfile = $out.d\n  deps = gcc\n"
+"build foo.o: cc foo.c\n"));
+  Edge* edge = state_.edges_.back();
+
+  fs_.Create("foo.c", now_, "");
+  fs_.Create("foo.o.d", now_, "foo.o: blah.h bar.h\n");
+  EXPECT_TRUE(builder_.AddTarget("foo.o", &err));
+  ASSERT_EQ("", err);
+  // Nothing in the log: the depfile isn't consulted and the edge is dirty.
+  EXPECT_EQ(0u, fs_.files_read_.size());
+  EXPECT_EQ(1u, edge->inputs_.size());
+
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, commands_ran_.size());
+
+  // The depfile was moved into the log.
+  EXPECT_EQ(1u, fs_.files_removed_.count("foo.o.d"));
+  const DepsLog::Deps* deps = deps_log.GetDeps(GetNode("foo.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(now_, deps->mtime);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("blah.h", deps_log.node(deps->node_ids[0])->path());
+  EXPECT_EQ("bar.h", deps_log.node(deps->node_ids[1])->path());
+}
+
+TEST_F(BuildTest, DepsLogLoad) {
+  DepsLog deps_log;
+  state_.deps_log_ = &deps_log;
+
+  string err;
+  int orig_edges = state_.edges_.size();
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n  command = cc $in\n  depfile = $out.d\n  deps = gcc\n"
+"build foo.o: cc foo.c\n"));
+  Edge* edge = state_.edges_.back();
+
+  vector<Node*> deps;
+  deps.push_back(GetNode("blah.h"));
+  deps.push_back(GetNode("bar.h"));
+  ASSERT_TRUE(deps_log.RecordDeps(GetNode("foo.o"), now_, deps));
+
+  fs_.Create("foo.c", now_, "");
+  fs_.Create("blah.h", now_, "");
+  fs_.Create("bar.h", now_, "");
+  fs_.Create("foo.o", now_, "");
+  EXPECT_TRUE(builder_.AddTarget("foo.o", &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0u, fs_.files_read_.size());
+
+  // Same as DepFileOK: two phony edges for the headers.
+  ASSERT_EQ(orig_edges + 3, (int)state_.edges_.size());
+  ASSERT_EQ(3u, edge->inputs_.size());
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+}
+
+TEST_F(BuildTest, DepsLogStale) {
+  DepsLog deps_log;
+  state_.deps_log_ = &deps_log;
+
+  string err;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n  command = cc $in\n  depfile = $out.d\n  deps = gcc\n"
+"build foo.o: cc foo.c\n"));
+
+  vector<Node*> deps;
+  deps.push_back(GetNode("blah.h"));
+  ASSERT_TRUE(deps_log.RecordDeps(GetNode("foo.o"), now_, deps));
+
+  // The output was written after the record, so the record can't be
+  // trusted.
+  fs_.Create("foo.c", now_, "");
+  fs_.Create("blah.h", now_, "");
+  fs_.Create("foo.o", now_ + 1, "");
+  EXPECT_TRUE(builder_.AddTarget("foo.o", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.AlreadyUpToDate());
+}
+
 TEST_F(BuildTest, OrderOnlyDeps) {
   string err;
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -499,6 +832,7 @@ TEST_F(BuildTest, OrderOnlyDeps) {
 
   fs_.Create("foo.c", now_, "");
   fs_.Create("otherfile", now_, "");
+  fs_.Create("foo.o", now_, "");
   fs_.Create("foo.o.d", now_, "foo.o: blah.h bar.h\n");
   EXPECT_TRUE(builder_.AddTarget("foo.o", &err));
   ASSERT_EQ("", err);
@@ -507,17 +841,19 @@ TEST_F(BuildTest, OrderOnlyDeps) {
   ASSERT_EQ(4u, edge->inputs_.size());
   EXPECT_EQ(2, edge->implicit_deps_);
   EXPECT_EQ(1, edge->order_only_deps_);
-  // Verify the inputs are in the order we expect
-  // (explicit then implicit then orderonly).
+  // Verify the inputs are in the order we expect (explicit then
+  // orderonly from the manifest, then implicit from the depfile).
   EXPECT_EQ("foo.c", edge->inputs_[0]->path());
-  EXPECT_EQ("blah.h", edge->inputs_[1]->path());
-  EXPECT_EQ("bar.h", edge->inputs_[2]->path());
-  EXPECT_EQ("otherfile", edge->inputs_[3]->path());
+  EXPECT_EQ("otherfile", edge->inputs_[1]->path());
+  EXPECT_EQ("blah.h", edge->inputs_[2]->path());
+  EXPECT_EQ("bar.h", edge->inputs_[3]->path());
+  EXPECT_TRUE(edge->is_order_only(1));
+  EXPECT_TRUE(edge->is_implicit(2));
 
   // Expect the command line we generate to only use the original input.
   ASSERT_EQ("cc foo.c", edge->EvaluateCommand());
 
-  // explicit dep dirty, expect a rebuild.
+  // implicit deps missing, expect a rebuild.
   EXPECT_TRUE(builder_.Build(&err));
   ASSERT_EQ("", err);
   ASSERT_EQ(1u, commands_ran_.size());
@@ -688,6 +1024,126 @@ TEST_F(BuildTest, SwallowFailuresLimit) {
   ASSERT_EQ("cannot make progress due to previous errors", err);
 }
 
+TEST_F(BuildTest, PoolsEmptyAfterFailedBuild) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool link\n"
+"  depth = 1\n"
+"rule fail\n"
+"  command = fail\n"
+"build mid: cat in1\n"
+"build bad: fail mid\n"
+"build p1: cat in1\n"
+"  pool = link\n"
+"build p2: cat in1\n"
+"  pool = link\n"
+"build all: phony bad p1 p2\n"));
+
+  // Each build has a Builder of its own, as with -t serve or a Session.
+  // The first fails while p1 holds the pool and p2 waits for it; the
+  // later ones, after either way of resetting the state, mustn't
+  // inherit that.
+  for (int pass = 0; pass < 3; ++pass) {
+    if (pass == 1)
+      state_.ResetDirtyNodes();
+    else if (pass == 2)
+      state_.Reset();
+    commands_ran_.clear();
+    Builder builder(&state_, config_);
+    builder.disk_interface_ = &fs_;
+    builder.command_runner_ = this;
+    string err;
+    EXPECT_TRUE(builder.AddTarget(pass ? "p2" : "all", &err));
+    ASSERT_EQ("", err);
+    if (pass == 0) {
+      EXPECT_FALSE(builder.Build(&err));
+      ASSERT_EQ(2u, commands_ran_.size());
+      EXPECT_EQ("fail", commands_ran_[1]);
+    } else {
+      EXPECT_TRUE(builder.Build(&err));
+      EXPECT_EQ("", err);
+      EXPECT_EQ(1u, commands_ran_.size());
+    }
+    fs_.Create("in1", ++now_, "");
+  }
+}
+
+TEST_F(BuildTest, OutputCache) {
+  OutputCache cache(&fs_, "cache");
+  builder_.cache_ = &cache;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in\n"
+"build out: cc in\n"));
+  fs_.Create("in", now_, "source");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ(1u, commands_ran_.size());
+
+  // The same inputs again: the output comes from the cache.
+  fs_.RemoveFile("out");
+  commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ(0u, commands_ran_.size());
+  EXPECT_GT(fs_.Stat("out"), 0);
+
+  // Different inputs: the command runs.
+  now_++;
+  fs_.Create("in", now_, "changed");
+  commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ(1u, commands_ran_.size());
+}
+
+TEST_F(BuildTest, OutputCacheWithDepfile) {
+  OutputCache cache(&fs_, "cache");
+  builder_.cache_ = &cache;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in\n"
+"  depfile = $out.d\n"
+"build out: cc in\n"));
+  fs_.Create("in", now_, "source");
+  fs_.Create("in.h", now_, "header");
+  fs_.Create("out.d", now_, "out: in in.h\n");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ(1u, commands_ran_.size());
+
+  // With the output missing, only the built deps of the depfile are
+  // loaded; the key must still cover the header.
+  fs_.RemoveFile("out");
+  commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ(0u, commands_ran_.size());
+  EXPECT_GT(fs_.Stat("out"), 0);
+
+  // A different header: the command runs.
+  now_++;
+  fs_.Create("in.h", now_, "changed");
+  fs_.RemoveFile("out");
+  commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  EXPECT_EQ(1u, commands_ran_.size());
+}
+
 struct BuildWithLogTest : public BuildTest {
   BuildWithLogTest() {
     state_.build_log_ = builder_.log_ = &build_log_;
@@ -746,6 +1202,45 @@ TEST_F(BuildWithLogTest, RestatTest) {
   ASSERT_EQ(2u, commands_ran_.size());
 }
 
+TEST_F(BuildWithLogTest, ResetDirtyNodesAfterRestat) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule true\n"
+"  command = true\n"
+"  restat = 1\n"
+"  depfile = $out.d\n"
+"build out1: true in\n"
+"build out2: cat out1\n"));
+  fs_.Create("out1", now_, "");
+  fs_.Create("out2", now_, "");
+  fs_.Create("out1.d", now_, "out1: in\n");
+  now_++;
+  fs_.Create("in", now_, "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  // The command leaves out1 alone but reads a new header.
+  fs_.Create("out1.d", now_, "out1: in new.h\n");
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ(1u, commands_ran_.size());
+  EXPECT_FALSE(GetNode("out1")->dirty());
+
+  // What -t serve does between builds: new.h wasn't in the graph when it
+  // changed, so only the reset of what ran brings it in.
+  state_.ResetDirtyNodes();
+  now_++;
+  fs_.Create("new.h", now_, "");
+  EXPECT_FALSE(state_.LookupNode("new.h"));
+
+  commands_ran_.clear();
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.AlreadyUpToDate());
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ(1u, commands_ran_.size());
+  EXPECT_EQ("true", commands_ran_[0]);
+}
+
 TEST_F(BuildWithLogTest, RestatMissingFile) {
   // If a restat rule doesn't create its output, and the output didn't
   // exist before the rule was run, consider that behavior equivalent
@@ -773,6 +1268,214 @@ TEST_F(BuildWithLogTest, RestatMissingFile) {
   ASSERT_EQ(1u, commands_ran_.size());
 }
 
+TEST_F(BuildWithLogTest, RestatHash) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc\n"
+"  restat = hash\n"
+"build out1: cc in\n"
+"build out2: cat out1\n"));
+
+  fs_.Create("in", now_, "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ(2u, commands_ran_.size());
+  TimeStamp out1_mtime = fs_.Stat("out1");
+
+  now_++;
+  fs_.Create("in", now_, "");
+
+  // "cc" rewrites out1 with the same contents, so out2 needn't be rebuilt
+  // and out1 keeps its old mtime.
+  commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ(1u, commands_ran_.size());
+  EXPECT_EQ(out1_mtime, fs_.Stat("out1"));
+
+  // Which also holds for the next build.
+  commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+}
+
+/// Holds back reads of whole files until told to, or for a few seconds.
+struct SlowReadDiskInterface : public RealDiskInterface {
+  SlowReadDiskInterface() : timed_out_(false) {}
+  virtual void ReadFileBlocks(const string& path, size_t block_size,
+                              BlockSink* sink, string* err) {
+    if (!release_.Wait(5000))
+      timed_out_ = true;
+    RealDiskInterface::ReadFileBlocks(path, block_size, sink, err);
+  }
+  Event release_;
+  bool timed_out_;
+};
+
+/// Runs two commands at once, writing their outputs for real.  A command
+/// finishing after "cc" did lets the disk's reads go.
+struct HashInBackgroundTest : public StateTestWithBuiltinRules,
+                              public CommandRunner {
+  HashInBackgroundTest() : config_(QuietBuildConfig()), lose_other_(false) {}
+
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("HashInBackgroundTest");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  void Write(const string& path) {
+    FILE* f = fopen(path.c_str(), "w");
+    fputs("same", f);
+    fclose(f);
+  }
+
+  virtual bool CanRunMore() { return running_.size() < 2; }
+  virtual bool StartCommand(Edge* edge) {
+    commands_ran_.push_back(edge->EvaluateCommand());
+    Write(edge->outputs_[0]->path());
+    running_.push(edge);
+    return true;
+  }
+  virtual Edge* WaitForCommand(bool* success, string* output,
+                               ResourceUsage* usage) {
+    if (running_.empty())
+      return NULL;
+    Edge* edge = running_.front();
+    running_.pop();
+    if (edge->rule().name() != "cc") {
+      disk_.release_.Signal();
+      if (lose_other_)
+        return NULL;
+    }
+    *success = edge->rule().name() != "fail";
+    return edge;
+  }
+
+  /// Build \a target from scratch, returning false on failure.
+  bool Build(const string& target) {
+    state_.Reset();
+    commands_ran_.clear();
+    Builder builder(&state_, config_);
+    builder.disk_interface_ = &disk_;
+    builder.command_runner_ = this;
+    builder.log_ = &build_log_;
+    string err;
+    EXPECT_TRUE(builder.AddTarget(target, &err));
+    EXPECT_EQ("", err);
+    if (builder.AlreadyUpToDate())
+      return true;
+    bool ok = builder.Build(&err);
+    EXPECT_EQ("", err);
+    return ok;
+  }
+
+  ScopedTempDir temp_dir_;
+  BuildConfig config_;
+  SlowReadDiskInterface disk_;
+  BuildLog build_log_;
+  queue<Edge*> running_;
+  vector<string> commands_ran_;
+  /// Whether to lose track of commands other than "cc", as a buggy
+  /// runner might.
+  bool lose_other_;
+};
+
+TEST_F(HashInBackgroundTest, BuildGoesOn) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $out\n"
+"  restat = hash\n"
+"build out1: cc in\n"
+"build out2: cat out1\n"
+"build other: cat in\n"
+"build all: phony out2 other\n"));
+  state_.build_log_ = &build_log_;
+  Write("in");
+
+  // The other command is reaped while out1 is being hashed.
+  EXPECT_TRUE(Build("all"));
+  EXPECT_FALSE(disk_.timed_out_);
+  ASSERT_EQ(3u, commands_ran_.size());
+  EXPECT_EQ("cat out1 > out2", commands_ran_[2]);
+
+  // cc writes out1 the same again, so out2 is left alone.
+  TimeStamp now = disk_.Stat("in");
+  ASSERT_TRUE(disk_.SetMTime("out1", now - 100));
+  ASSERT_TRUE(disk_.SetMTime("out2", now - 50));
+  ASSERT_TRUE(disk_.SetMTime("other", now + 10));
+  disk_.release_.Signal();
+  EXPECT_TRUE(Build("all"));
+  EXPECT_FALSE(disk_.timed_out_);
+  ASSERT_EQ(1u, commands_ran_.size());
+  EXPECT_EQ("cc out1", commands_ran_[0]);
+  EXPECT_EQ(now - 100, disk_.Stat("out1"));
+}
+
+TEST_F(HashInBackgroundTest, LostCommand) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $out\n"
+"  restat = hash\n"
+"build out1: cc in\n"
+"build other: cat in\n"
+"build all: phony out1 other\n"));
+  state_.build_log_ = &build_log_;
+  Write("in");
+  lose_other_ = true;
+
+  // A runner that returns no command without being woken is still an
+  // error while outputs are being hashed.
+  Builder builder(&state_, config_);
+  builder.disk_interface_ = &disk_;
+  builder.command_runner_ = this;
+  builder.log_ = &build_log_;
+  string err;
+  EXPECT_TRUE(builder.AddTarget("all", &err));
+  EXPECT_FALSE(builder.Build(&err));
+  EXPECT_EQ("stuck: pending commands but none to wait for? [this is a bug]",
+            err);
+}
+
+TEST_F(HashInBackgroundTest, FailureLogsHashedEdges) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $out\n"
+"  restat = hash\n"
+"rule fail\n"
+"  command = fail $out\n"
+"build out1: cc in\n"
+"build out2: cat out1\n"
+"build other: fail in\n"
+"build all: phony out2 other\n"));
+  state_.build_log_ = &build_log_;
+  Write("in");
+
+  // out1 is still being hashed when the other command fails; the build
+  // waits for it, so it needn't run again next time.
+  Builder builder(&state_, config_);
+  builder.disk_interface_ = &disk_;
+  builder.command_runner_ = this;
+  builder.log_ = &build_log_;
+  string err;
+  EXPECT_TRUE(builder.AddTarget("all", &err));
+  EXPECT_FALSE(builder.Build(&err));
+  EXPECT_EQ("subcommand failed", err);
+  EXPECT_FALSE(disk_.timed_out_);
+  ASSERT_EQ(2u, commands_ran_.size());
+  EXPECT_EQ("cc out1", commands_ran_[0]);
+  EXPECT_TRUE(build_log_.LookupByOutput("out1"));
+  EXPECT_FALSE(build_log_.LookupByOutput("other"));
+}
+
 struct BuildDryRun : public BuildWithLogTest {
   BuildDryRun() {
     config_.dry_run = true;
@@ -0,0 +1,181 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "byte_scan.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NINJA_SCAN_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define NINJA_SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+inline bool IsManifestSpecial(char c) {
+  return c == '$' || c == ' ' || c == ':' || c == '|' || c == '\n' ||
+      c == '\0';
+}
+
+inline bool IsDepfilePathChar(char c) {
+  // '+' through ':' is "+,-./0123456789:".
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+      (c >= '+' && c <= ':') || c == '_';
+}
+
+#ifdef NINJA_SCAN_SSE2
+/// Return the index of the lowest set bit of a nonzero \a mask.
+inline int FirstSetBit(int mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (int)index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+/// Bytes of \a v within [lo, hi].  Compares are signed, so bytes >= 0x80
+/// never match an ASCII range.
+inline __m128i InRange(__m128i v, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+#endif
+
+#ifdef NINJA_SCAN_NEON
+inline uint8x16_t InRange(uint8x16_t v, char lo, char hi) {
+  return vandq_u8(vcgeq_u8(v, vdupq_n_u8(lo)), vcleq_u8(v, vdupq_n_u8(hi)));
+}
+#endif
+
+}  // namespace
+
+const char* FindManifestSpecialScalar(const char* p, const char* end) {
+  while (p < end && !IsManifestSpecial(*p))
+    ++p;
+  return p;
+}
+
+const char* SkipDepfilePathCharsScalar(const char* p, const char* end) {
+  while (p < end && IsDepfilePathChar(*p))
+    ++p;
+  return p;
+}
+
+bool HasSlashBeforeSlashOrDotScalar(const char* p, const char* end) {
+  for (; end - p >= 2; ++p) {
+    if (p[0] == '/' && (p[1] == '/' || p[1] == '.'))
+      return true;
+  }
+  return false;
+}
+
+const char* FindManifestSpecial(const char* p, const char* end) {
+#ifdef NINJA_SCAN_SSE2
+  const __m128i dollar = _mm_set1_epi8('$');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i pipe = _mm_set1_epi8('|');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i nul = _mm_setzero_si128();
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, dollar),
+                                  _mm_cmpeq_epi8(v, space)),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, colon),
+                                  _mm_cmpeq_epi8(v, pipe))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, nul)));
+    int mask = _mm_movemask_epi8(special);
+    if (mask)
+      return p + FirstSetBit(mask);
+  }
+#elif defined(NINJA_SCAN_NEON)
+  for (; end - p >= 16; p += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+    uint8x16_t special = vorrq_u8(
+        vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('$')),
+                          vceqq_u8(v, vdupq_n_u8(' '))),
+                 vorrq_u8(vceqq_u8(v, vdupq_n_u8(':')),
+                          vceqq_u8(v, vdupq_n_u8('|')))),
+        vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')), vceqq_u8(v, vdupq_n_u8(0))));
+    // NEON has no movemask; find the byte with the scalar loop.
+    if (vmaxvq_u8(special))
+      return FindManifestSpecialScalar(p, p + 16);
+  }
+#endif
+  return FindManifestSpecialScalar(p, end);
+}
+
+const char* SkipDepfilePathChars(const char* p, const char* end) {
+#ifdef NINJA_SCAN_SSE2
+  const __m128i underscore = _mm_set1_epi8('_');
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i plain = _mm_or_si128(
+        _mm_or_si128(InRange(v, 'a', 'z'), InRange(v, 'A', 'Z')),
+        _mm_or_si128(InRange(v, '+', ':'), _mm_cmpeq_epi8(v, underscore)));
+    int mask = ~_mm_movemask_epi8(plain) & 0xffff;
+    if (mask)
+      return p + FirstSetBit(mask);
+  }
+#elif defined(NINJA_SCAN_NEON)
+  for (; end - p >= 16; p += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+    uint8x16_t plain = vorrq_u8(
+        vorrq_u8(InRange(v, 'a', 'z'), InRange(v, 'A', 'Z')),
+        vorrq_u8(InRange(v, '+', ':'), vceqq_u8(v, vdupq_n_u8('_'))));
+    if (vminvq_u8(plain) == 0)
+      return SkipDepfilePathCharsScalar(p, p + 16);
+  }
+#endif
+  return SkipDepfilePathCharsScalar(p, end);
+}
+
+bool HasSlashBeforeSlashOrDot(const char* p, const char* end) {
+  // Compare each block against the same block shifted by a byte, so each
+  // block needs one more byte after it.
+#ifdef NINJA_SCAN_SSE2
+  const __m128i slash = _mm_set1_epi8('/');
+  const __m128i dot = _mm_set1_epi8('.');
+  for (; end - p >= 17; p += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+    __m128i hits = _mm_and_si128(
+        _mm_cmpeq_epi8(v, slash),
+        _mm_or_si128(_mm_cmpeq_epi8(next, slash), _mm_cmpeq_epi8(next, dot)));
+    if (_mm_movemask_epi8(hits))
+      return true;
+  }
+#elif defined(NINJA_SCAN_NEON)
+  const uint8x16_t slash = vdupq_n_u8('/');
+  const uint8x16_t dot = vdupq_n_u8('.');
+  for (; end - p >= 17; p += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+    uint8x16_t next = vld1q_u8(reinterpret_cast<const uint8_t*>(p + 1));
+    uint8x16_t hits = vandq_u8(
+        vceqq_u8(v, slash),
+        vorrq_u8(vceqq_u8(next, slash), vceqq_u8(next, dot)));
+    if (vmaxvq_u8(hits))
+      return true;
+  }
+#endif
+  return HasSlashBeforeSlashOrDotScalar(p, end);
+}
@@ -0,0 +1,42 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_BYTE_SCAN_H_
+#define NINJA_BYTE_SCAN_H_
+
+// Fast paths for the lexers, which otherwise look at one byte at a time.
+// Most manifest and depfile text is long runs of path characters; these
+// skip over such runs 16 bytes at a time with SSE2 or NEON where
+// available, and one byte at a time otherwise.
+
+/// Return the first of '$', ' ', ':', '|', '\n' or NUL in [p, end) --
+/// whatever can end a run of plain text in a manifest -- or \a end if
+/// there is none.
+const char* FindManifestSpecial(const char* p, const char* end);
+
+/// Skip the characters in [p, end) that can appear unescaped in a
+/// depfile path, [a-zA-Z0-9+,/_:.-], returning the first one that can't
+/// or \a end.
+const char* SkipDepfilePathChars(const char* p, const char* end);
+
+/// Return true if [p, end) has a '/' followed by another '/' or a '.',
+/// i.e. may hold an empty, "." or ".." path component.
+bool HasSlashBeforeSlashOrDot(const char* p, const char* end);
+
+/// The byte-at-a-time versions of the above, for tests and benchmarks.
+const char* FindManifestSpecialScalar(const char* p, const char* end);
+const char* SkipDepfilePathCharsScalar(const char* p, const char* end);
+bool HasSlashBeforeSlashOrDotScalar(const char* p, const char* end);
+
+#endif  // NINJA_BYTE_SCAN_H_
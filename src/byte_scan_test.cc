@@ -0,0 +1,81 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "byte_scan.h"
+
+#include "test.h"
+
+namespace {
+
+/// Check the vectorized scans against the scalar ones from every offset
+/// of \a text, so that each lands at every position within a block.
+void ExpectSameAsScalar(const string& text) {
+  const char* begin = text.data();
+  const char* end = begin + text.size();
+  for (const char* p = begin; p <= end; ++p) {
+    EXPECT_EQ(FindManifestSpecialScalar(p, end) - begin,
+              FindManifestSpecial(p, end) - begin) << text << " @" << p - begin;
+    EXPECT_EQ(SkipDepfilePathCharsScalar(p, end) - begin,
+              SkipDepfilePathChars(p, end) - begin) << text << " @" << p - begin;
+    EXPECT_EQ(HasSlashBeforeSlashOrDotScalar(p, end),
+              HasSlashBeforeSlashOrDot(p, end)) << text << " @" << p - begin;
+  }
+}
+
+TEST(ByteScanTest, Manifest) {
+  string text = "out/obj/some/long/directory/file.o: cc in$ put || oo\n";
+  const char* end = text.data() + text.size();
+  EXPECT_EQ(text.find(':'), FindManifestSpecial(text.data(), end) - text.data());
+  // Runs end at the end of the input, too.
+  string plain = "a_path_longer_than_a_block_of_sixteen_bytes";
+  EXPECT_EQ(plain.data() + plain.size(),
+            FindManifestSpecial(plain.data(), plain.data() + plain.size()));
+  ExpectSameAsScalar(text);
+}
+
+TEST(ByteScanTest, Depfile) {
+  string text = "out/obj/file.o: src/file.c src/a\\ b.h +,:.-_/ZZzz09\t\n";
+  const char* end = text.data() + text.size();
+  EXPECT_EQ(text.find(' '),
+            SkipDepfilePathChars(text.data(), end) - text.data());
+  ExpectSameAsScalar(text);
+}
+
+TEST(ByteScanTest, Path) {
+  string text = "some/long/path/to/a/header/file.h";
+  const char* end = text.data() + text.size();
+  EXPECT_FALSE(HasSlashBeforeSlashOrDot(text.data(), end));
+  ExpectSameAsScalar(text);
+  // Each kind of hit past the first block, and across its end.
+  const char* kHits[] = { "some/long/path//x.h", "some/long/path/./x.h",
+                          "some/long/pat/.x", "some/long/pat//" };
+  for (size_t i = 0; i < sizeof(kHits) / sizeof(kHits[0]); ++i) {
+    text = kHits[i];
+    EXPECT_TRUE(HasSlashBeforeSlashOrDot(text.data(),
+                                         text.data() + text.size())) << text;
+    ExpectSameAsScalar(text);
+  }
+}
+
+TEST(ByteScanTest, AllBytes) {
+  // Each byte value, surrounded by plain text on both sides.
+  for (int c = 0; c < 256; ++c) {
+    string text(20, 'x');
+    text += (char)c;
+    text += string(20, 'x');
+    ExpectSameAsScalar(text);
+  }
+}
+
+}  // namespace
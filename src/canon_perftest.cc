@@ -0,0 +1,65 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Time CanonicalizePath() on a path that's already canonical, as most
+// paths in a generated manifest are, and on one that needs work.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+
+const char kPath[] =
+    "../../third_party/WebKit/Source/WebCore/"
+    "platform/leveldb/LevelDBWriteBatch.cpp";
+const char kMessyPath[] =
+    "../../third_party/WebKit/Source/WebCore/./"
+    "platform/../platform/leveldb//LevelDBWriteBatch.cpp";
+
+void Bench(const char* name, const char* path) {
+  const int kNumRepetitions = 2000000;
+  const int kNumRounds = 5;
+  char buf[200];
+  int len = (int)strlen(path);
+  int times[kNumRounds];
+  string err;
+  for (int j = 0; j < kNumRounds; ++j) {
+    int64_t start = GetTimeMillis();
+    for (int i = 0; i < kNumRepetitions; ++i) {
+      memcpy(buf, path, len + 1);
+      int new_len = len;
+      CanonicalizePath(buf, &new_len, &err);
+    }
+    times[j] = (int)(GetTimeMillis() - start);
+  }
+
+  int min = times[0], max = times[0];
+  float total = 0;
+  for (int i = 0; i < kNumRounds; ++i) {
+    total += times[i];
+    if (times[i] < min)
+      min = times[i];
+    if (times[i] > max)
+      max = times[i];
+  }
+  printf("%-10s min %dms  max %dms  avg %.1fms\n", name, min, max,
+         total / kNumRounds);
+}
+
+int main() {
+  Bench("canonical", kPath);
+  Bench("messy", kMessyPath);
+  return 0;
+}
@@ -0,0 +1,186 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "change_journal.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "util.h"
+
+namespace {
+
+/// Everything that can change the mtime of a file, or a file's
+/// existence, plus events that mean we may lose track of a directory.
+const uint32_t kWatchMask = IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+    IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+    IN_MOVE_SELF;
+
+}  // namespace
+
+ChangeJournal::ChangeJournal(DiskInterface* disk_interface)
+    : disk_interface_(disk_interface), fd_(-1), lost_changes_(false) {}
+
+ChangeJournal::~ChangeJournal() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool ChangeJournal::Start(string* err) {
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool ChangeJournal::ReadChanges(vector<string>* paths) {
+  METRIC_RECORD("change journal read");
+  paths->clear();
+  char buf[64 << 10]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t len = read(fd_, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0) {
+      if (errno != EAGAIN)
+        lost_changes_ = true;
+      break;
+    }
+
+    for (char* p = buf; p < buf + len; ) {
+      const inotify_event* event = (const inotify_event*)p;
+      p += sizeof(inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        lost_changes_ = true;
+        continue;
+      }
+      // Late events for directories we stopped watching don't matter.
+      map<int, string>::iterator dir = dirs_.find(event->wd);
+      if (dir == dirs_.end())
+        continue;
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        // We lost track of the files in a directory.
+        lost_changes_ = true;
+        continue;
+      }
+      if (event->len == 0)
+        continue;
+      if (dir->second == ".")
+        paths->push_back(event->name);
+      else
+        paths->push_back(dir->second + "/" + event->name);
+    }
+  }
+
+  paths->insert(paths->end(), unwatched_.begin(), unwatched_.end());
+  unwatched_.clear();
+
+  if (lost_changes_) {
+    // Start over: what isn't watched anymore is dropped, and the rest
+    // is watched again as it's stat()ed.
+    for (map<int, string>::iterator i = dirs_.begin(); i != dirs_.end(); ++i)
+      inotify_rm_watch(fd_, i->first);
+    dirs_.clear();
+    watched_.clear();
+    lost_changes_ = false;
+    return false;
+  }
+  return true;
+}
+
+void ChangeJournal::Watch(const string& path) {
+  string dir = DirName(path);
+  if (dir.empty())
+    dir = ".";
+  if (watched_.count(dir))
+    return;
+  int wd = inotify_add_watch(fd_, dir.c_str(), kWatchMask);
+  // The same directory may already be watched under another name, whose
+  // events would then be reported with that name.
+  if (wd < 0 || dirs_.count(wd)) {
+    unwatched_.insert(path);
+    return;
+  }
+  dirs_[wd] = dir;
+  watched_.insert(dir);
+}
+
+TimeStamp ChangeJournal::Stat(const string& path) {
+  Watch(path);
+  return disk_interface_->Stat(path);
+}
+
+void ChangeJournal::StatBatch(const vector<const string*>& paths,
+                              vector<TimeStamp>* mtimes) {
+  for (vector<const string*>::const_iterator i = paths.begin();
+       i != paths.end(); ++i) {
+    Watch(**i);
+  }
+  disk_interface_->StatBatch(paths, mtimes);
+}
+
+bool ChangeJournal::MakeDir(const string& path) {
+  return disk_interface_->MakeDir(path);
+}
+
+void ChangeJournal::MakeDirBatch(const vector<const string*>& paths,
+                                 vector<int>* results) {
+  disk_interface_->MakeDirBatch(paths, results);
+}
+
+string ChangeJournal::ReadFile(const string& path, string* err) {
+  return disk_interface_->ReadFile(path, err);
+}
+
+void ChangeJournal::ReadFileInto(const string& path, string* contents,
+                                 string* err) {
+  disk_interface_->ReadFileInto(path, contents, err);
+}
+
+void ChangeJournal::ReadFileBlocks(const string& path, size_t block_size,
+                                   BlockSink* sink, string* err) {
+  disk_interface_->ReadFileBlocks(path, block_size, sink, err);
+}
+
+int ChangeJournal::RemoveFile(const string& path) {
+  return disk_interface_->RemoveFile(path);
+}
+
+void ChangeJournal::RemoveFileBatch(const vector<const string*>& paths,
+                                    vector<int>* results) {
+  disk_interface_->RemoveFileBatch(paths, results);
+}
+
+int ChangeJournal::RemoveDir(const string& path) {
+  return disk_interface_->RemoveDir(path);
+}
+
+bool ChangeJournal::SetMTime(const string& path, TimeStamp mtime) {
+  return disk_interface_->SetMTime(path, mtime);
+}
+
+bool ChangeJournal::CloneFile(const string& from, const string& to) {
+  return disk_interface_->CloneFile(from, to);
+}
+
+void ChangeJournal::Invalidate(const string& path) {
+  disk_interface_->Invalidate(path);
+}
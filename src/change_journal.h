@@ -0,0 +1,86 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_CHANGE_JOURNAL_H_
+#define NINJA_CHANGE_JOURNAL_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "disk_interface.h"
+
+/// A DiskInterface decorator that asks inotify to watch the directory of
+/// every file it stats, so that a long-running ninja can learn which of
+/// those files changed since instead of stat()ing all of them again.
+/// Linux only.
+struct ChangeJournal : public DiskInterface {
+  explicit ChangeJournal(DiskInterface* disk_interface);
+  ~ChangeJournal();
+
+  /// Set up inotify.  Returns false on failure, in which case the journal
+  /// can't be used.
+  bool Start(string* err);
+
+  /// Set \a paths to the files that changed since the last call, or since
+  /// they were stat()ed.  A path is reported even if it only might have
+  /// changed, e.g. when its directory couldn't be watched.  Returns false
+  /// if changes may have been missed altogether, in which case everything
+  /// has to be checked again.
+  bool ReadChanges(vector<string>* paths);
+
+  // DiskInterface
+  virtual TimeStamp Stat(const string& path);
+  virtual void StatBatch(const vector<const string*>& paths,
+                         vector<TimeStamp>* mtimes);
+  virtual bool MakeDir(const string& path);
+  virtual void MakeDirBatch(const vector<const string*>& paths,
+                            vector<int>* results);
+  virtual string ReadFile(const string& path, string* err);
+  virtual void ReadFileInto(const string& path, string* contents,
+                            string* err);
+  virtual void ReadFileBlocks(const string& path, size_t block_size,
+                              BlockSink* sink, string* err);
+  virtual bool ReadsInBackground() const {
+    return disk_interface_->ReadsInBackground();
+  }
+  virtual int RemoveFile(const string& path);
+  virtual void RemoveFileBatch(const vector<const string*>& paths,
+                               vector<int>* results);
+  virtual int RemoveDir(const string& path);
+  virtual bool SetMTime(const string& path, TimeStamp mtime);
+  virtual bool CloneFile(const string& from, const string& to);
+  virtual void Invalidate(const string& path);
+
+ private:
+  /// Make sure the directory of \a path is watched, before it is stat()ed
+  /// so that no change in between goes unnoticed.
+  void Watch(const string& path);
+
+  DiskInterface* disk_interface_;
+  int fd_;
+
+  /// Watched directories, by watch descriptor and by path.
+  map<int, string> dirs_;
+  set<string> watched_;
+  /// Paths stat()ed whose directory couldn't be watched.
+  set<string> unwatched_;
+  /// Set once something went wrong that may have lost changes.
+  bool lost_changes_;
+};
+
+#endif  // NINJA_CHANGE_JOURNAL_H_
@@ -0,0 +1,105 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "change_journal.h"
+
+#include <algorithm>
+
+#include "test.h"
+#include "util.h"
+
+namespace {
+
+struct ChangeJournalTest : public testing::Test {
+  ChangeJournalTest() : journal_(&disk_interface_) {}
+
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-ChangeJournalTest");
+    string err;
+    ASSERT_TRUE(journal_.Start(&err)) << err;
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  void Write(const string& path, const char* contents) {
+    FILE* f = fopen(path.c_str(), "w");
+    ASSERT_TRUE(f);
+    fputs(contents, f);
+    fclose(f);
+  }
+
+  /// Return the sorted, deduplicated changes.
+  vector<string> Changes() {
+    vector<string> paths;
+    EXPECT_TRUE(journal_.ReadChanges(&paths));
+    sort(paths.begin(), paths.end());
+    paths.erase(unique(paths.begin(), paths.end()), paths.end());
+    return paths;
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_interface_;
+  ChangeJournal journal_;
+};
+
+TEST_F(ChangeJournalTest, Modified) {
+  Write("a", "");
+  Write("b", "");
+  EXPECT_LT(0, journal_.Stat("a"));
+  EXPECT_LT(0, journal_.Stat("b"));
+  EXPECT_TRUE(Changes().empty());
+
+  Write("a", "more");
+  vector<string> changes = Changes();
+  ASSERT_EQ(1u, changes.size());
+  EXPECT_EQ("a", changes[0]);
+  EXPECT_TRUE(Changes().empty());
+}
+
+TEST_F(ChangeJournalTest, CreatedAndRemoved) {
+  ASSERT_EQ(0, MakeDir("sub"));
+  EXPECT_EQ(0, journal_.Stat("sub/new"));
+  Write("sub/new", "");
+  unlink("sub/new");
+  vector<string> changes = Changes();
+  ASSERT_EQ(1u, changes.size());
+  EXPECT_EQ("sub/new", changes[0]);
+}
+
+TEST_F(ChangeJournalTest, MissingDirectory) {
+  // Paths that can't be watched are reported until they can.
+  EXPECT_EQ(0, journal_.Stat("out/x.o"));
+  vector<string> changes = Changes();
+  ASSERT_EQ(1u, changes.size());
+  EXPECT_EQ("out/x.o", changes[0]);
+  EXPECT_TRUE(Changes().empty());
+
+  ASSERT_EQ(0, MakeDir("out"));
+  EXPECT_EQ(0, journal_.Stat("out/x.o"));
+  EXPECT_TRUE(Changes().empty());
+}
+
+TEST_F(ChangeJournalTest, RemovedDirectory) {
+  ASSERT_EQ(0, MakeDir("sub"));
+  EXPECT_EQ(0, journal_.Stat("sub/x"));
+  rmdir("sub");
+  vector<string> paths;
+  EXPECT_FALSE(journal_.ReadChanges(&paths));
+  // Until the directory is watched again, there's nothing to report.
+  EXPECT_TRUE(journal_.ReadChanges(&paths));
+}
+
+}  // namespace
@@ -17,21 +17,45 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include "disk_interface.h"
 #include "graph.h"
+#include "metrics.h"
 #include "state.h"
 #include "util.h"
 
+namespace {
+
+/// Whether progress can be shown by overprinting a single line.
+bool IsSmartTerminal(const BuildConfig& config) {
+  if (config.verbosity != BuildConfig::NORMAL || config.dry_run)
+    return false;
+#ifndef _WIN32
+  const char* term = getenv("TERM");
+  return isatty(1) && term && string(term) != "dumb";
+#else
+  return false;
+#endif
+}
+
+}  // namespace
+
 Cleaner::Cleaner(State* state, const BuildConfig& config)
   : state_(state),
     config_(config),
     removed_(),
     cleaned_files_count_(0),
     disk_interface_(new RealDiskInterface),
-    status_(0) {
+    status_(0),
+    smart_terminal_(IsSmartTerminal(config)),
+    progress_printed_(false),
+    last_progress_millis_(0) {
 }
 
 Cleaner::Cleaner(State* state,
@@ -42,15 +66,10 @@ Cleaner::Cleaner(State* state,
     removed_(),
     cleaned_files_count_(0),
     disk_interface_(disk_interface),
-    status_(0) {
-}
-
-int Cleaner::RemoveFile(const string& path) {
-  return disk_interface_->RemoveFile(path);
-}
-
-bool Cleaner::FileExists(const string& path) {
-  return disk_interface_->Stat(path) > 0;
+    status_(0),
+    smart_terminal_(IsSmartTerminal(config)),
+    progress_printed_(false),
+    last_progress_millis_(0) {
 }
 
 void Cleaner::Report(const string& path) {
@@ -62,17 +81,89 @@ void Cleaner::Report(const string& path) {
 void Cleaner::Remove(const string& path) {
   if (!IsAlreadyRemoved(path)) {
     removed_.insert(path);
+    pending_.push_back(path);
+  }
+}
+
+void Cleaner::RemovePending() {
+  // Large enough to keep the disk interface's threads busy, small enough
+  // to show progress along the way.
+  const size_t kBatchSize = 1024;
+
+  for (size_t begin = 0; begin < pending_.size(); begin += kBatchSize) {
+    size_t end = min(begin + kBatchSize, pending_.size());
+    vector<const string*> paths;
+    for (size_t i = begin; i < end; ++i)
+      paths.push_back(&pending_[i]);
+
     if (config_.dry_run) {
-      if (FileExists(path))
-        Report(path);
+      vector<TimeStamp> mtimes;
+      disk_interface_->StatBatch(paths, &mtimes);
+      for (size_t i = 0; i < paths.size(); ++i) {
+        if (mtimes[i] > 0)
+          Report(*paths[i]);
+      }
     } else {
-      int ret = RemoveFile(path);
-      if (ret == 0)
-        Report(path);
-      else if (ret == -1)
-        status_ = 1;
+      vector<int> results;
+      disk_interface_->RemoveFileBatch(paths, &results);
+      for (size_t i = 0; i < paths.size(); ++i) {
+        if (results[i] == 0) {
+          Report(*paths[i]);
+          AddEmptyDirCandidate(*paths[i]);
+        } else if (results[i] == -1) {
+          status_ = 1;
+        }
+      }
     }
+    PrintProgress(end, pending_.size());
   }
+  pending_.clear();
+}
+
+void Cleaner::AddEmptyDirCandidate(const string& path) {
+  // Paths are canonical, so anything outside the build directory is
+  // either absolute or starts with "..".
+  if (path.empty() || path[0] == '/' || path.compare(0, 2, "..") == 0)
+    return;
+#ifdef _WIN32
+  if (path[0] == '\\' || (path.size() > 1 && path[1] == ':'))
+    return;
+#endif
+  string dir = DirName(path);
+  if (dir.empty())
+    return;
+  empty_dir_candidates_.insert(make_pair(dir.size(), dir));
+}
+
+void Cleaner::RemoveEmptyDirs() {
+  // A parent is shorter than its children, so it is only tried once they
+  // are gone.
+  while (!empty_dir_candidates_.empty()) {
+    set<pair<size_t, string> >::iterator deepest =
+        --empty_dir_candidates_.end();
+    string dir = deepest->second;
+    empty_dir_candidates_.erase(deepest);
+    int ret = disk_interface_->RemoveDir(dir);
+    if (ret == 0) {
+      if (IsVerbose())
+        printf("Remove %s/\n", dir.c_str());
+      AddEmptyDirCandidate(dir);
+    } else if (ret == -1) {
+      status_ = 1;
+    }
+  }
+}
+
+void Cleaner::PrintProgress(size_t done, size_t total) {
+  if (!smart_terminal_ || done == total)
+    return;
+  int64_t now = GetTimeMillis();
+  if (now - last_progress_millis_ < kProgressMillis)
+    return;
+  last_progress_millis_ = now;
+  printf("\rCleaning... [%d/%d]\x1B[K", (int)done, (int)total);
+  fflush(stdout);
+  progress_printed_ = true;
 }
 
 bool Cleaner::IsAlreadyRemoved(const string& path) {
@@ -93,6 +184,8 @@ void Cleaner::PrintHeader() {
 void Cleaner::PrintFooter() {
   if (config_.verbosity == BuildConfig::QUIET)
     return;
+  if (progress_printed_)
+    printf("\rCleaning... \x1B[K");
   printf("%d files.\n", cleaned_files_count_);
 }
 
@@ -112,8 +205,10 @@ int Cleaner::CleanAll(bool generator) {
       Remove((*out_node)->path());
     }
     if (!(*e)->rule().depfile().empty())
-      Remove((*e)->EvaluateDepFile());
+      Remove((*e)->EvaluateDepFileUncached());
   }
+  RemovePending();
+  RemoveEmptyDirs();
   PrintFooter();
   return status_;
 }
@@ -135,6 +230,8 @@ int Cleaner::CleanTarget(Node* target) {
   Reset();
   PrintHeader();
   DoCleanTarget(target);
+  RemovePending();
+  RemoveEmptyDirs();
   PrintFooter();
   return status_;
 }
@@ -163,11 +260,13 @@ int Cleaner::CleanTargets(int target_count, char* targets[]) {
       if (IsVerbose())
         printf("Target %s\n", target_name);
       DoCleanTarget(target);
+      RemovePending();
     } else {
       Error("unknown target '%s'", target_name);
       status_ = 1;
     }
   }
+  RemoveEmptyDirs();
   PrintFooter();
   return status_;
 }
@@ -192,6 +291,8 @@ int Cleaner::CleanRule(const Rule* rule) {
   Reset();
   PrintHeader();
   DoCleanRule(rule);
+  RemovePending();
+  RemoveEmptyDirs();
   PrintFooter();
   return status_;
 }
@@ -222,11 +323,13 @@ int Cleaner::CleanRules(int rule_count, char* rules[]) {
       if (IsVerbose())
         printf("Rule %s\n", rule_name);
       DoCleanRule(rule);
+      RemovePending();
     } else {
       Error("unknown rule '%s'", rule_name);
       status_ = 1;
     }
   }
+  RemoveEmptyDirs();
   PrintFooter();
   return status_;
 }
@@ -235,4 +338,7 @@ void Cleaner::Reset() {
   status_ = 0;
   cleaned_files_count_ = 0;
   removed_.clear();
+  pending_.clear();
+  empty_dir_candidates_.clear();
+  progress_printed_ = false;
 }
@@ -18,6 +18,8 @@
 
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "build.h"
 
@@ -76,14 +78,19 @@ class Cleaner {
   }
 
  private:
-  /// Remove the file @a path.
-  /// @return whether the file has been removed.
-  int RemoveFile(const string& path);
-  /// @returns whether the file @a path exists.
-  bool FileExists(const string& path);
   void Report(const string& path);
-  /// Remove the given @a path file only if it has not been already removed.
+  /// Queue the given @a path file for removal, unless it has already been.
   void Remove(const string& path);
+  /// Remove the files queued by Remove(), a batch at a time.
+  void RemovePending();
+  /// Note the directory containing @a path as possibly left empty.
+  void AddEmptyDirCandidate(const string& path);
+  /// Remove the directories noted by AddEmptyDirCandidate() that are now
+  /// empty, along with any parents this empties in turn.
+  void RemoveEmptyDirs();
+  /// Overprint the status line with how many of the @a total queued files
+  /// have been @a done, at most every kProgressMillis.
+  void PrintProgress(size_t done, size_t total);
   /// @return whether the given @a path has already been removed.
   bool IsAlreadyRemoved(const string& path);
   /// Helper recursive method for CleanTarget().
@@ -93,12 +100,23 @@ class Cleaner {
   void DoCleanRule(const Rule* rule);
   void Reset();
 
+  /// The same rate BuildStatus refreshes its status line at.
+  static const int kProgressMillis = 100;
+
   State* state_;
   const BuildConfig& config_;
   set<string> removed_;
+  /// Files passed to Remove() but not yet removed.
+  vector<string> pending_;
+  /// Directories to try removing, keyed by length so that the deepest
+  /// ones come last.
+  set<pair<size_t, string> > empty_dir_candidates_;
   int cleaned_files_count_;
   DiskInterface* disk_interface_;
   int status_;
+  bool smart_terminal_;
+  bool progress_printed_;
+  int64_t last_progress_millis_;
 };
 
 #endif  // NINJA_CLEAN_H_
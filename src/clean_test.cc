@@ -249,6 +249,46 @@ TEST_F(CleanTest, CleanDepFile) {
   EXPECT_EQ(2u, fs_.files_removed_.size());
 }
 
+TEST_F(CleanTest, CleanEmptyDirs) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out/a/x: cat src1\n"
+"build out/b/y: cat src1\n"
+"build gen/z: cat src1\n"));
+  fs_.MakeDir("out");
+  fs_.MakeDir("out/a");
+  fs_.MakeDir("out/b");
+  fs_.MakeDir("gen");
+  fs_.Create("out/a/x", 1, "");
+  fs_.Create("out/b/y", 1, "");
+  fs_.Create("gen/z", 1, "");
+  fs_.Create("gen/notes", 1, "");
+
+  Cleaner cleaner(&state_, config_, &fs_);
+  EXPECT_EQ(0, cleaner.CleanAll());
+  EXPECT_EQ(3, cleaner.cleaned_files_count());
+
+  // Directories left empty go, parents included; others stay.
+  EXPECT_EQ(3u, fs_.directories_removed_.size());
+  EXPECT_EQ(1u, fs_.directories_removed_.count("out"));
+  EXPECT_EQ(1u, fs_.directories_removed_.count("out/a"));
+  EXPECT_EQ(1u, fs_.directories_removed_.count("out/b"));
+  EXPECT_EQ(0u, fs_.directories_removed_.count("gen"));
+}
+
+TEST_F(CleanTest, CleanEmptyDirsDryRun) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out/x: cat src1\n"));
+  fs_.MakeDir("out");
+  fs_.Create("out/x", 1, "");
+
+  config_.dry_run = true;
+  Cleaner cleaner(&state_, config_, &fs_);
+  EXPECT_EQ(0, cleaner.CleanAll());
+  EXPECT_EQ(1, cleaner.cleaned_files_count());
+  EXPECT_EQ(0u, fs_.files_removed_.size());
+  EXPECT_EQ(0u, fs_.directories_removed_.size());
+}
+
 TEST_F(CleanTest, CleanFailure) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
                                       "build dir: cat src1\n"));
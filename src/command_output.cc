@@ -0,0 +1,162 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "command_output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+namespace {
+
+/// Create a new spill file in \a dir, readable only by the user, and
+/// store its name in \a path.  The directory may be shared, so the file
+/// must not exist yet (nor be a symlink planted there).  Returns NULL on
+/// failure.
+FILE* OpenSpillFile(const string& dir, string* path) {
+#ifdef _WIN32
+  static int count = 0;
+  for (int tries = 0; tries < 100; ++tries) {
+    char name[64];
+    snprintf(name, sizeof(name), "/ninja-output-%lu-%d.txt",
+             GetCurrentProcessId(), ++count);
+    *path = dir + name;
+    int fd = _open(path->c_str(), _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY,
+                   _S_IREAD | _S_IWRITE);
+    if (fd >= 0)
+      return _fdopen(fd, "wb");
+    if (errno != EEXIST)
+      break;
+  }
+  return NULL;
+#else
+  // mkstemp() creates the file with O_EXCL and mode 0600.
+  string name = dir + "/ninja-output-XXXXXX";
+  int fd = mkstemp(&name[0]);
+  if (fd < 0)
+    return NULL;
+  *path = name;
+  return fdopen(fd, "wb");
+#endif
+}
+
+}  // namespace
+
+CommandOutput::CommandOutput()
+    : truncated_(false), dropped_(0), reserved_from_(0), limit_(0),
+      spill_(NULL), stream_(NULL) {}
+
+CommandOutput::~CommandOutput() {
+  if (spill_)
+    fclose(spill_);
+}
+
+void CommandOutput::SetLimit(size_t limit, const string& spill_dir) {
+  limit_ = limit;
+  spill_dir_ = spill_dir;
+}
+
+char* CommandOutput::Reserve(size_t size) {
+  reserved_from_ = buf_.size();
+  buf_.resize(reserved_from_ + size);
+  return &buf_[reserved_from_];
+}
+
+void CommandOutput::Commit(size_t len) {
+  buf_.resize(reserved_from_ + len);
+  if (stream_) {
+    fwrite(buf_.data(), 1, buf_.size(), stream_);
+    fflush(stream_);
+    buf_.clear();
+    return;
+  }
+  if (spill_)
+    fwrite(buf_.data() + reserved_from_, 1, len, spill_);
+  if (!limit_ || head_.size() + buf_.size() <= limit_)
+    return;
+
+  if (!truncated_) {
+    // First time over: keep the first half of the limit for good.
+    truncated_ = true;
+    if (!spill_dir_.empty()) {
+      spill_ = OpenSpillFile(spill_dir_, &spill_path_);
+      if (spill_)
+        fwrite(buf_.data(), 1, buf_.size(), spill_);
+      else
+        spill_path_.clear();
+    }
+    head_.assign(buf_, 0, limit_ / 2);
+    buf_.erase(0, limit_ / 2);
+  }
+  // Let the tail grow to twice its size between trims, so that each
+  // byte is moved about once.
+  if (buf_.size() > 2 * TailSize())
+    Trim();
+}
+
+void CommandOutput::Append(const char* data, size_t len) {
+  memcpy(Reserve(len), data, len);
+  Commit(len);
+}
+
+void CommandOutput::Trim() {
+  size_t tail = TailSize();
+  if (buf_.size() > tail) {
+    dropped_ += buf_.size() - tail;
+    buf_.erase(0, buf_.size() - tail);
+  }
+}
+
+void CommandOutput::Stream(FILE* out) {
+  Finish();
+  fwrite(buf_.data(), 1, buf_.size(), out);
+  fflush(out);
+  buf_.clear();
+  stream_ = out;
+}
+
+void CommandOutput::Finish() {
+  if (!truncated_)
+    return;
+  truncated_ = false;
+  Trim();
+  if (spill_) {
+    fclose(spill_);
+    spill_ = NULL;
+  }
+
+  char note[64];
+  snprintf(note, sizeof(note), "\n[... %lu bytes omitted",
+           (unsigned long)dropped_);
+  string output = head_ + note;
+  if (!spill_path_.empty())
+    output += "; full output in " + spill_path_;
+  output += " ...]\n";
+  output += buf_;
+  buf_.swap(output);
+  head_.clear();
+  dropped_ = 0;
+}
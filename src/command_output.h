@@ -0,0 +1,79 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_COMMAND_OUTPUT_H_
+#define NINJA_COMMAND_OUTPUT_H_
+
+#include <stdio.h>
+
+#include <string>
+using namespace std;
+
+/// Collects what a command prints.  Past a limit only the beginning and
+/// the end are kept in memory, so that a command printing hundreds of
+/// megabytes doesn't bloat Ninja; the whole output can be spilled to a
+/// file instead.  It can also be passed through to a stream as it
+/// arrives.
+struct CommandOutput {
+  CommandOutput();
+  ~CommandOutput();
+
+  /// Keep at most about \a limit bytes (0 for no limit).  If \a spill_dir
+  /// isn't empty, the whole output of a command exceeding the limit is
+  /// written to a file in it.
+  void SetLimit(size_t limit, const string& spill_dir);
+
+  /// Return space for up to \a size more bytes, to be followed by
+  /// Commit() of the number actually written there.
+  char* Reserve(size_t size);
+  void Commit(size_t len);
+  void Append(const char* data, size_t len);
+
+  /// Write the output so far to \a out, and anything appended later as
+  /// it arrives, rather than keeping it.
+  void Stream(FILE* out);
+  bool streaming() const { return stream_ != NULL; }
+
+  /// Stop collecting.  Where output was dropped, a note saying how much
+  /// (and where to find it, if spilled) takes its place.
+  void Finish();
+
+  /// The output collected so far.
+  const string& str() const { return buf_; }
+
+ private:
+  /// How much of the end of the output to keep once over the limit.
+  size_t TailSize() const { return limit_ - limit_ / 2; }
+  /// Drop all of buf_ but the last TailSize() bytes.
+  void Trim();
+
+  /// Everything so far, or once over the limit the latest of it.
+  string buf_;
+  /// Whether the output went over the limit.
+  bool truncated_;
+  /// Once over the limit, the start of the output.
+  string head_;
+  /// Bytes dropped between head_ and buf_.
+  size_t dropped_;
+  /// The size of buf_ before the last Reserve().
+  size_t reserved_from_;
+  size_t limit_;
+  string spill_dir_;
+  string spill_path_;
+  FILE* spill_;
+  FILE* stream_;
+};
+
+#endif  // NINJA_COMMAND_OUTPUT_H_
@@ -0,0 +1,96 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "command_output.h"
+
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "test.h"
+#include "util.h"
+
+namespace {
+
+TEST(CommandOutputTest, NoLimit) {
+  CommandOutput output;
+  output.Append("hello ", 6);
+  strcpy(output.Reserve(16), "world");
+  output.Commit(5);
+  output.Finish();
+  EXPECT_EQ("hello world", output.str());
+}
+
+TEST(CommandOutputTest, KeepsHeadAndTail) {
+  CommandOutput output;
+  output.SetLimit(10, "");
+  output.Append("0123456789", 10);
+  EXPECT_EQ("0123456789", output.str());
+  for (int i = 0; i < 100; ++i)
+    output.Append("abcd", 4);
+  output.Append("end", 3);
+  output.Finish();
+  EXPECT_EQ("01234\n[... 403 bytes omitted ...]\ncdend", output.str());
+}
+
+TEST(CommandOutputTest, Spill) {
+  CommandOutput output;
+  output.SetLimit(4, ".");
+  output.Append("abc", 3);
+  output.Append("defgh", 5);
+  output.Append("ijk", 3);
+  output.Finish();
+
+  const string& str = output.str();
+  string::size_type start = str.find("full output in ");
+  ASSERT_NE(string::npos, start);
+  start += strlen("full output in ");
+  string path = str.substr(start, str.find(" ...]") - start);
+  EXPECT_EQ("ab\n[... 7 bytes omitted; full output in " + path +
+            " ...]\njk", str);
+
+  string contents, err;
+  ASSERT_EQ(0, ReadFile(path, &contents, &err));
+  EXPECT_EQ("abcdefghijk", contents);
+#ifndef _WIN32
+  // The spill directory may be shared, so only the user may read it.
+  struct stat st;
+  ASSERT_EQ(0, stat(path.c_str(), &st));
+  EXPECT_EQ(0600, (int)(st.st_mode & 0777));
+#endif
+  unlink(path.c_str());
+}
+
+TEST(CommandOutputTest, Stream) {
+  FILE* out = tmpfile();
+  ASSERT_TRUE(out != NULL);
+  CommandOutput output;
+  output.Append("before\n", 7);
+  output.Stream(out);
+  EXPECT_TRUE(output.streaming());
+  output.Append("after\n", 6);
+  output.Finish();
+  EXPECT_EQ("", output.str());
+
+  char buf[64];
+  rewind(out);
+  size_t len = fread(buf, 1, sizeof(buf), out);
+  EXPECT_EQ("before\nafter\n", string(buf, len));
+  fclose(out);
+}
+
+}  // namespace
@@ -14,6 +14,8 @@
 
 #include "depfile_parser.h"
 
+#include "byte_scan.h"
+
 // A note on backslashes in Makefiles, from reading the docs:
 // Backslash-newline is the line continuation character.
 // Backslash-# escapes a # (otherwise meaningful as a comment start).
@@ -40,6 +42,16 @@ bool DepfileParser::Parse(string* content, string* err) {
     // filename: start of the current parsed filename.
     char* filename = out;
     for (;;) {
+      // Move runs of plain path characters in bulk, as below; the state
+      // machine only has to deal with what ends them.
+      char* text_end = const_cast<char*>(SkipDepfilePathChars(in, end));
+      if (text_end != in) {
+        int len = text_end - in;
+        if (out < in)
+          memmove(out, in, len);
+        out += len;
+        in = text_end;
+      }
       // start: beginning of the current parsed span.
       const char* start = in;
       /*!re2c
@@ -0,0 +1,372 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "deps_log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+const char kFileSignature[] = "# ninjadeps\n";
+const int kSignatureSize = sizeof(kFileSignature) - 1;
+const int kCurrentVersion = 1;
+/// Signature plus version; keeps all records 4-byte aligned.
+const int kHeaderSize = kSignatureSize + 4;
+
+/// Record size is limited so a corrupt size field can't make us walk off
+/// into the weeds.
+const unsigned kMaxRecordSize = (1 << 19) - 1;
+const unsigned kDepsRecordFlag = 0x80000000;
+
+}  // namespace
+
+DepsLog::DepsLog() : file_(NULL), needs_recompaction_(false) {}
+
+DepsLog::~DepsLog() {
+  Close();
+  for (vector<int*>::iterator i = owned_ids_.begin();
+       i != owned_ids_.end(); ++i) {
+    delete [] *i;
+  }
+}
+
+bool DepsLog::OpenForWrite(const string& path, string* err) {
+  if (needs_recompaction_) {
+    if (!Recompact(path, err))
+      return false;
+  }
+
+  file_ = fopen(path.c_str(), "ab");
+  if (!file_) {
+    *err = strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(fileno(file_));
+
+  // Opening a file in append mode doesn't set the file pointer to the
+  // file's end on all platforms; do so explicitly.
+  fseek(file_, 0, SEEK_END);
+
+  if (ftell(file_) == 0) {
+    int version = kCurrentVersion;
+    if (fwrite(kFileSignature, kSignatureSize, 1, file_) < 1 ||
+        fwrite(&version, 4, 1, file_) < 1) {
+      *err = strerror(errno);
+      return false;
+    }
+  }
+  fflush(file_);
+
+  return true;
+}
+
+bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
+                         const vector<Node*>& nodes) {
+  // Track whether there's any new data to be recorded.
+  bool made_change = false;
+
+  // Assign ids to all nodes that are missing one.
+  if (node->id() < 0) {
+    if (!RecordId(node))
+      return false;
+    made_change = true;
+  }
+  for (vector<Node*>::const_iterator i = nodes.begin();
+       i != nodes.end(); ++i) {
+    if ((*i)->id() < 0) {
+      if (!RecordId(*i))
+        return false;
+      made_change = true;
+    }
+  }
+
+  // See if the new data is different than the existing data, if any.
+  if (!made_change) {
+    const Deps* deps = GetDeps(node);
+    if (!deps || deps->mtime != mtime ||
+        deps->node_count != (int)nodes.size()) {
+      made_change = true;
+    } else {
+      for (int i = 0; i < (int)nodes.size(); ++i) {
+        if (deps->node_ids[i] != nodes[i]->id()) {
+          made_change = true;
+          break;
+        }
+      }
+    }
+  }
+
+  // Don't write anything if there's no new info.
+  if (!made_change)
+    return true;
+
+  int* ids = new int[nodes.size() + 1];
+  owned_ids_.push_back(ids);
+  for (int i = 0; i < (int)nodes.size(); ++i)
+    ids[i] = nodes[i]->id();
+
+  if (file_) {
+    unsigned size = 4 * (2 + nodes.size());
+    if (size > kMaxRecordSize) {
+      errno = ERANGE;
+      return false;
+    }
+    size |= kDepsRecordFlag;
+    int id = node->id();
+    if (fwrite(&size, 4, 1, file_) < 1 ||
+        fwrite(&id, 4, 1, file_) < 1 ||
+        fwrite(&mtime, 4, 1, file_) < 1 ||
+        (!nodes.empty() && fwrite(ids, 4, nodes.size(), file_) < 1)) {
+      return false;
+    }
+    fflush(file_);
+  }
+
+  Deps deps;
+  deps.mtime = mtime;
+  deps.node_count = nodes.size();
+  deps.node_ids = ids;
+  UpdateDeps(node->id(), deps);
+
+  return true;
+}
+
+void DepsLog::Close() {
+  if (file_)
+    fclose(file_);
+  file_ = NULL;
+}
+
+bool DepsLog::Load(const string& path, State* state, string* err) {
+  METRIC_RECORD(".ninja_deps load");
+  int ret = mapped_.Open(path, err);
+  if (ret == -ENOENT) {
+    err->clear();
+    return true;
+  }
+  if (ret < 0)
+    return false;
+
+  const char* data = mapped_.data();
+  size_t size = mapped_.size();
+  if (size == 0)
+    return true;
+
+  int version = 0;
+  if (size >= (size_t)kHeaderSize)
+    memcpy(&version, data + kSignatureSize, 4);
+  if (size < (size_t)kHeaderSize ||
+      memcmp(data, kFileSignature, kSignatureSize) != 0 ||
+      version != kCurrentVersion) {
+    // An unknown or older format; there's nothing we can recover, so
+    // start over with an empty log.
+    mapped_.Close();
+    unlink(path.c_str());
+    return true;
+  }
+
+  int unique_dep_record_count = 0;
+  int total_dep_record_count = 0;
+  size_t offset = kHeaderSize;
+  bool read_failed = false;
+  while (offset + 4 <= size) {
+    unsigned record_size;
+    memcpy(&record_size, data + offset, 4);
+    bool is_deps = (record_size & kDepsRecordFlag) != 0;
+    record_size &= ~kDepsRecordFlag;
+    if (record_size > kMaxRecordSize || record_size % 4 != 0 ||
+        record_size > size - offset - 4) {
+      read_failed = true;
+      break;
+    }
+
+    const int* fields = (const int*)(data + offset + 4);
+    int field_count = record_size / 4;
+    if (is_deps) {
+      if (field_count < 2) {
+        read_failed = true;
+        break;
+      }
+      int out_id = fields[0];
+      bool ids_valid = out_id >= 0 && out_id < (int)nodes_.size();
+      for (int i = 2; ids_valid && i < field_count; ++i)
+        ids_valid = fields[i] >= 0 && fields[i] < (int)nodes_.size();
+      if (!ids_valid) {
+        read_failed = true;
+        break;
+      }
+
+      if (out_id >= (int)deps_.size() || deps_[out_id].node_count < 0)
+        ++unique_dep_record_count;
+      ++total_dep_record_count;
+
+      Deps deps;
+      deps.mtime = fields[1];
+      deps.node_count = field_count - 2;
+      deps.node_ids = fields + 2;
+      UpdateDeps(out_id, deps);
+    } else {
+      if (field_count < 1) {
+        read_failed = true;
+        break;
+      }
+      const char* path = data + offset + 4;
+      int path_size = record_size - 4;
+      // Strip the padding.
+      while (path_size > 0 && path[path_size - 1] == '\0')
+        --path_size;
+
+      int expected_id = nodes_.size();
+      Node* node = state->GetNode(StringPiece(path, path_size));
+      if (fields[field_count - 1] != ~expected_id || node->id() >= 0) {
+        read_failed = true;
+        break;
+      }
+      node->set_id(expected_id);
+      nodes_.push_back(node);
+    }
+    offset += 4 + record_size;
+  }
+
+  if (read_failed || offset != size) {
+    // A crash while writing a record leaves a partial record at the end
+    // of the file; everything before it is still usable.  Rewrite the
+    // log on open so new records don't land after the garbage.
+    needs_recompaction_ = true;
+    return true;
+  }
+
+  METRIC_COUNT(".ninja_deps records loaded", total_dep_record_count);
+
+  // Rebuild the log if there are too many dead records.
+  const int kMinCompactionEntryCount = 1000;
+  const int kCompactionRatio = 3;
+  if (total_dep_record_count > kMinCompactionEntryCount &&
+      total_dep_record_count > unique_dep_record_count * kCompactionRatio) {
+    needs_recompaction_ = true;
+  }
+
+  return true;
+}
+
+const DepsLog::Deps* DepsLog::GetDeps(Node* node) const {
+  int id = node->id();
+  if (id < 0 || id >= (int)deps_.size() || deps_[id].node_count < 0)
+    return NULL;
+  return &deps_[id];
+}
+
+bool DepsLog::Recompact(const string& path, string* err) {
+  METRIC_RECORD(".ninja_deps recompact");
+  printf("Recompacting deps...\n");
+
+  Close();
+  string temp_path = path + ".recompact";
+
+  // OpenForWrite() opens for append.  Make sure it's not appending to a
+  // left-over file from a previous recompaction attempt that crashed.
+  unlink(temp_path.c_str());
+
+  DepsLog new_log;
+  if (!new_log.OpenForWrite(temp_path, err))
+    return false;
+
+  // Clear all known ids so that new ones can be reassigned.  The new log
+  // assigns ids in the order it sees them.
+  for (vector<Node*>::iterator i = nodes_.begin(); i != nodes_.end(); ++i)
+    (*i)->set_id(-1);
+
+  for (int old_id = 0; old_id < (int)deps_.size(); ++old_id) {
+    const Deps& deps = deps_[old_id];
+    if (deps.node_count < 0)
+      continue;
+
+    // Outputs that are no longer built by any edge don't need their
+    // dependencies anymore.
+    Node* node = nodes_[old_id];
+    if (!node->in_edge())
+      continue;
+
+    vector<Node*> inputs;
+    for (int i = 0; i < deps.node_count; ++i)
+      inputs.push_back(nodes_[deps.node_ids[i]]);
+    if (!new_log.RecordDeps(node, deps.mtime, inputs)) {
+      *err = strerror(errno);
+      return false;
+    }
+  }
+  new_log.Close();
+
+  // All nodes now have ids that refer to the new log, so adopt its data.
+  // The new log takes our old storage with it when it goes away.
+  nodes_.swap(new_log.nodes_);
+  deps_.swap(new_log.deps_);
+  owned_ids_.swap(new_log.owned_ids_);
+  mapped_.Close();
+  needs_recompaction_ = false;
+
+  if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  return true;
+}
+
+bool DepsLog::RecordId(Node* node) {
+  int path_size = node->path().size();
+  int padding = (4 - path_size % 4) % 4;  // Pad path to 4 byte boundary.
+  unsigned size = path_size + padding + 4;
+  if (size > kMaxRecordSize) {
+    errno = ERANGE;
+    return false;
+  }
+
+  int id = nodes_.size();
+  if (file_) {
+    int checksum = ~id;
+    if (fwrite(&size, 4, 1, file_) < 1 ||
+        fwrite(node->path().data(), path_size, 1, file_) < 1 ||
+        (padding && fwrite("\0\0", padding, 1, file_) < 1) ||
+        fwrite(&checksum, 4, 1, file_) < 1) {
+      return false;
+    }
+  }
+
+  node->set_id(id);
+  nodes_.push_back(node);
+  return true;
+}
+
+void DepsLog::UpdateDeps(int out_id, const Deps& deps) {
+  if (out_id >= (int)deps_.size())
+    deps_.resize(out_id + 1);
+  deps_[out_id] = deps;
+}
@@ -0,0 +1,106 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_DEPS_LOG_H_
+#define NINJA_DEPS_LOG_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <stdio.h>
+
+#include "timestamp.h"
+#include "util.h"
+
+struct Node;
+struct State;
+
+/// As build commands run they can output extra dependency information
+/// (e.g. header dependencies for C source) via a depfile.  Rules marked
+/// with "deps = gcc" have their depfile ingested into this log once the
+/// command finishes, so later runs can recover the dependencies without
+/// reading and parsing the depfiles again.
+///
+/// The on-disk format is a header followed by a series of records, each
+/// starting with a 4-byte size.  If the high bit of the size is set the
+/// record is a dependency list, otherwise it is a path.
+///
+/// A path record assigns the next free id to a path.  Its payload is
+/// the path, padded with NULs to a 4-byte boundary, followed by the
+/// one's complement of the id as a checksum.
+///
+/// A dependency record's payload is the id of the output, its mtime as
+/// of when the record was written, and then the ids of its inputs.  All
+/// fields are 4-byte integers, so the loader can point straight into the
+/// mapped file.
+///
+/// Records are only ever appended; the last record for a given output
+/// wins.  Once enough stale records accumulate the log is recompacted.
+struct DepsLog {
+  DepsLog();
+  ~DepsLog();
+
+  // Writing (build-time) interface.
+  bool OpenForWrite(const string& path, string* err);
+  bool RecordDeps(Node* node, TimeStamp mtime, const vector<Node*>& nodes);
+  void Close();
+
+  // Reading (startup-time) interface.
+  struct Deps {
+    Deps() : mtime(-1), node_count(-1), node_ids(NULL) {}
+    TimeStamp mtime;
+    /// Number of inputs, or -1 if nothing has been recorded.
+    int node_count;
+    /// Ids of the inputs; points into the mapped log or into storage
+    /// owned by the DepsLog.
+    const int* node_ids;
+  };
+  bool Load(const string& path, State* state, string* err);
+
+  /// Return the dependencies recorded for \a node, or NULL if none.
+  const Deps* GetDeps(Node* node) const;
+
+  /// Return the node with the given id.
+  Node* node(int id) const { return nodes_[id]; }
+
+  /// Rewrite the log keeping only the latest record for each output that
+  /// is still produced by an edge.
+  bool Recompact(const string& path, string* err);
+
+  const vector<Node*>& nodes() const { return nodes_; }
+
+ private:
+  friend struct MemoryStats;
+
+  /// Write a path record for \a node, assigning it the next id.
+  bool RecordId(Node* node);
+  /// Store \a deps as the latest dependencies for \a out_id.
+  void UpdateDeps(int out_id, const Deps& deps);
+
+  FILE* file_;
+  bool needs_recompaction_;
+
+  /// Maps id -> Node.
+  vector<Node*> nodes_;
+  /// Maps id -> latest deps of that node.
+  vector<Deps> deps_;
+
+  /// The loaded log; Deps loaded from disk point into it.
+  MappedFile mapped_;
+  /// Id arrays for Deps recorded during this run.
+  vector<int*> owned_ids_;
+};
+
+#endif  // NINJA_DEPS_LOG_H_
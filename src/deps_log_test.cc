@@ -0,0 +1,304 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "deps_log.h"
+
+#include "graph.h"
+#include "test.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <share.h>
+#endif
+
+#ifdef linux
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char kTestFilename[] = "DepsLogTest-tempfile";
+
+struct DepsLogTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    // In case a crashing test left a stale file behind.
+    unlink(kTestFilename);
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+
+  /// Return the size of the test file, or -1 if it doesn't exist.
+  int FileSize() {
+    struct stat st;
+    if (stat(kTestFilename, &st) < 0)
+      return -1;
+    return (int)st.st_size;
+  }
+};
+
+TEST_F(DepsLogTest, WriteRead) {
+  string err;
+  {
+    DepsLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state_.GetNode("foo.h"));
+    deps.push_back(state_.GetNode("bar.h"));
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("out.o"), 1, deps));
+
+    deps.clear();
+    deps.push_back(state_.GetNode("foo.h"));
+    deps.push_back(state_.GetNode("bar2.h"));
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("out2.o"), 2, deps));
+
+    const DepsLog::Deps* log_deps = log.GetDeps(state_.GetNode("out.o"));
+    ASSERT_TRUE(log_deps);
+    ASSERT_EQ(1, log_deps->mtime);
+    ASSERT_EQ(2, log_deps->node_count);
+    log.Close();
+  }
+
+  State state;
+  DepsLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(5u, log.nodes().size());
+
+  const DepsLog::Deps* deps = log.GetDeps(state.LookupNode("out2.o"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(2, deps->mtime);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("foo.h", log.node(deps->node_ids[0])->path());
+  EXPECT_EQ("bar2.h", log.node(deps->node_ids[1])->path());
+
+  EXPECT_FALSE(log.GetDeps(state.LookupNode("foo.h")));
+}
+
+// Rewriting the same deps shouldn't grow the log.
+TEST_F(DepsLogTest, DoubleEntry) {
+  string err;
+  int file_size;
+  {
+    DepsLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state_.GetNode("foo.h"));
+    deps.push_back(state_.GetNode("bar.h"));
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("out.o"), 1, deps));
+    log.Close();
+    file_size = FileSize();
+    ASSERT_GT(file_size, 0);
+  }
+
+  State state;
+  DepsLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  vector<Node*> deps;
+  deps.push_back(state.GetNode("foo.h"));
+  deps.push_back(state.GetNode("bar.h"));
+  EXPECT_TRUE(log.RecordDeps(state.GetNode("out.o"), 1, deps));
+  log.Close();
+
+  ASSERT_EQ(file_size, FileSize());
+}
+
+// Recompaction keeps only the latest record of outputs that are still built.
+TEST_F(DepsLogTest, Recompact) {
+  AssertParse(&state_,
+"rule cc\n"
+"  command = cc\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"build out.o: cc\n"
+"build other_out.o: cc\n");
+
+  string err;
+  {
+    DepsLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state_.GetNode("foo.h"));
+    deps.push_back(state_.GetNode("bar.h"));
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("out.o"), 1, deps));
+    deps.clear();
+    deps.push_back(state_.GetNode("foo.h"));
+    deps.push_back(state_.GetNode("baz.h"));
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("other_out.o"), 1, deps));
+    // Overwrite the first record.
+    deps.clear();
+    deps.push_back(state_.GetNode("foo.h"));
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("out.o"), 2, deps));
+    // Not an output of any edge; dropped by recompaction.
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("gone.o"), 3, deps));
+    log.Close();
+  }
+  int file_size = FileSize();
+  ASSERT_GT(file_size, 0);
+
+  // Reload the manifest so the loaded log sees fresh nodes.
+  State state;
+  AssertParse(&state,
+"rule cc\n"
+"  command = cc\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"build out.o: cc\n"
+"build other_out.o: cc\n");
+
+  DepsLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  ASSERT_TRUE(log.Recompact(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_LT(FileSize(), file_size);
+
+  const DepsLog::Deps* deps = log.GetDeps(state.LookupNode("out.o"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(2, deps->mtime);
+  ASSERT_EQ(1, deps->node_count);
+  EXPECT_EQ("foo.h", log.node(deps->node_ids[0])->path());
+  EXPECT_FALSE(log.GetDeps(state.LookupNode("gone.o")));
+
+  // The in-memory ids must match the rewritten file.
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+  deps = log2.GetDeps(state2.LookupNode("other_out.o"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("baz.h", log2.node(deps->node_ids[1])->path());
+  EXPECT_FALSE(state2.LookupNode("gone.o"));
+  EXPECT_EQ(log.nodes().size(), log2.nodes().size());
+}
+
+// Loading a truncated log must not fail, and must recover what it can.
+TEST_F(DepsLogTest, Truncated) {
+  string err;
+  {
+    DepsLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state_.GetNode("foo.h"));
+    deps.push_back(state_.GetNode("bar.h"));
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("out.o"), 1, deps));
+    deps.clear();
+    deps.push_back(state_.GetNode("foo.h"));
+    deps.push_back(state_.GetNode("bar2.h"));
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("out2.o"), 2, deps));
+    log.Close();
+  }
+
+  int node_count = 5;
+  int deps_count = 2;
+  for (int size = FileSize(); size > 0; --size) {
+#ifndef _WIN32
+    ASSERT_EQ(0, truncate(kTestFilename, size));
+#else
+    int fh;
+    fh = _sopen(kTestFilename, _O_RDWR | _O_CREAT, _SH_DENYNO, _S_IREAD | _S_IWRITE);
+    ASSERT_EQ(0, _chsize(fh, size));
+    _close(fh);
+#endif
+
+    State state;
+    DepsLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+
+    // A log without a complete header is discarded.
+    if (FileSize() < 0) {
+      ASSERT_EQ(0u, log.nodes().size());
+      break;
+    }
+
+    // Truncating can only lose records, never invent them.
+    ASSERT_GE(node_count, (int)log.nodes().size());
+    node_count = log.nodes().size();
+
+    int new_deps_count = 0;
+    for (int i = 0; i < node_count; ++i) {
+      if (log.GetDeps(log.node(i)))
+        ++new_deps_count;
+    }
+    ASSERT_GE(deps_count, new_deps_count);
+    deps_count = new_deps_count;
+  }
+}
+
+// A log with a truncated final record is rewritten when opened for writing,
+// so new records don't land after the garbage.
+TEST_F(DepsLogTest, TruncatedRecovery) {
+  string err;
+  {
+    DepsLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state_.GetNode("foo.h"));
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("out.o"), 1, deps));
+    deps.clear();
+    deps.push_back(state_.GetNode("bar.h"));
+    EXPECT_TRUE(log.RecordDeps(state_.GetNode("out2.o"), 2, deps));
+    log.Close();
+  }
+
+  // Chop off the tail of the last record.
+  ASSERT_EQ(0, truncate(kTestFilename, FileSize() - 2));
+
+  {
+    State state;
+    AssertParse(&state,
+"rule cc\n"
+"  command = cc\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"build out.o out2.o: cc\n");
+    DepsLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(log.GetDeps(state.LookupNode("out.o")));
+    EXPECT_FALSE(log.GetDeps(state.LookupNode("out2.o")));
+
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("bar.h"));
+    EXPECT_TRUE(log.RecordDeps(state.GetNode("out2.o"), 3, deps));
+    log.Close();
+  }
+
+  State state;
+  DepsLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.GetDeps(state.LookupNode("out.o")));
+  const DepsLog::Deps* deps = log.GetDeps(state.LookupNode("out2.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(3, deps->mtime);
+}
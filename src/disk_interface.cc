@@ -14,38 +14,213 @@
 
 #include "disk_interface.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 
 #ifdef _WIN32
+#include <ctype.h>
+#include <direct.h>  // _rmdir
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #endif
 
+#include "metrics.h"
+#include "threads.h"
 #include "util.h"
 
 namespace {
 
-string DirName(const string& path) {
+/// Stats a slice of a batch on behalf of RealDiskInterface::StatBatch().
+struct StatTask : public ParallelTask {
+  StatTask(RealDiskInterface* disk_interface,
+           const vector<const string*>& paths, vector<TimeStamp>* mtimes)
+      : disk_interface_(disk_interface), paths_(paths), mtimes_(mtimes) {}
+
+  virtual void Run(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      (*mtimes_)[i] = disk_interface_->Stat(*paths_[i]);
+  }
+
+  RealDiskInterface* disk_interface_;
+  const vector<const string*>& paths_;
+  vector<TimeStamp>* mtimes_;
+};
+
+/// Creates a slice of a batch on behalf of
+/// RealDiskInterface::MakeDirBatch().
+struct MakeDirTask : public ParallelTask {
+  MakeDirTask(RealDiskInterface* disk_interface,
+              const vector<const string*>& paths, vector<int>* results)
+      : disk_interface_(disk_interface), paths_(paths), results_(results) {}
+
+  virtual void Run(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      (*results_)[i] = disk_interface_->MakeDir(*paths_[i]);
+  }
+
+  RealDiskInterface* disk_interface_;
+  const vector<const string*>& paths_;
+  vector<int>* results_;
+};
+
+/// Removes a slice of a batch on behalf of
+/// RealDiskInterface::RemoveFileBatch().
+struct RemoveTask : public ParallelTask {
+  RemoveTask(RealDiskInterface* disk_interface,
+             const vector<const string*>& paths, vector<int>* results)
+      : disk_interface_(disk_interface), paths_(paths), results_(results) {}
+
+  virtual void Run(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      (*results_)[i] = disk_interface_->RemoveFile(*paths_[i]);
+  }
+
+  RealDiskInterface* disk_interface_;
+  const vector<const string*>& paths_;
+  vector<int>* results_;
+};
+
 #ifdef _WIN32
-  const char kPathSeparator = '\\';
-#else
-  const char kPathSeparator = '/';
-#endif
+/// Split \a path into the directory to list and the name to look up in
+/// it.  Returns false if there's no name to look up, e.g. for "C:\\" or
+/// "dir/..", which are then best stat()ed on their own.
+bool SplitPath(const string& path, string* dir, string* name) {
+  *dir = DirName(path);
+  if (dir->empty())
+    *dir = ".";
+  else if ((*dir)[dir->size() - 1] == ':')
+    *dir += path[dir->size()];  // Keep the root's slash.
+  *name = path.substr(path.find_last_of("/\\") + 1);
+  return !name->empty() && *name != "." && *name != "..";
+}
+
+/// Paths are case-insensitive and either slash will do; the cache's keys
+/// are normalized accordingly.
+string CacheKey(string path) {
+  for (size_t i = 0; i < path.size(); ++i)
+    path[i] = path[i] == '\\' ? '/' : tolower(path[i]);
+  return path;
+}
+
+/// Convert a FILETIME to a TimeStamp.
+TimeStamp TimeStampFromFileTime(const FILETIME& filetime) {
+  // FILETIME is in 100-nanosecond increments since the Windows epoch.
+  // We don't much care about epoch correctness but we do want the
+  // resulting value to fit in an integer.
+  uint64_t mtime = ((uint64_t)filetime.dwHighDateTime << 32) |
+    ((uint64_t)filetime.dwLowDateTime);
+  mtime /= 1000000000LL / 100; // 100ns -> s.
+  mtime -= 12622770400LL;  // 1600 epoch -> 2000 epoch (subtract 400 years).
+  return (TimeStamp)mtime;
+}
+
+TimeStamp StatSingleFile(const string& path) {
+  WIN32_FILE_ATTRIBUTE_DATA attrs;
+  if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &attrs)) {
+    DWORD err = GetLastError();
+    if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND)
+      return 0;
+    Error("GetFileAttributesEx(%s): %s", path.c_str(),
+          GetLastErrorString().c_str());
+    return -1;
+  }
+  return TimeStampFromFileTime(attrs.ftLastWriteTime);
+}
+
+/// Read the modification time of every entry of \a dir into \a stamps,
+/// by lowercased name.  A missing directory has no entries.
+bool StatAllFilesInDir(const string& dir, map<string, TimeStamp>* stamps,
+                       string* err) {
+  // Not in older SDKs.  Both need Windows 7; earlier versions reject them
+  // as invalid, in which case we fall back to a standard query.
+  const FINDEX_INFO_LEVELS kFindExInfoBasic =
+      static_cast<FINDEX_INFO_LEVELS>(1);
+  const DWORD kFindFirstExLargeFetch = 2;
 
-  string::size_type slash_pos = path.rfind(kPathSeparator);
-  if (slash_pos == string::npos)
-    return string();  // Nothing to do.
-  while (slash_pos > 0 && path[slash_pos - 1] == kPathSeparator)
-    --slash_pos;
-  return path.substr(0, slash_pos);
+  string pattern = dir + "\\*";
+  WIN32_FIND_DATAA ffd;
+  HANDLE find_handle = FindFirstFileExA(pattern.c_str(), kFindExInfoBasic,
+                                        &ffd, FindExSearchNameMatch, NULL,
+                                        kFindFirstExLargeFetch);
+  if (find_handle == INVALID_HANDLE_VALUE &&
+      GetLastError() == ERROR_INVALID_PARAMETER) {
+    find_handle = FindFirstFileExA(pattern.c_str(), FindExInfoStandard, &ffd,
+                                   FindExSearchNameMatch, NULL, 0);
+  }
+  if (find_handle == INVALID_HANDLE_VALUE) {
+    DWORD win_err = GetLastError();
+    if (win_err == ERROR_FILE_NOT_FOUND || win_err == ERROR_PATH_NOT_FOUND)
+      return true;
+    *err = "FindFirstFileExA(" + dir + "): " + GetLastErrorString();
+    return false;
+  }
+  do {
+    // The entry for ".." carries the time of ".", not of the parent.
+    if (strcmp(ffd.cFileName, "..") == 0)
+      continue;
+    stamps->insert(make_pair(CacheKey(ffd.cFileName),
+                             TimeStampFromFileTime(ffd.ftLastWriteTime)));
+  } while (FindNextFileA(find_handle, &ffd));
+  FindClose(find_handle);
+  return true;
 }
 
+/// Marks a cached entry that must be stat()ed on its own, as it changed
+/// after its directory was listed.
+const TimeStamp kStatSingly = -2;
+#endif  // _WIN32
+
+/// Starting threads isn't free; don't bother for a handful of files.
+const size_t kMinParallelBatch = 64;
+
 }  // namespace
 
 // DiskInterface ---------------------------------------------------------------
 
+void DiskInterface::StatBatch(const vector<const string*>& paths,
+                              vector<TimeStamp>* mtimes) {
+  mtimes->resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*mtimes)[i] = Stat(*paths[i]);
+}
+
+void DiskInterface::MakeDirBatch(const vector<const string*>& paths,
+                                 vector<int>* results) {
+  results->resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*results)[i] = MakeDir(*paths[i]);
+}
+
+void DiskInterface::ReadFileBlocks(const string& path, size_t block_size,
+                                   BlockSink* sink, string* err) {
+  string contents = ReadFile(path, err);
+  if (!err->empty())
+    return;
+  size_t start = 0;
+  do {
+    size_t len = min(block_size, contents.size() - start);
+    sink->Block(StringPiece(contents.data() + start, len));
+    start += len;
+  } while (start < contents.size());
+}
+
+void DiskInterface::RemoveFileBatch(const vector<const string*>& paths,
+                                    vector<int>* results) {
+  results->resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*results)[i] = RemoveFile(*paths[i]);
+}
+
 bool DiskInterface::MakeDirs(const string& path) {
   string dir = DirName(path);
   if (dir.empty())
@@ -66,6 +241,7 @@ bool DiskInterface::MakeDirs(const string& path) {
 // RealDiskInterface -----------------------------------------------------------
 
 TimeStamp RealDiskInterface::Stat(const string& path) {
+  METRIC_COUNT("stat calls", 1);
 #ifdef _WIN32
   // MSDN: "Naming Files, Paths, and Namespaces"
   // http://msdn.microsoft.com/en-us/library/windows/desktop/aa365247(v=vs.85).aspx
@@ -73,24 +249,44 @@ TimeStamp RealDiskInterface::Stat(const string& path) {
     Error("Stat(%s): Filename longer than %i characters", path.c_str(), MAX_PATH);
     return -1;
   }
-  WIN32_FILE_ATTRIBUTE_DATA attrs;
-  if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &attrs)) {
-    DWORD err = GetLastError();
-    if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND)
-      return 0;
-    Error("GetFileAttributesEx(%s): %s", path.c_str(),
-          GetLastErrorString().c_str());
-    return -1;
+  string dir, name;
+  if (!use_dir_cache_ || !SplitPath(path, &dir, &name))
+    return StatSingleFile(path);
+  string dir_key = CacheKey(dir);
+  name = CacheKey(name);
+
+  TimeStamp mtime = 0;
+  bool listed = false;
+  {
+    ScopedLock lock(&cache_lock_);
+    Cache::iterator i = cache_.find(dir_key);
+    if (i != cache_.end()) {
+      listed = true;
+      DirCache::iterator entry = i->second.find(name);
+      if (entry != i->second.end())
+        mtime = entry->second;
+    }
   }
-  const FILETIME& filetime = attrs.ftLastWriteTime;
-  // FILETIME is in 100-nanosecond increments since the Windows epoch.
-  // We don't much care about epoch correctness but we do want the
-  // resulting value to fit in an integer.
-  uint64_t mtime = ((uint64_t)filetime.dwHighDateTime << 32) |
-    ((uint64_t)filetime.dwLowDateTime);
-  mtime /= 1000000000LL / 100; // 100ns -> s.
-  mtime -= 12622770400LL;  // 1600 epoch -> 2000 epoch (subtract 400 years).
-  return (TimeStamp)mtime;
+
+  if (!listed) {
+    // List the directory without holding the lock, so that StatBatch()'s
+    // other threads can go on with theirs.  Should two threads list the
+    // same one, the first to finish wins.
+    DirCache entries;
+    string err;
+    if (!StatAllFilesInDir(dir, &entries, &err)) {
+      Error("%s", err.c_str());
+      return -1;
+    }
+    ScopedLock lock(&cache_lock_);
+    Cache::iterator i = cache_.insert(make_pair(dir_key, entries)).first;
+    DirCache::iterator entry = i->second.find(name);
+    mtime = entry == i->second.end() ? 0 : entry->second;
+  }
+
+  if (mtime == kStatSingly)
+    return StatSingleFile(path);
+  return mtime;
 #else
   struct stat st;
   if (stat(path.c_str(), &st) < 0) {
@@ -103,7 +299,22 @@ TimeStamp RealDiskInterface::Stat(const string& path) {
 #endif
 }
 
+void RealDiskInterface::StatBatch(const vector<const string*>& paths,
+                                  vector<TimeStamp>* mtimes) {
+  if (paths.size() < kMinParallelBatch || stat_threads_ <= 1) {
+    DiskInterface::StatBatch(paths, mtimes);
+    return;
+  }
+
+  mtimes->resize(paths.size());
+  StatTask task(this, paths, mtimes);
+  RunInParallel(&task, paths.size(), stat_threads_);
+}
+
 bool RealDiskInterface::MakeDir(const string& path) {
+#ifdef _WIN32
+  ForgetDir(path);
+#endif
   if (::MakeDir(path) < 0) {
     Error("mkdir(%s): %s", path.c_str(), strerror(errno));
     return false;
@@ -111,17 +322,167 @@ bool RealDiskInterface::MakeDir(const string& path) {
   return true;
 }
 
+void RealDiskInterface::MakeDirBatch(const vector<const string*>& paths,
+                                     vector<int>* results) {
+  if (paths.size() < kMinParallelBatch || stat_threads_ <= 1) {
+    DiskInterface::MakeDirBatch(paths, results);
+    return;
+  }
+
+  results->resize(paths.size());
+  MakeDirTask task(this, paths, results);
+  RunInParallel(&task, paths.size(), stat_threads_);
+}
+
 string RealDiskInterface::ReadFile(const string& path, string* err) {
   string contents;
-  int ret = ::ReadFile(path, &contents, err);
+  ReadFileInto(path, &contents, err);
+  return contents;
+}
+
+void RealDiskInterface::ReadFileInto(const string& path, string* contents,
+                                     string* err) {
+  contents->clear();
+  int ret = ::ReadFile(path, contents, err);
   if (ret == -ENOENT) {
     // Swallow ENOENT.
     err->clear();
   }
-  return contents;
+}
+
+void RealDiskInterface::ReadFileBlocks(const string& path, size_t block_size,
+                                       BlockSink* sink, string* err) {
+  // Opened like ::ReadFile(), so the contents come out the same.
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f) {
+    if (errno != ENOENT)
+      err->assign(strerror(errno));
+    else
+      sink->Block(StringPiece());
+    return;
+  }
+  setvbuf(f, NULL, _IONBF, 0);
+  vector<char> block(block_size);
+  size_t total = 0;
+  for (;;) {
+    size_t used = 0;
+    while (used < block_size) {
+      size_t len = fread(&block[used], 1, block_size - used, f);
+      if (len == 0)
+        break;
+      used += len;
+    }
+    if (ferror(f)) {
+      err->assign(strerror(errno));
+      break;
+    }
+    total += used;
+    // A file that ends on a block boundary needs no empty block after it,
+    // except when it is empty.
+    if (used > 0 || total == 0)
+      sink->Block(StringPiece(&block[0], used));
+    if (used < block_size)
+      break;
+  }
+  METRIC_COUNT("files read", 1);
+  METRIC_COUNT("bytes read", total);
+  fclose(f);
+}
+
+bool RealDiskInterface::SetMTime(const string& path, TimeStamp mtime) {
+#ifdef _WIN32
+  Invalidate(path);
+  HANDLE file = CreateFile(path.c_str(), FILE_WRITE_ATTRIBUTES,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+  // The inverse of TimeStampFromFileTime().
+  uint64_t ticks = ((uint64_t)mtime + 12622770400LL) * (1000000000LL / 100);
+  FILETIME filetime;
+  filetime.dwLowDateTime = (DWORD)ticks;
+  filetime.dwHighDateTime = (DWORD)(ticks >> 32);
+  bool ok = SetFileTime(file, NULL, NULL, &filetime) != 0;
+  CloseHandle(file);
+  return ok;
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0)
+    return false;
+  struct utimbuf times;
+  times.actime = st.st_atime;
+  times.modtime = mtime;
+  return utime(path.c_str(), &times) == 0;
+#endif
+}
+
+bool RealDiskInterface::CloneFile(const string& from, const string& to) {
+  // Copy to a temporary and rename it into place, so that nobody sees
+  // a partial file.
+  char tmp[32];
+#ifdef _WIN32
+  Invalidate(to);
+  snprintf(tmp, sizeof(tmp), ".tmp%lu", GetCurrentProcessId());
+  string tmp_path = to + tmp;
+  if (!CopyFileA(from.c_str(), tmp_path.c_str(), FALSE))
+    return false;
+  // CopyFile() keeps the source's mtime, but a copy is new.
+  HANDLE file = CreateFileA(tmp_path.c_str(), FILE_WRITE_ATTRIBUTES, 0, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file != INVALID_HANDLE_VALUE) {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(file, NULL, NULL, &now);
+    CloseHandle(file);
+  }
+  if (!MoveFileExA(tmp_path.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+    DeleteFileA(tmp_path.c_str());
+    return false;
+  }
+  return true;
+#else
+  snprintf(tmp, sizeof(tmp), ".tmp%d", (int)getpid());
+  string tmp_path = to + tmp;
+  int in = open(from.c_str(), O_RDONLY);
+  if (in < 0)
+    return false;
+  struct stat st;
+  int out = -1;
+  if (fstat(in, &st) == 0)
+    out = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+
+  bool ok = false;
+#ifdef FICLONE
+  // A reflink shares the data until either copy is written to.
+  ok = ioctl(out, FICLONE, in) == 0;
+#endif
+  if (!ok) {
+    char buf[64 << 10];
+    ssize_t len;
+    ok = true;
+    while (ok && (len = read(in, buf, sizeof(buf))) != 0) {
+      if (len < 0 && errno == EINTR)
+        continue;
+      ok = len > 0 && write(out, buf, len) == len;
+    }
+  }
+  close(in);
+  if (close(out) < 0)
+    ok = false;
+  if (ok && rename(tmp_path.c_str(), to.c_str()) < 0)
+    ok = false;
+  if (!ok)
+    unlink(tmp_path.c_str());
+  return ok;
+#endif
 }
 
 int RealDiskInterface::RemoveFile(const string& path) {
+  Invalidate(path);
   if (remove(path.c_str()) < 0) {
     switch (errno) {
       case ENOENT:
@@ -134,3 +495,62 @@ int RealDiskInterface::RemoveFile(const string& path) {
     return 0;
   }
 }
+
+void RealDiskInterface::RemoveFileBatch(const vector<const string*>& paths,
+                                        vector<int>* results) {
+  if (paths.size() < kMinParallelBatch || stat_threads_ <= 1) {
+    DiskInterface::RemoveFileBatch(paths, results);
+    return;
+  }
+
+  results->resize(paths.size());
+  RemoveTask task(this, paths, results);
+  RunInParallel(&task, paths.size(), stat_threads_);
+}
+
+int RealDiskInterface::RemoveDir(const string& path) {
+#ifdef _WIN32
+  ForgetDir(path);
+  if (_rmdir(path.c_str()) < 0) {
+#else
+  if (rmdir(path.c_str()) < 0) {
+#endif
+    switch (errno) {
+      case ENOENT:
+      case ENOTEMPTY:
+      case EEXIST:
+        return 1;
+      default:
+        Error("rmdir(%s): %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+  }
+  return 0;
+}
+
+void RealDiskInterface::Invalidate(const string& path) {
+#ifdef _WIN32
+  string dir, name;
+  if (!SplitPath(path, &dir, &name))
+    return;
+  ScopedLock lock(&cache_lock_);
+  Cache::iterator i = cache_.find(CacheKey(dir));
+  if (i != cache_.end())
+    i->second[CacheKey(name)] = kStatSingly;
+#endif
+}
+
+void RealDiskInterface::ClearCache() {
+#ifdef _WIN32
+  ScopedLock lock(&cache_lock_);
+  cache_.clear();
+#endif
+}
+
+#ifdef _WIN32
+void RealDiskInterface::ForgetDir(const string& path) {
+  Invalidate(path);
+  ScopedLock lock(&cache_lock_);
+  cache_.erase(CacheKey(path));
+}
+#endif
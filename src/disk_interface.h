@@ -16,10 +16,25 @@
 #define NINJA_DISK_INTERFACE_H_
 
 #include <string>
+#include <vector>
 using namespace std;
 
+#include "string_piece.h"
 #include "timestamp.h"
 
+#ifdef _WIN32
+#include <map>
+
+#include "threads.h"
+#endif
+
+/// Receives a file's contents a block at a time from
+/// DiskInterface::ReadFileBlocks().
+struct BlockSink {
+  virtual ~BlockSink() {}
+  virtual void Block(StringPiece block) = 0;
+};
+
 /// Interface for accessing the disk.
 ///
 /// Abstract so it can be mocked out for tests.  The real implementation
@@ -31,12 +46,43 @@ struct DiskInterface {
   /// other errors.
   virtual TimeStamp Stat(const string& path) = 0;
 
+  /// Stat() each of \a paths, storing the results in \a mtimes in the
+  /// same order.  Implementations may issue the calls concurrently.
+  virtual void StatBatch(const vector<const string*>& paths,
+                         vector<TimeStamp>* mtimes);
+
   /// Create a directory, returning false on failure.
   virtual bool MakeDir(const string& path) = 0;
 
+  /// MakeDir() each of \a paths, storing 1 in \a results for each one
+  /// created and 0 for each failure, in the same order.  Implementations
+  /// may issue the calls concurrently, so no path may be the parent of
+  /// another.
+  virtual void MakeDirBatch(const vector<const string*>& paths,
+                            vector<int>* results);
+
   /// Read a file to a string.  Fill in |err| on error.
   virtual string ReadFile(const string& path, string* err) = 0;
 
+  /// Read a file into \a contents, replacing what was there but reusing
+  /// its storage, so that many files can be read through one buffer.
+  /// Otherwise like ReadFile().
+  virtual void ReadFileInto(const string& path, string* contents,
+                            string* err) {
+    *contents = ReadFile(path, err);
+  }
+
+  /// Pass the contents of \a path to \a sink in blocks of \a block_size
+  /// bytes, the last of which may be shorter (or empty, for an empty
+  /// file), without holding more than one block in memory.  Otherwise
+  /// like ReadFile().
+  virtual void ReadFileBlocks(const string& path, size_t block_size,
+                              BlockSink* sink, string* err);
+
+  /// Whether ReadFileBlocks() may be called from another thread while
+  /// this one goes on using the interface.
+  virtual bool ReadsInBackground() const { return false; }
+
   /// Remove the file named @a path. It behaves like 'rm -f path' so no errors
   /// are reported if it does not exists.
   /// @returns 0 if the file has been removed,
@@ -44,6 +90,32 @@ struct DiskInterface {
   ///          -1 if an error occurs.
   virtual int RemoveFile(const string& path) = 0;
 
+  /// RemoveFile() each of \a paths, storing the results in \a results in
+  /// the same order.  Implementations may issue the calls concurrently.
+  virtual void RemoveFileBatch(const vector<const string*>& paths,
+                               vector<int>* results);
+
+  /// Remove the directory \a path if it is empty.
+  /// @returns 0 if the directory has been removed,
+  ///          1 if it is not empty or does not exist, and
+  ///          -1 if an error occurs.
+  virtual int RemoveDir(const string& path) { return 1; }
+
+  /// Set the mtime of an existing file, returning false on failure.
+  virtual bool SetMTime(const string& path, TimeStamp mtime) {
+    return false;
+  }
+
+  /// Replace \a to with a copy of \a from, sharing storage with it where
+  /// the filesystem can, returning false on failure.
+  virtual bool CloneFile(const string& from, const string& to) {
+    return false;
+  }
+
+  /// Forget anything cached about \a path, e.g. because a command may
+  /// have rewritten it.
+  virtual void Invalidate(const string& path) {}
+
   /// Create all the parent directories for path; like mkdir -p
   /// `basename path`.
   bool MakeDirs(const string& path);
@@ -51,11 +123,60 @@ struct DiskInterface {
 
 /// Implementation of DiskInterface that actually hits the disk.
 struct RealDiskInterface : public DiskInterface {
+  RealDiskInterface() : stat_threads_(16)
+#ifdef _WIN32
+                      , use_dir_cache_(true)
+#endif
+                      {}
   virtual ~RealDiskInterface() {}
   virtual TimeStamp Stat(const string& path);
+  virtual void StatBatch(const vector<const string*>& paths,
+                         vector<TimeStamp>* mtimes);
   virtual bool MakeDir(const string& path);
+  virtual void MakeDirBatch(const vector<const string*>& paths,
+                            vector<int>* results);
   virtual string ReadFile(const string& path, string* err);
+  virtual void ReadFileInto(const string& path, string* contents,
+                            string* err);
+  virtual void ReadFileBlocks(const string& path, size_t block_size,
+                              BlockSink* sink, string* err);
+  virtual bool ReadsInBackground() const { return true; }
   virtual int RemoveFile(const string& path);
+  virtual void RemoveFileBatch(const vector<const string*>& paths,
+                               vector<int>* results);
+  virtual int RemoveDir(const string& path);
+  virtual bool SetMTime(const string& path, TimeStamp mtime);
+  virtual bool CloneFile(const string& from, const string& to);
+  virtual void Invalidate(const string& path);
+
+  /// Forget everything cached about the disk, so that files are looked at
+  /// afresh.  Only the directory cache on Windows keeps anything.
+  void ClearCache();
+
+  /// Number of threads StatBatch(), MakeDirBatch() and RemoveFileBatch()
+  /// may use.  All are usually bound by filesystem latency rather than
+  /// CPU, so this needn't track the number of processors.
+  int stat_threads_;
+
+#ifdef _WIN32
+  /// Whether Stat() reads a whole directory the first time it is asked
+  /// about a file in it, and answers for its other files from that.
+  /// Asking about files one at a time is far slower on Windows than
+  /// stat() is elsewhere.
+  bool use_dir_cache_;
+
+ private:
+  /// Drop the listing of directory \a path, which we created or removed.
+  void ForgetDir(const string& path);
+
+  /// Modification time of each entry of a directory, by lowercased name.
+  typedef map<string, TimeStamp> DirCache;
+  /// Cached directories, by lowercased path.
+  typedef map<string, DirCache> Cache;
+  Cache cache_;
+  /// StatBatch() calls Stat() from several threads.
+  Mutex cache_lock_;
+#endif
 };
 
 #endif  // NINJA_DISK_INTERFACE_H_
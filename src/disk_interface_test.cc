@@ -64,6 +64,52 @@ TEST_F(DiskInterfaceTest, StatExistingFile) {
   EXPECT_GT(disk_.Stat("file"), 1);
 }
 
+TEST_F(DiskInterfaceTest, StatBatch) {
+  // Enough files to take the threaded path.
+  vector<string> names;
+  for (int i = 0; i < 200; ++i) {
+    char name[32];
+    sprintf(name, "file%d", i);
+    names.push_back(name);
+    if (i % 2 == 0) {
+      FILE* f = fopen(name, "wb");
+      ASSERT_TRUE(f);
+      fclose(f);
+    }
+  }
+
+  vector<const string*> paths;
+  for (size_t i = 0; i < names.size(); ++i)
+    paths.push_back(&names[i]);
+  vector<TimeStamp> mtimes;
+  disk_.StatBatch(paths, &mtimes);
+  ASSERT_EQ(names.size(), mtimes.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (i % 2 == 0)
+      EXPECT_GT(mtimes[i], 1) << names[i];
+    else
+      EXPECT_EQ(0, mtimes[i]) << names[i];
+  }
+}
+
+TEST_F(DiskInterfaceTest, StatAfterChange) {
+  // On Windows the first Stat() lists the whole directory; later changes
+  // must still be seen.
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  EXPECT_EQ(0, disk_.Stat("subdir/a"));
+  EXPECT_EQ(0, disk_.Stat("subdir/b"));
+
+  FILE* f = fopen("subdir/a", "wb");
+  ASSERT_TRUE(f);
+  fclose(f);
+  disk_.Invalidate("subdir/a");
+  EXPECT_GT(disk_.Stat("subdir/a"), 1);
+  EXPECT_EQ(0, disk_.Stat("subdir/b"));
+
+  EXPECT_EQ(0, disk_.RemoveFile("subdir/a"));
+  EXPECT_EQ(0, disk_.Stat("subdir/a"));
+}
+
 TEST_F(DiskInterfaceTest, ReadFile) {
   string err;
   EXPECT_EQ("", disk_.ReadFile("foobar", &err));
@@ -78,6 +124,53 @@ TEST_F(DiskInterfaceTest, ReadFile) {
 
   EXPECT_EQ(kTestContent, disk_.ReadFile(kTestFile, &err));
   EXPECT_EQ("", err);
+
+  // Reading into a buffer replaces what it held.
+  string contents = "previous, longer contents";
+  disk_.ReadFileInto(kTestFile, &contents, &err);
+  EXPECT_EQ(kTestContent, contents);
+  EXPECT_EQ("", err);
+  disk_.ReadFileInto("foobar", &contents, &err);
+  EXPECT_EQ("", contents);
+  EXPECT_EQ("", err);
+}
+
+namespace {
+
+struct BlockCollector : public BlockSink {
+  virtual void Block(StringPiece block) { blocks_.push_back(block.AsString()); }
+  vector<string> blocks_;
+};
+
+}  // anonymous namespace
+
+TEST_F(DiskInterfaceTest, ReadFileBlocks) {
+  string err;
+  FILE* f = fopen("testfile", "wb");
+  ASSERT_TRUE(f);
+  fprintf(f, "abcdefghij");
+  ASSERT_EQ(0, fclose(f));
+
+  BlockCollector short_last;
+  disk_.ReadFileBlocks("testfile", 4, &short_last, &err);
+  EXPECT_EQ("", err);
+  ASSERT_EQ(3u, short_last.blocks_.size());
+  EXPECT_EQ("abcd", short_last.blocks_[0]);
+  EXPECT_EQ("efgh", short_last.blocks_[1]);
+  EXPECT_EQ("ij", short_last.blocks_[2]);
+
+  // No empty block after one that ends the file.
+  BlockCollector exact;
+  disk_.ReadFileBlocks("testfile", 5, &exact, &err);
+  ASSERT_EQ(2u, exact.blocks_.size());
+  EXPECT_EQ("fghij", exact.blocks_[1]);
+
+  // A missing file reads as empty, as with ReadFile().
+  BlockCollector missing;
+  disk_.ReadFileBlocks("foobar", 4, &missing, &err);
+  EXPECT_EQ("", err);
+  ASSERT_EQ(1u, missing.blocks_.size());
+  EXPECT_EQ("", missing.blocks_[0]);
 }
 
 TEST_F(DiskInterfaceTest, MakeDirs) {
@@ -98,6 +191,41 @@ TEST_F(DiskInterfaceTest, RemoveFile) {
   EXPECT_EQ(1, disk_.RemoveFile("does not exist"));
 }
 
+TEST_F(DiskInterfaceTest, RemoveFileBatch) {
+  // Enough files to take the threaded path.
+  vector<string> names;
+  for (int i = 0; i < 200; ++i) {
+    char name[32];
+    sprintf(name, "file%d", i);
+    names.push_back(name);
+    if (i % 2 == 0) {
+      FILE* f = fopen(name, "wb");
+      ASSERT_TRUE(f);
+      fclose(f);
+    }
+  }
+
+  vector<const string*> paths;
+  for (size_t i = 0; i < names.size(); ++i)
+    paths.push_back(&names[i]);
+  vector<int> results;
+  disk_.RemoveFileBatch(paths, &results);
+  ASSERT_EQ(names.size(), results.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    EXPECT_EQ(i % 2 == 0 ? 0 : 1, results[i]) << names[i];
+    EXPECT_EQ(0, disk_.Stat(names[i])) << names[i];
+  }
+}
+
+TEST_F(DiskInterfaceTest, RemoveDir) {
+  ASSERT_TRUE(disk_.MakeDir("dir"));
+  ASSERT_TRUE(disk_.MakeDir("dir/sub"));
+  EXPECT_EQ(1, disk_.RemoveDir("dir"));
+  EXPECT_EQ(0, disk_.RemoveDir("dir/sub"));
+  EXPECT_EQ(0, disk_.RemoveDir("dir"));
+  EXPECT_EQ(1, disk_.RemoveDir("dir"));
+}
+
 struct StatTest : public StateTestWithBuiltinRules,
                   public DiskInterface {
   // DiskInterface implementation.
@@ -14,40 +14,109 @@
 
 #include "eval_env.h"
 
-string BindingEnv::LookupVariable(const string& var) {
-  map<string, string>::iterator i = bindings_.find(var);
-  if (i != bindings_.end())
+#include "hash_map.h"
+#include "threads.h"
+
+namespace {
+
+struct SymbolTable {
+  Mutex mutex;
+  /// Keys point into the symbols' names.
+  ExternalStringHashMap<Symbol*>::Type symbols;
+};
+
+SymbolTable* GetSymbolTable() {
+  // Never destroyed, so that symbols stay valid through static destructors.
+  static SymbolTable* table = new SymbolTable;
+  return table;
+}
+
+}  // namespace
+
+// static
+const Symbol* Symbol::Intern(StringPiece name) {
+  SymbolTable* table = GetSymbolTable();
+  ScopedLock lock(&table->mutex);
+  ExternalStringHashMap<Symbol*>::Type::iterator i = table->symbols.find(name);
+  if (i != table->symbols.end())
     return i->second;
-  if (parent_)
-    return parent_->LookupVariable(var);
-  return "";
+  Symbol* symbol = new Symbol(name);
+  table->symbols.insert(make_pair(StringPiece(symbol->name_), symbol));
+  return symbol;
+}
+
+// static
+const Symbol* Symbol::Find(StringPiece name) {
+  SymbolTable* table = GetSymbolTable();
+  ScopedLock lock(&table->mutex);
+  ExternalStringHashMap<Symbol*>::Type::iterator i = table->symbols.find(name);
+  return i == table->symbols.end() ? NULL : i->second;
+}
+
+string Env::LookupVariable(const string& var) {
+  string result;
+  if (const Symbol* symbol = Symbol::Find(var))
+    AppendVariable(symbol, &result);
+  return result;
+}
+
+void BindingEnv::AppendVariable(const Symbol* var, string* result) {
+  Bindings::iterator i = bindings_.find(var);
+  if (i != bindings_.end())
+    result->append(i->second);
+  else if (parent_)
+    parent_->AppendVariable(var, result);
 }
 
 void BindingEnv::AddBinding(const string& key, const string& val) {
+  AddBinding(Symbol::Intern(key), val);
+}
+
+void BindingEnv::AddBinding(const Symbol* key, const string& val) {
   bindings_[key] = val;
 }
 
+BindingEnv* BindingEnv::Flatten() const {
+  vector<const BindingEnv*> chain;
+  for (const BindingEnv* env = this; env;
+       env = static_cast<const BindingEnv*>(env->parent_)) {
+    chain.push_back(env);
+  }
+
+  // Apply the outermost scope first so that inner bindings win.
+  BindingEnv* flat = new BindingEnv;
+  for (vector<const BindingEnv*>::reverse_iterator i = chain.rbegin();
+       i != chain.rend(); ++i) {
+    for (Bindings::const_iterator b = (*i)->bindings_.begin();
+         b != (*i)->bindings_.end(); ++b) {
+      flat->bindings_[b->first] = b->second;
+    }
+  }
+  return flat;
+}
+
 string EvalString::Evaluate(Env* env) const {
+  // Variables append straight into the result, without copies.
   string result;
   for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i) {
-    if (i->second == RAW)
-      result.append(i->first);
+    if (i->type == RAW)
+      result.append(i->text);
     else
-      result.append(env->LookupVariable(i->first));
+      env->AppendVariable(i->symbol, &result);
   }
   return result;
 }
 
 void EvalString::AddText(StringPiece text) {
   // Add it to the end of an existing RAW token if possible.
-  if (!parsed_.empty() && parsed_.back().second == RAW) {
-    parsed_.back().first.append(text.str_, text.len_);
+  if (!parsed_.empty() && parsed_.back().type == RAW) {
+    parsed_.back().text.append(text.str_, text.len_);
   } else {
-    parsed_.push_back(make_pair(text.AsString(), RAW));
+    parsed_.push_back(Token(text, RAW));
   }
 }
 void EvalString::AddSpecial(StringPiece text) {
-  parsed_.push_back(make_pair(text.AsString(), SPECIAL));
+  parsed_.push_back(Token(text, SPECIAL));
 }
 
 string EvalString::Serialize() const {
@@ -55,9 +124,9 @@ string EvalString::Serialize() const {
   for (TokenList::const_iterator i = parsed_.begin();
        i != parsed_.end(); ++i) {
     result.append("[");
-    if (i->second == SPECIAL)
+    if (i->type == SPECIAL)
       result.append("$");
-    result.append(i->first);
+    result.append(i->text);
     result.append("]");
   }
   return result;
@@ -22,10 +22,42 @@ using namespace std;
 
 #include "string_piece.h"
 
+/// An interned variable name.  Names are interned as they're parsed, so
+/// that looking up a variable compares addresses rather than strings.
+/// Symbols are never freed.
+struct Symbol {
+  /// Return the symbol named \a name, creating it if needed.  Safe to
+  /// call from several threads.
+  static const Symbol* Intern(StringPiece name);
+  /// Return the symbol named \a name, or NULL if there is none, in which
+  /// case nothing can have bound it.
+  static const Symbol* Find(StringPiece name);
+
+  const string& name() const { return name_; }
+
+ private:
+  explicit Symbol(StringPiece name) : name_(name.AsString()) {}
+
+  string name_;
+};
+
+/// Orders symbols by name.  Their addresses differ from run to run, so
+/// containers walked in order, e.g. to write them out, use this.
+struct SymbolLess {
+  bool operator()(const Symbol* a, const Symbol* b) const {
+    return a != b && a->name() < b->name();
+  }
+};
+
 /// An interface for a scope for variable (e.g. "$foo") lookups.
 struct Env {
   virtual ~Env() {}
-  virtual string LookupVariable(const string& var) = 0;
+  /// Append the value of \a var to \a result.
+  virtual void AppendVariable(const Symbol* var, string* result) = 0;
+
+  /// Return the value of the variable named \a var; for callers that
+  /// only have the name, e.g. tools and tests.
+  string LookupVariable(const string& var);
 };
 
 /// An Env which contains a mapping of variables to values
@@ -34,11 +66,23 @@ struct BindingEnv : public Env {
   BindingEnv() : parent_(NULL) {}
   explicit BindingEnv(Env* parent) : parent_(parent) {}
   virtual ~BindingEnv() {}
-  virtual string LookupVariable(const string& var);
+  virtual void AppendVariable(const Symbol* var, string* result);
   void AddBinding(const string& key, const string& val);
+  void AddBinding(const Symbol* key, const string& val);
+
+  /// Return a new parentless scope holding every binding currently
+  /// visible from this one.  All enclosing scopes must be BindingEnvs.
+  BindingEnv* Flatten() const;
+
+  Env* parent() const { return parent_; }
+  void set_parent(Env* parent) { parent_ = parent; }
 
 private:
-  map<string, string> bindings_;
+  friend struct ManifestSnapshot;
+  friend struct MemoryStats;
+
+  typedef map<const Symbol*, string, SymbolLess> Bindings;
+  Bindings bindings_;
   Env* parent_;
 };
 
@@ -58,8 +102,21 @@ struct EvalString {
   string Serialize() const;
 
 private:
+  friend struct ManifestSnapshot;
+  friend struct MemoryStats;
+
   enum TokenType { RAW, SPECIAL };
-  typedef vector<pair<string, TokenType> > TokenList;
+  struct Token {
+    Token(StringPiece value, TokenType token_type)
+        : text(value.AsString()), type(token_type),
+          symbol(token_type == SPECIAL ? Symbol::Intern(value) : NULL) {}
+    /// The raw text, or the variable's name.
+    string text;
+    TokenType type;
+    /// The variable, for SPECIAL tokens.
+    const Symbol* symbol;
+  };
+  typedef vector<Token> TokenList;
   TokenList parsed_;
 };
 
@@ -0,0 +1,75 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "eval_env.h"
+
+#include <set>
+
+#include "test.h"
+
+TEST(SymbolTest, Intern) {
+  const Symbol* cflags = Symbol::Intern("symbol_test_cflags");
+  EXPECT_EQ("symbol_test_cflags", cflags->name());
+  EXPECT_EQ(cflags, Symbol::Intern(string("symbol_test_cflags")));
+  EXPECT_NE(cflags, Symbol::Intern("symbol_test_cflags2"));
+  // The name is copied, so the one passed in needn't outlive the symbol.
+  string name = "symbol_test_copied";
+  const Symbol* copied = Symbol::Intern(name);
+  name[0] = 'X';
+  EXPECT_EQ("symbol_test_copied", copied->name());
+}
+
+TEST(SymbolTest, Find) {
+  EXPECT_EQ(NULL, Symbol::Find("symbol_test_never_interned"));
+  const Symbol* ldflags = Symbol::Intern("symbol_test_ldflags");
+  EXPECT_EQ(ldflags, Symbol::Find("symbol_test_ldflags"));
+}
+
+TEST(SymbolTest, OrderedByName) {
+  // Interned in the reverse of their names' order.
+  set<const Symbol*, SymbolLess> symbols;
+  symbols.insert(Symbol::Intern("symbol_test_z"));
+  symbols.insert(Symbol::Intern("symbol_test_a"));
+  symbols.insert(Symbol::Intern("symbol_test_m"));
+  symbols.insert(Symbol::Intern("symbol_test_a"));
+  ASSERT_EQ(3u, symbols.size());
+  set<const Symbol*, SymbolLess>::iterator i = symbols.begin();
+  EXPECT_EQ("symbol_test_a", (*i++)->name());
+  EXPECT_EQ("symbol_test_m", (*i++)->name());
+  EXPECT_EQ("symbol_test_z", (*i++)->name());
+}
+
+TEST(BindingEnvTest, Lookup) {
+  BindingEnv outer;
+  outer.AddBinding("in", "outer");
+  outer.AddBinding("cflags", "-O2");
+  BindingEnv inner(&outer);
+  inner.AddBinding("in", "inner");
+
+  EXPECT_EQ("inner", inner.LookupVariable("in"));
+  EXPECT_EQ("-O2", inner.LookupVariable("cflags"));
+  EXPECT_EQ("", inner.LookupVariable("binding_env_test_unbound"));
+
+  // A symbol interned elsewhere finds the same binding.
+  string result;
+  inner.AppendVariable(Symbol::Intern("cflags"), &result);
+  EXPECT_EQ("-O2", result);
+
+  BindingEnv* flat = inner.Flatten();
+  EXPECT_EQ(NULL, flat->parent());
+  EXPECT_EQ("inner", flat->LookupVariable("in"));
+  EXPECT_EQ("-O2", flat->LookupVariable("cflags"));
+  delete flat;
+}
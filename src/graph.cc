@@ -16,72 +16,122 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include "build_log.h"
 #include "depfile_parser.h"
+#include "deps_log.h"
 #include "disk_interface.h"
 #include "metrics.h"
 #include "parsers.h"
 #include "state.h"
 #include "util.h"
 
+int GraphState::AddNode() {
+  node_mtimes.push_back(-1);
+  node_dirty.push_back(false);
+  return (int)node_mtimes.size() - 1;
+}
+
+int GraphState::AddEdge() {
+  edge_outputs_ready.push_back(false);
+  edge_scanned.push_back(false);
+  edge_want.push_back(Edge::kNotInPlan);
+  edge_ran.push_back(false);
+  return (int)edge_outputs_ready.size() - 1;
+}
+
+void GraphState::Reset() {
+  fill(node_mtimes.begin(), node_mtimes.end(), -1);
+  if (!node_dirty.empty())
+    memset(&node_dirty[0], 0, node_dirty.size());
+  if (!edge_outputs_ready.empty()) {
+    memset(&edge_outputs_ready[0], 0, edge_outputs_ready.size());
+    memset(&edge_scanned[0], 0, edge_scanned.size());
+    memset(&edge_ran[0], 0, edge_ran.size());
+  }
+}
+
 bool Node::Stat(DiskInterface* disk_interface) {
   METRIC_RECORD("node stat");
-  mtime_ = disk_interface->Stat(path_);
-  return mtime_ > 0;
+  set_mtime(disk_interface->Stat(path_));
+  return mtime() > 0;
+}
+
+void Node::RemoveOutEdge(Edge* edge) {
+  // Deps are loaded after the edges of the manifest, so look from the end.
+  for (size_t i = out_edges_.size(); i > 0; --i) {
+    if (out_edges_[i - 1] == edge) {
+      out_edges_.erase(out_edges_.begin() + i - 1);
+      return;
+    }
+  }
 }
 
 bool Edge::RecomputeDirty(State* state, DiskInterface* disk_interface,
                           string* err) {
   bool dirty = false;
-  outputs_ready_ = true;
+  set_outputs_ready(true);
+  set_scanned(true);
 
+  bool load_depfile = false;
   if (!rule_->depfile().empty()) {
-    if (!LoadDepFile(state, disk_interface, err))
-      return false;
+    if (!rule_->deps().empty() && state && state->deps_log_) {
+      // Without an up-to-date record we can't know the dependencies, so
+      // the edge must run again to regenerate them.
+      if (!LoadDepsFromLog(state, disk_interface))
+        dirty = true;
+    } else {
+      // Parsing it is slow; wait and see whether it can matter.
+      load_depfile = true;
+    }
   }
 
-  // Visit all inputs; we're dirty if any of the inputs are dirty.
+  // Visit all inputs; we're dirty if any of the inputs are dirty.  The
+  // order-only deps go last, as their outputs are needed last.
   TimeStamp most_recent_input = 1;
-  for (vector<Node*>::iterator i = inputs_.begin(); i != inputs_.end(); ++i) {
-    if ((*i)->StatIfNecessary(disk_interface)) {
-      if (Edge* edge = (*i)->in_edge()) {
-        if (!edge->RecomputeDirty(state, disk_interface, err))
-          return false;
-      } else {
-        // This input has no in-edge; it is dirty if it is missing.
-        (*i)->set_dirty(!(*i)->exists());
-      }
-    }
-
-    // If an input is not ready, neither are our outputs.
-    if (Edge* edge = (*i)->in_edge()) {
-      if (!edge->outputs_ready_)
-        outputs_ready_ = false;
-    }
+  size_t order_only_begin = this->order_only_begin();
+  size_t order_only_end = this->order_only_end();
+  if (!VisitInputs(state, disk_interface, 0, order_only_begin, false, &dirty,
+                   &most_recent_input, err) ||
+      !VisitInputs(state, disk_interface, order_only_end, inputs_.size(),
+                   false, &dirty, &most_recent_input, err) ||
+      !VisitInputs(state, disk_interface, order_only_begin, order_only_end,
+                   true, &dirty, &most_recent_input, err))
+    return false;
 
-    if (!is_order_only(i - inputs_.begin())) {
-      // If a regular input is dirty (or missing), we're dirty.
-      // Otherwise consider mtime.
-      if ((*i)->dirty()) {
-        dirty = true;
-      } else {
-        if ((*i)->mtime() > most_recent_input)
-          most_recent_input = (*i)->mtime();
-      }
-    }
+  if (load_depfile) {
+    // If nothing the depfile says can make us clean again, its inputs only
+    // matter for the order things are built in.
+    bool dirty_anyway = DirtyWhateverTheDeps(disk_interface);
+    size_t begin = inputs_.size();
+    if (!LoadDepFile(state, disk_interface, dirty_anyway, err))
+      return false;
+    if (!VisitInputs(state, disk_interface, begin, inputs_.size(), false,
+                     &dirty, &most_recent_input, err))
+      return false;
+    if (dirty_anyway)
+      dirty = true;
   }
+  most_recent_input_ = most_recent_input;
 
   // We may also be dirty due to output state: missing outputs, out of
   // date outputs, etc.  Visit all outputs and determine whether they're dirty.
   if (!dirty) {
     BuildLog* build_log = state ? state->build_log_ : 0;
-    string command = EvaluateCommand();
+    // Only the hash is compared against the log, so compute it once for
+    // all outputs.
+    uint64_t command_hash = 0;
+    if (build_log)
+      command_hash = GetCommandHash();
 
     for (vector<Node*>::iterator i = outputs_.begin();
          i != outputs_.end(); ++i) {
       (*i)->StatIfNecessary(disk_interface);
-      if (RecomputeOutputDirty(build_log, most_recent_input, command, *i)) {
+      if (RecomputeOutputDirty(build_log, most_recent_input, command_hash,
+                               *i)) {
         dirty = true;
         break;
       }
@@ -100,14 +150,88 @@ bool Edge::RecomputeDirty(State* state, DiskInterface* disk_interface,
   // clean but still have not be ready in the presence of order-only
   // inputs.)
   if (dirty)
-    outputs_ready_ = false;
+    set_outputs_ready(false);
+
+  return true;
+}
 
+bool Edge::VisitInputs(State* state, DiskInterface* disk_interface,
+                       size_t begin, size_t end, bool order_only,
+                       bool* dirty, TimeStamp* most_recent_input,
+                       string* err) {
+  for (size_t i = begin; i < end; ++i) {
+    Node* input = inputs_[i];
+    // Nodes may have been stat()ed ahead of time (see
+    // Builder::StatReachableNodes), so track visited edges separately.
+    input->StatIfNecessary(disk_interface);
+    if (Edge* edge = input->in_edge()) {
+      if (!edge->scanned() &&
+          !edge->RecomputeDirty(state, disk_interface, err))
+        return false;
+    } else {
+      // This input has no in-edge; it is dirty if it is missing.
+      input->set_dirty(!input->exists());
+    }
+
+    // If an input is not ready, neither are our outputs.
+    if (Edge* edge = input->in_edge()) {
+      if (!edge->outputs_ready())
+        set_outputs_ready(false);
+    }
+
+    if (!order_only) {
+      // If a regular input is dirty (or missing), we're dirty.  Either
+      // way it counts towards most_recent_input_, in case a restat cleans
+      // it later.
+      if (input->dirty())
+        *dirty = true;
+      if (input->mtime() > *most_recent_input)
+        *most_recent_input = input->mtime();
+    }
+  }
   return true;
 }
 
+/// Whether \a node is a plain file rather than something we build.  Its
+/// mtime is then fixed for the whole build.
+static bool IsSourceFile(Node* node) {
+  Edge* edge = node->in_edge();
+  return !edge || (edge->is_phony() && edge->inputs_.empty());
+}
+
+bool Edge::DirtyWhateverTheDeps(DiskInterface* disk_interface) {
+  // A missing input or output can't be fixed by a restat, and neither can
+  // an output older than a file we don't build, unless a restat rule's log
+  // says otherwise.
+  TimeStamp oldest_output = 0;
+  for (vector<Node*>::iterator i = outputs_.begin(); i != outputs_.end(); ++i) {
+    (*i)->StatIfNecessary(disk_interface);
+    if (!(*i)->exists())
+      return true;
+    if (oldest_output == 0 || (*i)->mtime() < oldest_output)
+      oldest_output = (*i)->mtime();
+  }
+  for (size_t i = 0; i < inputs_.size(); ++i) {
+    Node* input = inputs_[i];
+    if (is_order_only(i) || !IsSourceFile(input))
+      continue;
+    if (!input->exists() || (!rule_->restat() && input->mtime() > oldest_output))
+      return true;
+  }
+  return false;
+}
+
+bool Edge::HasDirtyInputs() const {
+  for (size_t i = 0; i < inputs_.size(); ++i) {
+    if (inputs_[i]->dirty() && !is_order_only(i))
+      return true;
+  }
+  return false;
+}
+
 bool Edge::RecomputeOutputDirty(BuildLog* build_log,
                                 TimeStamp most_recent_input,
-                                const string& command, Node* output) {
+                                uint64_t command_hash, Node* output) {
   if (is_phony()) {
     // Phony edges don't write any output.  Outputs are only dirty if
     // there are no inputs and we're missing the output.
@@ -140,7 +264,7 @@ bool Edge::RecomputeOutputDirty(BuildLog* build_log,
   // dirty.
   if (!rule_->generator() && build_log &&
       (entry || (entry = build_log->LookupByOutput(output->path())))) {
-    if (command != entry->command)
+    if (command_hash != entry->command_hash)
       return true;
   }
 
@@ -156,79 +280,154 @@ bool Edge::AllInputsReady() const {
   return true;
 }
 
+namespace {
+
+const Symbol* const kInSymbol = Symbol::Intern("in");
+const Symbol* const kOutSymbol = Symbol::Intern("out");
+
+}  // namespace
+
 /// An Env for an Edge, providing $in and $out.
 struct EdgeEnv : public Env {
   EdgeEnv(Edge* edge) : edge_(edge) {}
-  virtual string LookupVariable(const string& var);
+  virtual void AppendVariable(const Symbol* var, string* result);
 
-  /// Given a span of Nodes, construct a list of paths suitable for a command
-  /// line.  XXX here is where shell-escaping of e.g spaces should happen.
-  string MakePathList(vector<Node*>::iterator begin,
-                      vector<Node*>::iterator end);
+  /// Given a span of Nodes, append a list of paths suitable for a command
+  /// line to \a result.  XXX here is where shell-escaping of e.g spaces
+  /// should happen.
+  void AppendPathList(vector<Node*>::iterator begin,
+                      vector<Node*>::iterator end, string* result);
 
   Edge* edge_;
 };
 
-string EdgeEnv::LookupVariable(const string& var) {
-  if (var == "in") {
+void EdgeEnv::AppendVariable(const Symbol* var, string* result) {
+  if (var == kInSymbol) {
     int explicit_deps_count = edge_->inputs_.size() - edge_->implicit_deps_ -
       edge_->order_only_deps_;
-    return MakePathList(edge_->inputs_.begin(),
-                        edge_->inputs_.begin() + explicit_deps_count);
-  } else if (var == "out") {
-    return MakePathList(edge_->outputs_.begin(),
-                        edge_->outputs_.end());
+    AppendPathList(edge_->inputs_.begin(),
+                   edge_->inputs_.begin() + explicit_deps_count, result);
+  } else if (var == kOutSymbol) {
+    AppendPathList(edge_->outputs_.begin(), edge_->outputs_.end(), result);
   } else if (edge_->env_) {
-    return edge_->env_->LookupVariable(var);
-  } else {
-    // XXX shoudl we warn here?
-    return string();
+    edge_->env_->AppendVariable(var, result);
   }
+  // XXX should we warn about unknown variables?
 }
 
-string EdgeEnv::MakePathList(vector<Node*>::iterator begin,
-                             vector<Node*>::iterator end) {
-  string result;
+void EdgeEnv::AppendPathList(vector<Node*>::iterator begin,
+                             vector<Node*>::iterator end, string* result) {
   for (vector<Node*>::iterator i = begin; i != end; ++i) {
-    if (!result.empty())
-      result.push_back(' ');
+    if (i != begin)
+      result->push_back(' ');
     const string& path = (*i)->path();
     if (path.find(" ") != string::npos) {
-      result.append("\"");
-      result.append(path);
-      result.append("\"");
+      result->append("\"");
+      result->append(path);
+      result->append("\"");
     } else {
-      result.append(path);
+      result->append(path);
     }
   }
-  return result;
 }
 
-string Edge::EvaluateCommand() {
+const string& Edge::EvaluateCommand() {
+  if (!command_known_) {
+    EdgeEnv env(this);
+    command_ = rule_->command().Evaluate(&env);
+    command_known_ = true;
+  }
+  return command_;
+}
+
+string Edge::EvaluateCommandUncached() {
+  if (command_known_)
+    return command_;
   EdgeEnv env(this);
   return rule_->command().Evaluate(&env);
 }
 
-string Edge::EvaluateDepFile() {
+uint64_t Edge::GetCommandHash() {
+  if (!command_hash_known_) {
+    // Up-to-date edges only ever need the hash, so don't keep their
+    // (possibly long) command around.
+    if (command_known_) {
+      command_hash_ = BuildLog::LogEntry::HashCommand(command_);
+    } else {
+      command_hash_ =
+          BuildLog::LogEntry::HashCommand(EvaluateCommandUncached());
+    }
+    command_hash_known_ = true;
+  }
+  return command_hash_;
+}
+
+const string& Edge::EvaluateDepFile() {
+  if (!depfile_known_) {
+    EdgeEnv env(this);
+    depfile_ = rule_->depfile().Evaluate(&env);
+    depfile_known_ = true;
+  }
+  return depfile_;
+}
+
+string Edge::EvaluateDepFileUncached() {
+  if (depfile_known_)
+    return depfile_;
   EdgeEnv env(this);
   return rule_->depfile().Evaluate(&env);
 }
 
-string Edge::GetDescription() {
+const string& Edge::GetDescription() {
+  if (!description_known_) {
+    EdgeEnv env(this);
+    description_ = rule_->description().Evaluate(&env);
+    description_known_ = true;
+  }
+  return description_;
+}
+
+string Edge::EvaluateWorker() {
   EdgeEnv env(this);
-  return rule_->description().Evaluate(&env);
+  return rule_->worker().Evaluate(&env);
+}
+
+void Edge::ForgetEvaluatedStrings() {
+  // swap() actually releases the memory, unlike clear().
+  string().swap(command_);
+  string().swap(depfile_);
+  string().swap(description_);
+  command_known_ = depfile_known_ = description_known_ = false;
 }
 
 bool Edge::LoadDepFile(State* state, DiskInterface* disk_interface,
-                       string* err) {
+                       bool only_built, string* err) {
+  vector<Node*> nodes;
+  if (!ReadDepFile(state, disk_interface, &nodes, err))
+    return false;
+  if (only_built)
+    nodes.erase(remove_if(nodes.begin(), nodes.end(), IsSourceFile),
+                nodes.end());
+  AddImplicitDeps(state, nodes);
+  return true;
+}
+
+bool Edge::ReadDepFile(State* state, DiskInterface* disk_interface,
+                       vector<Node*>* nodes, string* err) {
   METRIC_RECORD("depfile load");
-  string path = EvaluateDepFile();
-  string content = disk_interface->ReadFile(path, err);
+  // As with the command hash, most edges are up to date and won't need
+  // the path again.
+  string path = EvaluateDepFileUncached();
+  // The parser works in place, and the paths it finds are looked up in
+  // the State by StringPiece; only new nodes copy them.
+  string& content = state->depfile_buffer_;
+  disk_interface->ReadFileInto(path, &content, err);
   if (!err->empty())
     return false;
   if (content.empty())
     return true;
 
+  METRIC_COUNT("depfiles parsed", 1);
   DepfileParser depfile;
   string depfile_err;
   if (!depfile.Parse(&content, &depfile_err)) {
@@ -244,19 +443,56 @@ bool Edge::LoadDepFile(State* state, DiskInterface* disk_interface,
     return false;
   }
 
-  inputs_.insert(inputs_.end() - order_only_deps_, depfile.ins_.size(), 0);
-  implicit_deps_ += depfile.ins_.size();
-  vector<Node*>::iterator implicit_dep =
-    inputs_.end() - order_only_deps_ - depfile.ins_.size();
-
-  // Add all its in-edges.
+  nodes->reserve(depfile.ins_.size());
   for (vector<StringPiece>::iterator i = depfile.ins_.begin();
-       i != depfile.ins_.end(); ++i, ++implicit_dep) {
+       i != depfile.ins_.end(); ++i) {
     if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, err))
       return false;
+    nodes->push_back(state->GetNode(*i));
+  }
+
+  return true;
+}
+
+bool Edge::LoadDepsFromLog(State* state, DiskInterface* disk_interface) {
+  METRIC_RECORD("deps log lookup");
+  DepsLog* deps_log = state->deps_log_;
+  Node* output = outputs_[0];
+  const DepsLog::Deps* deps = deps_log->GetDeps(output);
+  if (!deps)
+    return false;
+
+  // The record is stale if the output was written after it.
+  output->StatIfNecessary(disk_interface);
+  if (output->mtime() > deps->mtime)
+    return false;
+
+  vector<Node*> nodes;
+  nodes.reserve(deps->node_count);
+  for (int i = 0; i < deps->node_count; ++i)
+    nodes.push_back(deps_log->node(deps->node_ids[i]));
+  AddImplicitDeps(state, nodes);
+
+  return true;
+}
+
+void Edge::ForgetLoadedDeps() {
+  size_t begin = order_only_end();
+  for (size_t i = begin; i < inputs_.size(); ++i)
+    inputs_[i]->RemoveOutEdge(this);
+  inputs_.resize(begin);
+  implicit_deps_ -= loaded_deps_;
+  loaded_deps_ = 0;
+}
+
+void Edge::AddImplicitDeps(State* state, const vector<Node*>& nodes) {
+  inputs_.insert(inputs_.end(), nodes.begin(), nodes.end());
+  implicit_deps_ += nodes.size();
+  loaded_deps_ += nodes.size();
 
-    Node* node = state->GetNode(*i);
-    *implicit_dep = node;
+  // Add all its in-edges.
+  for (vector<Node*>::const_iterator i = nodes.begin(); i != nodes.end(); ++i) {
+    Node* node = *i;
     node->AddOutEdge(this);
 
     // If we don't have a edge that generates this input already,
@@ -270,14 +506,12 @@ bool Edge::LoadDepFile(State* state, DiskInterface* disk_interface,
       // RecomputeDirty might not be called for phony_edge if a previous call
       // to RecomputeDirty had caused the file to be stat'ed.  Because previous
       // invocations of RecomputeDirty would have seen this node without an
-      // input edge (and therefore ready), we have to set outputs_ready_ to true
+      // input edge (and therefore ready), we have to set outputs_ready to true
       // to avoid a potential stuck build.  If we do call RecomputeDirty for
-      // this node, it will simply set outputs_ready_ to the correct value.
-      phony_edge->outputs_ready_ = true;
+      // this node, it will simply set outputs_ready to the correct value.
+      phony_edge->set_outputs_ready(true);
     }
   }
-
-  return true;
 }
 
 void Edge::Dump() {
@@ -295,3 +529,19 @@ void Edge::Dump() {
 bool Edge::is_phony() const {
   return rule_ == &State::kPhonyRule;
 }
+
+void EdgePriorityQueue::push(Edge* edge) {
+  heap_.push_back(edge);
+  push_heap(heap_.begin(), heap_.end(), Less());
+}
+
+Edge* EdgePriorityQueue::pop() {
+  pop_heap(heap_.begin(), heap_.end(), Less());
+  Edge* edge = heap_.back();
+  heap_.pop_back();
+  return edge;
+}
+
+void EdgePriorityQueue::Reorder() {
+  make_heap(heap_.begin(), heap_.end(), Less());
+}
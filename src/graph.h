@@ -15,6 +15,7 @@
 #ifndef NINJA_GRAPH_H_
 #define NINJA_GRAPH_H_
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 using namespace std;
@@ -25,13 +26,48 @@ using namespace std;
 struct DiskInterface;
 struct Edge;
 
+/// The mutable per-build state of the nodes and edges of a State, kept
+/// apart from the graph itself in dense arrays indexed by Node::index()
+/// and Edge::index_.  Walking a large graph then touches a few compact
+/// arrays instead of every Node and Edge, and State::Reset() just
+/// overwrites them.
+struct GraphState {
+  /// Add the state of a new node or edge, returning its index.
+  int AddNode();
+  int AddEdge();
+
+  /// Mark every node as not-yet-stat()ed and not dirty, and every edge as
+  /// not yet visited nor run.
+  void Reset();
+
+  /// Possible values of the mtime of a node:
+  ///   -1: file hasn't been examined
+  ///   0:  we looked, and file doesn't exist
+  ///   >0: actual file's mtime
+  vector<TimeStamp> node_mtimes;
+
+  /// Whether a node's file is out-of-date.  But note that
+  /// edge_outputs_ready is also used in judging which edges to build.
+  vector<char> node_dirty;
+
+  /// Whether all of an edge's outputs are up to date.
+  vector<char> edge_outputs_ready;
+  /// Whether RecomputeDirty() has visited an edge.
+  vector<char> edge_scanned;
+  /// Where an edge stands in the Plan building it, an Edge::Want.
+  vector<char> edge_want;
+  /// Whether a Builder started an edge since the last reset.
+  vector<char> edge_ran;
+};
+
 /// Information about a node in the dependency graph: the file, whether
 /// it's dirty, mtime, etc.
 struct Node {
-  Node(const string& path) : path_(path), mtime_(-1), dirty_(false),
-                             in_edge_(NULL) {}
+  Node(StringPiece path, GraphState* graph_state, int index)
+      : path_(path.str_, path.len_), graph_state_(graph_state), index_(index),
+        in_edge_(NULL), id_(-1) {}
 
-  /// Return true if the file exists (mtime_ got a value).
+  /// Return true if the file exists (its mtime got a value).
   bool Stat(DiskInterface* disk_interface);
 
   /// Return true if we needed to stat.
@@ -44,48 +80,54 @@ struct Node {
 
   /// Mark as not-yet-stat()ed and not dirty.
   void ResetState() {
-    mtime_ = -1;
-    dirty_ = false;
+    set_mtime(-1);
+    set_dirty(false);
   }
 
   /// Mark the Node as already-stat()ed and missing.
   void MarkMissing() {
-    mtime_ = 0;
+    set_mtime(0);
   }
 
   bool exists() const {
-    return mtime_ != 0;
+    return mtime() != 0;
   }
 
   bool status_known() const {
-    return mtime_ != -1;
+    return mtime() != -1;
   }
 
   const string& path() const { return path_; }
-  TimeStamp mtime() const { return mtime_; }
+  TimeStamp mtime() const { return graph_state_->node_mtimes[index_]; }
+  /// Record the result of a stat() done on the node's behalf, e.g. by
+  /// DiskInterface::StatBatch().
+  void set_mtime(TimeStamp mtime) {
+    graph_state_->node_mtimes[index_] = mtime;
+  }
 
-  bool dirty() const { return dirty_; }
-  void set_dirty(bool dirty) { dirty_ = dirty; }
-  void MarkDirty() { dirty_ = true; }
+  bool dirty() const { return graph_state_->node_dirty[index_] != 0; }
+  void set_dirty(bool dirty) { graph_state_->node_dirty[index_] = dirty; }
+  void MarkDirty() { set_dirty(true); }
 
   Edge* in_edge() const { return in_edge_; }
   void set_in_edge(Edge* edge) { in_edge_ = edge; }
 
+  /// The node's position in its State's GraphState.
+  int index() const { return index_; }
+
+  int id() const { return id_; }
+  void set_id(int id) { id_ = id; }
+
   const vector<Edge*>& out_edges() const { return out_edges_; }
   void AddOutEdge(Edge* edge) { out_edges_.push_back(edge); }
+  void RemoveOutEdge(Edge* edge);
 
 private:
   string path_;
-  /// Possible values of mtime_:
-  ///   -1: file hasn't been examined
-  ///   0:  we looked, and file doesn't exist
-  ///   >0: actual file's mtime
-  TimeStamp mtime_;
 
-  /// Dirty is true when the underlying file is out-of-date.
-  /// But note that Edge::outputs_ready_ is also used in judging which
-  /// edges to build.
-  bool dirty_;
+  /// Where the node's mtime and dirty state live.
+  GraphState* graph_state_;
+  int index_;
 
   /// The Edge that produces this Node, or NULL when there is no
   /// known edge to produce it.
@@ -93,21 +135,36 @@ private:
 
   /// All Edges that use this Node as an input.
   vector<Edge*> out_edges_;
+
+  /// A dense integer id for the node, assigned and used by DepsLog.
+  int id_;
 };
 
 /// An invokable build command and associated metadata (description, etc.).
 struct Rule {
-  Rule(const string& name) : name_(name), generator_(false), restat_(false) { }
+  Rule(const string& name)
+      : name_(name), generator_(false), restat_(false), hash_restat_(false),
+        local_(false) {}
 
   const string& name() const { return name_; }
 
   bool generator() const { return generator_; }
   bool restat() const { return restat_; }
+  /// True for "restat = hash": an output is considered unchanged if its
+  /// contents are, even if the command rewrote it.
+  bool hash_restat() const { return hash_restat_; }
+  /// True if commands must not be sent to remote workers.
+  bool local() const { return local_; }
 
   const EvalString& command() const { return command_; }
   EvalString& command() { return command_; }
   const EvalString& description() const { return description_; }
   const EvalString& depfile() const { return depfile_; }
+  const string& deps() const { return deps_; }
+  const EvalString& pool() const { return pool_; }
+  /// The command starting a persistent worker to run the rule's commands,
+  /// if any.
+  const EvalString& worker() const { return worker_; }
 
   // TODO: private:
 
@@ -118,73 +175,223 @@ struct Rule {
 
   bool generator_;
   bool restat_;
+  bool hash_restat_;
+  bool local_;
 
   EvalString command_;
   EvalString description_;
   EvalString depfile_;
+  /// How the depfile is handled; "gcc" to store it in the deps log.
+  string deps_;
+  /// The name of the pool the rule's edges run in, if any.
+  EvalString pool_;
+  EvalString worker_;
 };
 
 struct BuildLog;
 struct Node;
+struct Pool;
 struct State;
 
 /// An edge in the dependency graph; links between Nodes using Rules.
 struct Edge {
-  Edge() : rule_(NULL), env_(NULL), outputs_ready_(false), implicit_deps_(0),
-           order_only_deps_(0) {}
+  Edge(GraphState* graph_state, int index)
+      : graph_state_(graph_state), index_(index), rule_(NULL), pool_(NULL),
+        env_(NULL), most_recent_input_(1), critical_time_(0),
+        failed_before_(false), implicit_deps_(0), order_only_deps_(0),
+        loaded_deps_(0), command_hash_(0), command_hash_known_(false),
+        command_known_(false), depfile_known_(false),
+        description_known_(false) {}
 
   /// Examine inputs, outputs, and command lines to judge whether this edge
-  /// needs to be re-run, and update outputs_ready_ and each outputs' |dirty_|
-  /// state accordingly.
+  /// needs to be re-run, and update outputs_ready() and each outputs'
+  /// dirty() state accordingly.
   /// Returns false on failure.
   bool RecomputeDirty(State* state, DiskInterface* disk_interface, string* err);
 
   /// Recompute whether a given single output should be marked dirty.
   /// Returns true if so.
   bool RecomputeOutputDirty(BuildLog* build_log, TimeStamp most_recent_input,
-                            const string& command, Node* output);
+                            uint64_t command_hash, Node* output);
 
   /// Return true if all inputs' in-edges are ready.
   bool AllInputsReady() const;
 
-  string EvaluateCommand();  // XXX move to env, take env ptr
-  string EvaluateDepFile();
-  string GetDescription();
-  bool LoadDepFile(State* state, DiskInterface* disk_interface, string* err);
+  /// Evaluate the command, depfile and description.  Each is only
+  /// evaluated once and then kept, until ForgetEvaluatedStrings().
+  const string& EvaluateCommand();  // XXX move to env, take env ptr
+  const string& EvaluateDepFile();
+  const string& GetDescription();
+  /// Evaluate the command or depfile without keeping the result, for
+  /// callers that won't run the edge, such as tools.  A string already
+  /// kept is reused.
+  string EvaluateCommandUncached();
+  string EvaluateDepFileUncached();
+  /// Evaluate the command starting the edge's persistent worker, if any.
+  string EvaluateWorker();
+  /// Free the strings kept by the above, e.g. once the edge has run.
+  void ForgetEvaluatedStrings();
+  /// The BuildLog hash of EvaluateCommand(), computed only once.
+  uint64_t GetCommandHash();
+  /// Add the inputs listed in the edge's depfile, or if \a only_built just
+  /// those that are built by some edge, for the order edges are run in.
+  bool LoadDepFile(State* state, DiskInterface* disk_interface,
+                   bool only_built, string* err);
+  /// Parse the edge's depfile into \a nodes without adding them to the
+  /// edge.  A missing depfile yields no nodes.
+  bool ReadDepFile(State* state, DiskInterface* disk_interface,
+                   vector<Node*>* nodes, string* err);
+  /// Load the dependencies recorded for this edge in the deps log.
+  /// Returns false if there is no up-to-date record, in which case the
+  /// edge must be rebuilt to regenerate it.
+  bool LoadDepsFromLog(State* state, DiskInterface* disk_interface);
+  /// Drop the deps added by the above, so that the next RecomputeDirty()
+  /// can load them afresh.
+  void ForgetLoadedDeps();
 
   void Dump();
 
+ private:
+  /// RecomputeDirty() for inputs_[begin, end), which are all order-only
+  /// deps if \a order_only and none otherwise.
+  bool VisitInputs(State* state, DiskInterface* disk_interface,
+                   size_t begin, size_t end, bool order_only, bool* dirty,
+                   TimeStamp* most_recent_input, string* err);
+  /// Whether the edge is dirty no matter what its depfile says, e.g.
+  /// because an output is missing or older than an explicit source file.
+  bool DirtyWhateverTheDeps(DiskInterface* disk_interface);
+
+ public:
+  /// Where the edge's per-build state lives.
+  GraphState* graph_state_;
+  int index_;
+
   const Rule* rule_;
+  Pool* pool_;
   vector<Node*> inputs_;
   vector<Node*> outputs_;
   Env* env_;
-  bool outputs_ready_;
+  /// The newest mtime of the non-order-only inputs when RecomputeDirty()
+  /// ran.  Node mtimes aren't refreshed during a build, so this stays
+  /// valid for Plan::CleanNode() to recheck the outputs.
+  TimeStamp most_recent_input_;
+
+  /// Where this edge stands in the Plan building it.  Only Plan uses this.
+  enum Want {
+    /// The plan doesn't involve this edge or its dependents.
+    kNotInPlan,
+    /// We do not want to build the edge, but we might want to build one of
+    /// its dependents.
+    kWantNothing,
+    /// We want to build the edge, but have not yet scheduled it.
+    kWantToStart,
+    /// We want to build the edge, have scheduled it, and are waiting for
+    /// it to complete.
+    kWantToFinish
+  };
+  Want want() const { return (Want)graph_state_->edge_want[index_]; }
+  void set_want(Want want) { graph_state_->edge_want[index_] = want; }
+  /// The estimated time, in milliseconds, from starting this edge to
+  /// finishing the longest chain of wanted edges depending on it.  Set by
+  /// Plan::ComputeCriticalPath().
+  int64_t critical_time_;
+  /// Whether the edge failed in the previous build, or leads to one that
+  /// did, which makes it go ahead of the critical path.  Also set by
+  /// Plan::ComputeCriticalPath().
+  bool failed_before_;
 
   const Rule& rule() const { return *rule_; }
-  bool outputs_ready() const { return outputs_ready_; }
+  Pool* pool() const { return pool_; }
+  bool outputs_ready() const {
+    return graph_state_->edge_outputs_ready[index_] != 0;
+  }
+  void set_outputs_ready(bool ready) {
+    graph_state_->edge_outputs_ready[index_] = ready;
+  }
+  /// True once RecomputeDirty() has visited this edge.
+  bool scanned() const { return graph_state_->edge_scanned[index_] != 0; }
+  void set_scanned(bool scanned) {
+    graph_state_->edge_scanned[index_] = scanned;
+  }
+  /// True once a Builder has started this edge, even if a restat found
+  /// its outputs clean afterwards.
+  bool ran() const { return graph_state_->edge_ran[index_] != 0; }
+  void set_ran(bool ran) { graph_state_->edge_ran[index_] = ran; }
 
-  // XXX There are three types of inputs.
+  // There are three types of inputs.
   // 1) explicit deps, which show up as $in on the command line;
   // 2) implicit deps, which the target depends on implicitly (e.g. C headers),
   //                   and changes in them cause the target to rebuild;
   // 3) order-only deps, which are needed before the target builds but which
   //                     don't cause the target to rebuild.
-  // Currently we stuff all of these into inputs_ and keep counts of #2 and #3
-  // when we need to compute subsets.  This is suboptimal; should think of a
-  // better representation.  (Could make each pointer into a pair of a pointer
-  // and a type of input, or if memory matters could use the low bits of the
-  // pointer...)
+  // Each type is a contiguous range of inputs_, in this order:
+  //   explicit | implicit | order-only | implicit loaded from deps
+  // The implicit deps loaded from a depfile or the deps log come last, so
+  // that loading them is an append and forgetting them a truncation; the
+  // manifest's inputs are then always a prefix of inputs_.
   int implicit_deps_;
   int order_only_deps_;
-  bool is_implicit(int index) {
+  /// How many of the implicit deps were loaded from a depfile or the deps
+  /// log rather than named in the manifest.
+  int loaded_deps_;
+  /// Where the order-only deps start and end in inputs_.
+  size_t order_only_begin() const {
+    return inputs_.size() - loaded_deps_ - order_only_deps_;
+  }
+  size_t order_only_end() const { return inputs_.size() - loaded_deps_; }
+  bool is_implicit(int index) const {
     return index >= ((int)inputs_.size()) - order_only_deps_ - implicit_deps_ &&
         !is_order_only(index);
   }
-  bool is_order_only(int index) {
-    return index >= ((int)inputs_.size()) - order_only_deps_;
+  bool is_order_only(int index) const {
+    return index >= (int)order_only_begin() && index < (int)order_only_end();
   }
+  /// Whether an input that isn't order-only is dirty.
+  bool HasDirtyInputs() const;
 
   bool is_phony() const;
+
+ private:
+  friend struct MemoryStats;
+
+  uint64_t command_hash_;
+  bool command_hash_known_;
+  string command_;
+  string depfile_;
+  string description_;
+  bool command_known_;
+  bool depfile_known_;
+  bool description_known_;
+
+  /// Add \a nodes as implicit dependencies, making up phony edges for
+  /// any that have no in-edge so that a missing header isn't an error.
+  void AddImplicitDeps(State* state, const vector<Node*>& nodes);
+};
+
+/// Edges ready to run, handing out those that failed before first, and
+/// then the one with the longest critical path.  Ties go to the lowest
+/// address, for a stable order.
+struct EdgePriorityQueue {
+  bool empty() const { return heap_.empty(); }
+  size_t size() const { return heap_.size(); }
+  void push(Edge* edge);
+  Edge* pop();
+  void clear() { heap_.clear(); }
+
+  /// Restore the order after the critical times of queued edges changed.
+  void Reorder();
+
+ private:
+  struct Less {
+    bool operator()(const Edge* a, const Edge* b) const {
+      if (a->failed_before_ != b->failed_before_)
+        return b->failed_before_;
+      if (a->critical_time_ != b->critical_time_)
+        return a->critical_time_ < b->critical_time_;
+      return a > b;
+    }
+  };
+  vector<Edge*> heap_;
 };
 
 #endif  // NINJA_GRAPH_H_
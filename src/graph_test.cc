@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include "graph.h"
+#include "memory_stats.h"
 
 #include "test.h"
 
@@ -140,3 +141,132 @@ TEST_F(GraphTest, VarInOutQuoteSpaces) {
   EXPECT_EQ("cat nospace \"with space\" nospace2 > \"a b\"",
       edge->EvaluateCommand());
 }
+
+TEST_F(GraphTest, MostRecentInput) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat in1 in2 | implicit || order_only\n"));
+  fs_.Create("in1", 3, "");
+  fs_.Create("in2", 1, "");
+  fs_.Create("implicit", 5, "");
+  fs_.Create("order_only", 9, "");
+  fs_.Create("out", 2, "");
+
+  Edge* edge = GetNode("out")->in_edge();
+  string err;
+  EXPECT_TRUE(edge->RecomputeDirty(&state_, &fs_, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(GetNode("out")->dirty());
+
+  // Kept for Plan::CleanNode(); order-only inputs don't count.
+  EXPECT_EQ(5, edge->most_recent_input_);
+}
+
+TEST_F(GraphTest, EvaluatedStringsAreKept) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdesc\n"
+"  command = cat $in > $out\n"
+"  description = cat $out\n"
+"build out: catdesc in\n"));
+  Edge* edge = GetNode("out")->in_edge();
+
+  const string& command = edge->EvaluateCommand();
+  EXPECT_EQ("cat in > out", command);
+  EXPECT_EQ(&command, &edge->EvaluateCommand());
+  EXPECT_EQ("cat out", edge->GetDescription());
+
+  // Forgetting them only frees memory; they come back on demand.
+  uint64_t hash = edge->GetCommandHash();
+  edge->ForgetEvaluatedStrings();
+  EXPECT_EQ("cat in > out", edge->EvaluateCommand());
+  EXPECT_EQ(hash, edge->GetCommandHash());
+}
+
+TEST_F(GraphTest, UncachedEvaluationKeepsNothing) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  command = cat $in > $out\n"
+"  depfile = $out.d\n"
+"build out: catdep in\n"));
+  Edge* edge = GetNode("out")->in_edge();
+
+  EXPECT_EQ("cat in > out", edge->EvaluateCommandUncached());
+  EXPECT_EQ("out.d", edge->EvaluateDepFileUncached());
+  MemoryStats stats;
+  stats.AddState(state_);
+  const MemoryStats::Item* evaluated = stats.Find("evaluated edge strings");
+  ASSERT_TRUE(evaluated);
+  EXPECT_EQ(0, evaluated->count);
+
+  // An evaluation already kept is reused.
+  const string& command = edge->EvaluateCommand();
+  EXPECT_EQ(command, edge->EvaluateCommandUncached());
+}
+
+TEST_F(GraphTest, ResetReloadsDepfile) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build out.o: catdep foo.cc || order.h\n"));
+  fs_.Create("foo.cc", 1, "");
+  fs_.Create("a.h", 1, "");
+  fs_.Create("b.h", 1, "");
+  fs_.Create("order.h", 1, "");
+  fs_.Create("out.o.d", 1, "out.o: a.h\n");
+  fs_.Create("out.o", 1, "");
+
+  Edge* edge = GetNode("out.o")->in_edge();
+  string err;
+  EXPECT_TRUE(edge->RecomputeDirty(&state_, &fs_, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(3u, edge->inputs_.size());
+  EXPECT_EQ("a.h", edge->inputs_[2]->path());
+
+  // A later scan sees what the depfile says then, without duplicates.
+  fs_.Create("out.o.d", 1, "out.o: b.h\n");
+  state_.Reset();
+  EXPECT_TRUE(edge->RecomputeDirty(&state_, &fs_, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(3u, edge->inputs_.size());
+  EXPECT_EQ("foo.cc", edge->inputs_[0]->path());
+  EXPECT_EQ("order.h", edge->inputs_[1]->path());
+  EXPECT_EQ("b.h", edge->inputs_[2]->path());
+  EXPECT_TRUE(edge->is_order_only(1));
+  EXPECT_TRUE(edge->is_implicit(2));
+  EXPECT_TRUE(GetNode("a.h")->out_edges().empty());
+  EXPECT_EQ(1u, GetNode("b.h")->out_edges().size());
+}
+
+TEST_F(GraphTest, DirtyEdgeLoadsOnlyBuiltDeps) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build gen.h: cat gen.in\n"
+"build out.o: catdep foo.cc\n"));
+  fs_.Create("foo.cc", 2, "");
+  fs_.Create("a.h", 1, "");
+  fs_.Create("gen.in", 1, "");
+  fs_.Create("gen.h", 1, "");
+  fs_.Create("out.o.d", 1, "out.o: a.h gen.h\n");
+  fs_.Create("out.o", 1, "");
+
+  // foo.cc is newer than out.o, so the headers can't make a difference;
+  // only gen.h is needed, to build it first.
+  Edge* edge = GetNode("out.o")->in_edge();
+  string err;
+  EXPECT_TRUE(edge->RecomputeDirty(&state_, &fs_, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(GetNode("out.o")->dirty());
+  ASSERT_EQ(2u, edge->inputs_.size());
+  EXPECT_EQ("gen.h", edge->inputs_[1]->path());
+  EXPECT_TRUE(GetNode("gen.h")->in_edge()->scanned());
+
+  // Once clean as far as foo.cc goes, the depfile counts in full.
+  fs_.Create("out.o", 3, "");
+  state_.Reset();
+  EXPECT_TRUE(edge->RecomputeDirty(&state_, &fs_, &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(GetNode("out.o")->dirty());
+  EXPECT_EQ(3u, edge->inputs_.size());
+}
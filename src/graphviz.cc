@@ -14,22 +14,94 @@
 
 #include "graphviz.h"
 
-#include <stdio.h>
+#include <deque>
 
 #include "graph.h"
+#include "util.h"
 
-void GraphViz::AddTarget(Node* node) {
-  if (visited_.find(node) != visited_.end())
+namespace {
+
+/// Make sure \a index is within \a v.
+template <typename T>
+void Grow(vector<T>* v, int index) {
+  if ((size_t)index >= v->size())
+    v->resize(index + 1);
+}
+
+}  // namespace
+
+void GraphViz::AddTarget(Node* target) {
+  // Breadth first, so that each node is first reached at its least depth.
+  deque<pair<Node*, int> > queue(1, make_pair(target, 0));
+  while (!queue.empty()) {
+    Node* node = queue.front().first;
+    int depth = queue.front().second;
+    queue.pop_front();
+
+    // Without a limit depth doesn't matter, so each node is queued once.
+    int key = max_depth_ ? depth + 1 : 1;
+    Grow(&depths_, node->index());
+    if (depths_[node->index()] && depths_[node->index()] <= key)
+      continue;
+    depths_[node->index()] = key;
+
+    Edge* edge = node->in_edge();
+    bool cut_off = max_depth_ && depth >= max_depth_;
+    AddNode(node, cut_off && edge);
+    if (!edge || cut_off)
+      continue;
+
+    AddEdge(edge);
+    for (vector<Node*>::iterator in = edge->inputs_.begin();
+         in != edge->inputs_.end(); ++in) {
+      queue.push_back(make_pair(*in, depth + 1));
+    }
+  }
+}
+
+void GraphViz::AddNode(Node* node, bool cut_off) {
+  if (grouping_ != kFiles) {
+    Group(node);
     return;
+  }
 
-  printf("\"%p\" [label=\"%s\"]\n", node, node->path().c_str());
-  visited_.insert(node);
+  // 0: not drawn, 1: drawn, 2: drawn dashed.
+  Grow(&drawn_nodes_, node->index());
+  char& drawn = drawn_nodes_[node->index()];
+  if (!drawn) {
+    fprintf(out_, "\"%p\" [label=\"%s\"%s]\n", node, node->path().c_str(),
+            cut_off ? ", style=dashed" : "");
+  } else if (drawn == 2 && !cut_off) {
+    // Reached again closer to a target; attributes given later win.
+    fprintf(out_, "\"%p\" [style=solid]\n", node);
+  } else {
+    return;
+  }
+  drawn = cut_off ? 2 : 1;
+}
 
-  Edge* edge = node->in_edge();
+void GraphViz::AddEdge(Edge* edge) {
+  Grow(&drawn_edges_, edge->index_);
+  if (drawn_edges_[edge->index_])
+    return;
+  drawn_edges_[edge->index_] = true;
+
+  for (vector<Node*>::iterator out = edge->outputs_.begin();
+       out != edge->outputs_.end(); ++out) {
+    AddNode(*out, false);
+  }
 
-  if (!edge) {
-    // Leaf node.
-    // Draw as a rect?
+  if (grouping_ != kFiles) {
+    for (vector<Node*>::iterator in = edge->inputs_.begin();
+         in != edge->inputs_.end(); ++in) {
+      int from = Group(*in);
+      for (vector<Node*>::iterator out = edge->outputs_.begin();
+           out != edge->outputs_.end(); ++out) {
+        int to = Group(*out);
+        if (from != to && group_edges_.insert(make_pair(from, to)).second)
+          fprintf(out_, "\"g%d\" -> \"g%d\"\n", from, to);
+      }
+    }
     return;
   }
 
@@ -37,36 +109,51 @@ void GraphViz::AddTarget(Node* node) {
     // Can draw simply.
     // Note extra space before label text -- this is cosmetic and feels
     // like a graphviz bug.
-    printf("\"%p\" -> \"%p\" [label=\" %s\"]\n",
-           edge->inputs_[0], edge->outputs_[0], edge->rule_->name().c_str());
+    fprintf(out_, "\"%p\" -> \"%p\" [label=\" %s\"]\n",
+            edge->inputs_[0], edge->outputs_[0], edge->rule_->name().c_str());
   } else {
-    printf("\"%p\" [label=\"%s\", shape=ellipse]\n",
-           edge, edge->rule_->name().c_str());
+    fprintf(out_, "\"%p\" [label=\"%s\", shape=ellipse]\n",
+            edge, edge->rule_->name().c_str());
     for (vector<Node*>::iterator out = edge->outputs_.begin();
          out != edge->outputs_.end(); ++out) {
-      printf("\"%p\" -> \"%p\"\n", edge, *out);
+      fprintf(out_, "\"%p\" -> \"%p\"\n", edge, *out);
     }
     for (vector<Node*>::iterator in = edge->inputs_.begin();
          in != edge->inputs_.end(); ++in) {
       const char* order_only = "";
       if (edge->is_order_only(in - edge->inputs_.begin()))
         order_only = " style=dotted";
-      printf("\"%p\" -> \"%p\" [arrowhead=none%s]\n", (*in), edge, order_only);
+      fprintf(out_, "\"%p\" -> \"%p\" [arrowhead=none%s]\n", (*in), edge,
+              order_only);
     }
   }
+}
 
-  for (vector<Node*>::iterator in = edge->inputs_.begin();
-       in != edge->inputs_.end(); ++in) {
-    AddTarget(*in);
+int GraphViz::Group(Node* node) {
+  string name;
+  if (grouping_ == kRules) {
+    name = node->in_edge() ? node->in_edge()->rule_->name() : "(sources)";
+  } else {
+    name = DirName(node->path());
+    if (name.empty())
+      name = ".";
   }
+
+  map<string, int>::iterator i = groups_.find(name);
+  if (i != groups_.end())
+    return i->second;
+  int id = groups_.size();
+  groups_.insert(make_pair(name, id));
+  fprintf(out_, "\"g%d\" [label=\"%s\"]\n", id, name.c_str());
+  return id;
 }
 
 void GraphViz::Start() {
-  printf("digraph ninja {\n");
-  printf("node [fontsize=10, shape=box, height=0.25]\n");
-  printf("edge [fontsize=10]\n");
+  fprintf(out_, "digraph ninja {\n");
+  fprintf(out_, "node [fontsize=10, shape=box, height=0.25]\n");
+  fprintf(out_, "edge [fontsize=10]\n");
 }
 
 void GraphViz::Finish() {
-  printf("}\n");
+  fprintf(out_, "}\n");
 }
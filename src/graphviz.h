@@ -15,18 +15,64 @@
 #ifndef NINJA_GRAPHVIZ_H_
 #define NINJA_GRAPHVIZ_H_
 
+#include <stdio.h>
+
+#include <map>
 #include <set>
+#include <string>
+#include <utility>
+#include <vector>
 using namespace std;
 
+struct Edge;
 struct Node;
 
 /// Runs the process of creating GraphViz .dot file output.
+///
+/// The graph is written out as it is walked, breadth first from the
+/// targets, and what has been written is tracked in arrays indexed by
+/// Node::index() and Edge::index_, so even huge graphs cost little memory.
 struct GraphViz {
+  /// What each node drawn stands for.
+  enum Grouping {
+    kFiles,        // One file.
+    kRules,        // The outputs of a rule, or source files.
+    kDirectories   // The files in a directory.
+  };
+
+  GraphViz() : max_depth_(0), grouping_(kFiles), out_(stdout) {}
+
   void Start();
   void AddTarget(Node* node);
   void Finish();
 
-  set<Node*> visited_;
+  /// Show inputs at most this many edges away from a target; 0 shows them
+  /// all.  Files whose inputs are cut off are drawn dashed.
+  int max_depth_;
+  Grouping grouping_;
+  FILE* out_;
+
+ private:
+  /// Draw \a edge, the first time it is reached.
+  void AddEdge(Edge* edge);
+  /// Draw \a node if it hasn't been yet.  \a cut_off tells whether the
+  /// walk stops there.
+  void AddNode(Node* node, bool cut_off);
+  /// The id of the group \a node belongs to, drawing it when new.
+  int Group(Node* node);
+
+  /// For each node, the least depth it was queued at, plus one; 0 if it
+  /// hasn't been reached.
+  vector<int> depths_;
+  /// For each node, whether it has been drawn, and if so whether dashed.
+  vector<char> drawn_nodes_;
+  /// For each edge, whether it has been drawn.
+  vector<bool> drawn_edges_;
+
+  /// With grouping, the id of each group by name, and which connections
+  /// between them have been drawn.
+  map<string, int> groups_;
+  set<pair<int, int> > group_edges_;
 };
 
 #endif  // NINJA_GRAPHVIZ_H_
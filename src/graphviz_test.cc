@@ -0,0 +1,94 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "graphviz.h"
+
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct GraphVizTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out/a.o: cat src/a.c\n"
+"build out/b.o: cat src/b.c\n"
+"build out/lib: cat out/a.o out/b.o\n"
+"build app: cat out/lib\n"));
+    out_ = tmpfile();
+    ASSERT_TRUE(out_);
+    graph_.out_ = out_;
+  }
+  virtual void TearDown() {
+    fclose(out_);
+  }
+
+  /// Draw \a target and return the number of lines that took, counting
+  /// those containing \a text in \a matches.
+  int Draw(const char* target, const char* text, int* matches) {
+    graph_.Start();
+    graph_.AddTarget(GetNode(target));
+    graph_.Finish();
+
+    rewind(out_);
+    char buf[256];
+    int lines = 0;
+    *matches = 0;
+    while (fgets(buf, sizeof(buf), out_)) {
+      ++lines;
+      if (strstr(buf, text))
+        ++*matches;
+    }
+    return lines;
+  }
+
+  GraphViz graph_;
+  FILE* out_;
+};
+
+TEST_F(GraphVizTest, Full) {
+  int labels;
+  // Three header lines, a closing brace, 6 files, 3 simple edges, and
+  // out/lib's edge as a node with three connections.
+  EXPECT_EQ(17, Draw("app", "label=\"", &labels));
+  EXPECT_EQ(10, labels);
+}
+
+TEST_F(GraphVizTest, Depth) {
+  graph_.max_depth_ = 2;
+  int dashed;
+  // app, out/lib, out/a.o and out/b.o; the objects' inputs are cut off.
+  EXPECT_EQ(13, Draw("app", "dashed", &dashed));
+  EXPECT_EQ(2, dashed);
+}
+
+TEST_F(GraphVizTest, GroupByRule) {
+  graph_.grouping_ = GraphViz::kRules;
+  int arrows;
+  // Two groups, "cat" and "(sources)", with one arrow between them.
+  EXPECT_EQ(7, Draw("app", "->", &arrows));
+  EXPECT_EQ(1, arrows);
+}
+
+TEST_F(GraphVizTest, GroupByDirectory) {
+  graph_.grouping_ = GraphViz::kDirectories;
+  int arrows;
+  // ".", "out" and "src": src -> out -> ".".
+  EXPECT_EQ(9, Draw("app", "->", &arrows));
+  EXPECT_EQ(2, arrows);
+}
+
+}  // namespace
@@ -15,6 +15,10 @@
 #ifndef NINJA_MAP_H_
 #define NINJA_MAP_H_
 
+#include <utility>
+#include <vector>
+using namespace std;
+
 #include "string_piece.h"
 
 // MurmurHash2, by Austin Appleby
@@ -93,17 +97,171 @@ struct hash<StringPiece> {
 }
 #endif
 
-/// A template for hash_maps keyed by a StringPiece whose string is
+/// An open-addressing hash table keyed by StringPiece, for the hot
+/// path -> object maps.  Slots live in one array and cache the hash of
+/// their key, so a lookup is usually a single probe and a failed one
+/// rarely touches the key's bytes; collisions are resolved by linear
+/// probing.  Keys cannot be erased.
+///
+/// The interface is the subset of hash_map's that ninja uses, so it can
+/// stand in for one.
+template<typename V>
+struct FlatHashMap {
+  typedef StringPiece key_type;
+  typedef V mapped_type;
+  typedef pair<StringPiece, V> value_type;
+
+ private:
+  struct Slot {
+    Slot() : hash(0), used(false) {}
+    value_type value;
+    unsigned int hash;
+    bool used;
+  };
+
+  template<typename SlotT, typename ValueT>
+  struct Iterator {
+    Iterator() : slot_(NULL), end_(NULL) {}
+    Iterator(SlotT* slot, SlotT* end) : slot_(slot), end_(end) { Skip(); }
+    /// Allow converting iterator to const_iterator.
+    template<typename S, typename T>
+    Iterator(const Iterator<S, T>& o) : slot_(o.slot_), end_(o.end_) {}
+
+    ValueT& operator*() const { return slot_->value; }
+    ValueT* operator->() const { return &slot_->value; }
+    Iterator& operator++() {
+      ++slot_;
+      Skip();
+      return *this;
+    }
+    bool operator==(const Iterator& o) const { return slot_ == o.slot_; }
+    bool operator!=(const Iterator& o) const { return slot_ != o.slot_; }
+
+    void Skip() {
+      while (slot_ != end_ && !slot_->used)
+        ++slot_;
+    }
+
+    SlotT* slot_;
+    SlotT* end_;
+  };
+
+ public:
+  typedef Iterator<Slot, value_type> iterator;
+  typedef Iterator<const Slot, const value_type> const_iterator;
+
+  FlatHashMap() : size_(0) {}
+
+  iterator begin() { return iterator(Slots(), Slots() + slots_.size()); }
+  iterator end() {
+    return iterator(Slots() + slots_.size(), Slots() + slots_.size());
+  }
+  const_iterator begin() const {
+    return const_iterator(Slots(), Slots() + slots_.size());
+  }
+  const_iterator end() const {
+    return const_iterator(Slots() + slots_.size(), Slots() + slots_.size());
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t bucket_count() const { return slots_.size(); }
+  /// Bytes taken by the slots.
+  size_t allocated_bytes() const { return slots_.capacity() * sizeof(Slot); }
+
+  iterator find(StringPiece key) {
+    if (slots_.empty())
+      return end();
+    Slot* slot = Probe(key, Hash(key));
+    if (!slot->used)
+      return end();
+    return iterator(slot, Slots() + slots_.size());
+  }
+  const_iterator find(StringPiece key) const {
+    return const_cast<FlatHashMap*>(this)->find(key);
+  }
+
+  /// Insert \a value unless its key is already present.
+  pair<iterator, bool> insert(const value_type& value) {
+    Reserve(size_ + 1);
+    unsigned int hash = Hash(value.first);
+    Slot* slot = Probe(value.first, hash);
+    bool inserted = !slot->used;
+    if (inserted) {
+      slot->value = value;
+      slot->hash = hash;
+      slot->used = true;
+      ++size_;
+    }
+    return make_pair(iterator(slot, Slots() + slots_.size()), inserted);
+  }
+
+  V& operator[](StringPiece key) {
+    return insert(value_type(key, V())).first->second;
+  }
+
+  void clear() {
+    slots_.clear();
+    size_ = 0;
+  }
+
+  /// Make room for \a count entries without further rehashing.
+  void Reserve(size_t count) {
+    // Keep the table at most 3/4 full.
+    if (count * 4 <= slots_.size() * 3)
+      return;
+    size_t capacity = slots_.empty() ? 16 : slots_.size();
+    while (count * 4 > capacity * 3)
+      capacity *= 2;
+    vector<Slot> old_slots(capacity);
+    old_slots.swap(slots_);
+    for (typename vector<Slot>::iterator i = old_slots.begin();
+         i != old_slots.end(); ++i) {
+      if (!i->used)
+        continue;
+      // Keys are distinct, so just find the first free slot.
+      size_t mask = slots_.size() - 1;
+      size_t index = i->hash & mask;
+      while (slots_[index].used)
+        index = (index + 1) & mask;
+      slots_[index] = *i;
+    }
+  }
+
+ private:
+  static unsigned int Hash(StringPiece key) {
+    return MurmurHash2(key.str_, key.len_);
+  }
+
+  /// Return the slot holding \a key, or the empty slot where it belongs.
+  /// The table must not be full.
+  Slot* Probe(StringPiece key, unsigned int hash) {
+    size_t mask = slots_.size() - 1;
+    size_t index = hash & mask;
+    for (;;) {
+      Slot* slot = &slots_[index];
+      if (!slot->used ||
+          (slot->hash == hash && slot->value.first == key)) {
+        return slot;
+      }
+      index = (index + 1) & mask;
+    }
+  }
+
+  Slot* Slots() { return slots_.empty() ? NULL : &slots_[0]; }
+  const Slot* Slots() const { return slots_.empty() ? NULL : &slots_[0]; }
+
+  vector<Slot> slots_;
+  size_t size_;
+};
+
+/// A template for hash maps keyed by a StringPiece whose string is
 /// owned externally (typically by the values).  Use like:
 /// ExternalStringHash<Foo*>::Type foos; to make foos into a hash
 /// mapping StringPiece => Foo*.
 template<typename V>
 struct ExternalStringHashMap {
-#ifdef _MSC_VER
-  typedef hash_map<StringPiece, V, StringPieceCmp> Type;
-#else
-  typedef hash_map<StringPiece, V> Type;
-#endif
+  typedef FlatHashMap<V> Type;
 };
 
 #endif // NINJA_MAP_H_
@@ -0,0 +1,84 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compare FlatHashMap against the hash_map it replaced, on paths shaped
+// like those in a large build.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "hash_map.h"
+#include "util.h"
+
+#ifdef _MSC_VER
+typedef hash_map<StringPiece, int, StringPieceCmp> OldMap;
+#else
+typedef hash_map<StringPiece, int> OldMap;
+#endif
+typedef FlatHashMap<int> NewMap;
+
+/// Make \a count distinct paths like "out/obj/dir12/file345.o".
+void MakePaths(int count, vector<string>* paths) {
+  srand(1);
+  for (int i = 0; i < count; ++i) {
+    char buf[64];
+    sprintf(buf, "out/obj/third_party/dir%d/file%d.o", rand() % 500, i);
+    paths->push_back(buf);
+  }
+}
+
+template<typename Map>
+void Bench(const char* name, const vector<string>& paths,
+           const vector<string>& misses) {
+  const int kLookupRounds = 10;
+  int64_t start = GetTimeMillis();
+  Map map;
+  for (size_t i = 0; i < paths.size(); ++i)
+    map[paths[i]] = (int)i;
+  int64_t inserted = GetTimeMillis();
+
+  int found = 0;
+  for (int round = 0; round < kLookupRounds; ++round) {
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if (map.find(paths[i]) != map.end())
+        ++found;
+      if (map.find(misses[i]) != map.end())
+        --found;
+    }
+  }
+  int64_t end = GetTimeMillis();
+
+  printf("%-12s insert %4dms  lookup %4dms  (%d found)\n", name,
+         (int)(inserted - start), (int)(end - inserted), found);
+}
+
+int main(int argc, char* argv[]) {
+  int count = 500000;
+  if (argc > 1)
+    count = atoi(argv[1]);
+
+  vector<string> paths, misses;
+  MakePaths(count, &paths);
+  for (size_t i = 0; i < paths.size(); ++i)
+    misses.push_back(paths[i] + "bj");
+
+  printf("%d paths\n", count);
+  Bench<OldMap>("hash_map", paths, misses);
+  Bench<NewMap>("FlatHashMap", paths, misses);
+  return 0;
+}
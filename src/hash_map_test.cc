@@ -0,0 +1,74 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash_map.h"
+
+#include <set>
+
+#include "test.h"
+
+namespace {
+
+TEST(FlatHashMap, InsertFind) {
+  FlatHashMap<int> map;
+  EXPECT_TRUE(map.find("a") == map.end());
+  EXPECT_TRUE(map.insert(make_pair(StringPiece("a"), 1)).second);
+  EXPECT_FALSE(map.insert(make_pair(StringPiece("a"), 2)).second);
+  map["b"] = 3;
+  EXPECT_EQ(2u, map.size());
+  ASSERT_TRUE(map.find("a") != map.end());
+  EXPECT_EQ(1, map.find("a")->second);
+  EXPECT_EQ(3, map["b"]);
+  EXPECT_TRUE(map.find("c") == map.end());
+  // Prefixes and the empty string are distinct keys.
+  EXPECT_TRUE(map.find("") == map.end());
+  map[""] = 4;
+  EXPECT_EQ(4, map.find("")->second);
+}
+
+TEST(FlatHashMap, Grow) {
+  vector<string> keys;
+  for (int i = 0; i < 1000; ++i) {
+    char buf[16];
+    sprintf(buf, "key%d", i);
+    keys.push_back(buf);
+  }
+
+  FlatHashMap<int> map;
+  for (int i = 0; i < (int)keys.size(); ++i)
+    map[keys[i]] = i;
+  ASSERT_EQ(keys.size(), map.size());
+  EXPECT_LE(map.size() * 4, map.bucket_count() * 3);
+  for (int i = 0; i < (int)keys.size(); ++i) {
+    FlatHashMap<int>::iterator it = map.find(keys[i]);
+    ASSERT_TRUE(it != map.end()) << keys[i];
+    EXPECT_EQ(i, it->second);
+  }
+
+  // Iteration visits each entry once.
+  set<int> seen;
+  const FlatHashMap<int>& const_map = map;
+  for (FlatHashMap<int>::const_iterator i = const_map.begin();
+       i != const_map.end(); ++i) {
+    EXPECT_TRUE(seen.insert(i->second).second);
+  }
+  EXPECT_EQ(keys.size(), seen.size());
+
+  map.clear();
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.begin() == map.end());
+  EXPECT_TRUE(map.find("key1") == map.end());
+}
+
+}  // namespace
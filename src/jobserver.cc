@@ -0,0 +1,305 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "jobserver.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+namespace {
+
+#ifdef _WIN32
+/// A jobserver whose tokens are counts of a named semaphore.
+struct SemaphoreJobserver : public Jobserver {
+  explicit SemaphoreJobserver(HANDLE semaphore) : semaphore_(semaphore) {}
+  virtual ~SemaphoreJobserver() { CloseHandle(semaphore_); }
+
+  virtual bool Acquire() {
+    return WaitForSingleObject(semaphore_, 0) == WAIT_OBJECT_0;
+  }
+  virtual void Release() { ReleaseSemaphore(semaphore_, 1, NULL); }
+
+  HANDLE semaphore_;
+};
+#else
+/// A jobserver whose tokens are bytes in a pipe.
+struct PipeJobserver : public Jobserver {
+  PipeJobserver(int read_fd, int write_fd, int owned_fd)
+      : read_fd_(read_fd), write_fd_(write_fd), owned_fd_(owned_fd) {}
+  virtual ~PipeJobserver();
+
+  virtual bool Acquire();
+  virtual void Release();
+
+  /// read_fd_ is non-blocking if it's ours; otherwise it may be shared
+  /// with other clients, and mustn't be changed.
+  int read_fd_;
+  int write_fd_;
+  /// The descriptor we opened, if any, to close when done.
+  int owned_fd_;
+  /// The tokens held, to be given back as they were.
+  string tokens_;
+  /// If we created the jobserver, its fifo, to remove when done.
+  string fifo_;
+};
+
+PipeJobserver::~PipeJobserver() {
+  while (!tokens_.empty())
+    Release();
+  if (owned_fd_ >= 0)
+    close(owned_fd_);
+  if (!fifo_.empty()) {
+    unlink(fifo_.c_str());
+    rmdir(fifo_.substr(0, fifo_.rfind('/')).c_str());
+  }
+}
+
+/// A duplicate of a shared, blocking jobserver descriptor being read, for
+/// OnReadTimeout() to close.
+volatile sig_atomic_t g_timed_read_fd = -1;
+
+void OnReadTimeout(int) {
+  if (g_timed_read_fd >= 0)
+    close(g_timed_read_fd);
+  g_timed_read_fd = -1;
+}
+
+/// Read a byte into \a c from \a fd, which may block, giving up after a
+/// few milliseconds.  As in GNU make, the read is from a duplicate of \a fd
+/// that a timer closes, so that it fails even if the timer fires before
+/// the read starts.  The threads ninja starts block SIGALRM, so that the
+/// timer interrupts this one.
+bool TimedRead(int fd, char* c) {
+  int dup_fd = dup(fd);
+  if (dup_fd < 0)
+    return false;
+  struct sigaction act, old_act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = OnReadTimeout;  // Without SA_RESTART, to interrupt it.
+  sigaction(SIGALRM, &act, &old_act);
+  g_timed_read_fd = dup_fd;
+  struct itimerval timer, old_timer;
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value.tv_usec = 10 * 1000;
+  setitimer(ITIMER_REAL, &timer, &old_timer);
+
+  ssize_t len = read(dup_fd, c, 1);
+
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_REAL, &timer, NULL);
+  sigaction(SIGALRM, &old_act, NULL);
+  if (g_timed_read_fd >= 0)
+    close(dup_fd);
+  g_timed_read_fd = -1;
+  setitimer(ITIMER_REAL, &old_timer, NULL);
+  return len == 1;
+}
+
+bool PipeJobserver::Acquire() {
+  char token;
+  if (read_fd_ != owned_fd_) {
+    // The descriptor is shared and so blocking: someone may still take
+    // the token between the poll() and the read().
+    pollfd fd;
+    fd.fd = read_fd_;
+    fd.events = POLLIN;
+    if (poll(&fd, 1, 0) != 1 || !TimedRead(read_fd_, &token))
+      return false;
+  } else if (read(read_fd_, &token, 1) != 1) {
+    return false;
+  }
+  tokens_.push_back(token);
+  return true;
+}
+
+void PipeJobserver::Release() {
+  char token = '+';
+  if (!tokens_.empty()) {
+    token = tokens_[tokens_.size() - 1];
+    tokens_.resize(tokens_.size() - 1);
+  }
+  while (write(write_fd_, &token, 1) < 0 && errno == EINTR) {}
+}
+
+/// Open the fifo at \a path without blocking, for reading and writing.
+int OpenFifo(const string& path) {
+  int fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+  if (fd >= 0)
+    SetCloseOnExec(fd);
+  return fd;
+}
+
+bool IsPipe(int fd) {
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+#endif
+
+}  // namespace
+
+// static
+bool Jobserver::ParseMakeflags(const string& makeflags, Auth* auth) {
+  *auth = Auth();
+  // Look at every word, as later flags override earlier ones in make.
+  const char kAuth[] = "--jobserver-auth=";
+  const char kFds[] = "--jobserver-fds=";
+  size_t start = 0;
+  while (start < makeflags.size()) {
+    size_t end = makeflags.find(' ', start);
+    if (end == string::npos)
+      end = makeflags.size();
+    string word = makeflags.substr(start, end - start);
+    start = end + 1;
+
+    string value;
+    if (word.compare(0, sizeof(kAuth) - 1, kAuth) == 0)
+      value = word.substr(sizeof(kAuth) - 1);
+    else if (word.compare(0, sizeof(kFds) - 1, kFds) == 0)
+      value = word.substr(sizeof(kFds) - 1);
+    else if (word.size() > 2 && word[0] == '-' && word[1] == 'j')
+      auth->jobs = atoi(word.c_str() + 2);
+    if (value.empty())
+      continue;
+
+    int read_fd, write_fd;
+    char extra;
+    auth->path.clear();
+    auth->read_fd = auth->write_fd = -1;
+    if (value.compare(0, 5, "fifo:") == 0) {
+      auth->path = value.substr(5);
+    } else if (sscanf(value.c_str(), "%d,%d%c", &read_fd, &write_fd,
+                      &extra) == 2) {
+      // Negative descriptors mean there's no jobserver for us.
+      if (read_fd >= 0 && write_fd >= 0) {
+        auth->read_fd = read_fd;
+        auth->write_fd = write_fd;
+      }
+    } else {
+      auth->path = value;
+    }
+  }
+  return !auth->empty();
+}
+
+// static
+Jobserver* Jobserver::Connect(const Auth& auth, string* err) {
+#ifdef _WIN32
+  if (auth.read_fd >= 0) {
+    *err = "jobserver pipes aren't supported on Windows";
+    return NULL;
+  }
+  HANDLE semaphore = OpenSemaphoreA(SYNCHRONIZE | SEMAPHORE_MODIFY_STATE,
+                                    FALSE, auth.path.c_str());
+  if (!semaphore) {
+    *err = "opening jobserver semaphore " + auth.path + ": " +
+        GetLastErrorString();
+    return NULL;
+  }
+  return new SemaphoreJobserver(semaphore);
+#else
+  if (!auth.path.empty()) {
+    int fd = OpenFifo(auth.path);
+    if (fd < 0) {
+      *err = "opening jobserver fifo " + auth.path + ": " + strerror(errno);
+      return NULL;
+    }
+    return new PipeJobserver(fd, fd, fd);
+  }
+
+  // make only keeps the pipe open for commands it knows run make.
+  if (!IsPipe(auth.read_fd) || !IsPipe(auth.write_fd)) {
+    *err = "jobserver pipe isn't open; "
+        "mark the command running ninja as recursive with '+'";
+    return NULL;
+  }
+  int read_fd = -1;
+#ifdef __linux__
+  // Opening the pipe anew gives a descriptor of our own, which can be
+  // made non-blocking without upsetting anyone else reading from it.
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", auth.read_fd);
+  read_fd = open(path, O_RDONLY | O_NONBLOCK);
+  if (read_fd >= 0)
+    SetCloseOnExec(read_fd);
+#endif
+  if (read_fd < 0)
+    return new PipeJobserver(auth.read_fd, auth.write_fd, -1);
+  return new PipeJobserver(read_fd, auth.write_fd, read_fd);
+#endif
+}
+
+// static
+Jobserver* Jobserver::Create(int slots, string* err) {
+  char flags[64];
+#ifdef _WIN32
+  char name[64];
+  snprintf(name, sizeof(name), "ninja_jobserver_%lu",
+           (unsigned long)GetCurrentProcessId());
+  HANDLE semaphore = CreateSemaphoreA(NULL, slots - 1, slots - 1, name);
+  if (!semaphore) {
+    *err = "creating jobserver semaphore: " + GetLastErrorString();
+    return NULL;
+  }
+  snprintf(flags, sizeof(flags), " -j%d --jobserver-auth=", slots);
+  Jobserver* jobserver = new SemaphoreJobserver(semaphore);
+  string path = name;
+#else
+  string dir = GetTempDir() + "/ninja-jobserver-XXXXXX";
+  if (!mkdtemp(&dir[0])) {
+    *err = string("creating jobserver directory: ") + strerror(errno);
+    return NULL;
+  }
+  string path = dir + "/fifo";
+  int fd = -1;
+  if (mkfifo(path.c_str(), 0600) < 0 || (fd = OpenFifo(path)) < 0) {
+    *err = "creating jobserver fifo " + path + ": " + strerror(errno);
+    unlink(path.c_str());
+    rmdir(dir.c_str());
+    return NULL;
+  }
+  PipeJobserver* pipe_jobserver = new PipeJobserver(fd, fd, fd);
+  pipe_jobserver->fifo_ = path;
+  for (int i = 1; i < slots; ++i)
+    pipe_jobserver->Release();
+  snprintf(flags, sizeof(flags), " -j%d --jobserver-auth=fifo:", slots);
+  Jobserver* jobserver = pipe_jobserver;
+#endif
+
+  string makeflags;
+  if (const char* old = getenv("MAKEFLAGS"))
+    makeflags = old;
+  makeflags += flags + path;
+#ifdef _WIN32
+  _putenv(("MAKEFLAGS=" + makeflags).c_str());
+#else
+  setenv("MAKEFLAGS", makeflags.c_str(), 1);
+#endif
+  return jobserver;
+}
@@ -0,0 +1,68 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_JOBSERVER_H_
+#define NINJA_JOBSERVER_H_
+
+#include <string>
+using namespace std;
+
+/// A GNU make jobserver: a pool of tokens shared by a tree of nested
+/// builds.  Each build may run one command on its own, and takes a token
+/// from the pool for every further command it runs at the same time, so
+/// together they run no more than the pool allows.
+///
+/// The pool is advertised to child processes in $MAKEFLAGS, as
+/// "--jobserver-auth=fifo:PATH" (a named pipe, make 4.4 and up),
+/// "--jobserver-auth=R,W" or "--jobserver-fds=R,W" (an inherited pipe,
+/// older makes) on POSIX systems, and as "--jobserver-auth=NAME" (a named
+/// semaphore) on Windows.
+struct Jobserver {
+  virtual ~Jobserver() {}
+
+  /// Take a token if one is free right away.
+  virtual bool Acquire() = 0;
+  /// Give back a token taken by Acquire().
+  virtual void Release() = 0;
+
+  /// What $MAKEFLAGS says about the jobserver.
+  struct Auth {
+    Auth() : read_fd(-1), write_fd(-1), jobs(0) {}
+    /// The named pipe or semaphore, if that's what it is.
+    string path;
+    /// The inherited pipe otherwise, or -1.
+    int read_fd;
+    int write_fd;
+    /// The "-j" make was given, or 0 if none.
+    int jobs;
+
+    bool empty() const { return path.empty() && read_fd < 0; }
+  };
+  /// Parse \a makeflags, as found in $MAKEFLAGS.  Returns false if it
+  /// doesn't advertise a jobserver, e.g. because the command running us
+  /// wasn't marked as recursive.
+  static bool ParseMakeflags(const string& makeflags, Auth* auth);
+
+  /// Connect to the jobserver described by \a auth.  Returns NULL and
+  /// sets \a err if it can't be used.
+  static Jobserver* Connect(const Auth& auth, string* err);
+
+  /// Create a jobserver for \a slots commands in all, the one its creator
+  /// may always run included, and point $MAKEFLAGS at it so that child
+  /// processes use it.  Returns NULL and sets \a err on failure.
+  static Jobserver* Create(int slots, string* err);
+};
+
+#endif  // NINJA_JOBSERVER_H_
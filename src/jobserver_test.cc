@@ -0,0 +1,120 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "jobserver.h"
+
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "test.h"
+
+namespace {
+
+TEST(Jobserver, ParseMakeflags) {
+  Jobserver::Auth auth;
+  EXPECT_FALSE(Jobserver::ParseMakeflags("", &auth));
+  EXPECT_FALSE(Jobserver::ParseMakeflags("k -j8", &auth));
+  EXPECT_EQ(8, auth.jobs);
+
+  EXPECT_TRUE(Jobserver::ParseMakeflags(" -j8 --jobserver-auth=3,4", &auth));
+  EXPECT_EQ(3, auth.read_fd);
+  EXPECT_EQ(4, auth.write_fd);
+  EXPECT_EQ("", auth.path);
+  EXPECT_EQ(8, auth.jobs);
+
+  // The last one wins.
+  EXPECT_TRUE(Jobserver::ParseMakeflags(
+      "k -j --jobserver-fds=5,6 --jobserver-auth=fifo:/tmp/GMfifo1", &auth));
+  EXPECT_EQ(-1, auth.read_fd);
+  EXPECT_EQ("/tmp/GMfifo1", auth.path);
+  EXPECT_EQ(0, auth.jobs);
+
+  EXPECT_TRUE(Jobserver::ParseMakeflags("--jobserver-auth=gmake_sem", &auth));
+  EXPECT_EQ("gmake_sem", auth.path);
+
+  EXPECT_FALSE(Jobserver::ParseMakeflags(" -j4 --jobserver-auth=-2,-2",
+                                         &auth));
+}
+
+TEST(Jobserver, CreateConnect) {
+  const char* old_makeflags = getenv("MAKEFLAGS");
+  string saved = old_makeflags ? old_makeflags : "";
+
+  string err;
+  Jobserver* server = Jobserver::Create(3, &err);
+  ASSERT_TRUE(server) << err;
+  Jobserver::Auth auth;
+  ASSERT_TRUE(getenv("MAKEFLAGS"));
+  ASSERT_TRUE(Jobserver::ParseMakeflags(getenv("MAKEFLAGS"), &auth));
+  EXPECT_EQ(3, auth.jobs);
+  Jobserver* client = Jobserver::Connect(auth, &err);
+  ASSERT_TRUE(client) << err;
+
+  // Two tokens, for the server and client to share.
+  EXPECT_TRUE(server->Acquire());
+  EXPECT_TRUE(client->Acquire());
+  EXPECT_FALSE(client->Acquire());
+  EXPECT_FALSE(server->Acquire());
+  client->Release();
+  EXPECT_TRUE(server->Acquire());
+  server->Release();
+  server->Release();
+  delete client;
+  delete server;
+
+#ifdef _WIN32
+  _putenv(("MAKEFLAGS=" + saved).c_str());
+#else
+  if (old_makeflags)
+    setenv("MAKEFLAGS", saved.c_str(), 1);
+  else
+    unsetenv("MAKEFLAGS");
+#endif
+}
+
+#ifndef _WIN32
+TEST(Jobserver, InheritedPipe) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  ASSERT_EQ(1, write(fds[1], "x", 1));
+
+  Jobserver::Auth auth;
+  auth.read_fd = fds[0];
+  auth.write_fd = fds[1];
+  string err;
+  Jobserver* client = Jobserver::Connect(auth, &err);
+  ASSERT_TRUE(client) << err;
+  EXPECT_TRUE(client->Acquire());
+  EXPECT_FALSE(client->Acquire());
+  // The token goes back as it came.
+  client->Release();
+  char token = 0;
+  EXPECT_EQ(1, read(fds[0], &token, 1));
+  EXPECT_EQ('x', token);
+  delete client;
+
+  close(fds[0]);
+  close(fds[1]);
+  auth.read_fd = 100;
+  auth.write_fd = 101;
+  EXPECT_FALSE(Jobserver::Connect(auth, &err));
+  EXPECT_NE("", err);
+}
+#endif
+
+}  // namespace
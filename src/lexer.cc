@@ -17,20 +17,25 @@
 
 #include <stdio.h>
 
+#include "byte_scan.h"
 #include "eval_env.h"
 #include "util.h"
 
 bool Lexer::Error(const string& message, string* err) {
+  return ErrorAt(last_token_, message, err);
+}
+
+bool Lexer::ErrorAt(const char* pos, const string& message, string* err) {
   // Compute line/column.
   int line = 1;
   const char* context = input_.str_;
-  for (const char* p = input_.str_; p < last_token_; ++p) {
+  for (const char* p = input_.str_; p < pos; ++p) {
     if (*p == '\n') {
       ++line;
       context = p + 1;
     }
   }
-  int col = last_token_ ? last_token_ - context : 0;
+  int col = pos ? pos - context : 0;
 
   char buf[1024];
   snprintf(buf, sizeof(buf), "%s:%d: ", filename_.AsString().c_str(), line);
@@ -63,10 +68,10 @@ Lexer::Lexer(const char* input) {
   Start("input", input);
 }
 
-void Lexer::Start(StringPiece filename, StringPiece input) {
+void Lexer::Start(StringPiece filename, StringPiece input, size_t offset) {
   filename_ = filename;
   input_ = input;
-  ofs_ = input_.str_;
+  ofs_ = input_.str_ + offset;
   last_token_ = NULL;
 }
 
@@ -83,6 +88,7 @@ const char* Lexer::TokenName(Token t) {
   case NEWLINE:  return "newline";
   case PIPE2:    return "'||'";
   case PIPE:     return "'|'";
+  case POOL:     return "'pool'";
   case RULE:     return "'rule'";
   case SUBNINJA: return "'subninja'";
   case TEOF:     return "eof";
@@ -103,6 +109,7 @@ const char* Lexer::TokenErrorHint(Token t) {
   case NEWLINE:  return "";
   case PIPE2:    return "";
   case PIPE:     return "";
+  case POOL:     return "";
   case RULE:     return "";
   case SUBNINJA: return "";
   case TEOF:     return "";
@@ -197,6 +204,7 @@ Lexer::Token Lexer::ReadToken() {
 		} else {
 			if (yych <= 's') {
 				if (yych <= 'i') goto yy18;
+				if (yych == 'p') goto yy67;
 				if (yych <= 'q') goto yy20;
 				if (yych <= 'r') goto yy10;
 				goto yy19;
@@ -379,6 +387,18 @@ yy66:
 	++p;
 	yych = *p;
 	goto yy7;
+yy67:
+	yych = *++p;
+	if (yych != 'o') goto yy25;
+	yych = *++p;
+	if (yych != 'o') goto yy25;
+	yych = *++p;
+	if (yych != 'l') goto yy25;
+	++p;
+	if (yybm[0+(yych = *p)] & 32) {
+		goto yy24;
+	}
+	{ token = POOL;     break; }
 }
 
   }
@@ -569,7 +589,15 @@ bool Lexer::ReadEvalString(EvalString* eval, bool path, string* err) {
   const char* p = ofs_;
   const char* q;
   const char* start;
+  const char* end = input_.str_ + input_.len_;
   for (;;) {
+    // Take runs of plain text in bulk; the state machine below only has
+    // to deal with what ends them.
+    const char* text_end = FindManifestSpecial(p, end);
+    if (text_end != p) {
+      eval->AddText(StringPiece(p, text_end - p));
+      p = text_end;
+    }
     start = p;
     
 {
@@ -38,6 +38,7 @@ struct Lexer {
     NEWLINE,
     PIPE,
     PIPE2,
+    POOL,
     RULE,
     SUBNINJA,
     TEOF,
@@ -50,8 +51,8 @@ struct Lexer {
   /// Return a human-readable token hint, used in error messages.
   static const char* TokenErrorHint(Token t);
 
-  /// Start parsing some input.
-  void Start(StringPiece filename, StringPiece input);
+  /// Start parsing some input, from \a offset bytes into it.
+  void Start(StringPiece filename, StringPiece input, size_t offset = 0);
 
   /// Read a Token from the Token enum.
   Token ReadToken();
@@ -82,6 +83,13 @@ struct Lexer {
   /// Construct an error message with context.
   bool Error(const string& message, string* err);
 
+  /// Like Error(), but pointing at \a pos, a position returned by
+  /// last_token() for the same input.
+  bool ErrorAt(const char* pos, const string& message, string* err);
+
+  /// Where the last token read starts.
+  const char* last_token() const { return last_token_; }
+
 private:
   /// Skip past whitespace (called after each read token/ident/etc.).
   void EatWhitespace();
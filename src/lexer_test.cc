@@ -85,3 +85,12 @@ TEST(Lexer, CommentEOF) {
   Lexer::Token token = lexer.ReadToken();
   EXPECT_EQ(Lexer::ERROR, token);
 }
+
+TEST(Lexer, Keywords) {
+  Lexer lexer("pool pools po rule\n");
+  EXPECT_EQ(Lexer::POOL, lexer.ReadToken());
+  EXPECT_EQ(Lexer::IDENT, lexer.ReadToken());
+  EXPECT_EQ(Lexer::IDENT, lexer.ReadToken());
+  EXPECT_EQ(Lexer::RULE, lexer.ReadToken());
+  EXPECT_EQ(Lexer::NEWLINE, lexer.ReadToken());
+}
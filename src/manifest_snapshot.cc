@@ -0,0 +1,528 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_snapshot.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <map>
+
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+const char kFileSignature[] = "# ninja manifest snapshot v4\n";
+
+/// Get the modification time and size of \a path; returns false if it
+/// can't be stat()ed.
+bool StatFile(const string& path, int64_t* mtime, int64_t* size) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0)
+    return false;
+  *mtime = st.st_mtime;
+  *size = st.st_size;
+  return true;
+}
+
+/// Appends native-endian values to a buffer.  Snapshots are only ever
+/// read on the machine that wrote them.
+struct Writer {
+  void Int(uint32_t value) { buf_.append((const char*)&value, sizeof(value)); }
+  void Int64(int64_t value) { buf_.append((const char*)&value, sizeof(value)); }
+  void Str(StringPiece str) {
+    Int(str.len_);
+    buf_.append(str.str_, str.len_);
+  }
+
+  string buf_;
+};
+
+/// Reads what a Writer wrote, checking bounds; once anything is out of
+/// range every later read fails too.
+struct Reader {
+  Reader(const char* data, size_t size)
+      : pos_(data), end_(data + size), ok_(true) {}
+
+  uint32_t Int() {
+    uint32_t value = 0;
+    if (Have(sizeof(value))) {
+      memcpy(&value, pos_, sizeof(value));
+      pos_ += sizeof(value);
+    }
+    return value;
+  }
+  int64_t Int64() {
+    int64_t value = 0;
+    if (Have(sizeof(value))) {
+      memcpy(&value, pos_, sizeof(value));
+      pos_ += sizeof(value);
+    }
+    return value;
+  }
+  StringPiece Str() {
+    uint32_t len = Int();
+    if (!Have(len))
+      return StringPiece();
+    StringPiece str(pos_, len);
+    pos_ += len;
+    return str;
+  }
+  /// Read a count of items that take at least \a item_size bytes each.
+  uint32_t Count(size_t item_size) {
+    uint32_t count = Int();
+    if (count > (size_t)(end_ - pos_) / item_size)
+      ok_ = false;
+    return ok_ ? count : 0;
+  }
+  /// Read an index into a table of \a size entries.
+  uint32_t Index(size_t size) {
+    uint32_t index = Int();
+    if (index >= size)
+      ok_ = false;
+    return ok_ ? index : 0;
+  }
+
+  bool Have(size_t len) {
+    if (ok_ && len > (size_t)(end_ - pos_))
+      ok_ = false;
+    return ok_;
+  }
+
+  const char* pos_;
+  const char* end_;
+  bool ok_;
+};
+
+/// Number \a env and the scopes it's nested in, parents first, unless
+/// they already are.  Returns false if it isn't nested in the State's.
+bool NumberEnv(BindingEnv* env, map<BindingEnv*, int>* env_ids,
+               vector<BindingEnv*>* envs) {
+  vector<BindingEnv*> chain;
+  for (; env && env_ids->find(env) == env_ids->end();
+       env = static_cast<BindingEnv*>(env->parent())) {
+    chain.push_back(env);
+  }
+  for (vector<BindingEnv*>::reverse_iterator i = chain.rbegin();
+       i != chain.rend(); ++i) {
+    if (!(*i)->parent())
+      return false;
+    int id = envs->size();
+    (*env_ids)[*i] = id;
+    envs->push_back(*i);
+  }
+  return true;
+}
+
+}  // namespace
+
+bool RecordingFileReader::ReadFile(const string& path, string* content,
+                                   string* err) {
+  if (!file_reader_->ReadFile(path, content, err))
+    return false;
+  ScopedLock lock(&mutex_);
+  files_.push_back(path);
+  return true;
+}
+
+// static
+bool ManifestSnapshot::Save(const string& path, const string& manifest,
+                            const vector<string>& files, State* state,
+                            string* err) {
+  METRIC_RECORD("manifest snapshot save");
+  Writer out;
+  out.buf_ = kFileSignature;
+  out.Str(manifest);
+
+  out.Int(files.size());
+  for (vector<string>::const_iterator i = files.begin(); i != files.end();
+       ++i) {
+    int64_t mtime, size;
+    if (!StatFile(*i, &mtime, &size)) {
+      *err = *i + ": " + strerror(errno);
+      return false;
+    }
+    out.Str(*i);
+    out.Int64(mtime);
+    out.Int64(size);
+  }
+
+  // Rules, except for the builtin phony rule.
+  map<const Rule*, int> rule_ids;
+  out.Int(state->rules_.size() - 1);
+  for (map<string, const Rule*>::iterator i = state->rules_.begin();
+       i != state->rules_.end(); ++i) {
+    const Rule* rule = i->second;
+    if (rule == &State::kPhonyRule)
+      continue;
+    int id = rule_ids.size();
+    rule_ids[rule] = id;
+    out.Str(rule->name());
+    out.Int(rule->generator() | (rule->restat() << 1) |
+            (rule->hash_restat() << 2) | (rule->local() << 3));
+    out.Str(rule->deps());
+    const EvalString* evals[] = {
+      &rule->command(), &rule->description(), &rule->depfile(), &rule->pool(),
+      &rule->worker()
+    };
+    for (size_t e = 0; e < sizeof(evals) / sizeof(evals[0]); ++e) {
+      const EvalString::TokenList& tokens = evals[e]->parsed_;
+      out.Int(tokens.size());
+      for (EvalString::TokenList::const_iterator t = tokens.begin();
+           t != tokens.end(); ++t) {
+        out.Int(t->type);
+        out.Str(t->text);
+      }
+    }
+  }
+
+  map<Pool*, int> pool_ids;
+  out.Int(state->pools_.size());
+  for (map<string, Pool*>::iterator i = state->pools_.begin();
+       i != state->pools_.end(); ++i) {
+    int id = pool_ids.size();
+    pool_ids[i->second] = id;
+    out.Str(i->first);
+    out.Int(i->second->depth());
+  }
+
+  // Scopes, parents first; the first is the State's own.  Those of the
+  // manifest files count too, edges or not.
+  map<BindingEnv*, int> env_ids;
+  vector<BindingEnv*> envs;
+  env_ids[&state->bindings_] = 0;
+  envs.push_back(&state->bindings_);
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    // The parser only ever creates BindingEnvs.
+    if (!NumberEnv(static_cast<BindingEnv*>((*e)->env_), &env_ids, &envs)) {
+      *err = "edge scope is not nested in the manifest's";
+      return false;
+    }
+  }
+  for (vector<ManifestFile>::iterator f = state->manifest_files_.begin();
+       f != state->manifest_files_.end(); ++f) {
+    if (!NumberEnv(f->scope, &env_ids, &envs)) {
+      *err = "file scope is not nested in the manifest's";
+      return false;
+    }
+  }
+  out.Int(envs.size());
+  for (vector<BindingEnv*>::iterator i = envs.begin(); i != envs.end(); ++i) {
+    if (i != envs.begin())
+      out.Int(env_ids[static_cast<BindingEnv*>((*i)->parent_)]);
+    out.Int((*i)->bindings_.size());
+    for (BindingEnv::Bindings::iterator b = (*i)->bindings_.begin();
+         b != (*i)->bindings_.end(); ++b) {
+      out.Str(b->first->name());
+      out.Str(b->second);
+    }
+  }
+
+  // Number the nodes through their ids, which are put back afterwards.
+  vector<Node*> nodes;
+  vector<int> saved_ids;
+  nodes.reserve(state->paths_.size());
+  saved_ids.reserve(state->paths_.size());
+  out.Int(state->paths_.size());
+  for (State::Paths::iterator i = state->paths_.begin();
+       i != state->paths_.end(); ++i) {
+    saved_ids.push_back(i->second->id());
+    i->second->set_id(nodes.size());
+    nodes.push_back(i->second);
+    out.Str(i->first);
+  }
+
+  out.Int(state->edges_.size());
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    Edge* edge = *e;
+    // Rule ids are offset by one to make room for phony.
+    out.Int(edge->rule_ == &State::kPhonyRule ? 0 : rule_ids[edge->rule_] + 1);
+    // Likewise for the default pool.
+    out.Int(edge->pool_ == &State::kDefaultPool ? 0
+                                                : pool_ids[edge->pool_] + 1);
+    out.Int(env_ids[static_cast<BindingEnv*>(edge->env_)]);
+    // Only the manifest's inputs, which come before any loaded deps.
+    out.Int(edge->implicit_deps_ - edge->loaded_deps_);
+    out.Int(edge->order_only_deps_);
+    out.Int(edge->order_only_end());
+    for (size_t n = 0; n < edge->order_only_end(); ++n)
+      out.Int(edge->inputs_[n]->id());
+    out.Int(edge->outputs_.size());
+    for (vector<Node*>::iterator n = edge->outputs_.begin();
+         n != edge->outputs_.end(); ++n) {
+      out.Int((*n)->id());
+    }
+  }
+
+  out.Int(state->defaults_.size());
+  for (vector<Node*>::iterator n = state->defaults_.begin();
+       n != state->defaults_.end(); ++n) {
+    out.Int((*n)->id());
+  }
+
+  // What ManifestParser::Reparse() needs to know of the files.
+  out.Int(state->manifest_files_.size());
+  for (vector<ManifestFile>::iterator f = state->manifest_files_.begin();
+       f != state->manifest_files_.end(); ++f) {
+    out.Str(f->path);
+    out.Int64(f->hash);
+    out.Int(f->scope ? env_ids[f->scope] + 1 : 0);
+    out.Int(f->subninja | (f->defines_globals << 1) |
+            ((f->parent_bindings != NULL) << 2));
+    out.Int(f->globals_seen);
+    if (f->parent_bindings) {
+      out.Int(f->parent_bindings->bindings_.size());
+      for (BindingEnv::Bindings::iterator b =
+               f->parent_bindings->bindings_.begin();
+           b != f->parent_bindings->bindings_.end(); ++b) {
+        out.Str(b->first->name());
+        out.Str(b->second);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < nodes.size(); ++i)
+    nodes[i]->set_id(saved_ids[i]);
+
+  // Write to a temporary file so a reader never sees a partial snapshot.
+  string temp_path = path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (fwrite(out.buf_.data(), out.buf_.size(), 1, f) != 1) {
+    *err = strerror(errno);
+    fclose(f);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (fclose(f) != 0) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+#ifdef _WIN32
+  unlink(path.c_str());
+#endif
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+// static
+bool ManifestSnapshot::Load(const string& path, const string& manifest,
+                            State* state, vector<string>* files) {
+  METRIC_RECORD("manifest snapshot load");
+  MappedFile file;
+  string err;
+  if (file.Open(path, &err) < 0)
+    return false;
+  int64_t saved_time, saved_size;
+  if (!StatFile(path, &saved_time, &saved_size))
+    return false;
+
+  size_t signature_len = sizeof(kFileSignature) - 1;
+  if (file.size() < signature_len ||
+      memcmp(file.data(), kFileSignature, signature_len) != 0) {
+    return false;
+  }
+  Reader in(file.data() + signature_len, file.size() - signature_len);
+  if (!(in.Str() == manifest))
+    return false;
+
+  // Check the manifest files before touching the state.
+  if (files)
+    files->clear();
+  uint32_t file_count = in.Count(4 + 8 + 8);
+  for (uint32_t i = 0; i < file_count; ++i) {
+    string file_path = in.Str().AsString();
+    int64_t mtime = in.Int64();
+    int64_t size = in.Int64();
+    int64_t actual_mtime, actual_size;
+    if (!in.ok_ || !StatFile(file_path, &actual_mtime, &actual_size))
+      return false;
+    // A file modified in the second the snapshot was written may have
+    // been modified again without its mtime showing it.
+    if (actual_mtime != mtime || actual_size != size || mtime >= saved_time)
+      return false;
+    if (files)
+      files->push_back(file_path);
+  }
+  if (!in.ok_ || file_count == 0)
+    return false;
+
+  vector<const Rule*> rules;
+  rules.push_back(&State::kPhonyRule);
+  uint32_t rule_count = in.Count(4 + 8 + 4 + 4 + 4 + 4);
+  for (uint32_t i = 0; i < rule_count; ++i) {
+    Rule* rule = new Rule(in.Str().AsString());
+    uint32_t flags = in.Int();
+    rule->generator_ = (flags & 1) != 0;
+    rule->restat_ = (flags & 2) != 0;
+    rule->hash_restat_ = (flags & 4) != 0;
+    rule->local_ = (flags & 8) != 0;
+    rule->deps_ = in.Str().AsString();
+    EvalString* evals[] = {
+      &rule->command_, &rule->description_, &rule->depfile_, &rule->pool_,
+      &rule->worker_
+    };
+    for (size_t e = 0; e < sizeof(evals) / sizeof(evals[0]); ++e) {
+      uint32_t token_count = in.Count(4 + 4);
+      for (uint32_t t = 0; t < token_count; ++t) {
+        uint32_t type = in.Int();
+        StringPiece text = in.Str();
+        if (type == EvalString::SPECIAL)
+          evals[e]->AddSpecial(text);
+        else
+          evals[e]->AddText(text);
+      }
+    }
+    if (!in.ok_ || state->LookupRule(rule->name())) {
+      delete rule;
+      return false;
+    }
+    state->AddRule(rule);
+    rules.push_back(rule);
+  }
+
+  vector<Pool*> pools;
+  pools.push_back(&State::kDefaultPool);
+  uint32_t pool_count = in.Count(4 + 4);
+  for (uint32_t i = 0; i < pool_count; ++i) {
+    string name = in.Str().AsString();
+    int depth = in.Int();
+    if (!in.ok_ || depth < 0 || state->LookupPool(name))
+      return false;
+    Pool* pool = new Pool(name, depth);
+    state->AddPool(pool);
+    pools.push_back(pool);
+  }
+
+  vector<BindingEnv*> envs;
+  uint32_t env_count = in.Count(4);
+  for (uint32_t i = 0; i < env_count; ++i) {
+    BindingEnv* env = &state->bindings_;
+    if (i > 0)
+      env = new BindingEnv(envs[in.Index(envs.size())]);
+    uint32_t binding_count = in.Count(4 + 4);
+    for (uint32_t b = 0; b < binding_count; ++b) {
+      string key = in.Str().AsString();
+      env->AddBinding(key, in.Str().AsString());
+    }
+    envs.push_back(env);
+  }
+  if (!in.ok_ || envs.empty())
+    return false;
+
+  vector<Node*> nodes;
+  uint32_t node_count = in.Count(4);
+  nodes.reserve(node_count);
+  state->paths_.Reserve(node_count);
+  for (uint32_t i = 0; i < node_count; ++i) {
+    StringPiece node_path = in.Str();
+    if (!in.ok_)
+      return false;
+    nodes.push_back(state->GetNode(node_path));
+  }
+
+  uint32_t edge_count = in.Count(4 + 8 + 4 + 4 + 4);
+  state->edges_.reserve(edge_count);
+  for (uint32_t i = 0; i < edge_count; ++i) {
+    Edge* edge = state->AddEdge(rules[in.Index(rules.size())]);
+    edge->pool_ = pools[in.Index(pools.size())];
+    edge->env_ = envs[in.Index(envs.size())];
+    edge->implicit_deps_ = in.Int();
+    edge->order_only_deps_ = in.Int();
+    uint32_t input_count = in.Count(4);
+    edge->inputs_.reserve(input_count);
+    for (uint32_t n = 0; n < input_count; ++n) {
+      uint32_t id = in.Index(nodes.size());
+      if (!in.ok_)
+        return false;
+      Node* node = nodes[id];
+      edge->inputs_.push_back(node);
+      node->AddOutEdge(edge);
+    }
+    uint32_t output_count = in.Count(4);
+    edge->outputs_.reserve(output_count);
+    for (uint32_t n = 0; n < output_count; ++n) {
+      uint32_t id = in.Index(nodes.size());
+      if (!in.ok_)
+        return false;
+      Node* node = nodes[id];
+      edge->outputs_.push_back(node);
+      if (node->in_edge()) {
+        Warning("multiple rules generate %s. "
+                "build will not be correct; continuing anyway",
+                node->path().c_str());
+      }
+      node->set_in_edge(edge);
+    }
+    if (!in.ok_ ||
+        edge->implicit_deps_ + edge->order_only_deps_ >
+            (int)edge->inputs_.size()) {
+      return false;
+    }
+  }
+
+  uint32_t default_count = in.Count(4);
+  for (uint32_t i = 0; i < default_count; ++i) {
+    uint32_t id = in.Index(nodes.size());
+    if (!in.ok_)
+      return false;
+    state->defaults_.push_back(nodes[id]);
+  }
+
+  uint32_t manifest_file_count = in.Count(4 + 8 + 4 + 4 + 4);
+  for (uint32_t i = 0; i < manifest_file_count; ++i) {
+    ManifestFile file;
+    file.path = in.Str().AsString();
+    file.hash = in.Int64();
+    uint32_t scope = in.Index(envs.size() + 1);
+    file.scope = scope > 0 ? envs[scope - 1] : NULL;
+    uint32_t flags = in.Int();
+    file.subninja = (flags & 1) != 0;
+    file.defines_globals = (flags & 2) != 0;
+    file.globals_seen = in.Int();
+    if (flags & 4) {
+      file.parent_bindings = new BindingEnv;
+      uint32_t binding_count = in.Count(4 + 4);
+      for (uint32_t b = 0; b < binding_count; ++b) {
+        string key = in.Str().AsString();
+        file.parent_bindings->AddBinding(key, in.Str().AsString());
+      }
+    }
+    // Even if, the State owns it.
+    state->manifest_files_.push_back(file);
+    if (!in.ok_)
+      return false;
+  }
+
+  // Anything left over means the snapshot isn't what we think it is.
+  return in.ok_ && in.pos_ == in.end_;
+}
@@ -0,0 +1,63 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MANIFEST_SNAPSHOT_H_
+#define NINJA_MANIFEST_SNAPSHOT_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "parsers.h"
+#include "threads.h"
+
+struct State;
+
+/// A FileReader that passes reads through to another one and remembers
+/// which files were read, so a snapshot knows what it depends on.  Safe
+/// to use from several parser threads at once.
+struct RecordingFileReader : public ManifestParser::FileReader {
+  explicit RecordingFileReader(ManifestParser::FileReader* file_reader)
+      : file_reader_(file_reader) {}
+
+  virtual bool ReadFile(const string& path, string* content, string* err);
+
+  ManifestParser::FileReader* file_reader_;
+  vector<string> files_;
+  Mutex mutex_;
+};
+
+/// A binary image of a parsed State: rules, pools, scopes with their
+/// evaluated bindings, nodes, edges and defaults.  Loading one is much
+/// faster than lexing and parsing a large manifest again.
+///
+/// A snapshot records the modification time and size of every file the
+/// parser read.  It is only used while none of them has changed, and
+/// isn't trusted for files modified in the same second it was written.
+struct ManifestSnapshot {
+  /// Fill \a state from the snapshot at \a path if it was taken of
+  /// \a manifest and is still up to date.  Returns false if it can't be
+  /// used, in which case \a state may have been partially filled and
+  /// should be discarded.  If \a files is non-NULL, it's set to the
+  /// manifest files the snapshot was taken of.
+  static bool Load(const string& path, const string& manifest, State* state,
+                   vector<string>* files);
+
+  /// Write a snapshot of \a state, parsed from \a manifest and the
+  /// \a files it includes, to \a path.
+  static bool Save(const string& path, const string& manifest,
+                   const vector<string>& files, State* state, string* err);
+};
+
+#endif  // NINJA_MANIFEST_SNAPSHOT_H_
@@ -0,0 +1,257 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_snapshot.h"
+
+#include <sys/types.h>
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+#include "graph.h"
+#include "test.h"
+
+namespace {
+
+const char kSnapshot[] = "snapshot";
+
+struct RealFileReader : public ManifestParser::FileReader {
+  virtual bool ReadFile(const string& path, string* content, string* err) {
+    return ::ReadFile(path, content, err) == 0;
+  }
+};
+
+struct ManifestSnapshotTest : public testing::Test {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-ManifestSnapshotTest");
+    WriteFile("build.ninja",
+"cflags = -O2\n"
+"pool link\n"
+"  depth = 3\n"
+"rule cc\n"
+"  command = cc $cflags -c $in -o $out\n"
+"  description = CC $out\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"rule gen\n"
+"  command = regen\n"
+"  generator = 1\n"
+"  restat = 1\n"
+"  pool = link\n"
+"build a.o: cc a.c | a.h || gen.stamp\n"
+"  cflags = -g\n"
+"build gen.stamp: gen\n"
+"build all: phony a.o\n"
+"subninja sub.ninja\n"
+"default all\n");
+    WriteFile("sub.ninja",
+"cflags = -O0\n"
+"build b.o: cc b.c\n");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  /// Write \a path, dated well in the past.
+  void WriteFile(const string& path, const string& contents) {
+    FILE* f = fopen(path.c_str(), "wb");
+    ASSERT_TRUE(f);
+    fputs(contents.c_str(), f);
+    fclose(f);
+    struct utimbuf times = { 1000000000, 1000000000 };
+    ASSERT_EQ(0, utime(path.c_str(), &times));
+  }
+
+  /// Parse build.ninja into \a state and snapshot it.
+  void ParseAndSave(State* state) {
+    RecordingFileReader reader(&file_reader_);
+    ManifestParser parser(state, &reader);
+    string err;
+    ASSERT_TRUE(parser.Load("build.ninja", &err));
+    ASSERT_EQ("", err);
+    ASSERT_EQ(2u, reader.files_.size());
+    ASSERT_TRUE(ManifestSnapshot::Save(kSnapshot, "build.ninja",
+                                       reader.files_, state, &err));
+    ASSERT_EQ("", err);
+  }
+
+  ScopedTempDir temp_dir_;
+  RealFileReader file_reader_;
+};
+
+TEST_F(ManifestSnapshotTest, RoundTrip) {
+  State parsed;
+  ParseAndSave(&parsed);
+
+  State state;
+  vector<string> files;
+  ASSERT_TRUE(ManifestSnapshot::Load(kSnapshot, "build.ninja", &state,
+                                     &files));
+  ASSERT_EQ(2u, files.size());
+  EXPECT_EQ("build.ninja", files[0]);
+  EXPECT_EQ("sub.ninja", files[1]);
+  ASSERT_EQ(parsed.edges_.size(), state.edges_.size());
+  ASSERT_EQ(parsed.paths_.size(), state.paths_.size());
+  for (size_t i = 0; i < state.edges_.size(); ++i) {
+    Edge* expected = parsed.edges_[i];
+    Edge* edge = state.edges_[i];
+    EXPECT_EQ(expected->rule_->name(), edge->rule_->name());
+    EXPECT_EQ(expected->pool_->name(), edge->pool_->name());
+    EXPECT_EQ(expected->EvaluateCommand(), edge->EvaluateCommand());
+    EXPECT_EQ(expected->GetDescription(), edge->GetDescription());
+    EXPECT_EQ(expected->EvaluateDepFile(), edge->EvaluateDepFile());
+    EXPECT_EQ(expected->implicit_deps_, edge->implicit_deps_);
+    EXPECT_EQ(expected->order_only_deps_, edge->order_only_deps_);
+    ASSERT_EQ(expected->inputs_.size(), edge->inputs_.size());
+    for (size_t n = 0; n < edge->inputs_.size(); ++n)
+      EXPECT_EQ(expected->inputs_[n]->path(), edge->inputs_[n]->path());
+  }
+
+  EXPECT_EQ("cc -g -c a.c -o a.o", state.edges_[0]->EvaluateCommand());
+  EXPECT_EQ("cc -O0 -c b.c -o b.o", state.edges_[3]->EvaluateCommand());
+  EXPECT_TRUE(state.edges_[2]->is_phony());
+  const Rule* gen = state.LookupRule("gen");
+  ASSERT_TRUE(gen);
+  EXPECT_TRUE(gen->generator());
+  EXPECT_TRUE(gen->restat());
+  Pool* link = state.LookupPool("link");
+  ASSERT_TRUE(link);
+  EXPECT_EQ(3, link->depth());
+  EXPECT_EQ(link, state.edges_[1]->pool());
+  EXPECT_EQ(&State::kDefaultPool, state.edges_[0]->pool());
+  EXPECT_EQ("gcc", state.LookupRule("cc")->deps());
+  EXPECT_EQ("-O2", state.bindings_.LookupVariable("cflags"));
+
+  Node* a = state.LookupNode("a.o");
+  ASSERT_TRUE(a);
+  EXPECT_EQ(state.edges_[0], a->in_edge());
+  ASSERT_EQ(1u, a->out_edges().size());
+  EXPECT_EQ(state.edges_[2], a->out_edges()[0]);
+
+  string err;
+  vector<Node*> defaults = state.DefaultNodes(&err);
+  ASSERT_EQ(1u, defaults.size());
+  EXPECT_EQ("all", defaults[0]->path());
+}
+
+TEST_F(ManifestSnapshotTest, Reparse) {
+  State parsed;
+  ParseAndSave(&parsed);
+  State state;
+  ASSERT_TRUE(ManifestSnapshot::Load(kSnapshot, "build.ninja", &state, NULL));
+
+  // What the parser noted of the files survives, so the state can be
+  // patched like one that was just parsed.
+  ASSERT_EQ(2u, state.manifest_files_.size());
+  ManifestFile& sub = state.manifest_files_[1];
+  EXPECT_EQ("sub.ninja", sub.path);
+  EXPECT_EQ(parsed.manifest_files_[1].hash, sub.hash);
+  EXPECT_TRUE(sub.subninja);
+  EXPECT_FALSE(sub.defines_globals);
+  EXPECT_TRUE(state.manifest_files_[0].defines_globals);
+  EXPECT_EQ(&state.bindings_, state.manifest_files_[0].scope);
+  EXPECT_EQ(state.edges_[3]->env_, sub.scope);
+  ASSERT_TRUE(sub.parent_bindings);
+  EXPECT_EQ("-O2", sub.parent_bindings->LookupVariable("cflags"));
+
+  WriteFile("sub.ninja", "build c.o: cc c.c\n");
+  ManifestParser parser(&state, &file_reader_);
+  string err;
+  ASSERT_TRUE(parser.Reparse(1, &err)) << err;
+  ASSERT_EQ(4u, state.edges_.size());
+  EXPECT_EQ("cc -O2 -c c.c -o c.o", state.edges_[3]->EvaluateCommand());
+  EXPECT_FALSE(state.LookupNode("b.o")->in_edge());
+}
+
+TEST_F(ManifestSnapshotTest, LoadedDeps) {
+  State parsed;
+  ParseAndSave(&parsed);
+
+  // Deps loaded into the state since the parse aren't part of the
+  // manifest.
+  VirtualFileSystem fs;
+  fs.Create("a.c", 1, "");
+  fs.Create("a.h", 1, "");
+  fs.Create("b.h", 1, "");
+  fs.Create("a.o", 2, "");
+  fs.Create("a.o.d", 1, "a.o: b.h\n");
+  Edge* edge = parsed.edges_[0];
+  string err;
+  ASSERT_TRUE(edge->RecomputeDirty(&parsed, &fs, &err));
+  ASSERT_EQ(1, edge->loaded_deps_);
+  vector<string> manifests;
+  manifests.push_back("build.ninja");
+  manifests.push_back("sub.ninja");
+  ASSERT_TRUE(ManifestSnapshot::Save(kSnapshot, "build.ninja", manifests,
+                                     &parsed, &err));
+
+  State state;
+  ASSERT_TRUE(ManifestSnapshot::Load(kSnapshot, "build.ninja", &state, NULL));
+  edge = state.edges_[0];
+  ASSERT_EQ(3u, edge->inputs_.size());
+  EXPECT_EQ(1, edge->implicit_deps_);
+  EXPECT_EQ(0, edge->loaded_deps_);
+  EXPECT_TRUE(edge->is_order_only(2));
+  EXPECT_EQ("gen.stamp", edge->inputs_[2]->path());
+}
+
+TEST_F(ManifestSnapshotTest, ManifestChanged) {
+  State parsed;
+  ParseAndSave(&parsed);
+
+  WriteFile("sub.ninja", "build c.o: cc c.c\n");
+  State state;
+  EXPECT_FALSE(ManifestSnapshot::Load(kSnapshot, "build.ninja", &state, NULL));
+}
+
+TEST_F(ManifestSnapshotTest, OtherManifest) {
+  State parsed;
+  ParseAndSave(&parsed);
+
+  State state;
+  EXPECT_FALSE(ManifestSnapshot::Load(kSnapshot, "other.ninja", &state, NULL));
+}
+
+TEST_F(ManifestSnapshotTest, RacyManifest) {
+  State parsed;
+  ParseAndSave(&parsed);
+
+  // Modified in the same second as, or after, the snapshot was written.
+  struct utimbuf times = { time(NULL) + 10, time(NULL) + 10 };
+  ASSERT_EQ(0, utime("build.ninja", &times));
+  State state;
+  EXPECT_FALSE(ManifestSnapshot::Load(kSnapshot, "build.ninja", &state, NULL));
+}
+
+TEST_F(ManifestSnapshotTest, Truncated) {
+  State parsed;
+  ParseAndSave(&parsed);
+
+  string contents, err;
+  ASSERT_EQ(0, ReadFile(kSnapshot, &contents, &err));
+  // Every truncation is rejected without crashing.
+  for (size_t size = contents.size() - 1; size > 0; --size) {
+    FILE* f = fopen(kSnapshot, "wb");
+    ASSERT_TRUE(f);
+    fwrite(contents.data(), size, 1, f);
+    fclose(f);
+    State state;
+    EXPECT_FALSE(ManifestSnapshot::Load(kSnapshot, "build.ninja", &state, NULL))
+        << size;
+  }
+}
+
+}  // namespace
@@ -0,0 +1,239 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "memory_stats.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "build_log.h"
+#include "deps_log.h"
+#include "eval_env.h"
+#include "graph.h"
+#include "state.h"
+
+namespace {
+
+/// What a std::map node holds besides its value: the color and the
+/// parent, left and right links, as in the common red-black trees.
+const size_t kMapNodeOverhead = 4 * sizeof(void*);
+
+template<typename T>
+size_t VectorBytes(const vector<T>& v) {
+  return v.capacity() * sizeof(T);
+}
+
+/// Objects placed in the Arena take up their size rounded up like this.
+size_t ArenaBytes(size_t size) {
+  return (size + 15) & ~(size_t)15;
+}
+
+bool ByBytes(const MemoryStats::Item& a, const MemoryStats::Item& b) {
+  return a.bytes > b.bytes;
+}
+
+}  // namespace
+
+// static
+size_t MemoryStats::StringBytes(const string& str) {
+  // A short string's characters live within the object itself.
+  const char* data = str.data();
+  const char* object = reinterpret_cast<const char*>(&str);
+  if (data >= object && data < object + sizeof(str))
+    return 0;
+  return str.capacity() + 1;
+}
+
+const MemoryStats::Item* MemoryStats::Find(const string& name) const {
+  for (deque<Item>::const_iterator i = items_.begin(); i != items_.end();
+       ++i) {
+    if (i->name == name)
+      return &*i;
+  }
+  return NULL;
+}
+
+MemoryStats::Item* MemoryStats::Get(const string& name) {
+  for (deque<Item>::iterator i = items_.begin(); i != items_.end(); ++i) {
+    if (i->name == name)
+      return &*i;
+  }
+  items_.push_back(Item(name));
+  return &items_.back();
+}
+
+void MemoryStats::AddEvalString(const EvalString& str, Item* item) {
+  item->count += str.parsed_.size();
+  item->bytes += VectorBytes(str.parsed_);
+  for (EvalString::TokenList::const_iterator i = str.parsed_.begin();
+       i != str.parsed_.end(); ++i) {
+    item->bytes += StringBytes(i->text);
+  }
+}
+
+void MemoryStats::AddEnv(const BindingEnv& env, Item* item) {
+  item->count += env.bindings_.size();
+  for (BindingEnv::Bindings::const_iterator i = env.bindings_.begin();
+       i != env.bindings_.end(); ++i) {
+    item->bytes += kMapNodeOverhead + sizeof(*i) + StringBytes(i->second);
+  }
+}
+
+void MemoryStats::AddState(const State& state) {
+  Item* nodes = Get("nodes");
+  Item* paths = Get("node paths");
+  nodes->count += state.nodes_.size();
+  nodes->bytes += VectorBytes(state.nodes_);
+  paths->count += state.nodes_.size();
+  for (vector<Node*>::const_iterator i = state.nodes_.begin();
+       i != state.nodes_.end(); ++i) {
+    nodes->bytes += sizeof(Node) + VectorBytes((*i)->out_edges());
+    paths->bytes += StringBytes((*i)->path());
+  }
+
+  Item* edges = Get("edges");
+  Item* evaluated = Get("evaluated edge strings");
+  edges->count += state.edges_.size();
+  edges->bytes += VectorBytes(state.edges_);
+  // Scopes are shared by many edges; count each once.
+  set<const BindingEnv*> envs;
+  envs.insert(&state.bindings_);
+  for (vector<Edge*>::const_iterator i = state.edges_.begin();
+       i != state.edges_.end(); ++i) {
+    const Edge* edge = *i;
+    edges->bytes += sizeof(Edge) + VectorBytes(edge->inputs_) +
+        VectorBytes(edge->outputs_);
+    if (edge->command_known_)
+      ++evaluated->count;
+    evaluated->bytes += StringBytes(edge->command_) +
+        StringBytes(edge->depfile_) + StringBytes(edge->description_);
+    // Edge scopes always are BindingEnvs nested in the manifest's.
+    for (const BindingEnv* env = static_cast<const BindingEnv*>(edge->env_);
+         env && envs.insert(env).second;
+         env = static_cast<const BindingEnv*>(env->parent())) {}
+  }
+  for (vector<ManifestFile>::const_iterator i = state.manifest_files_.begin();
+       i != state.manifest_files_.end(); ++i) {
+    if (i->scope)
+      envs.insert(i->scope);
+  }
+
+  Item* scopes = Get("scopes");
+  Item* bindings = Get("bindings");
+  scopes->count += envs.size();
+  for (set<const BindingEnv*>::iterator i = envs.begin(); i != envs.end();
+       ++i) {
+    scopes->bytes += sizeof(BindingEnv);
+    AddEnv(**i, bindings);
+  }
+
+  Item* rules = Get("rules");
+  Item* tokens = Get("rule eval string tokens");
+  rules->count += state.rules_.size();
+  for (map<string, const Rule*>::const_iterator i = state.rules_.begin();
+       i != state.rules_.end(); ++i) {
+    const Rule* rule = i->second;
+    rules->bytes += kMapNodeOverhead + sizeof(*i) + StringBytes(i->first) +
+        sizeof(Rule) + StringBytes(rule->name_) + StringBytes(rule->deps_);
+    AddEvalString(rule->command_, tokens);
+    AddEvalString(rule->description_, tokens);
+    AddEvalString(rule->depfile_, tokens);
+    AddEvalString(rule->pool_, tokens);
+    AddEvalString(rule->worker_, tokens);
+  }
+
+  Item* buckets = Get("path hash buckets");
+  buckets->count += state.paths_.bucket_count();
+  buckets->bytes += state.paths_.allocated_bytes();
+
+  const GraphState& graph = state.graph_state_;
+  Item* graph_state = Get("per-build node and edge state");
+  graph_state->count += graph.node_mtimes.size() + graph.edge_want.size();
+  graph_state->bytes += VectorBytes(graph.node_mtimes) +
+      VectorBytes(graph.node_dirty) + VectorBytes(graph.edge_outputs_ready) +
+      VectorBytes(graph.edge_scanned) + VectorBytes(graph.edge_want) +
+      VectorBytes(graph.edge_ran);
+
+  // Nodes and edges live in the arena, and are counted above; the rest
+  // of its blocks is padding and room not yet used.
+  size_t used = state.nodes_.size() * ArenaBytes(sizeof(Node)) +
+      state.edges_.size() * ArenaBytes(sizeof(Edge));
+  Item* arena = Get("arena slack");
+  if (state.arena_.allocated_bytes() > used)
+    arena->bytes += state.arena_.allocated_bytes() - used;
+  arena->bytes += state.nodes_.size() * (ArenaBytes(sizeof(Node)) -
+                                         sizeof(Node));
+  arena->bytes += state.edges_.size() * (ArenaBytes(sizeof(Edge)) -
+                                         sizeof(Edge));
+}
+
+void MemoryStats::AddBuildLog(const BuildLog& log) {
+  Item* entries = Get("build log entries");
+  entries->count += log.entries_.size();
+  entries->bytes += log.entries_.size() * sizeof(BuildLog::LogEntry) +
+      log.log_.allocated_bytes();
+  for (deque<string>::const_iterator i = log.owned_outputs_.begin();
+       i != log.owned_outputs_.end(); ++i) {
+    entries->bytes += sizeof(*i) + StringBytes(*i);
+  }
+
+  Item* mapped = Get("build log (mapped)");
+  mapped->bytes += log.mapped_.size();
+}
+
+void MemoryStats::AddDepsLog(const DepsLog& log) {
+  Item* records = Get("deps log records");
+  records->bytes += VectorBytes(log.nodes_) + VectorBytes(log.deps_) +
+      VectorBytes(log.owned_ids_);
+  const char* mapped_begin = log.mapped_.data();
+  const char* mapped_end = mapped_begin + log.mapped_.size();
+  for (vector<DepsLog::Deps>::const_iterator i = log.deps_.begin();
+       i != log.deps_.end(); ++i) {
+    if (i->node_count < 0)
+      continue;
+    ++records->count;
+    // Ids loaded from disk point into the mapped log.
+    const char* ids = reinterpret_cast<const char*>(i->node_ids);
+    if (ids && (ids < mapped_begin || ids >= mapped_end))
+      records->bytes += i->node_count * sizeof(int);
+  }
+
+  Item* mapped = Get("deps log (mapped)");
+  mapped->bytes += log.mapped_.size();
+}
+
+int64_t MemoryStats::total_bytes() const {
+  int64_t total = 0;
+  for (deque<Item>::const_iterator i = items_.begin(); i != items_.end();
+       ++i) {
+    total += i->bytes;
+  }
+  return total;
+}
+
+void MemoryStats::Report(FILE* out) const {
+  vector<Item> items(items_.begin(), items_.end());
+  stable_sort(items.begin(), items.end(), ByBytes);
+  int64_t total = total_bytes();
+  fprintf(out, "%-32s %10s %14s %6s\n", "what", "count", "bytes", "share");
+  for (vector<Item>::iterator i = items.begin(); i != items.end(); ++i) {
+    fprintf(out, "%-32s %10lld %14lld %5.1f%%\n", i->name.c_str(),
+            (long long)i->count, (long long)i->bytes,
+            total > 0 ? 100.0 * i->bytes / total : 0.0);
+  }
+  fprintf(out, "%-32s %10s %14lld\n", "total", "", (long long)total);
+}
@@ -0,0 +1,75 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_MEMORY_STATS_H_
+#define NINJA_MEMORY_STATS_H_
+
+#include <stdio.h>
+
+#include <deque>
+#include <string>
+using namespace std;
+
+#include "util.h"  // For int64_t.
+
+struct BindingEnv;
+struct BuildLog;
+struct DepsLog;
+struct EvalString;
+struct State;
+
+/// Counts the objects that make up a loaded build, and the bytes they
+/// hold, for "-t memstats".
+///
+/// Bytes are those of the objects themselves plus the heap blocks they
+/// own (string and vector buffers, map nodes), as requested from the
+/// allocator: its own overhead per block is not included.  Map node
+/// sizes are estimates, as the standard library doesn't tell.
+struct MemoryStats {
+  struct Item {
+    Item(const string& name) : name(name), count(0), bytes(0) {}
+    string name;
+    int64_t count;
+    int64_t bytes;
+  };
+
+  /// Count the nodes, edges, rules and scopes of \a state.
+  void AddState(const State& state);
+  void AddBuildLog(const BuildLog& log);
+  void AddDepsLog(const DepsLog& log);
+
+  const deque<Item>& items() const { return items_; }
+  /// The item named \a name, or NULL if there is none.
+  const Item* Find(const string& name) const;
+  int64_t total_bytes() const;
+
+  /// Print a table of the items, largest first.
+  void Report(FILE* out) const;
+
+  /// The heap bytes \a str holds beyond the string object itself: none
+  /// if it's short enough to be stored inline.
+  static size_t StringBytes(const string& str);
+
+ private:
+  /// Return the item named \a name, adding it if needed.  Items never
+  /// move once added.
+  Item* Get(const string& name);
+  void AddEvalString(const EvalString& str, Item* item);
+  void AddEnv(const BindingEnv& env, Item* item);
+
+  deque<Item> items_;
+};
+
+#endif  // NINJA_MEMORY_STATS_H_
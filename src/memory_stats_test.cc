@@ -0,0 +1,89 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "memory_stats.h"
+
+#include "build_log.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct MemoryStatsTest : public StateTestWithBuiltinRules {
+  MemoryStats stats_;
+};
+
+TEST_F(MemoryStatsTest, StringBytes) {
+  EXPECT_EQ(0u, MemoryStats::StringBytes(""));
+  string long_string(100, 'x');
+  EXPECT_LE(101u, MemoryStats::StringBytes(long_string));
+}
+
+TEST_F(MemoryStatsTest, State) {
+  AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"build out: cat mid\n"
+"  extra = a value long enough to live on the heap\n"
+"build mid: cat in\n"
+"build other: touch in\n");
+  stats_.AddState(state_);
+
+  const MemoryStats::Item* nodes = stats_.Find("nodes");
+  ASSERT_TRUE(nodes);
+  EXPECT_EQ(4, nodes->count);
+  EXPECT_GE(nodes->bytes, (int64_t)(4 * sizeof(Node)));
+  const MemoryStats::Item* edges = stats_.Find("edges");
+  ASSERT_TRUE(edges);
+  EXPECT_EQ(3, edges->count);
+  // "cat" from the test setup, "phony" and "touch".
+  const MemoryStats::Item* rules = stats_.Find("rules");
+  ASSERT_TRUE(rules);
+  EXPECT_EQ(3, rules->count);
+  // "touch $out" is "touch " and "out", "cat $in > $out" four more.
+  const MemoryStats::Item* tokens = stats_.Find("rule eval string tokens");
+  ASSERT_TRUE(tokens);
+  EXPECT_EQ(6, tokens->count);
+  // The manifest's scope and that of the edge with a binding.
+  const MemoryStats::Item* scopes = stats_.Find("scopes");
+  ASSERT_TRUE(scopes);
+  EXPECT_EQ(2, scopes->count);
+  const MemoryStats::Item* bindings = stats_.Find("bindings");
+  ASSERT_TRUE(bindings);
+  EXPECT_EQ(1, bindings->count);
+  EXPECT_GT(bindings->bytes, 40);
+
+  int64_t sum = 0;
+  for (deque<MemoryStats::Item>::const_iterator i = stats_.items().begin();
+       i != stats_.items().end(); ++i) {
+    sum += i->bytes;
+  }
+  EXPECT_EQ(sum, stats_.total_bytes());
+}
+
+TEST_F(MemoryStatsTest, BuildLog) {
+  AssertParse(&state_,
+"build out: cat in\n");
+  BuildLog log;
+  log.RecordCommand(state_.edges_[0], 1, 2);
+  stats_.AddBuildLog(log);
+  const MemoryStats::Item* entries = stats_.Find("build log entries");
+  ASSERT_TRUE(entries);
+  EXPECT_EQ(1, entries->count);
+  EXPECT_GE(entries->bytes, (int64_t)sizeof(BuildLog::LogEntry));
+}
+
+}  // namespace
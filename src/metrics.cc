@@ -14,6 +14,8 @@
 
 #include "metrics.h"
 
+#include <algorithm>
+
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,6 +26,7 @@
 #include <windows.h>
 #endif
 
+#include "trace.h"
 #include "util.h"
 
 Metrics* g_metrics = NULL;
@@ -65,8 +68,10 @@ int64_t TimerToMicros(int64_t dt) {
     ticks_per_sec = LargeIntegerToInt64(freq);
   }
 
-  // dt is in ticks.  We want microseconds.
-  return (dt * 1000000) / ticks_per_sec;
+  // dt is in ticks.  We want microseconds, without overflowing for a
+  // machine that has been up for days.
+  return (dt / ticks_per_sec) * 1000000 +
+      (dt % ticks_per_sec) * 1000000 / ticks_per_sec;
 }
 #endif
 
@@ -81,35 +86,155 @@ ScopedMetric::ScopedMetric(Metric* metric) {
 ScopedMetric::~ScopedMetric() {
   if (!metric_)
     return;
-  metric_->count++;
   int64_t dt = TimerToMicros(HighResTimer() - start_);
-  metric_->sum += dt;
+  g_metrics->Record(metric_, dt);
+  if (g_trace)
+    g_trace->Span(metric_->name, TimerToMicros(start_), dt);
+}
+
+int64_t GetTimeMicros() {
+  return TimerToMicros(HighResTimer());
+}
+
+namespace {
+
+/// The histogram bucket for a hit taking \a dt micros.
+int BucketFor(int64_t dt) {
+  int bucket = 0;
+  while (dt > 0 && bucket < Metric::kBuckets - 1) {
+    dt >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+}  // anonymous namespace
+
+int64_t Metric::Percentile(double percent) const {
+  if (count == 0)
+    return 0;
+  double target = count * percent / 100;
+  int seen = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    if (seen + buckets[i] < target) {
+      seen += buckets[i];
+      continue;
+    }
+    // Assume the hits are spread evenly over the bucket.
+    int64_t low = i ? (int64_t)1 << (i - 1) : 0;
+    int64_t high = i ? (int64_t)1 << i : 0;
+    int64_t estimate =
+        low + (int64_t)((high - low) * (target - seen) / buckets[i]);
+    return std::min(std::max(estimate, min), max);
+  }
+  return max;
 }
 
 Metric* Metrics::NewMetric(const string& name) {
+  ScopedLock lock(&mutex_);
   Metric* metric = new Metric;
   metric->name = name;
   metric->count = 0;
   metric->sum = 0;
+  metric->min = 0;
+  metric->max = 0;
+  memset(metric->buckets, 0, sizeof(metric->buckets));
   metrics_.push_back(metric);
   return metric;
 }
 
+Counter* Metrics::NewCounter(const string& name) {
+  ScopedLock lock(&mutex_);
+  Counter* counter = new Counter;
+  counter->name = name;
+  counter->value = 0;
+  counters_.push_back(counter);
+  return counter;
+}
+
+void Metrics::Record(Metric* metric, int64_t dt) {
+  ScopedLock lock(&mutex_);
+  if (metric->count == 0 || dt < metric->min)
+    metric->min = dt;
+  if (dt > metric->max)
+    metric->max = dt;
+  metric->count++;
+  metric->sum += dt;
+  metric->buckets[BucketFor(dt)]++;
+}
+
+void Metrics::Add(Counter* counter, int64_t n) {
+  ScopedLock lock(&mutex_);
+  counter->value += n;
+}
+
 void Metrics::Report() {
   int width = 0;
   for (vector<Metric*>::iterator i = metrics_.begin();
        i != metrics_.end(); ++i) {
     width = max((int)(*i)->name.size(), width);
   }
+  for (vector<Counter*>::iterator i = counters_.begin();
+       i != counters_.end(); ++i) {
+    width = max((int)(*i)->name.size(), width);
+  }
 
-  printf("%-*s\t%-6s\t%9s\t%s\n", width,
-         "metric", "count", "total (ms)" , "avg (us)");
+  printf("%-*s\t%-6s\t%9s\t%s\t%s\t%s\t%s\t%s\t%s\n", width,
+         "metric", "count", "total (ms)" , "avg (us)", "min", "p50", "p90",
+         "p99", "max");
   for (vector<Metric*>::iterator i = metrics_.begin();
        i != metrics_.end(); ++i) {
     Metric* metric = *i;
     double total = metric->sum / (double)1000;
     double avg = metric->sum / (double)metric->count;
-    printf("%-*s\t%-6d\t%-8.1f\t%.1f\n", width, metric->name.c_str(),
-           metric->count, total, avg);
+    printf("%-*s\t%-6d\t%-8.1f\t%.1f\t%lld\t%lld\t%lld\t%lld\t%lld\n", width,
+           metric->name.c_str(), metric->count, total, avg,
+           (long long)metric->min, (long long)metric->Percentile(50),
+           (long long)metric->Percentile(90),
+           (long long)metric->Percentile(99), (long long)metric->max);
+  }
+
+  if (counters_.empty())
+    return;
+  printf("\n%-*s\t%s\n", width, "counter", "value");
+  for (vector<Counter*>::iterator i = counters_.begin();
+       i != counters_.end(); ++i) {
+    printf("%-*s\t%lld\n", width, (*i)->name.c_str(),
+           (long long)(*i)->value);
+  }
+}
+
+void Metrics::ReportJSON(FILE* file) {
+  string json = "{\"metrics\":{";
+  for (vector<Metric*>::iterator i = metrics_.begin();
+       i != metrics_.end(); ++i) {
+    Metric* metric = *i;
+    if (i != metrics_.begin())
+      json += ",";
+    json += "\n";
+    AppendJSONString(metric->name, &json);
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             ":{\"count\":%d,\"total_us\":%lld,\"min_us\":%lld,"
+             "\"p50_us\":%lld,\"p90_us\":%lld,\"p99_us\":%lld,"
+             "\"max_us\":%lld}",
+             metric->count, (long long)metric->sum, (long long)metric->min,
+             (long long)metric->Percentile(50),
+             (long long)metric->Percentile(90),
+             (long long)metric->Percentile(99), (long long)metric->max);
+    json += buf;
+  }
+  json += "},\n\"counters\":{";
+  for (vector<Counter*>::iterator i = counters_.begin();
+       i != counters_.end(); ++i) {
+    if (i != counters_.begin())
+      json += ",";
+    json += "\n";
+    AppendJSONString((*i)->name, &json);
+    char buf[32];
+    snprintf(buf, sizeof(buf), ":%lld", (long long)(*i)->value);
+    json += buf;
   }
+  json += "}}\n";
+  fputs(json.c_str(), file);
 }
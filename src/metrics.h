@@ -12,10 +12,13 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <stdio.h>
+
 #include <string>
 #include <vector>
 using namespace std;
 
+#include "threads.h"
 #include "util.h"  // For int64_t.
 
 /// The Metrics module is used for the debug mode that dumps timing stats of
@@ -28,6 +31,23 @@ struct Metric {
   int count;
   /// Total time (in micros) we've spent on the code path.
   int64_t sum;
+  /// Shortest and longest time (in micros) of a single hit.
+  int64_t min;
+  int64_t max;
+  /// Number of hits taking [2^(i-1), 2^i) micros for bucket i, or no
+  /// time at all for bucket 0.
+  enum { kBuckets = 40 };
+  int buckets[kBuckets];
+
+  /// Estimate the time (in micros) that \a percent percent of the hits
+  /// took at most.
+  int64_t Percentile(double percent) const;
+};
+
+/// A quantity we're counting, like "bytes read".
+struct Counter {
+  string name;
+  int64_t value;
 };
 
 /// A scoped object for recording a metric across the body of a function.
@@ -44,16 +64,31 @@ private:
 };
 
 /// The singleton that stores metrics and prints the report.
+/// Metrics may be recorded from several threads at once.
 struct Metrics {
   Metric* NewMetric(const string& name);
+  Counter* NewCounter(const string& name);
+
+  /// Add one hit taking \a dt micros to \a metric.
+  void Record(Metric* metric, int64_t dt);
+  /// Add \a n to \a counter.
+  void Add(Counter* counter, int64_t n);
 
   /// Print a summary report to stdout.
   void Report();
+  /// Write the same as a JSON object to \a file, for tracking over time.
+  void ReportJSON(FILE* file);
 
 private:
   vector<Metric*> metrics_;
+  vector<Counter*> counters_;
+  Mutex mutex_;
 };
 
+/// Return a high-resolution timestamp in microseconds, relative to an
+/// arbitrary start.
+int64_t GetTimeMicros();
+
 /// The primary interface to metrics.  Use METRIC_RECORD("foobar") at the top
 /// of a function to get timing stats recorded for each call of the function.
 #define METRIC_RECORD(name)                                             \
@@ -61,4 +96,13 @@ private:
       g_metrics ? g_metrics->NewMetric(name) : NULL;                    \
   ScopedMetric metrics_h_scoped(metrics_h_metric);
 
+/// Count \a n more of \a name, e.g. METRIC_COUNT("bytes read", len).
+#define METRIC_COUNT(name, n)                                           \
+  do {                                                                  \
+    static Counter* metrics_h_counter =                                 \
+        g_metrics ? g_metrics->NewCounter(name) : NULL;                 \
+    if (metrics_h_counter)                                              \
+      g_metrics->Add(metrics_h_counter, n);                             \
+  } while (0)
+
 extern Metrics* g_metrics;
@@ -0,0 +1,73 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metrics.h"
+
+#include "test.h"
+
+namespace {
+
+TEST(MetricsTest, Histogram) {
+  Metrics metrics;
+  Metric* metric = metrics.NewMetric("test");
+  for (int i = 1; i <= 100; ++i)
+    metrics.Record(metric, i);
+  EXPECT_EQ(100, metric->count);
+  EXPECT_EQ(5050, metric->sum);
+  EXPECT_EQ(1, metric->min);
+  EXPECT_EQ(100, metric->max);
+
+  // Buckets are powers of two, so estimates are only that close.
+  int64_t p50 = metric->Percentile(50);
+  EXPECT_GE(p50, 32);
+  EXPECT_LE(p50, 64);
+  int64_t p99 = metric->Percentile(99);
+  EXPECT_GE(p99, 64);
+  EXPECT_LE(p99, 100);
+  EXPECT_EQ(100, metric->Percentile(100));
+}
+
+TEST(MetricsTest, PercentileClamped) {
+  Metrics metrics;
+  Metric* metric = metrics.NewMetric("test");
+  EXPECT_EQ(0, metric->Percentile(50));
+  metrics.Record(metric, 1000);
+  metrics.Record(metric, 1000);
+  EXPECT_EQ(1000, metric->Percentile(10));
+  EXPECT_EQ(1000, metric->Percentile(90));
+}
+
+TEST(MetricsTest, JSON) {
+  Metrics metrics;
+  Metric* metric = metrics.NewMetric("load");
+  metrics.Record(metric, 7);
+  Counter* counter = metrics.NewCounter("bytes \"read\"");
+  metrics.Add(counter, 40);
+  metrics.Add(counter, 2);
+
+  FILE* file = tmpfile();
+  ASSERT_TRUE(file != NULL);
+  metrics.ReportJSON(file);
+  char buf[512];
+  rewind(file);
+  size_t len = fread(buf, 1, sizeof(buf), file);
+  fclose(file);
+  EXPECT_EQ("{\"metrics\":{\n"
+            "\"load\":{\"count\":1,\"total_us\":7,\"min_us\":7,\"p50_us\":7,"
+            "\"p90_us\":7,\"p99_us\":7,\"max_us\":7}},\n"
+            "\"counters\":{\n"
+            "\"bytes \\\"read\\\"\":42}}\n", string(buf, len));
+}
+
+}  // namespace
@@ -18,11 +18,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#if defined(__APPLE__) || defined(__FreeBSD__)
-#include <sys/sysctl.h>
-#elif defined(linux)
-#include <sys/sysinfo.h>
-#endif
+#include <set>
 
 #ifdef _WIN32
 #include "getopt.h"
@@ -30,27 +26,57 @@
 #include <windows.h>
 #else
 #include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 #endif
 
+#include "affected.h"
 #include "browse.h"
 #include "build.h"
 #include "build_log.h"
+#ifdef __linux__
+#include "change_journal.h"
+#endif
+#include "deps_log.h"
 #include "clean.h"
 #include "edit_distance.h"
 #include "graph.h"
 #include "graphviz.h"
+#include "jobserver.h"
+#include "manifest_snapshot.h"
+#include "memory_stats.h"
 #include "metrics.h"
+#include "output_cache.h"
+#include "shard.h"
+#include "simulate.h"
 #include "parsers.h"
+#include "profile.h"
+#include "query.h"
+#ifndef _WIN32
+#include "remote.h"
+#include "serve.h"
+#endif
+#include "stat_cache.h"
 #include "state.h"
+#include "trace.h"
 #include "util.h"
 
 namespace {
 
 /// Global information passed into subtools.
 struct Globals {
-  Globals() : state(new State()) {}
+  Globals() : manifest_load_time(0), state(new State()), use_stat_cache(false),
+              use_output_cache(false), use_manifest_snapshot(false),
+              keep_commands(false), parallel_parse(false),
+              print_stats(false), write_stats(false), disk_interface(NULL),
+              shard_index(0), shard_count(0) {}
   ~Globals() {
     delete state;
+    delete config.jobserver;
   }
 
   /// Deletes and recreates state so it is empty.
@@ -61,10 +87,37 @@ struct Globals {
 
   /// Command line used to run Ninja.
   const char* ninja_command;
+  /// The top-level manifest, e.g. "build.ninja".
+  const char* input_file;
+  /// All the manifest files the state was loaded from.
+  vector<string> manifest_files;
+  /// When the state was last loaded; manifest files modified before then
+  /// are known to be what it was parsed from.
+  TimeStamp manifest_load_time;
   /// Build configuration (e.g. parallelism).
   BuildConfig config;
   /// Loaded state (rules, nodes). This is a pointer so it can be reset.
   State* state;
+  /// Whether to keep mtimes across runs in .ninja_stat.
+  bool use_stat_cache;
+  /// Whether to reuse outputs built before from .ninja_cache.
+  bool use_output_cache;
+  /// Whether to keep the parsed manifest in .ninja_manifest.
+  bool use_manifest_snapshot;
+  /// Whether to log full command lines alongside the build log.
+  bool keep_commands;
+  /// Whether to parse subninja files on several threads.
+  bool parallel_parse;
+  /// Whether to print metrics when done.
+  bool print_stats;
+  /// Whether to write metrics to .ninja_metrics when done.
+  bool write_stats;
+  /// Disk interface for builders to use, or NULL for their default.
+  DiskInterface* disk_interface;
+  /// If \a shard_count is positive, build only the \a shard_index'th
+  /// (from 1) of that many shards of the targets; see Sharder.
+  int shard_index;
+  int shard_count;
 };
 
 /// Print usage information.
@@ -82,8 +135,18 @@ void Usage(const BuildConfig& config) {
 "  -f FILE  specify input build file [default=build.ninja]\n"
 "\n"
 "  -j N     run N jobs in parallel [default=%d]\n"
+"  -j auto[:MIN-MAX]\n"
+"           adjust the number of jobs to the load of the machine\n"
+"  --jobserver\n"
+"           share the -j jobs with nested builds as a make jobserver\n"
+"  --shard=I/N\n"
+"           build only the I'th of N parts of about equal cost\n"
 "  -k N     keep going until N jobs fail [default=1]\n"
+"  -l N     don't start new jobs if the load average is greater than N\n"
+"  -m N     don't start new jobs if less than N MB of memory is available\n"
 "  -n       dry run (don't run commands but pretend they succeeded)\n"
+"  -r N     run up to N jobs on the workers in $NINJA_REMOTE_WORKERS\n"
+"           [default=8 per worker]\n"
 "  -v       show all command lines while building\n"
 "\n"
 "  -d MODE  enable debugging (use -d list to list modes)\n"
@@ -95,24 +158,7 @@ void Usage(const BuildConfig& config) {
 
 /// Choose a default value for the -j (parallelism) flag.
 int GuessParallelism() {
-  int processors = 0;
-
-#if defined(linux)
-  processors = get_nprocs();
-#elif defined(__APPLE__) || defined(__FreeBSD__)
-  size_t processors_size = sizeof(processors);
-  int name[] = {CTL_HW, HW_NCPU};
-  if (sysctl(name, sizeof(name) / sizeof(int),
-             &processors, &processors_size,
-             NULL, 0) < 0) {
-    processors = 1;
-  }
-#elif defined(_WIN32)
-  SYSTEM_INFO info;
-  GetSystemInfo(&info);
-  processors = info.dwNumberOfProcessors;
-#endif
-
+  int processors = GetProcessorCount();
   switch (processors) {
   case 0:
   case 1:
@@ -132,23 +178,225 @@ struct RealFileReader : public ManifestParser::FileReader {
   }
 };
 
+/// Return the path of the file \a name that Ninja keeps in the build
+/// directory (the root, unless the manifest sets builddir).
+string BuildDirPath(State* state, const char* name) {
+  const string build_dir = state->bindings_.LookupVariable("builddir");
+  if (build_dir.empty())
+    return name;
+  return build_dir + "/" + name;
+}
+
+const char kSnapshotName[] = ".ninja_manifest";
+
+/// Guess where the snapshot of \a input_file is before parsing it, from
+/// a plain top-level "builddir = ..." line ahead of the first build
+/// statement.  A wrong guess only costs a parse.
+string GuessSnapshotPath(const char* input_file) {
+  string build_dir;
+  FILE* f = fopen(input_file, "r");
+  if (f) {
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+      if (strncmp(line, "build ", 6) == 0)
+        break;
+      if (strncmp(line, "builddir", 8) != 0)
+        continue;
+      const char* p = line + 8;
+      p += strspn(p, " ");
+      if (*p != '=')
+        continue;
+      ++p;
+      p += strspn(p, " ");
+      build_dir.assign(p, strcspn(p, "\r\n"));
+      if (build_dir.find('$') != string::npos)
+        build_dir.clear();
+    }
+    fclose(f);
+  }
+  if (build_dir.empty())
+    return kSnapshotName;
+  return build_dir + "/" + kSnapshotName;
+}
+
+/// Write the snapshot of globals->state, loaded from \a files, if it is
+/// enabled.  Failing to is only worth a warning.
+void SaveManifestSnapshot(Globals* globals, const vector<string>& files) {
+  if (!globals->use_manifest_snapshot)
+    return;
+  const string build_dir = globals->state->bindings_.LookupVariable("builddir");
+  string err;
+  if (!build_dir.empty() && MakeDir(build_dir) < 0 && errno != EEXIST) {
+    err = strerror(errno);
+  } else if (ManifestSnapshot::Save(BuildDirPath(globals->state, kSnapshotName),
+                                    globals->input_file, files, globals->state,
+                                    &err)) {
+    return;
+  }
+  Warning("saving manifest snapshot: %s", err.c_str());
+}
+
+/// Load the manifest into globals->state, which must be empty, from its
+/// snapshot if that is enabled and up to date.  Returns false, having
+/// printed an error, on failure.
+bool LoadManifest(Globals* globals) {
+  globals->manifest_load_time = time(NULL);
+  if (globals->use_manifest_snapshot) {
+    string path = GuessSnapshotPath(globals->input_file);
+    if (ManifestSnapshot::Load(path, globals->input_file, globals->state,
+                               &globals->manifest_files) &&
+        BuildDirPath(globals->state, kSnapshotName) == path) {
+      return true;
+    }
+  }
+
+  globals->ResetState();
+  RealFileReader file_reader;
+  RecordingFileReader recording_reader(&file_reader);
+  ManifestParser parser(globals->state, &recording_reader);
+  if (globals->parallel_parse)
+    parser.set_parallelism(GuessParallelism());
+  string err;
+  if (!parser.Load(globals->input_file, &err)) {
+    Error("%s", err.c_str());
+    return false;
+  }
+  globals->manifest_files = recording_reader.files_;
+  SaveManifestSnapshot(globals, globals->manifest_files);
+  return true;
+}
+
+/// After the manifest was regenerated, parse again only the subninja
+/// files that changed since globals->state was loaded, in place.  Returns
+/// false if that isn't possible, in which case the state must be loaded
+/// from scratch.
+bool ReparseChangedManifests(Globals* globals) {
+  METRIC_RECORD("manifest reparse changed");
+  State* state = globals->state;
+  vector<ManifestFile>& files = state->manifest_files_;
+  if (files.empty())
+    return false;
+
+  // Only what the generator rewrote can differ, and not all of it has to.
+  RealDiskInterface disk_interface;
+  set<string> changed;
+  for (size_t i = 0; i < files.size(); ++i) {
+    TimeStamp mtime = disk_interface.Stat(files[i].path);
+    if (mtime <= 0)
+      return false;
+    if (mtime >= globals->manifest_load_time)
+      changed.insert(files[i].path);
+  }
+
+  RealFileReader file_reader;
+  // Each pass reparses the subninja file one changed file belongs to,
+  // which brings the records of everything it includes up to date.
+  for (size_t pass = 0; pass <= files.size(); ++pass) {
+    size_t unit = files.size();
+    for (size_t i = 0; i < files.size() && unit == files.size(); ++i) {
+      if (!changed.count(files[i].path))
+        continue;
+      string contents, err;
+      if (!file_reader.ReadFile(files[i].path, &contents, &err))
+        return false;
+      if (BuildLog::LogEntry::HashContents(contents) == files[i].hash)
+        continue;
+      if (!files[i].scope || files[i].scope == &state->bindings_)
+        return false;
+      for (size_t j = 0; j < files.size(); ++j) {
+        if (files[j].subninja && files[j].scope == files[i].scope)
+          unit = j;
+      }
+      if (unit == files.size())
+        return false;
+    }
+    if (unit == files.size()) {
+      // All caught up.
+      globals->manifest_files.clear();
+      for (size_t i = 0; i < files.size(); ++i)
+        globals->manifest_files.push_back(files[i].path);
+      globals->manifest_load_time = time(NULL);
+      SaveManifestSnapshot(globals, globals->manifest_files);
+      return true;
+    }
+
+    ManifestParser parser(state, &file_reader);
+    string err;
+    if (!parser.Reparse(unit, &err))
+      return false;
+  }
+  return false;
+}
+
+/// Load the build and deps logs of globals->state and open them for
+/// writing.  Returns false, having printed an error, on failure.
+bool OpenLogs(Globals* globals, BuildLog* build_log, DepsLog* deps_log) {
+  build_log->SetConfig(&globals->config);
+  build_log->set_keep_commands(globals->keep_commands);
+  globals->state->build_log_ = build_log;
+
+  const string build_dir = globals->state->bindings_.LookupVariable("builddir");
+  if (!build_dir.empty()) {
+    if (MakeDir(build_dir) < 0 && errno != EEXIST) {
+      Error("creating build directory %s: %s",
+            build_dir.c_str(), strerror(errno));
+      return false;
+    }
+  }
+  string log_path = BuildDirPath(globals->state, ".ninja_log");
+
+  string err;
+  if (!build_log->Load(log_path.c_str(), &err)) {
+    Error("loading build log %s: %s",
+          log_path.c_str(), err.c_str());
+    return false;
+  }
+
+  RealDiskInterface disk_interface;
+  StateBuildLogUser user(globals->state, globals->disk_interface
+                         ? globals->disk_interface : &disk_interface);
+  if (!build_log->OpenForWrite(log_path.c_str(), &err, &user)) {
+    Error("opening build log: %s", err.c_str());
+    return false;
+  }
+
+  globals->state->deps_log_ = deps_log;
+
+  string deps_path = BuildDirPath(globals->state, ".ninja_deps");
+
+  if (!deps_log->Load(deps_path, globals->state, &err)) {
+    Error("loading deps log %s: %s", deps_path.c_str(), err.c_str());
+    return false;
+  }
+
+  if (!deps_log->OpenForWrite(deps_path, &err)) {
+    Error("opening deps log: %s", err.c_str());
+    return false;
+  }
+  return true;
+}
+
 /// Rebuild the build manifest, if necessary.
 /// Returns true if the manifest was rebuilt.
-bool RebuildManifest(State* state, const BuildConfig& config,
-                     const char* input_file, string* err) {
+bool RebuildManifest(Globals* globals, const char* input_file, string* err) {
   string path = input_file;
   if (!CanonicalizePath(&path, err))
     return false;
-  Node* node = state->LookupNode(path);
+  Node* node = globals->state->LookupNode(path);
   if (!node)
     return false;
 
-  Builder manifest_builder(state, config);
+  Builder manifest_builder(globals->state, globals->config);
+  if (globals->disk_interface)
+    manifest_builder.disk_interface_ = globals->disk_interface;
   if (!manifest_builder.AddTarget(node, err))
     return false;
 
   if (manifest_builder.AlreadyUpToDate())
     return false;  // Not an error, but we didn't rebuild.
+  // The generator may look at the log, e.g. through a tool.
+  if (globals->state->build_log_)
+    globals->state->build_log_->Flush();
   return manifest_builder.Build(err);
 }
 
@@ -201,6 +449,43 @@ bool CollectTargetsFromArgs(State* state, int argc, char* argv[],
 }
 
 int ToolGraph(Globals* globals, int argc, char* argv[]) {
+  // The graph tool uses getopt, and expects argv[0] to contain the name of
+  // the tool, i.e. "graph".
+  argc++;
+  argv--;
+
+  GraphViz graph;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hd:g:"))) != -1) {
+    switch (opt) {
+    case 'd':
+      graph.max_depth_ = atoi(optarg);
+      break;
+    case 'g':
+      if (string(optarg) == "rule") {
+        graph.grouping_ = GraphViz::kRules;
+        break;
+      } else if (string(optarg) == "dir") {
+        graph.grouping_ = GraphViz::kDirectories;
+        break;
+      }
+      Error("unknown grouping '%s'", optarg);
+      // Fall through.
+    case 'h':
+    default:
+      printf("usage: ninja -t graph [options] [targets]\n"
+"\n"
+"options:\n"
+"  -d N   only show inputs up to N edges away from the targets\n"
+"  -g rule|dir  draw one node per rule, or per directory, instead of per file\n"
+             );
+    return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
   vector<Node*> nodes;
   string err;
   if (!CollectTargetsFromArgs(globals->state, argc, argv, &nodes, &err)) {
@@ -208,7 +493,6 @@ int ToolGraph(Globals* globals, int argc, char* argv[]) {
     return 1;
   }
 
-  GraphViz graph;
   graph.Start();
   for (vector<Node*>::const_iterator n = nodes.begin(); n != nodes.end(); ++n)
     graph.AddTarget(*n);
@@ -222,6 +506,11 @@ int ToolQuery(Globals* globals, int argc, char* argv[]) {
     Error("expected a target to query");
     return 1;
   }
+  if (argc == 1 && string(argv[0]) == "-") {
+    QueryService service(globals->state);
+    service.Run(stdin, stdout);
+    return 0;
+  }
   for (int i = 0; i < argc; ++i) {
     Node* node = globals->state->LookupNode(argv[i]);
     if (!node) {
@@ -337,6 +626,20 @@ int ToolTargetsList(State* state) {
   return 0;
 }
 
+int ToolTargetsPrefixList(State* state, const string& prefix) {
+  vector<Node*> nodes;
+  state->NodesWithPrefix(prefix, &nodes);
+  for (vector<Node*>::iterator n = nodes.begin(); n != nodes.end(); ++n) {
+    if ((*n)->in_edge()) {
+      printf("%s: %s\n", (*n)->path().c_str(),
+             (*n)->in_edge()->rule_->name().c_str());
+    } else {
+      printf("%s\n", (*n)->path().c_str());
+    }
+  }
+  return 0;
+}
+
 int ToolTargets(Globals* globals, int argc, char* argv[]) {
   int depth = 1;
   if (argc >= 1) {
@@ -354,9 +657,11 @@ int ToolTargets(Globals* globals, int argc, char* argv[]) {
         depth = atoi(argv[1]);
     } else if (mode == "all") {
       return ToolTargetsList(globals->state);
+    } else if (mode == "prefix") {
+      return ToolTargetsPrefixList(globals->state, argc > 1 ? argv[1] : "");
     } else {
       const char* suggestion =
-          SpellcheckString(mode, "rule", "depth", "all", NULL);
+          SpellcheckString(mode, "rule", "depth", "all", "prefix", NULL);
       if (suggestion) {
         Error("unknown target tool mode '%s', did you mean '%s'?",
               mode.c_str(), suggestion);
@@ -405,7 +710,7 @@ void PrintCommands(Edge* edge, set<Edge*>* seen) {
     PrintCommands((*in)->in_edge(), seen);
 
   if (!edge->is_phony())
-    puts(edge->EvaluateCommand().c_str());
+    puts(edge->EvaluateCommandUncached().c_str());
 }
 
 int ToolCommands(Globals* globals, int argc, char* argv[]) {
@@ -472,55 +777,393 @@ int ToolClean(Globals* globals, int argc, char* argv[]) {
   }
 }
 
-int RunTool(const string& tool, Globals* globals, int argc, char** argv) {
-  typedef int (*ToolFunc)(Globals*, int, char**);
-  struct Tool {
-    const char* name;
-    const char* desc;
-    ToolFunc func;
-  } tools[] = {
-#if !defined(_WIN32) && !defined(NINJA_BOOTSTRAP)
-    { "browse", "browse dependency graph in a web browser",
-      ToolBrowse },
-#endif
-    { "clean", "clean built files",
-      ToolClean },
-    { "commands", "list all commands required to rebuild given targets",
-      ToolCommands },
-    { "graph", "output graphviz dot file for targets",
-      ToolGraph },
-    { "query", "show inputs/outputs for a path",
-      ToolQuery },
-    { "rules",    "list all rules",
-      ToolRules },
-    { "targets",  "list targets by their rule or depth in the DAG",
-      ToolTargets },
-    { NULL, NULL, NULL }
-  };
+int ToolAffected(Globals* globals, int argc, char* argv[]) {
+  // The affected tool uses getopt, and expects argv[0] to contain the name
+  // of the tool, i.e. "affected".
+  argc++;
+  argv--;
+
+  enum { MINIMAL, ALL, DEFAULTS } mode = MINIMAL;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("had"))) != -1) {
+    switch (opt) {
+    case 'a':
+      mode = ALL;
+      break;
+    case 'd':
+      mode = DEFAULTS;
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t affected [options] [changed files...]\n"
+"\n"
+"List the outputs built from any of the changed files, which are read\n"
+"from stdin, one per line, if none are given.  By default only those no\n"
+"other affected command uses are listed: building them rebuilds the rest.\n"
+"\n"
+"options:\n"
+"  -a     list all affected outputs\n"
+"  -d     list the affected default targets\n"
+             );
+    return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
 
-  if (tool == "list") {
-    printf("ninja subtools:\n");
-    for (int i = 0; tools[i].name; ++i) {
-      printf("%10s  %s\n", tools[i].name, tools[i].desc);
+  vector<string> paths(argv, argv + argc);
+  if (argc == 0) {
+    char buf[4 << 10];
+    while (fgets(buf, sizeof(buf), stdin)) {
+      string path = buf;
+      while (!path.empty() &&
+             (path[path.size() - 1] == '\n' || path[path.size() - 1] == '\r'))
+        path.resize(path.size() - 1);
+      if (!path.empty())
+        paths.push_back(path);
     }
-    return 0;
   }
 
-  for (int i = 0; tools[i].name; ++i) {
-    if (tool == tools[i].name)
-      return tools[i].func(globals, argc, argv);
+  string err;
+  string deps_path = BuildDirPath(globals->state, ".ninja_deps");
+  DepsLog deps_log;
+  if (!deps_log.Load(deps_path, globals->state, &err)) {
+    Error("loading deps log %s: %s", deps_path.c_str(), err.c_str());
+    return 1;
+  }
+  RealDiskInterface disk_interface;
+  AffectedTargets affected(globals->state, &deps_log, &disk_interface);
+
+  // Files the graph doesn't know about affect nothing.
+  vector<Node*> changed;
+  for (vector<string>::iterator i = paths.begin(); i != paths.end(); ++i) {
+    if (!CanonicalizePath(&*i, &err)) {
+      Error("%s", err.c_str());
+      return 1;
+    }
+    if (Node* node = globals->state->LookupNode(*i))
+      changed.push_back(node);
   }
+  affected.Compute(changed);
 
-  vector<const char*> words;
-  for (int i = 0; tools[i].name; ++i)
-    words.push_back(tools[i].name);
-  const char* suggestion = SpellcheckStringV(tool, words);
-  if (suggestion) {
-    Error("unknown tool '%s', did you mean '%s'?", tool.c_str(), suggestion);
+  vector<Node*> nodes;
+  if (mode == DEFAULTS) {
+    vector<Node*> defaults = globals->state->DefaultNodes(&err);
+    if (!err.empty()) {
+      Error("%s", err.c_str());
+      return 1;
+    }
+    for (vector<Node*>::iterator i = defaults.begin(); i != defaults.end();
+         ++i) {
+      if (affected.affected(*i))
+        nodes.push_back(*i);
+    }
+  } else if (mode == ALL) {
+    affected.All(&nodes);
   } else {
-    Error("unknown tool '%s'", tool.c_str());
+    affected.Minimal(&nodes);
   }
-  return 1;
+  for (vector<Node*>::iterator i = nodes.begin(); i != nodes.end(); ++i)
+    printf("%s\n", (*i)->path().c_str());
+  return 0;
+}
+
+int ToolProfile(Globals* globals, int argc, char* argv[]) {
+  // The profile tool uses getopt, and expects argv[0] to contain the name
+  // of the tool, i.e. "profile".
+  argc++;
+  argv--;
+
+  int count = 20;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hn:"))) != -1) {
+    switch (opt) {
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t profile [options] [old_log]\n"
+"\n"
+"Summarize the command timings in the build log.  Given the path of an\n"
+"older copy of the log, list the commands that got slower instead.\n"
+"\n"
+"options:\n"
+"  -n N   show the N slowest commands [default=20]\n"
+             );
+    return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  string err;
+  string log_path = BuildDirPath(globals->state, ".ninja_log");
+  BuildLog build_log;
+  if (!build_log.Load(log_path, &err)) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+  string deps_path = BuildDirPath(globals->state, ".ninja_deps");
+  DepsLog deps_log;
+  if (!deps_log.Load(deps_path, globals->state, &err)) {
+    Error("loading deps log %s: %s", deps_path.c_str(), err.c_str());
+    return 1;
+  }
+  Profile profile(globals->state, &build_log, &deps_log);
+
+  if (argc >= 1) {
+    BuildLog old_log;
+    if (!old_log.Load(argv[0], &err)) {
+      Error("loading build log %s: %s", argv[0], err.c_str());
+      return 1;
+    }
+    // Ignore the jitter of short commands.
+    vector<Profile::Change> changes = profile.SlowerThan(&old_log, 1.1, 100);
+    printf("%8s %8s %8s  %s\n", "old ms", "new ms", "change", "output");
+    for (vector<Profile::Change>::iterator i = changes.begin();
+         i != changes.end(); ++i) {
+      printf("%8d %8d %+7.0f%%  %s\n", i->old_millis, i->new_millis,
+             i->old_millis ?
+                 (i->new_millis - i->old_millis) * 100.0 / i->old_millis : 0,
+             i->edge->outputs_[0]->path().c_str());
+    }
+    return 0;
+  }
+
+  vector<Profile::EdgeTime> slowest = profile.Slowest(count);
+  printf("slowest commands:\n%8s  %-16s %s\n", "ms", "rule", "output");
+  for (vector<Profile::EdgeTime>::iterator i = slowest.begin();
+       i != slowest.end(); ++i) {
+    printf("%8d  %-16s %s\n", i->millis, i->edge->rule().name().c_str(),
+           i->edge->outputs_[0]->path().c_str());
+  }
+
+  vector<Profile::RuleTime> rules = profile.ByRule();
+  int64_t total = 0;
+  for (vector<Profile::RuleTime>::iterator i = rules.begin();
+       i != rules.end(); ++i)
+    total += i->millis;
+  printf("\ntime per rule:\n%8s %6s %8s %8s %8s  %s\n", "ms", "%", "cpu ms",
+         "peak MB", "commands", "rule");
+  for (vector<Profile::RuleTime>::iterator i = rules.begin();
+       i != rules.end(); ++i) {
+    printf("%8lld %5.1f%% %8lld %8lld %8d  %s\n", (long long)i->millis,
+           total ? i->millis * 100.0 / total : 0.0, (long long)i->cpu_millis,
+           (long long)(i->max_rss >> 20), i->edges, i->rule.c_str());
+  }
+
+  vector<Edge*> path;
+  int64_t length = profile.CriticalPath(&path);
+  printf("\ncritical path: %lld ms in %d commands, of %lld ms in all\n",
+         (long long)length, (int)path.size(), (long long)total);
+  for (vector<Edge*>::iterator i = path.begin(); i != path.end(); ++i) {
+    int millis = Profile::Duration(*i, &build_log);
+    char duration[16] = "-";
+    if (millis >= 0)
+      snprintf(duration, sizeof(duration), "%d", millis);
+    printf("%8s  %-16s %s\n", duration, (*i)->rule().name().c_str(),
+           (*i)->outputs_[0]->path().c_str());
+  }
+  return 0;
+}
+
+int ToolMemStats(Globals* globals, int argc, char* argv[]) {
+  string err;
+  string log_path = BuildDirPath(globals->state, ".ninja_log");
+  BuildLog build_log;
+  if (!build_log.Load(log_path, &err)) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+  string deps_path = BuildDirPath(globals->state, ".ninja_deps");
+  DepsLog deps_log;
+  if (!deps_log.Load(deps_path, globals->state, &err)) {
+    Error("loading deps log %s: %s", deps_path.c_str(), err.c_str());
+    return 1;
+  }
+
+  MemoryStats stats;
+  stats.AddState(*globals->state);
+  stats.AddBuildLog(build_log);
+  stats.AddDepsLog(deps_log);
+  stats.Report(stdout);
+
+#ifndef _WIN32
+  // For comparison with what the items above account for.
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+    long long max_rss = usage.ru_maxrss;  // Already in bytes.
+#else
+    long long max_rss = (long long)usage.ru_maxrss * 1024;
+#endif
+    printf("\npeak resident set size: %lld bytes\n", max_rss);
+  }
+#endif
+  return 0;
+}
+
+int ToolSimulate(Globals* globals, int argc, char* argv[]) {
+  // The simulate tool uses getopt, and expects argv[0] to contain the
+  // name of the tool, i.e. "simulate".
+  argc++;
+  argv--;
+
+  int parallelism = globals->config.parallelism;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hj:"))) != -1) {
+    switch (opt) {
+    case 'j':
+      parallelism = atoi(optarg);
+      if (parallelism < 1) {
+        Error("invalid -j parameter");
+        return 1;
+      }
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t simulate [options] [targets...]\n"
+"\n"
+"Predict how long building the targets from scratch takes, from the\n"
+"command durations in the build log, without running anything.\n"
+"\n"
+"options:\n"
+"  -j N   run N jobs in parallel [default=%d, or as given before -t]\n",
+             globals->config.parallelism);
+    return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  string err;
+  string log_path = BuildDirPath(globals->state, ".ninja_log");
+  BuildLog build_log;
+  if (!build_log.Load(log_path, &err)) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+  vector<Node*> targets;
+  if (!CollectTargetsFromArgs(globals->state, argc, argv, &targets, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+
+  Simulation simulation(globals->state, &build_log);
+  Simulation::Result result;
+  if (!simulation.Run(targets, parallelism, &result, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+
+  printf("simulated build of %d commands (%d not in the log) with -j%d\n",
+         result.commands, result.unknown, parallelism);
+  printf("wall time:     %8lld ms\n", (long long)result.wall_millis);
+  printf("command time:  %8lld ms, %.1f%% of the job slots\n",
+         (long long)result.busy_millis,
+         result.wall_millis ? result.busy_millis * 100.0 /
+                                  (result.wall_millis * parallelism)
+                            : 0.0);
+  printf("critical path: %8lld ms in %d commands\n",
+         (long long)result.critical_millis, (int)result.critical_path.size());
+  for (vector<Edge*>::iterator i = result.critical_path.begin();
+       i != result.critical_path.end(); ++i) {
+    printf("%8lld  %-16s %s\n", (long long)simulation.Duration(*i),
+           (*i)->rule().name().c_str(), (*i)->outputs_[0]->path().c_str());
+  }
+  return 0;
+}
+
+int ToolShard(Globals* globals, int argc, char* argv[]) {
+  int count = argc >= 1 ? atoi(argv[0]) : 0;
+  if (count < 1) {
+    printf("usage: ninja -t shard N [targets...]\n"
+"\n"
+"Split building the targets into N parts of about equal cost, as\n"
+"--shard=I/N builds them, and list the targets of each.\n");
+    return 1;
+  }
+
+  string err;
+  string log_path = BuildDirPath(globals->state, ".ninja_log");
+  BuildLog build_log;
+  if (!build_log.Load(log_path, &err)) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+  vector<Node*> targets;
+  if (!CollectTargetsFromArgs(globals->state, argc - 1, argv + 1, &targets,
+                              &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+
+  Sharder sharder(globals->state, &build_log);
+  vector<Sharder::Shard> shards = sharder.Split(targets, count);
+  for (size_t i = 0; i < shards.size(); ++i) {
+    printf("shard %d/%d: %d commands, %.1f s\n", (int)i + 1, count,
+           shards[i].edges, shards[i].millis / 1000.0);
+    for (vector<Node*>::iterator t = shards[i].targets.begin();
+         t != shards[i].targets.end(); ++t) {
+      printf("  %s\n", (*t)->path().c_str());
+    }
+  }
+  return 0;
+}
+
+int ToolRecompact(Globals* globals, int argc, char* argv[]) {
+  string err;
+  string log_path = BuildDirPath(globals->state, ".ninja_log");
+  BuildLog build_log;
+  if (!build_log.Load(log_path, &err)) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+  RealDiskInterface disk_interface;
+  StateBuildLogUser user(globals->state, &disk_interface);
+  if (!build_log.Recompact(log_path, &err, &user)) {
+    Error("recompacting build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+
+  string deps_path = BuildDirPath(globals->state, ".ninja_deps");
+  DepsLog deps_log;
+  if (!deps_log.Load(deps_path, globals->state, &err)) {
+    Error("loading deps log %s: %s", deps_path.c_str(), err.c_str());
+    return 1;
+  }
+  if (!deps_log.Recompact(deps_path, &err)) {
+    Error("recompacting deps log %s: %s", deps_path.c_str(), err.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int ToolCachePrune(Globals* globals, int argc, char* argv[]) {
+  int megabytes = argc == 1 ? atoi(argv[0]) : -1;
+  if (megabytes < 0 || (megabytes == 0 && strcmp(argv[0], "0") != 0)) {
+    printf("usage: ninja -t cache-prune MEGABYTES\n"
+"\n"
+"Remove the entries of the output cache (see -d outputcache) used least\n"
+"recently until it takes at most MEGABYTES.\n");
+    return 1;
+  }
+
+  string err;
+  RealDiskInterface disk_interface;
+  OutputCache cache(&disk_interface,
+                    BuildDirPath(globals->state, ".ninja_cache"));
+  int removed;
+  if (!cache.Prune((int64_t)megabytes << 20, &removed, &err)) {
+    Error("pruning output cache: %s", err.c_str());
+    return 1;
+  }
+  printf("ninja: removed %d cache entries\n", removed);
+  return 0;
 }
 
 /// Enable a debugging mode.  Returns false if Ninja should exit instead
@@ -528,11 +1171,62 @@ int RunTool(const string& tool, Globals* globals, int argc, char** argv) {
 bool DebugEnable(const string& name, Globals* globals) {
   if (name == "list") {
     printf("debugging modes:\n"
-"  stats  print operation counts/timing info\n");
+"  stats      print operation counts/timing info\n"
+"  statsjson  write the same to .ninja_metrics as JSON\n"
+"  statcache  remember mtimes across runs in .ninja_stat (see manual)\n"
+"  outputcache  reuse outputs built before from .ninja_cache (see manual)\n"
+"  manifestsnapshot  keep the parsed manifest in .ninja_manifest (see manual)\n"
+"  keepcmds   also log full command lines to .ninja_log.commands\n"
+"  parallelparse  parse subninja files and big manifests in parallel\n"
+"  directexec run simple commands without /bin/sh (see manual)\n"
+"  trace      write a trace of the build to .ninja_trace (see manual)\n"
+"  spilloutput  write the full output of very chatty commands to $TMPDIR\n"
+"  streamoutput  show the output of a long-running command as it runs\n"
+"  mkdirsfirst  create all output directories before running commands\n");
 //"multiple modes can be enabled via -d FOO -d BAR\n");
     return false;
   } else if (name == "stats") {
-    g_metrics = new Metrics;
+    if (!g_metrics)
+      g_metrics = new Metrics;
+    globals->print_stats = true;
+    return true;
+  } else if (name == "statsjson") {
+    if (!g_metrics)
+      g_metrics = new Metrics;
+    globals->write_stats = true;
+    return true;
+  } else if (name == "trace") {
+    // The trace takes its spans from the metrics.
+    if (!g_metrics)
+      g_metrics = new Metrics;
+    g_trace = new Trace;
+    return true;
+  } else if (name == "statcache") {
+    globals->use_stat_cache = true;
+    return true;
+  } else if (name == "outputcache") {
+    globals->use_output_cache = true;
+    return true;
+  } else if (name == "manifestsnapshot") {
+    globals->use_manifest_snapshot = true;
+    return true;
+  } else if (name == "keepcmds") {
+    globals->keep_commands = true;
+    return true;
+  } else if (name == "directexec") {
+    globals->config.direct_exec = true;
+    return true;
+  } else if (name == "parallelparse") {
+    globals->parallel_parse = true;
+    return true;
+  } else if (name == "spilloutput") {
+    globals->config.spill_dir = GetTempDir();
+    return true;
+  } else if (name == "streamoutput") {
+    globals->config.stream_after_millis = 5000;
+    return true;
+  } else if (name == "mkdirsfirst") {
+    globals->config.make_dirs_first = true;
     return true;
   } else {
     printf("ninja: unknown debug setting '%s'\n", name.c_str());
@@ -547,8 +1241,19 @@ int RunBuild(Globals* globals, int argc, char** argv) {
     Error("%s", err.c_str());
     return 1;
   }
+  if (globals->shard_count > 0) {
+    Sharder sharder(globals->state, globals->state->build_log_);
+    targets = sharder.Split(targets, globals->shard_count)
+        [globals->shard_index - 1].targets;
+  }
 
   Builder builder(globals->state, globals->config);
+  if (globals->disk_interface)
+    builder.disk_interface_ = globals->disk_interface;
+  OutputCache cache(builder.disk_interface_,
+                    BuildDirPath(globals->state, ".ninja_cache"));
+  if (globals->use_output_cache)
+    builder.cache_ = &cache;
   for (size_t i = 0; i < targets.size(); ++i) {
     if (!builder.AddTarget(targets[i], &err)) {
       if (!err.empty()) {
@@ -574,27 +1279,378 @@ int RunBuild(Globals* globals, int argc, char** argv) {
   return 0;
 }
 
+#ifndef _WIN32
+const char kServeSocketPath[] = ".ninja_serve";
+
+/// What "-t serve" keeps loaded from one build to the next.
+struct Server {
+  explicit Server(Globals* globals)
+      : globals_(globals), loaded_(false), build_log_(NULL),
+        deps_log_(NULL)
+#ifdef __linux__
+        , journal_(&disk_interface_), use_journal_(false)
+#endif
+        {}
+  ~Server() {
+    globals_->ResetState();
+    globals_->disk_interface = NULL;
+    delete build_log_;
+    delete deps_log_;
+  }
+
+  /// Start watching the files builds stat, if possible.
+  void StartJournal();
+
+  /// Open the logs of the state main() loaded.
+  bool Start();
+  /// Run a build of \a args, taking in any changes to the manifest first.
+  int Build(const vector<string>& args);
+
+ private:
+  /// Parse the manifest again and reopen the logs for the new state.
+  bool Reload();
+  /// Prepare the state for another build.
+  void ResetState();
+
+  Globals* globals_;
+  /// False if the last Reload() failed, so the next build retries it.
+  bool loaded_;
+  BuildLog* build_log_;
+  DepsLog* deps_log_;
+  ManifestFiles manifest_files_;
+  RealDiskInterface disk_interface_;
+#ifdef __linux__
+  ChangeJournal journal_;
+  bool use_journal_;
+#endif
+};
+
+void Server::StartJournal() {
+#ifdef __linux__
+  string err;
+  if (!journal_.Start(&err)) {
+    Warning("watching files: %s; every build stats all of them", err.c_str());
+    return;
+  }
+  use_journal_ = true;
+  globals_->disk_interface = &journal_;
+#endif
+}
+
+bool Server::Start() {
+  manifest_files_.Record(globals_->manifest_files, time(NULL),
+                         &disk_interface_);
+  build_log_ = new BuildLog;
+  deps_log_ = new DepsLog;
+  loaded_ = OpenLogs(globals_, build_log_, deps_log_);
+  return loaded_;
+}
+
+bool Server::Reload() {
+  // The logs refer to the nodes of the old state, so they go too.
+  globals_->ResetState();
+  delete build_log_;
+  delete deps_log_;
+  build_log_ = NULL;
+  deps_log_ = NULL;
+  loaded_ = false;
+  if (!LoadManifest(globals_))
+    return false;
+#ifdef __linux__
+  // Nothing is known about the new state anyway.
+  vector<string> changed;
+  if (use_journal_)
+    journal_.ReadChanges(&changed);
+#endif
+  manifest_files_.Record(globals_->manifest_files, time(NULL),
+                         &disk_interface_);
+  return Start();
+}
+
+void Server::ResetState() {
+  State* state = globals_->state;
+#ifdef __linux__
+  // Only the files that changed, what was built and what still has to be
+  // need another look.
+  vector<string> changed;
+  if (use_journal_ && journal_.ReadChanges(&changed)) {
+    state->ResetDirtyNodes();
+    for (vector<string>::iterator i = changed.begin(); i != changed.end();
+         ++i) {
+      if (Node* node = state->LookupNode(*i))
+        state->ResetFrom(node);
+    }
+    return;
+  }
+#endif
+  state->Reset();
+}
+
+int Server::Build(const vector<string>& args) {
+  if (!loaded_ || manifest_files_.Changed(&disk_interface_)) {
+    if (!Reload())
+      return 1;
+  } else {
+    ResetState();
+  }
+
+  string err;
+  if (RebuildManifest(globals_, globals_->input_file, &err)) {
+    if (ReparseChangedManifests(globals_)) {
+      globals_->state->Reset();
+      manifest_files_.Record(globals_->manifest_files, time(NULL),
+                             &disk_interface_);
+    } else if (!Reload()) {
+      return 1;
+    }
+  } else if (!err.empty()) {
+    Error("rebuilding '%s': %s", globals_->input_file, err.c_str());
+    return 1;
+  }
+
+  vector<char*> argv;
+  for (vector<string>::const_iterator i = args.begin(); i != args.end(); ++i)
+    argv.push_back(const_cast<char*>(i->c_str()));
+  argv.push_back(NULL);
+  return RunBuild(globals_, (int)args.size(), &argv[0]);
+}
+
+int ToolServe(Globals* globals, int argc, char* argv[]) {
+  if (argc != 0) {
+    Error("serve takes no arguments; send targets with -t request");
+    return 1;
+  }
+
+  Server server(globals);
+  server.StartJournal();
+  if (!server.Start())
+    return 1;
+  ServeSocket socket;
+  string err;
+  if (!socket.Listen(kServeSocketPath, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  // Clients may hang up before their build is done.
+  signal(SIGPIPE, SIG_IGN);
+  printf("ninja: serving builds on %s\n", kServeSocketPath);
+
+  for (;;) {
+    vector<string> args;
+    int connection = socket.Accept(&args, &err);
+    if (connection < 0) {
+      Error("accepting a request: %s", err.c_str());
+      return 1;
+    }
+
+    // Send everything the build prints to the client.
+    fflush(stdout);
+    fflush(stderr);
+    int saved_stdout = dup(1);
+    int saved_stderr = dup(2);
+    dup2(connection, 1);
+    dup2(connection, 2);
+    int status = server.Build(args);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, 1);
+    dup2(saved_stderr, 2);
+    close(saved_stdout);
+    close(saved_stderr);
+
+    ServeSocket::Finish(connection, status);
+  }
+}
+
+int ToolWorker(Globals* globals, int argc, char* argv[]) {
+  // The worker tool uses getopt, and expects argv[0] to contain the name
+  // of the tool, i.e. "worker".
+  argc++;
+  argv--;
+
+  // Only this machine, unless asked otherwise.
+  string address = "127.0.0.1";
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hb:"))) != -1) {
+    switch (opt) {
+    case 'b':
+      address = optarg;
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t worker [-b ADDRESS] PORT\n"
+"\n"
+"options:\n"
+"  -b ADDRESS  listen on ADDRESS instead of 127.0.0.1\n"
+"\n"
+"Only clients sending the secret in NINJA_REMOTE_SECRET are served.\n"
+             );
+      return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+  if (argc != 1) {
+    Error("usage: ninja -t worker [-b ADDRESS] PORT");
+    return 1;
+  }
+
+  const char* secret = getenv("NINJA_REMOTE_SECRET");
+  if (!secret || !*secret) {
+    Error("set NINJA_REMOTE_SECRET to what clients must send");
+    return 1;
+  }
+  printf("ninja: running jobs sent to %s port %s\n", address.c_str(),
+         argv[0]);
+  string err;
+  RunRemoteWorker(address, argv[0], secret, &err);
+  Error("listening on %s port %s: %s", address.c_str(), argv[0],
+        err.c_str());
+  return 1;
+}
+
+int ToolRemoteRun(Globals* globals, int argc, char* argv[]) {
+  if (argc != 1) {
+    Error("usage: ninja -t remote-run JOBFILE");
+    return 1;
+  }
+  RemoteJob job;
+  string err;
+  if (!job.Load(argv[0], &err)) {
+    Error("loading job %s: %s", argv[0], err.c_str());
+    return 1;
+  }
+  unlink(argv[0]);
+  if (const char* secret = getenv("NINJA_REMOTE_SECRET"))
+    job.secret = secret;
+  return job.Run();
+}
+
+int ToolRequest(Globals* globals, int argc, char* argv[]) {
+  vector<string> args(argv, argv + argc);
+  string err;
+  int status = SendServeRequest(kServeSocketPath, args, stdout, &err);
+  if (status < 0) {
+    Error("no server at %s: %s; start one with 'ninja -t serve'",
+          kServeSocketPath, err.c_str());
+    return 1;
+  }
+  return status;
+}
+#endif  // _WIN32
+
+/// A subtool, run with "-t name".
+struct Tool {
+  const char* name;
+  const char* desc;
+
+  /// When to run the tool.
+  enum {
+    /// Right after the command line was parsed, without loading anything.
+    RUN_AFTER_FLAGS,
+    /// Once the manifest was loaded.
+    RUN_AFTER_LOAD
+  } when;
+
+  int (*func)(Globals*, int, char**);
+};
+
+const Tool kTools[] = {
+  { "affected", "list the outputs built from given changed files",
+    Tool::RUN_AFTER_LOAD, ToolAffected },
+#if !defined(_WIN32) && !defined(NINJA_BOOTSTRAP)
+  { "browse", "browse dependency graph in a web browser",
+    Tool::RUN_AFTER_LOAD, ToolBrowse },
+#endif
+  { "cache-prune", "shrink the output cache to a given size",
+    Tool::RUN_AFTER_LOAD, ToolCachePrune },
+  { "clean", "clean built files",
+    Tool::RUN_AFTER_LOAD, ToolClean },
+  { "commands", "list all commands required to rebuild given targets",
+    Tool::RUN_AFTER_LOAD, ToolCommands },
+  { "graph", "output graphviz dot file for targets",
+    Tool::RUN_AFTER_LOAD, ToolGraph },
+  { "memstats", "show what the loaded graph and logs take in memory",
+    Tool::RUN_AFTER_LOAD, ToolMemStats },
+  { "profile", "show the slowest commands and the critical path",
+    Tool::RUN_AFTER_LOAD, ToolProfile },
+  { "query", "show inputs/outputs for a path",
+    Tool::RUN_AFTER_LOAD, ToolQuery },
+  { "recompact", "rewrite the build and deps logs, dropping stale entries",
+    Tool::RUN_AFTER_LOAD, ToolRecompact },
+#ifndef _WIN32
+  { "remote-run", "run a job on a remote worker (used by builds)",
+    Tool::RUN_AFTER_FLAGS, ToolRemoteRun },
+  { "request", "build targets on the server started by -t serve",
+    Tool::RUN_AFTER_FLAGS, ToolRequest },
+#endif
+  { "rules",    "list all rules",
+    Tool::RUN_AFTER_LOAD, ToolRules },
+#ifndef _WIN32
+  { "serve", "keep the build graph loaded and build on request",
+    Tool::RUN_AFTER_LOAD, ToolServe },
+#endif
+  { "shard", "split the targets into parts of about equal cost",
+    Tool::RUN_AFTER_LOAD, ToolShard },
+  { "simulate", "predict the duration of a build from the build log",
+    Tool::RUN_AFTER_LOAD, ToolSimulate },
+  { "targets",  "list targets by their rule or depth in the DAG",
+    Tool::RUN_AFTER_LOAD, ToolTargets },
+#ifndef _WIN32
+  { "worker", "run commands sent by builds on other machines",
+    Tool::RUN_AFTER_FLAGS, ToolWorker },
+#endif
+  { NULL, NULL, Tool::RUN_AFTER_FLAGS, NULL }
+};
+
+/// Find the tool called \a name.  Returns NULL, having printed an error,
+/// if there is none.
+const Tool* ChooseTool(const string& name) {
+  for (int i = 0; kTools[i].name; ++i) {
+    if (name == kTools[i].name)
+      return &kTools[i];
+  }
+
+  vector<const char*> words;
+  for (int i = 0; kTools[i].name; ++i)
+    words.push_back(kTools[i].name);
+  const char* suggestion = SpellcheckStringV(name, words);
+  if (suggestion) {
+    Error("unknown tool '%s', did you mean '%s'?", name.c_str(), suggestion);
+  } else {
+    Error("unknown tool '%s'", name.c_str());
+  }
+  return NULL;
+}
+
 }  // anonymous namespace
 
 int main(int argc, char** argv) {
   Globals globals;
   globals.ninja_command = argv[0];
-  const char* input_file = "build.ninja";
+  globals.input_file = "build.ninja";
   const char* working_dir = NULL;
-  string tool;
+  int remote_parallelism = -1;
+  bool explicit_jobs = false;
+  bool create_jobserver = false;
+  string tool_name;
 
   setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
 
   globals.config.parallelism = GuessParallelism();
 
+  enum { OPT_JOBSERVER = 1, OPT_SHARD };
   const option kLongOptions[] = {
     { "help", no_argument, NULL, 'h' },
+    { "jobserver", no_argument, NULL, OPT_JOBSERVER },
+    { "shard", required_argument, NULL, OPT_SHARD },
     { NULL, 0, NULL, 0 }
   };
 
   int opt;
-  while (tool.empty() &&
-         (opt = getopt_long(argc, argv, "d:f:hj:k:nt:vC:", kLongOptions,
+  while (tool_name.empty() &&
+         (opt = getopt_long(argc, argv, "d:f:hj:k:l:m:nr:t:vC:", kLongOptions,
                             NULL)) != -1) {
     switch (opt) {
       case 'd':
@@ -602,10 +1658,25 @@ int main(int argc, char** argv) {
           return 1;
         break;
       case 'f':
-        input_file = optarg;
+        globals.input_file = optarg;
         break;
       case 'j':
-        globals.config.parallelism = atoi(optarg);
+        explicit_jobs = true;
+        if (strncmp(optarg, "auto", 4) == 0) {
+          // Start from the usual guess, going as low as one job and as
+          // high as twice as many.
+          int min_jobs = 1, max_jobs = 2 * globals.config.parallelism;
+          if (optarg[4] != 0 &&
+              (sscanf(optarg + 4, ":%d-%d", &min_jobs, &max_jobs) != 2 ||
+               min_jobs < 1 || max_jobs < min_jobs)) {
+            Fatal("-j auto bounds invalid: use e.g. -j auto:2-64");
+          }
+          globals.config.min_parallelism = min_jobs;
+          globals.config.max_parallelism = max_jobs;
+        } else {
+          globals.config.parallelism = atoi(optarg);
+          globals.config.max_parallelism = 0;
+        }
         break;
       case 'k': {
         char* end;
@@ -618,18 +1689,56 @@ int main(int argc, char** argv) {
         globals.config.swallow_failures = value - 1;
         break;
       }
+      case 'l': {
+        char* end;
+        double value = strtod(optarg, &end);
+        if (end == optarg || *end != 0)
+          Fatal("-l parameter not numeric: did you mean -l 0.0?");
+        globals.config.max_load_average = value;
+        break;
+      }
+      case 'm': {
+        char* end;
+        long value = strtol(optarg, &end, 10);
+        if (end == optarg || *end != 0)
+          Fatal("-m parameter not numeric: did you mean -m 0?");
+        globals.config.min_available_memory = (int64_t)value << 20;
+        break;
+      }
       case 'n':
         globals.config.dry_run = true;
         break;
+      case 'r': {
+        char* end;
+        long value = strtol(optarg, &end, 10);
+        if (end == optarg || *end != 0)
+          Fatal("-r parameter not numeric: did you mean -r 0?");
+        remote_parallelism = value;
+        break;
+      }
       case 'v':
         globals.config.verbosity = BuildConfig::VERBOSE;
         break;
       case 't':
-        tool = optarg;
+        tool_name = optarg;
         break;
       case 'C':
         working_dir = optarg;
         break;
+      case OPT_JOBSERVER:
+        create_jobserver = true;
+        break;
+      case OPT_SHARD: {
+        int index, count;
+        char extra;
+        if (sscanf(optarg, "%d/%d%c", &index, &count, &extra) != 2 ||
+            index < 1 || index > count) {
+          Fatal("--shard invalid: use e.g. --shard=1/4");
+        }
+        globals.shard_index = index;
+        globals.shard_count = count;
+        break;
+      }
       case 'h':
       default:
         Usage(globals.config);
@@ -639,6 +1748,51 @@ int main(int argc, char** argv) {
   argv += optind;
   argc -= optind;
 
+  // Under make, share its job slots unless told how many jobs to run.
+  Jobserver::Auth jobserver_auth;
+  const char* makeflags = getenv("MAKEFLAGS");
+  if (globals.config.dry_run) {
+    // Nothing to share.
+  } else if (makeflags && !explicit_jobs &&
+             Jobserver::ParseMakeflags(makeflags, &jobserver_auth)) {
+    string err;
+    globals.config.jobserver = Jobserver::Connect(jobserver_auth, &err);
+    if (!globals.config.jobserver)
+      Warning("%s; ignoring the jobserver", err.c_str());
+    else if (jobserver_auth.jobs > 0)
+      globals.config.parallelism = jobserver_auth.jobs;
+  } else if (create_jobserver) {
+    string err;
+    globals.config.jobserver =
+        Jobserver::Create(globals.config.parallelism, &err);
+    if (!globals.config.jobserver)
+      Fatal("%s", err.c_str());
+  }
+
+#ifndef _WIN32
+  if (const char* workers = getenv("NINJA_REMOTE_WORKERS")) {
+    for (const char* start = workers; *start; ) {
+      const char* end = strchr(start, ',');
+      if (!end)
+        end = start + strlen(start);
+      if (end > start)
+        globals.config.remote_workers.push_back(string(start, end));
+      start = *end ? end + 1 : end;
+    }
+    if (remote_parallelism < 0)
+      remote_parallelism = 8 * globals.config.remote_workers.size();
+    globals.config.remote_parallelism = remote_parallelism;
+    // Remote commands are shipped by running Ninja itself, perhaps from
+    // another directory once -C applies.
+    char path[PATH_MAX];
+    if (strchr(globals.ninja_command, '/') &&
+        realpath(globals.ninja_command, path))
+      globals.config.ninja_path = path;
+    else
+      globals.config.ninja_path = globals.ninja_command;
+  }
+#endif
+
   if (working_dir) {
     // The formatting of this string, complete with funny quotes, is
     // so Emacs can properly identify that the cwd has changed for
@@ -653,71 +1807,94 @@ int main(int argc, char** argv) {
     }
   }
 
+  const Tool* tool = NULL;
+  if (!tool_name.empty()) {
+    if (tool_name == "list") {
+      printf("ninja subtools:\n");
+      int width = 0;
+      for (int i = 0; kTools[i].name; ++i)
+        width = max(width, (int)strlen(kTools[i].name));
+      for (int i = 0; kTools[i].name; ++i)
+        printf("%*s  %s\n", width, kTools[i].name, kTools[i].desc);
+      return 0;
+    }
+    tool = ChooseTool(tool_name);
+    if (!tool)
+      return 1;
+    if (tool->when == Tool::RUN_AFTER_FLAGS)
+      return tool->func(&globals, argc, argv);
+  }
+
   bool rebuilt_manifest = false;
 
 reload:
-  RealFileReader file_reader;
-  ManifestParser parser(globals.state, &file_reader);
-  string err;
-  if (!parser.Load(input_file, &err)) {
-    Error("%s", err.c_str());
+  if (!LoadManifest(&globals))
     return 1;
-  }
 
-  if (!tool.empty())
-    return RunTool(tool, &globals, argc, argv);
+  if (tool)
+    return tool->func(&globals, argc, argv);
 
   BuildLog build_log;
-  build_log.SetConfig(&globals.config);
-  globals.state->build_log_ = &build_log;
+  DepsLog deps_log;
+  if (!OpenLogs(&globals, &build_log, &deps_log))
+    return 1;
 
-  const string build_dir = globals.state->bindings_.LookupVariable("builddir");
-  const char* kLogPath = ".ninja_log";
-  string log_path = kLogPath;
-  if (!build_dir.empty()) {
-    if (MakeDir(build_dir) < 0 && errno != EEXIST) {
-      Error("creating build directory %s: %s",
-            build_dir.c_str(), strerror(errno));
+  string err;
+  RealDiskInterface disk_interface;
+  CachingDiskInterface stat_cache(&disk_interface);
+  string stat_cache_path = BuildDirPath(globals.state, ".ninja_stat");
+  globals.disk_interface = NULL;
+  if (globals.use_stat_cache) {
+    if (!stat_cache.Load(stat_cache_path, &err)) {
+      Error("loading stat cache %s: %s", stat_cache_path.c_str(), err.c_str());
       return 1;
     }
-    log_path = build_dir + "/" + kLogPath;
-  }
-
-  if (!build_log.Load(log_path.c_str(), &err)) {
-    Error("loading build log %s: %s",
-          log_path.c_str(), err.c_str());
-    return 1;
-  }
-
-  if (!build_log.OpenForWrite(log_path.c_str(), &err)) {
-    Error("opening build log: %s", err.c_str());
-    return 1;
+    globals.disk_interface = &stat_cache;
   }
 
   if (!rebuilt_manifest) { // Don't get caught in an infinite loop by a rebuild
                            // target that is never up to date.
-    if (RebuildManifest(globals.state, globals.config, input_file, &err)) {
+    if (RebuildManifest(&globals, globals.input_file, &err)) {
       rebuilt_manifest = true;
-      globals.ResetState();
-      goto reload;
+      if (ReparseChangedManifests(&globals)) {
+        // The nodes, and so the logs, are still those of the state.
+        globals.state->Reset();
+      } else {
+        globals.ResetState();
+        goto reload;
+      }
     } else if (!err.empty()) {
-      Error("rebuilding '%s': %s", input_file, err.c_str());
+      Error("rebuilding '%s': %s", globals.input_file, err.c_str());
       return 1;
     }
   }
 
   int result = RunBuild(&globals, argc, argv);
-  if (g_metrics) {
+  if (globals.use_stat_cache && !globals.config.dry_run) {
+    if (!stat_cache.Save(stat_cache_path, &err))
+      Warning("saving stat cache %s: %s", stat_cache_path.c_str(), err.c_str());
+  }
+  if (g_trace) {
+    string trace_path = BuildDirPath(globals.state, ".ninja_trace");
+    if (!g_trace->Save(trace_path, &err))
+      Warning("saving trace %s: %s", trace_path.c_str(), err.c_str());
+  }
+  if (globals.write_stats) {
+    string stats_path = BuildDirPath(globals.state, ".ninja_metrics");
+    FILE* file = fopen(stats_path.c_str(), "w");
+    if (file) {
+      g_metrics->ReportJSON(file);
+      fclose(file);
+    } else {
+      Warning("writing %s: %s", stats_path.c_str(), strerror(errno));
+    }
+  }
+  if (globals.print_stats) {
     g_metrics->Report();
 
     printf("\n");
     int count = (int)globals.state->paths_.size();
-    int buckets =
-#ifdef _MSC_VER
-        (int)globals.state->paths_.comp.bucket_size;
-#else
-        (int)globals.state->paths_.bucket_count();
-#endif
+    int buckets = (int)globals.state->paths_.bucket_count();
     printf("path->node hash load %.2f (%d entries / %d buckets)\n",
            count / (double) buckets, count, buckets);
   }
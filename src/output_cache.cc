@@ -0,0 +1,237 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "output_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#include <algorithm>
+#include <map>
+
+#include "build_log.h"
+#include "graph.h"
+#include "metrics.h"
+#include "util.h"
+
+namespace {
+
+/// A file in the cache directory.
+struct CacheFile {
+  string name;
+  int64_t size;
+  /// Only comparable with that of other files.
+  int64_t mtime;
+};
+
+/// List the files in \a dir, which may not exist yet.  Returns false
+/// with \a err set on failure.
+bool ListFiles(const string& dir, vector<CacheFile>* files, string* err) {
+#ifdef _WIN32
+  WIN32_FIND_DATAA data;
+  HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &data);
+  if (find == INVALID_HANDLE_VALUE) {
+    DWORD error = GetLastError();
+    if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND)
+      return true;
+    *err = GetLastErrorString();
+    return false;
+  }
+  do {
+    if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+      continue;
+    CacheFile file;
+    file.name = data.cFileName;
+    file.size = ((int64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    file.mtime = ((int64_t)data.ftLastWriteTime.dwHighDateTime << 32) |
+        data.ftLastWriteTime.dwLowDateTime;
+    files->push_back(file);
+  } while (FindNextFileA(find, &data));
+  FindClose(find);
+  return true;
+#else
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    if (errno == ENOENT)
+      return true;
+    *err = strerror(errno);
+    return false;
+  }
+  while (dirent* entry = readdir(d)) {
+    CacheFile file;
+    file.name = entry->d_name;
+    struct stat st;
+    if (stat((dir + "/" + file.name).c_str(), &st) < 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    file.size = st.st_size;
+    file.mtime = st.st_mtime;
+    files->push_back(file);
+  }
+  closedir(d);
+  return true;
+#endif
+}
+
+/// The files of one cache entry.
+struct CacheEntry {
+  CacheEntry() : size(0), mtime(0) {}
+  int64_t size;
+  /// That of the newest file, i.e. when the entry was last used.
+  int64_t mtime;
+  vector<string> names;
+};
+
+bool OlderEntry(const CacheEntry* a, const CacheEntry* b) {
+  return a->mtime < b->mtime;
+}
+
+}  // namespace
+
+OutputCache::OutputCache(DiskInterface* disk_interface, const string& dir)
+    : disk_interface_(disk_interface), dir_(dir) {}
+
+bool OutputCache::Key(const string& command, const vector<Node*>& inputs,
+                      const vector<string>& outputs, uint64_t* key) {
+  METRIC_RECORD("output cache key");
+  // Hash a description of the command with each input's contents
+  // replaced by its hash.
+  string description = command;
+  description.push_back('\0');
+  for (vector<Node*>::const_iterator i = inputs.begin();
+       i != inputs.end(); ++i) {
+    uint64_t hash;
+    if (!HashFile((*i)->path(), &hash))
+      return false;
+    description.append((*i)->path());
+    description.push_back('\0');
+    description.append((const char*)&hash, sizeof(hash));
+  }
+  for (vector<string>::const_iterator i = outputs.begin();
+       i != outputs.end(); ++i) {
+    description.append(*i);
+    description.push_back('\0');
+  }
+  *key = BuildLog::LogEntry::HashCommand(description);
+  return true;
+}
+
+bool OutputCache::Restore(uint64_t key, const vector<string>& outputs) {
+  METRIC_RECORD("output cache restore");
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    if (disk_interface_->Stat(EntryPath(key, i)) <= 0)
+      return false;
+  }
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    if (!disk_interface_->CloneFile(EntryPath(key, i), outputs[i]))
+      return false;
+  }
+  // The copy is new, so its mtime is the current time; give it to the
+  // entry too, so that Prune() keeps it.
+  TimeStamp now = disk_interface_->Stat(outputs[0]);
+  if (now > 0)
+    disk_interface_->SetMTime(EntryPath(key, 0), now);
+  return true;
+}
+
+void OutputCache::Store(uint64_t key, const vector<string>& outputs) {
+  METRIC_RECORD("output cache store");
+  if (outputs.empty() || !disk_interface_->MakeDirs(EntryPath(key, 0)))
+    return;
+  // Store the first output last, so that a lookup never finds an entry
+  // that is still being written.
+  for (size_t i = outputs.size(); i > 0; --i) {
+    if (!disk_interface_->CloneFile(outputs[i - 1], EntryPath(key, i - 1)))
+      return;
+  }
+}
+
+bool OutputCache::Prune(int64_t max_size, int* removed, string* err) {
+  METRIC_RECORD("output cache prune");
+  *removed = 0;
+  vector<CacheFile> files;
+  if (!ListFiles(dir_, &files, err))
+    return false;
+
+  // Entry files are named "<16 hex digits of the key>.<index>"; anything
+  // else (e.g. the temporary of a copy in progress) belongs to the entry
+  // its name starts with, if any.
+  map<string, CacheEntry> entries;
+  int64_t total = 0;
+  for (vector<CacheFile>::iterator i = files.begin(); i != files.end(); ++i) {
+    if (i->name.size() < 18 || i->name[16] != '.')
+      continue;
+    CacheEntry& entry = entries[i->name.substr(0, 16)];
+    entry.size += i->size;
+    entry.mtime = max(entry.mtime, i->mtime);
+    entry.names.push_back(i->name);
+    total += i->size;
+  }
+
+  vector<CacheEntry*> by_age;
+  for (map<string, CacheEntry>::iterator i = entries.begin();
+       i != entries.end(); ++i) {
+    by_age.push_back(&i->second);
+  }
+  sort(by_age.begin(), by_age.end(), OlderEntry);
+  for (vector<CacheEntry*>::iterator i = by_age.begin();
+       i != by_age.end() && total > max_size; ++i) {
+    // The first output goes first, so that a lookup never finds the entry
+    // half removed.
+    sort((*i)->names.begin(), (*i)->names.end());
+    for (vector<string>::iterator name = (*i)->names.begin();
+         name != (*i)->names.end(); ++name) {
+      disk_interface_->RemoveFile(dir_ + "/" + *name);
+    }
+    total -= (*i)->size;
+    ++*removed;
+  }
+  return true;
+}
+
+string OutputCache::EntryPath(uint64_t key, size_t index) const {
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx.%u", (unsigned long long)key,
+           (unsigned)index);
+  return dir_ + name;
+}
+
+bool OutputCache::HashFile(const string& path, uint64_t* hash) {
+  TimeStamp mtime = disk_interface_->Stat(path);
+  if (mtime <= 0)
+    return false;
+  FileHash& file_hash = file_hashes_[path];
+  if (file_hash.hash != 0 && file_hash.mtime == mtime) {
+    *hash = file_hash.hash;
+    return true;
+  }
+
+  string err;
+  disk_interface_->ReadFileInto(path, &contents_, &err);
+  if (!err.empty())
+    return false;
+  file_hash.mtime = mtime;
+  file_hash.hash = BuildLog::LogEntry::HashContents(contents_);
+  *hash = file_hash.hash;
+  return true;
+}
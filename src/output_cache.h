@@ -0,0 +1,86 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_OUTPUT_CACHE_H_
+#define NINJA_OUTPUT_CACHE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "disk_interface.h"
+#include "hash_map.h"
+
+struct Node;
+
+/// A local cache of command outputs, so that outputs built before (e.g.
+/// on another branch) can be copied back instead of being rebuilt.
+///
+/// Entries are keyed by a hash of the command line, the paths and
+/// contents of its inputs, and the paths of its outputs.  Each output is
+/// stored as a separate file in the cache directory, named after the key
+/// and the output's position.  Files are cloned rather than hard-linked,
+/// as some tools rewrite their outputs in place, which would corrupt the
+/// cached copy.
+///
+/// The cache doesn't limit its own size; Prune() drops the entries used
+/// least recently until it fits.
+struct OutputCache {
+  OutputCache(DiskInterface* disk_interface, const string& dir);
+
+  /// Compute the key of running \a command on \a inputs to produce
+  /// \a outputs.  Returns false if an input is missing or unreadable, in
+  /// which case the command can't be cached.
+  bool Key(const string& command, const vector<Node*>& inputs,
+           const vector<string>& outputs, uint64_t* key);
+
+  /// Copy the files stored under \a key to \a outputs.  Returns false if
+  /// there isn't a complete entry, or it couldn't be copied.  The entry
+  /// then counts as just used.
+  bool Restore(uint64_t key, const vector<string>& outputs);
+
+  /// Store copies of \a outputs under \a key.  Failures only mean the
+  /// next lookup misses, so they aren't reported.
+  void Store(uint64_t key, const vector<string>& outputs);
+
+  /// Remove the entries stored or restored least recently until the
+  /// cache takes at most \a max_size bytes, counting how many in
+  /// \a removed.  Lists the cache directory directly, so it only works
+  /// with the real disk.  Returns false with \a err set on failure.
+  bool Prune(int64_t max_size, int* removed, string* err);
+
+ private:
+  /// The file holding output number \a index of entry \a key.
+  string EntryPath(uint64_t key, size_t index) const;
+  /// Hash the contents of \a path, reusing the hash of a previous call if
+  /// its mtime hasn't changed since.  Returns false if it can't be read.
+  bool HashFile(const string& path, uint64_t* hash);
+
+  DiskInterface* disk_interface_;
+  string dir_;
+
+  struct FileHash {
+    TimeStamp mtime;
+    uint64_t hash;
+  };
+  typedef hash_map<string, FileHash> FileHashes;
+  FileHashes file_hashes_;
+
+  /// Buffer for reading inputs.
+  string contents_;
+};
+
+#endif  // NINJA_OUTPUT_CACHE_H_
@@ -0,0 +1,127 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "output_cache.h"
+
+#include <stdio.h>
+
+#include "test.h"
+
+namespace {
+
+struct OutputCacheTest : public StateTestWithBuiltinRules {
+  OutputCacheTest() : cache_(&fs_, "cache") {
+    fs_.Create("in1", 1, "one");
+    fs_.Create("in2", 1, "two");
+    inputs_.push_back(GetNode("in1"));
+    inputs_.push_back(GetNode("in2"));
+    outputs_.push_back("out");
+  }
+
+  VirtualFileSystem fs_;
+  OutputCache cache_;
+  vector<Node*> inputs_;
+  vector<string> outputs_;
+};
+
+TEST_F(OutputCacheTest, Key) {
+  uint64_t key1, key2;
+  ASSERT_TRUE(cache_.Key("cc", inputs_, outputs_, &key1));
+  ASSERT_TRUE(cache_.Key("cc", inputs_, outputs_, &key2));
+  EXPECT_EQ(key1, key2);
+
+  ASSERT_TRUE(cache_.Key("cc -O2", inputs_, outputs_, &key2));
+  EXPECT_NE(key1, key2);
+
+  // Touching an input doesn't matter, changing it does.
+  fs_.Create("in1", 2, "one");
+  ASSERT_TRUE(cache_.Key("cc", inputs_, outputs_, &key2));
+  EXPECT_EQ(key1, key2);
+  fs_.Create("in1", 3, "uno");
+  ASSERT_TRUE(cache_.Key("cc", inputs_, outputs_, &key2));
+  EXPECT_NE(key1, key2);
+
+  // A missing input can't be hashed.
+  inputs_.push_back(GetNode("missing"));
+  EXPECT_FALSE(cache_.Key("cc", inputs_, outputs_, &key2));
+}
+
+TEST_F(OutputCacheTest, StoreAndRestore) {
+  outputs_.push_back("out.d");
+  uint64_t key;
+  ASSERT_TRUE(cache_.Key("cc", inputs_, outputs_, &key));
+  EXPECT_FALSE(cache_.Restore(key, outputs_));
+
+  fs_.Create("out", 1, "object");
+  fs_.Create("out.d", 1, "out: in1 in2");
+  cache_.Store(key, outputs_);
+  fs_.RemoveFile("out");
+  fs_.RemoveFile("out.d");
+
+  fs_.now_ = 5;
+  EXPECT_TRUE(cache_.Restore(key, outputs_));
+  EXPECT_EQ("object", fs_.files_["out"].contents);
+  EXPECT_EQ(5, fs_.files_["out"].mtime);
+  EXPECT_EQ("out: in1 in2", fs_.files_["out.d"].contents);
+}
+
+TEST(OutputCachePruneTest, LeastRecentlyUsed) {
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("Ninja-OutputCachePruneTest");
+  RealDiskInterface disk;
+  OutputCache cache(&disk, "cache");
+  vector<string> outputs(1, "out");
+
+  // Three entries of 100 bytes, stored a minute apart.
+  FILE* f = fopen("out", "wb");
+  ASSERT_TRUE(f);
+  fprintf(f, "%s", string(100, 'x').c_str());
+  ASSERT_EQ(0, fclose(f));
+  TimeStamp now = disk.Stat("out");
+  ASSERT_GT(now, 0);
+  for (uint64_t key = 1; key <= 3; ++key) {
+    cache.Store(key, outputs);
+    char name[64];
+    snprintf(name, sizeof(name), "cache/%016llx.0", (unsigned long long)key);
+    ASSERT_TRUE(disk.SetMTime(name, now - 600 + 60 * (int)key));
+  }
+  // Using the oldest one makes it the newest.
+  ASSERT_TRUE(cache.Restore(1, outputs));
+
+  string err;
+  int removed;
+  ASSERT_TRUE(cache.Prune(250, &removed, &err)) << err;
+  EXPECT_EQ(1, removed);
+  EXPECT_TRUE(cache.Restore(1, outputs));
+  EXPECT_FALSE(cache.Restore(2, outputs));
+  EXPECT_TRUE(cache.Restore(3, outputs));
+
+  ASSERT_TRUE(cache.Prune(0, &removed, &err)) << err;
+  EXPECT_EQ(2, removed);
+  EXPECT_FALSE(cache.Restore(1, outputs));
+
+  temp_dir.Cleanup();
+}
+
+TEST_F(OutputCacheTest, IncompleteEntry) {
+  outputs_.push_back("out2");
+  uint64_t key;
+  ASSERT_TRUE(cache_.Key("cc", inputs_, outputs_, &key));
+  fs_.Create("out", 1, "");
+  cache_.Store(key, outputs_);
+  EXPECT_FALSE(cache_.Restore(key, outputs_));
+}
+
+}  // namespace
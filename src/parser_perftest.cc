@@ -15,12 +15,59 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "byte_scan.h"
 #include "depfile_parser.h"
 #include "util.h"
 
+namespace {
+
+typedef const char* (*ScanFunction)(const char* p, const char* end);
+
+/// Scan all of \a text in runs ended by \a scan, the way the lexers use
+/// it, and return how many runs there were.
+int ScanRuns(const string& text, ScanFunction scan) {
+  const char* p = text.data();
+  const char* end = p + text.size();
+  int runs = 0;
+  while (p < end) {
+    p = scan(p, end) + 1;
+    ++runs;
+  }
+  return runs;
+}
+
+/// Return the time in microseconds one ScanRuns() of \a text takes.
+float TimeScan(const string& text, ScanFunction scan) {
+  for (int limit = 1 << 6; ; limit *= 2) {
+    int64_t start = GetTimeMillis();
+    int runs = 0;
+    for (int rep = 0; rep < limit; ++rep)
+      runs += ScanRuns(text, scan);
+    int64_t end = GetTimeMillis();
+    // Use the result so the loop isn't optimized away.
+    if (end - start > 100 && runs > 0)
+      return (end - start) * 1000 / (float)limit;
+  }
+}
+
+/// Compare the vectorized scans of \a text against byte-at-a-time ones.
+void CompareScans(const char* filename, const string& text) {
+  printf("%s: manifest scan %.1fus (scalar %.1fus), "
+         "depfile scan %.1fus (scalar %.1fus)\n", filename,
+         TimeScan(text, FindManifestSpecial),
+         TimeScan(text, FindManifestSpecialScalar),
+         TimeScan(text, SkipDepfilePathChars),
+         TimeScan(text, SkipDepfilePathCharsScalar));
+}
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
   if (argc < 2) {
-    printf("usage: %s <file1> <file2...>\n", argv[0]);
+    printf("usage: %s <file1> <file2...>\n"
+           "Times parsing each file as a depfile, and the lexers' scans of\n"
+           "it with and without vector instructions.  Try manifests too.\n",
+           argv[0]);
     return 1;
   }
 
@@ -28,6 +75,14 @@ int main(int argc, char* argv[]) {
   for (int i = 1; i < argc; ++i) {
     const char* filename = argv[i];
 
+    string text;
+    string err;
+    if (ReadFile(filename, &text, &err) < 0) {
+      printf("%s: %s\n", filename, err.c_str());
+      return 1;
+    }
+    CompareScans(filename, text);
+
     for (int limit = 1 << 10; limit < (1<<20); limit *= 2) {
       int64_t start = GetTimeMillis();
       for (int rep = 0; rep < limit; ++rep) {
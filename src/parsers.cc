@@ -15,17 +15,240 @@
 #include "parsers.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <deque>
+
+#include "build_log.h"
 #include "graph.h"
 #include "metrics.h"
 #include "state.h"
+#include "threads.h"
 #include "util.h"
 
+/// Statements of a parallel parse whose effect on the State has to wait
+/// until the subninja fragments before them have been merged.
+struct ManifestParser::Deferred {
+  struct Item {
+    enum Type {
+      RULE,       // A rule was defined.
+      POOL,       // A pool was defined.
+      EDGE,       // An edge used a rule that wasn't known yet.
+      EDGE_POOL,  // An edge used a pool that wasn't known yet.
+      DEFAULT,    // A default named a target that wasn't known yet.
+      SUBNINJA    // A fragment goes here.
+    } type;
+    /// The rule's or pool's name, or the default target's path.
+    string name;
+    /// The edge's index in the parsed State's edges_, or the fragment's
+    /// index.
+    size_t index;
+    /// The error to report if the rule, pool or target is still unknown,
+    /// or if the pool turns out to be a duplicate.
+    string error;
+    /// For EDGE: whether the build statement named its own pool, which
+    /// then takes precedence over the rule's.
+    bool own_pool;
+  };
+
+  Deferred() : fragments(NULL) {}
+
+  vector<Item> items;
+  /// Where the top-level parse collects subninja files; NULL while
+  /// parsing a fragment, whose own subninja files are parsed in place.
+  vector<Fragment*>* fragments;
+};
+
+struct ManifestParser::Defined {
+  set<string> rules;
+  set<string> pools;
+};
+
+/// A subninja file parsed on its own into a private State.
+struct ManifestParser::Fragment {
+  Fragment()
+      : env(NULL), frozen_parent(NULL), parent(NULL), file(-1), ok(false) {}
+
+  string path;
+  string contents;
+  /// The file's scope.
+  BindingEnv* env;
+  /// A copy of the bindings visible from the subninja statement, which
+  /// is env's parent while parsing.
+  BindingEnv* frozen_parent;
+  /// The scope of the subninja statement, env's parent once merged.
+  BindingEnv* parent;
+  /// The file's index in the State's manifest_files_, or -1.  Its own
+  /// state records it first, followed by the files it includes.
+  int file;
+  State state;
+  Deferred deferred;
+  bool ok;
+  string err;
+};
+
+/// A statement as read from the input, before anything in it is
+/// evaluated.  Reading doesn't depend on the statements before it, so
+/// the chunks of a large file can be read in parallel; the positions it
+/// records let the errors found when it's applied point where a serial
+/// parse would.
+struct ManifestParser::Statement {
+  Statement()
+      : type(Lexer::ERROR), pos(NULL), end(NULL), outs(0), implicit(0),
+        order_only(0) {}
+
+  /// BUILD, POOL, RULE, DEFAULT, INCLUDE or SUBNINJA, or IDENT for a
+  /// variable binding.
+  Lexer::Token type;
+  /// The variable, pool or rule defined, or the rule a build statement
+  /// uses.
+  string name;
+  /// The value of a variable binding.
+  EvalString value;
+  /// The end of the first line of a pool or rule, the rule name of a
+  /// build statement or the path of an include.
+  const char* pos;
+  /// The token after the statement.
+  const char* end;
+  /// The indented bindings, and where each one's value ends.
+  vector<pair<string, EvalString> > bindings;
+  vector<const char*> binding_pos;
+  /// A build statement's outputs followed by its inputs, a default
+  /// statement's targets or the file included, and where each one ends.
+  vector<EvalString> paths;
+  vector<const char*> path_pos;
+  /// How many of a build statement's paths are outputs, and how many of
+  /// its inputs are implicit and order-only.
+  int outs, implicit, order_only;
+};
+
+/// A piece of a large file, holding the statements that start in
+/// [begin, end).
+struct ManifestParser::Chunk {
+  Chunk() : begin(0), end(0), ok(false) {}
+
+  size_t begin;
+  size_t end;
+  /// A deque, as statements are costly to copy.
+  deque<Statement> statements;
+  /// False if reading stopped at \a err, which follows \a statements.
+  bool ok;
+  string err;
+};
+
+namespace {
+
+uint64_t HashManifest(const string& contents) {
+  return BuildLog::LogEntry::HashContents(contents);
+}
+
+/// Whether \a env is \a scope or nested in it.  The parser only ever
+/// creates BindingEnvs.
+bool Within(Env* env, BindingEnv* scope) {
+  for (; env; env = static_cast<BindingEnv*>(env)->parent()) {
+    if (env == scope)
+      return true;
+  }
+  return false;
+}
+
+struct FragmentTask : public ParallelTask {
+  FragmentTask(vector<ManifestParser::Fragment*>* fragments,
+               ManifestParser::FileReader* file_reader)
+      : fragments_(fragments), file_reader_(file_reader) {}
+
+  virtual void Run(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      ManifestParser::ParseFragment((*fragments_)[i], file_reader_);
+  }
+
+  vector<ManifestParser::Fragment*>* fragments_;
+  ManifestParser::FileReader* file_reader_;
+};
+
+/// Whether \a key is a variable a rule can set.
+bool IsRuleVariable(const string& key) {
+  return key == "command" || key == "depfile" || key == "deps" ||
+      key == "description" || key == "generator" || key == "restat" ||
+      key == "local" || key == "pool" || key == "worker";
+}
+
+/// Split \a input, up to its terminating NUL, into chunks of about
+/// \a chunk_size bytes.  Each chunk starts a line that begins a statement:
+/// one that isn't indented and doesn't continue the line before it with
+/// a '$'-escaped newline.  Returns the offsets of the chunks followed by
+/// the end of the input.
+vector<size_t> SplitChunks(const string& input, size_t chunk_size) {
+  const char* data = input.c_str();
+  size_t size = strlen(data);
+  vector<size_t> offsets(1, 0);
+  size_t pos = chunk_size;
+  while (pos < size) {
+    const char* newline =
+        static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+    if (!newline)
+      break;
+    pos = newline + 1 - data;
+    if (pos >= size)
+      break;
+    char c = data[pos];
+    if (!(isalnum(static_cast<unsigned char>(c)) || c == '_'))
+      continue;
+    size_t dollars = 0;
+    while (dollars < pos - 1 && data[pos - 2 - dollars] == '$')
+      ++dollars;
+    if (dollars % 2 != 0)
+      continue;
+    offsets.push_back(pos);
+    pos += chunk_size;
+  }
+  offsets.push_back(size);
+  return offsets;
+}
+
+struct ChunkTask : public ParallelTask {
+  ChunkTask(const string& filename, const string& input,
+            ManifestParser::Chunk* chunks)
+      : filename_(filename), input_(input), chunks_(chunks) {}
+
+  virtual void Run(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      ManifestParser::ReadChunk(filename_, input_, &chunks_[i]);
+  }
+
+  const string& filename_;
+  const string& input_;
+  ManifestParser::Chunk* chunks_;
+};
+
+/// Reads \a count chunks on up to \a threads threads, either in the
+/// background or on the calling thread.
+struct ChunkReader : public Thread {
+  ChunkReader(const string& filename, const string& input,
+              ManifestParser::Chunk* chunks, size_t count, int threads)
+      : task_(filename, input, chunks), count_(count), threads_(threads) {}
+
+  void Read() { RunInParallel(&task_, count_, threads_); }
+
+ protected:
+  virtual void Run() { Read(); }
+
+ private:
+  ChunkTask task_;
+  size_t count_;
+  int threads_;
+};
+
+}  // namespace
+
 ManifestParser::ManifestParser(State* state, FileReader* file_reader)
-  : state_(state), file_reader_(file_reader) {
+  : state_(state), file_reader_(file_reader), parallelism_(1),
+    chunk_size_(1 << 20), deferred_(NULL), file_(-1) {
   env_ = &state->bindings_;
 }
 bool ManifestParser::Load(const string& filename, string* err) {
@@ -35,286 +258,918 @@ bool ManifestParser::Load(const string& filename, string* err) {
     *err = "loading '" + filename + "': " + read_err;
     return false;
   }
+  ManifestFile file;
+  file.path = filename;
+  file.hash = HashManifest(contents);
+  file.scope = env_;
+  file_ = state_->manifest_files_.size();
+  state_->manifest_files_.push_back(file);
   contents.resize(contents.size() + 10);
-  return Parse(filename, contents, err);
+  return ParseTopLevel(filename, contents, err);
 }
 
-bool ManifestParser::Parse(const string& filename, const string& input,
-                           string* err) {
-  METRIC_RECORD(".ninja parse");
-  lexer_.Start(filename, input);
+bool ManifestParser::ParseTopLevel(const string& filename,
+                                   const string& input, string* err) {
+  if (parallelism_ <= 1)
+    return Parse(filename, input, err);
 
-  for (;;) {
-    Lexer::Token token = lexer_.ReadToken();
-    switch (token) {
-    case Lexer::BUILD:
-      if (!ParseEdge(err))
-        return false;
-      break;
-    case Lexer::RULE:
-      if (!ParseRule(err))
+  Defined defined;
+  for (map<string, const Rule*>::iterator i = state_->rules_.begin();
+       i != state_->rules_.end(); ++i) {
+    defined.rules.insert(i->first);
+  }
+  for (map<string, Pool*>::iterator i = state_->pools_.begin();
+       i != state_->pools_.end(); ++i) {
+    defined.pools.insert(i->first);
+  }
+
+  vector<Fragment*> fragments;
+  Deferred deferred;
+  deferred.fragments = &fragments;
+  deferred_ = &deferred;
+  bool ok = Parse(filename, input, err);
+  deferred_ = NULL;
+  if (ok)
+    ok = FinishParallelParse(&deferred, &defined, err);
+
+  for (vector<Fragment*>::iterator i = fragments.begin();
+       i != fragments.end(); ++i) {
+    delete *i;
+  }
+  return ok;
+}
+
+// static
+void ManifestParser::ParseFragment(Fragment* fragment,
+                                   FileReader* file_reader) {
+  ManifestParser parser(&fragment->state, file_reader);
+  parser.env_ = fragment->env;
+  parser.deferred_ = &fragment->deferred;
+  if (fragment->file >= 0) {
+    ManifestFile file;
+    file.scope = fragment->env;
+    parser.file_ = 0;
+    fragment->state.manifest_files_.push_back(file);
+  }
+  fragment->ok = parser.Parse(fragment->path, fragment->contents,
+                              &fragment->err);
+  string().swap(fragment->contents);
+}
+
+bool ManifestParser::FinishParallelParse(Deferred* deferred,
+                                         Defined* defined, string* err) {
+  FragmentTask task(deferred->fragments, file_reader_);
+  RunInParallel(&task, deferred->fragments->size(), parallelism_);
+  return Replay(deferred, state_, 0, defined, err);
+}
+
+bool ManifestParser::Replay(Deferred* deferred, State* from,
+                            size_t edge_base, Defined* defined,
+                            string* err) {
+  for (vector<Deferred::Item>::iterator i = deferred->items.begin();
+       i != deferred->items.end(); ++i) {
+    switch (i->type) {
+    case Deferred::Item::RULE:
+      // Rules of fragments are now checked against everything before
+      // them, and rules after them against the fragments' rules.
+      if (!defined->rules.insert(i->name).second ||
+          (from != state_ && state_->LookupRule(i->name))) {
+        *err = "duplicate rule '" + i->name + "'";
         return false;
+      }
+      if (from != state_)
+        state_->AddRule(from->LookupRule(i->name));
       break;
-    case Lexer::DEFAULT:
-      if (!ParseDefault(err))
+    case Deferred::Item::POOL:
+      // Likewise for pools, whose errors say where they were defined.  A
+      // top-level pool of the same name further down reports itself as
+      // the duplicate once we get to it.
+      if (!defined->pools.insert(i->name).second) {
+        *err = i->error;
         return false;
+      }
+      if (from != state_ && !state_->LookupPool(i->name))
+        state_->AddPool(from->LookupPool(i->name));
       break;
-    case Lexer::IDENT: {
-      lexer_.UnreadToken();
-      string name;
-      EvalString value;
-      if (!ParseLet(&name, &value, err))
+    case Deferred::Item::EDGE: {
+      if (defined->rules.find(i->name) == defined->rules.end()) {
+        *err = i->error;
         return false;
-      env_->AddBinding(name, value.Evaluate(env_));
+      }
+      Edge* edge = state_->edges_[edge_base + i->index];
+      edge->rule_ = state_->LookupRule(i->name);
+      // Now that we know the rule, its pool applies too, unless the
+      // build statement named one of its own.
+      if (!edge->rule_->pool().empty() && !i->own_pool) {
+        string pool_name = edge->rule_->pool().Evaluate(edge->env_);
+        if (!pool_name.empty()) {
+          if (defined->pools.find(pool_name) == defined->pools.end()) {
+            *err = "unknown pool name '" + pool_name + "'";
+            return false;
+          }
+          edge->pool_ = state_->LookupPool(pool_name);
+        }
+      }
       break;
     }
-    case Lexer::INCLUDE:
-      if (!ParseFileInclude(false, err))
+    case Deferred::Item::EDGE_POOL:
+      if (defined->pools.find(i->name) == defined->pools.end()) {
+        *err = i->error;
         return false;
+      }
+      state_->edges_[edge_base + i->index]->pool_ =
+          state_->LookupPool(i->name);
       break;
-    case Lexer::SUBNINJA:
-      if (!ParseFileInclude(true, err))
+    case Deferred::Item::DEFAULT: {
+      Node* node = state_->LookupNode(i->name);
+      if (!node) {
+        *err = i->error;
         return false;
+      }
+      state_->defaults_.push_back(node);
       break;
-    case Lexer::ERROR:
-      return lexer_.Error("lexing error", err);
-    case Lexer::TEOF:
-      return true;
-    case Lexer::NEWLINE:
+    }
+    case Deferred::Item::SUBNINJA: {
+      Fragment* fragment = (*deferred->fragments)[i->index];
+      if (!fragment->ok) {
+        *err = fragment->err;
+        return false;
+      }
+      size_t fragment_edge_base = state_->edges_.size();
+      MergeFragment(fragment);
+      if (!Replay(&fragment->deferred, &fragment->state, fragment_edge_base,
+                  defined, err)) {
+        return false;
+      }
       break;
-    default:
-      return lexer_.Error(string("unexpected ") + Lexer::TokenName(token),
-                          err);
     }
+    }
+  }
+  return true;
+}
+
+void ManifestParser::MergeFragment(Fragment* fragment) {
+  State* from = &fragment->state;
+
+  // Map the fragment's nodes, numbered through their ids, to ours.
+  vector<Node*> nodes;
+  nodes.reserve(from->paths_.size());
+  for (State::Paths::iterator i = from->paths_.begin();
+       i != from->paths_.end(); ++i) {
+    i->second->set_id(nodes.size());
+    nodes.push_back(state_->GetNode(i->first));
+  }
+  // Outputs the fragment generates more than once were already warned
+  // about while parsing it.
+  vector<bool> merged_output(nodes.size());
+
+  for (vector<Edge*>::iterator e = from->edges_.begin();
+       e != from->edges_.end(); ++e) {
+    Edge* edge = state_->AddEdge((*e)->rule_);
+    // Copy everything but the edge's place in our GraphState; its
+    // per-build state is still the initial one on both sides.
+    int index = edge->index_;
+    *edge = **e;
+    edge->graph_state_ = &state_->graph_state_;
+    edge->index_ = index;
+    for (vector<Node*>::iterator n = edge->inputs_.begin();
+         n != edge->inputs_.end(); ++n) {
+      *n = nodes[(*n)->id()];
+      (*n)->AddOutEdge(edge);
+    }
+    for (vector<Node*>::iterator n = edge->outputs_.begin();
+         n != edge->outputs_.end(); ++n) {
+      int id = (*n)->id();
+      *n = nodes[id];
+      if ((*n)->in_edge() && !merged_output[id]) {
+        Warning("multiple rules generate %s. "
+                "build will not be correct; continuing anyway",
+                (*n)->path().c_str());
+      }
+      merged_output[id] = true;
+      (*n)->set_in_edge(edge);
+    }
+  }
+
+  for (vector<Node*>::iterator n = from->defaults_.begin();
+       n != from->defaults_.end(); ++n) {
+    state_->defaults_.push_back(nodes[(*n)->id()]);
+  }
+
+  // The fragment recorded its own file first, then those it included,
+  // whose parent_bindings now belong to us.
+  vector<ManifestFile>& files = from->manifest_files_;
+  if (fragment->file >= 0 && !files.empty()) {
+    if (files[0].defines_globals)
+      state_->manifest_files_[fragment->file].defines_globals = true;
+    state_->manifest_files_.insert(state_->manifest_files_.end(),
+                                   files.begin() + 1, files.end());
+    files.clear();
+  }
+
+  fragment->env->set_parent(fragment->parent);
+  delete fragment->frozen_parent;
+  fragment->frozen_parent = NULL;
+}
+
+bool ManifestParser::Parse(const string& filename, const string& input,
+                           string* err) {
+  METRIC_RECORD(".ninja parse");
+  lexer_.Start(filename, input);
+  if (parallelism_ > 1 && input.size() > 2 * chunk_size_)
+    return ParseChunks(filename, input, err);
+
+  for (;;) {
+    Lexer::Token token = lexer_.ReadToken();
+    if (token == Lexer::TEOF)
+      return true;
+    if (token == Lexer::NEWLINE)
+      continue;
+    Statement statement;
+    if (!ReadStatement(&lexer_, token, &statement, err))
+      return false;
+    if (!ApplyStatement(statement, err))
+      return false;
   }
   return false;  // not reached
 }
 
-bool ManifestParser::ParseRule(string* err) {
-  string name;
-  if (!lexer_.ReadIdent(&name))
-    return lexer_.Error("expected rule name", err);
+bool ManifestParser::ParseChunks(const string& filename, const string& input,
+                                 string* err) {
+  vector<size_t> offsets = SplitChunks(input, chunk_size_);
+  vector<Chunk> chunks(offsets.size() - 1);
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    chunks[i].begin = offsets[i];
+    chunks[i].end = offsets[i + 1];
+  }
 
-  if (!ExpectToken(Lexer::NEWLINE, err))
-    return false;
+  // Read a batch of chunks ahead of the one being applied, which keeps
+  // the memory held by statements bounded.
+  const size_t batch = parallelism_ * 2;
+  ChunkReader(filename, input, &chunks[0], min(batch, chunks.size()),
+              parallelism_).Read();
+  for (size_t begin = 0; begin < chunks.size(); begin += batch) {
+    size_t end = min(begin + batch, chunks.size());
+    size_t next_end = min(end + batch, chunks.size());
+    ChunkReader reader(filename, input, &chunks[0] + end, next_end - end,
+                       max(parallelism_ - 1, 1));
+    bool background = end < next_end && reader.Start();
 
-  if (state_->LookupRule(name) != NULL) {
-    *err = "duplicate rule '" + name + "'";
-    return false;
+    bool ok = true;
+    for (size_t i = begin; ok && i < end; ++i)
+      ok = ApplyChunk(&chunks[i], err);
+
+    if (background)
+      reader.Join();
+    else if (ok)
+      reader.Read();
+    if (!ok)
+      return false;
   }
+  return true;
+}
 
-  Rule* rule = new Rule(name);  // XXX scoped_ptr
+// static
+void ManifestParser::ReadChunk(const string& filename, const string& input,
+                               Chunk* chunk) {
+  Lexer lexer;
+  lexer.Start(filename, input, chunk->begin);
+  const char* end = input.data() + chunk->end;
+  for (;;) {
+    Lexer::Token token = lexer.ReadToken();
+    if (token == Lexer::TEOF || lexer.last_token() >= end)
+      break;
+    if (token == Lexer::NEWLINE)
+      continue;
+    chunk->statements.push_back(Statement());
+    if (!ReadStatement(&lexer, token, &chunk->statements.back(),
+                       &chunk->err)) {
+      chunk->statements.pop_back();
+      return;
+    }
+  }
+  chunk->ok = true;
+}
 
-  while (lexer_.PeekToken(Lexer::INDENT)) {
-    string key;
-    EvalString value;
-    if (!ParseLet(&key, &value, err))
+bool ManifestParser::ApplyChunk(Chunk* chunk, string* err) {
+  for (deque<Statement>::iterator i = chunk->statements.begin();
+       i != chunk->statements.end(); ++i) {
+    if (!ApplyStatement(*i, err))
       return false;
+  }
+  if (!chunk->ok) {
+    *err = chunk->err;
+    return false;
+  }
+  deque<Statement>().swap(chunk->statements);
+  return true;
+}
 
-    if (key == "command") {
-      rule->command_ = value;
-    } else if (key == "depfile") {
-      rule->depfile_ = value;
-    } else if (key == "description") {
-      rule->description_ = value;
-    } else if (key == "generator") {
-      rule->generator_ = true;
-    } else if (key == "restat") {
-      rule->restat_ = true;
-    } else {
+// static
+bool ManifestParser::ReadStatement(Lexer* lexer, Lexer::Token token,
+                                   Statement* statement, string* err) {
+  statement->type = token;
+  switch (token) {
+  case Lexer::BUILD:
+    return ReadEdge(lexer, statement, err);
+  case Lexer::POOL:
+  case Lexer::RULE:
+    return ReadDefinition(lexer, statement, err);
+  case Lexer::DEFAULT:
+    return ReadDefault(lexer, statement, err);
+  case Lexer::IDENT:
+    lexer->UnreadToken();
+    return ReadLet(lexer, &statement->name, &statement->value, err);
+  case Lexer::INCLUDE:
+  case Lexer::SUBNINJA:
+    return ReadFileInclude(lexer, statement, err);
+  case Lexer::ERROR:
+    return lexer->Error("lexing error", err);
+  default:
+    return lexer->Error(string("unexpected ") + Lexer::TokenName(token),
+                        err);
+  }
+}
+
+// static
+bool ManifestParser::ReadDefinition(Lexer* lexer, Statement* statement,
+                                    string* err) {
+  bool pool = statement->type == Lexer::POOL;
+  if (!lexer->ReadIdent(&statement->name))
+    return lexer->Error(pool ? "expected pool name" : "expected rule name",
+                        err);
+
+  if (!ExpectToken(lexer, Lexer::NEWLINE, err))
+    return false;
+  statement->pos = lexer->last_token();
+
+  if (!ReadBindings(lexer, statement, err))
+    return false;
+  for (size_t i = 0; i < statement->bindings.size(); ++i) {
+    const string& key = statement->bindings[i].first;
+    if (pool ? key != "depth" : !IsRuleVariable(key)) {
       // Die on other keyvals for now; revisit if we want to add a
       // scope here.
-      return lexer_.Error("unexpected variable '" + key + "'", err);
+      return lexer->ErrorAt(statement->binding_pos[i],
+                            "unexpected variable '" + key + "'", err);
     }
   }
-
-  if (rule->command_.empty())
-    return lexer_.Error("expected 'command =' line", err);
-
-  state_->AddRule(rule);
   return true;
 }
 
-bool ManifestParser::ParseLet(string* key, EvalString* value, string* err) {
-  if (!lexer_.ReadIdent(key))
+// static
+bool ManifestParser::ReadLet(Lexer* lexer, string* key, EvalString* value,
+                             string* err) {
+  if (!lexer->ReadIdent(key))
     return false;
-  if (!ExpectToken(Lexer::EQUALS, err))
+  if (!ExpectToken(lexer, Lexer::EQUALS, err))
     return false;
-  if (!lexer_.ReadVarValue(value, err))
+  if (!lexer->ReadVarValue(value, err))
     return false;
   return true;
 }
 
-bool ManifestParser::ParseDefault(string* err) {
-  EvalString eval;
-  if (!lexer_.ReadPath(&eval, err))
+// static
+bool ManifestParser::ReadPaths(Lexer* lexer, Statement* statement,
+                               int* count, string* err) {
+  for (;;) {
+    statement->paths.push_back(EvalString());
+    if (!lexer->ReadPath(&statement->paths.back(), err))
+      return false;
+    if (statement->paths.back().empty()) {
+      statement->paths.pop_back();
+      return true;
+    }
+    statement->path_pos.push_back(lexer->last_token());
+    ++*count;
+  }
+}
+
+// static
+bool ManifestParser::ReadBindings(Lexer* lexer, Statement* statement,
+                                  string* err) {
+  while (lexer->PeekToken(Lexer::INDENT)) {
+    statement->bindings.push_back(make_pair(string(), EvalString()));
+    if (!ReadLet(lexer, &statement->bindings.back().first,
+                 &statement->bindings.back().second, err))
+      return false;
+    statement->binding_pos.push_back(lexer->last_token());
+  }
+  statement->end = lexer->last_token();
+  return true;
+}
+
+// static
+bool ManifestParser::ReadDefault(Lexer* lexer, Statement* statement,
+                                 string* err) {
+  int count = 0;
+  if (!ReadPaths(lexer, statement, &count, err))
     return false;
-  if (eval.empty())
-    return lexer_.Error("expected target name", err);
+  if (count == 0)
+    return lexer->Error("expected target name", err);
+  return ExpectToken(lexer, Lexer::NEWLINE, err);
+}
 
-  do {
-    string path = eval.Evaluate(env_);
-    string path_err;
-    if (!CanonicalizePath(&path, &path_err))
-      return lexer_.Error(path_err, err);
-    if (!state_->AddDefault(path, &path_err))
-      return lexer_.Error(path_err, err);
+// static
+bool ManifestParser::ReadEdge(Lexer* lexer, Statement* statement,
+                              string* err) {
+  if (!ReadPaths(lexer, statement, &statement->outs, err))
+    return false;
+  if (statement->outs == 0)
+    return lexer->Error("expected path", err);
 
-    eval.Clear();
-    if (!lexer_.ReadPath(&eval, err))
-      return false;
-  } while (!eval.empty());
+  if (!ExpectToken(lexer, Lexer::COLON, err))
+    return false;
+
+  if (!lexer->ReadIdent(&statement->name))
+    return lexer->Error("expected build command name", err);
+  statement->pos = lexer->last_token();
 
-  if (!ExpectToken(Lexer::NEWLINE, err))
+  // XXX should we require one path here?
+  int explicit_ins = 0;
+  if (!ReadPaths(lexer, statement, &explicit_ins, err))
     return false;
 
+  // Add all implicit and order-only deps, counting how many as we go.
+  if (lexer->PeekToken(Lexer::PIPE) &&
+      !ReadPaths(lexer, statement, &statement->implicit, err))
+    return false;
+  if (lexer->PeekToken(Lexer::PIPE2) &&
+      !ReadPaths(lexer, statement, &statement->order_only, err))
+    return false;
+
+  if (!ExpectToken(lexer, Lexer::NEWLINE, err))
+    return false;
+
+  return ReadBindings(lexer, statement, err);
+}
+
+// static
+bool ManifestParser::ReadFileInclude(Lexer* lexer, Statement* statement,
+                                     string* err) {
+  // XXX this should use ReadPath!
+  statement->paths.resize(1);
+  if (!lexer->ReadPath(&statement->paths[0], err))
+    return false;
+  statement->pos = lexer->last_token();
+  return ExpectToken(lexer, Lexer::NEWLINE, err);
+}
+
+// static
+bool ManifestParser::ExpectToken(Lexer* lexer, Lexer::Token expected,
+                                 string* err) {
+  Lexer::Token token = lexer->ReadToken();
+  if (token != expected) {
+    string message = string("expected ") + Lexer::TokenName(expected);
+    message += string(", got ") + Lexer::TokenName(token);
+    message += Lexer::TokenErrorHint(expected);
+    return lexer->Error(message, err);
+  }
   return true;
 }
 
-bool ManifestParser::ParseEdge(string* err) {
-  vector<EvalString> ins, outs;
+bool ManifestParser::ApplyStatement(const Statement& statement,
+                                    string* err) {
+  switch (statement.type) {
+  case Lexer::BUILD:
+    return ApplyEdge(statement, err);
+  case Lexer::POOL:
+    return ApplyPool(statement, err);
+  case Lexer::RULE:
+    return ApplyRule(statement, err);
+  case Lexer::DEFAULT:
+    return ApplyDefault(statement, err);
+  case Lexer::IDENT:
+    env_->AddBinding(statement.name, statement.value.Evaluate(env_));
+    return true;
+  case Lexer::INCLUDE:
+    return ApplyFileInclude(statement, false, err);
+  case Lexer::SUBNINJA:
+    return ApplyFileInclude(statement, true, err);
+  default:
+    assert(false);  // ReadStatement() fails on anything else.
+    return false;
+  }
+}
 
-  {
-    EvalString out;
-    if (!lexer_.ReadPath(&out, err))
-      return false;
-    if (out.empty())
-      return lexer_.Error("expected path", err);
+bool ManifestParser::ApplyPool(const Statement& statement, string* err) {
+  const string& name = statement.name;
+  string duplicate_error;
+  lexer_.ErrorAt(statement.pos, "duplicate pool '" + name + "'",
+                 &duplicate_error);
+  if (state_->LookupPool(name) != NULL) {
+    *err = duplicate_error;
+    return false;
+  }
 
-    do {
-      outs.push_back(out);
+  // ReadDefinition() only lets 'depth' through.
+  int depth = -1;
+  for (size_t i = 0; i < statement.bindings.size(); ++i) {
+    string depth_string = statement.bindings[i].second.Evaluate(env_);
+    char* end;
+    depth = strtol(depth_string.c_str(), &end, 10);
+    if (depth_string.empty() || *end != 0 || depth < 0)
+      return lexer_.ErrorAt(statement.binding_pos[i], "invalid pool depth",
+                            err);
+  }
 
-      out.Clear();
-      if (!lexer_.ReadPath(&out, err))
-        return false;
-    } while (!out.empty());
+  if (depth < 0)
+    return lexer_.ErrorAt(statement.end, "expected 'depth =' line", err);
+
+  state_->AddPool(new Pool(name, depth));
+  DefinesGlobals();
+  if (deferred_) {
+    Deferred::Item item;
+    item.type = Deferred::Item::POOL;
+    item.name = name;
+    item.error = duplicate_error;
+    deferred_->items.push_back(item);
   }
+  return true;
+}
 
-  if (!ExpectToken(Lexer::COLON, err))
+bool ManifestParser::ApplyRule(const Statement& statement, string* err) {
+  const string& name = statement.name;
+  if (state_->LookupRule(name) != NULL) {
+    *err = "duplicate rule '" + name + "'";
     return false;
+  }
 
-  string rule_name;
-  if (!lexer_.ReadIdent(&rule_name))
-    return lexer_.Error("expected build command name", err);
-
-  const Rule* rule = state_->LookupRule(rule_name);
-  if (!rule)
-    return lexer_.Error("unknown build rule '" + rule_name + "'", err);
+  Rule* rule = new Rule(name);  // XXX scoped_ptr
 
-  for (;;) {
-    // XXX should we require one path here?
-    EvalString in;
-    if (!lexer_.ReadPath(&in, err))
-      return false;
-    if (in.empty())
-      break;
-    ins.push_back(in);
-  }
-
-  // Add all order-only deps, counting how many as we go.
-  int implicit = 0;
-  if (lexer_.PeekToken(Lexer::PIPE)) {
-    for (;;) {
-      EvalString in;
-      if (!lexer_.ReadPath(&in, err))
-        return err;
-      if (in.empty())
-        break;
-      ins.push_back(in);
-      ++implicit;
+  // ReadDefinition() only lets rule variables through.
+  for (size_t i = 0; i < statement.bindings.size(); ++i) {
+    const string& key = statement.bindings[i].first;
+    const EvalString& value = statement.bindings[i].second;
+    if (key == "command") {
+      rule->command_ = value;
+    } else if (key == "depfile") {
+      rule->depfile_ = value;
+    } else if (key == "deps") {
+      rule->deps_ = value.Evaluate(env_);
+      if (rule->deps_ != "gcc")
+        return lexer_.ErrorAt(statement.binding_pos[i],
+                              "unknown deps type '" + rule->deps_ + "'", err);
+    } else if (key == "description") {
+      rule->description_ = value;
+    } else if (key == "generator") {
+      rule->generator_ = true;
+    } else if (key == "restat") {
+      rule->restat_ = true;
+      rule->hash_restat_ = value.Evaluate(env_) == "hash";
+    } else if (key == "local") {
+      rule->local_ = true;
+    } else if (key == "pool") {
+      rule->pool_ = value;
+    } else if (key == "worker") {
+      rule->worker_ = value;
     }
   }
 
-  // Add all order-only deps, counting how many as we go.
-  int order_only = 0;
-  if (lexer_.PeekToken(Lexer::PIPE2)) {
-    for (;;) {
-      EvalString in;
-      if (!lexer_.ReadPath(&in, err))
-        return false;
-      if (in.empty())
-        break;
-      ins.push_back(in);
-      ++order_only;
+  if (rule->command_.empty())
+    return lexer_.ErrorAt(statement.end, "expected 'command =' line", err);
+
+  if (!rule->deps_.empty() && rule->depfile_.empty())
+    return lexer_.ErrorAt(statement.end,
+                          "'deps =' requires a 'depfile =' line", err);
+
+  state_->AddRule(rule);
+  DefinesGlobals();
+  if (deferred_) {
+    Deferred::Item item;
+    item.type = Deferred::Item::RULE;
+    item.name = name;
+    deferred_->items.push_back(item);
+  }
+  return true;
+}
+
+bool ManifestParser::ApplyDefault(const Statement& statement, string* err) {
+  DefinesGlobals();
+
+  for (size_t i = 0; i < statement.paths.size(); ++i) {
+    string path = statement.paths[i].Evaluate(env_);
+    string path_err;
+    if (!CanonicalizePath(&path, &path_err))
+      return lexer_.ErrorAt(statement.path_pos[i], path_err, err);
+    if (!state_->AddDefault(path, &path_err)) {
+      if (!deferred_)
+        return lexer_.ErrorAt(statement.path_pos[i], path_err, err);
+      // It may be built by a subninja file parsed in parallel.
+      Deferred::Item item;
+      item.type = Deferred::Item::DEFAULT;
+      item.name = path;
+      lexer_.ErrorAt(statement.path_pos[i], path_err, &item.error);
+      deferred_->items.push_back(item);
     }
   }
+  return true;
+}
 
-  if (!ExpectToken(Lexer::NEWLINE, err))
-    return false;
+bool ManifestParser::ApplyEdge(const Statement& statement, string* err) {
+  const string& rule_name = statement.name;
+  const Rule* rule = state_->LookupRule(rule_name);
+  string unknown_rule_error;
+  if (!rule) {
+    lexer_.ErrorAt(statement.pos, "unknown build rule '" + rule_name + "'",
+                   &unknown_rule_error);
+    if (!deferred_) {
+      *err = unknown_rule_error;
+      return false;
+    }
+    // It may be defined by a subninja file parsed in parallel; stand in
+    // with phony until the merge.
+    rule = &State::kPhonyRule;
+  }
 
   // Default to using outer env.
   BindingEnv* env = env_;
 
   // But create and fill a nested env if there are variables in scope.
-  if (lexer_.PeekToken(Lexer::INDENT)) {
+  // A pool named by the build statement takes precedence over the rule's;
+  // a "pool" variable of an enclosing scope is just a variable.
+  bool own_pool = false;
+  string pool_name;
+  if (!statement.bindings.empty()) {
     // XXX scoped_ptr to handle error case.
     env = new BindingEnv(env_);
-    do {
-      string key;
-      EvalString val;
-      if (!ParseLet(&key, &val, err))
+    for (vector<pair<string, EvalString> >::const_iterator i =
+             statement.bindings.begin();
+         i != statement.bindings.end(); ++i) {
+      string value = i->second.Evaluate(env_);
+      if (i->first == "pool") {
+        own_pool = true;
+        pool_name = value;
+      }
+      env->AddBinding(i->first, value);
+    }
+  }
+  if (!own_pool)
+    pool_name = rule->pool().Evaluate(env);
+  Pool* pool = &State::kDefaultPool;
+  string unknown_pool_error;
+  if (!pool_name.empty()) {
+    pool = state_->LookupPool(pool_name);
+    if (!pool) {
+      lexer_.ErrorAt(statement.end, "unknown pool name '" + pool_name + "'",
+                     &unknown_pool_error);
+      if (!deferred_) {
+        *err = unknown_pool_error;
         return false;
-      env->AddBinding(key, val.Evaluate(env_));
-    } while (lexer_.PeekToken(Lexer::INDENT));
+      }
+      // It may be defined by a subninja file parsed in parallel.
+      pool = &State::kDefaultPool;
+    }
   }
 
   Edge* edge = state_->AddEdge(rule);
   edge->env_ = env;
-  for (vector<EvalString>::iterator i = ins.begin(); i != ins.end(); ++i) {
-    string path = i->Evaluate(env);
+  edge->pool_ = pool;
+  if (!unknown_rule_error.empty()) {
+    Deferred::Item item;
+    item.type = Deferred::Item::EDGE;
+    item.name = rule_name;
+    item.index = state_->edges_.size() - 1;
+    item.error = unknown_rule_error;
+    item.own_pool = own_pool;
+    deferred_->items.push_back(item);
+  }
+  if (!unknown_pool_error.empty()) {
+    Deferred::Item item;
+    item.type = Deferred::Item::EDGE_POOL;
+    item.name = pool_name;
+    item.index = state_->edges_.size() - 1;
+    item.error = unknown_pool_error;
+    deferred_->items.push_back(item);
+  }
+  // The inputs come after the outputs, but are added first.
+  const vector<EvalString>& paths = statement.paths;
+  for (size_t i = statement.outs; i < paths.size(); ++i) {
+    string path = paths[i].Evaluate(env);
     string path_err;
     if (!CanonicalizePath(&path, &path_err))
-      return lexer_.Error(path_err, err);
+      return lexer_.ErrorAt(statement.end, path_err, err);
     state_->AddIn(edge, path);
   }
-  for (vector<EvalString>::iterator i = outs.begin(); i != outs.end(); ++i) {
-    string path = i->Evaluate(env);
+  for (int i = 0; i < statement.outs; ++i) {
+    string path = paths[i].Evaluate(env);
     string path_err;
     if (!CanonicalizePath(&path, &path_err))
-      return lexer_.Error(path_err, err);
+      return lexer_.ErrorAt(statement.end, path_err, err);
     state_->AddOut(edge, path);
   }
-  edge->implicit_deps_ = implicit;
-  edge->order_only_deps_ = order_only;
+  edge->implicit_deps_ = statement.implicit;
+  edge->order_only_deps_ = statement.order_only;
 
   return true;
 }
 
-bool ManifestParser::ParseFileInclude(bool new_scope, string* err) {
-  // XXX this should use ReadPath!
-  EvalString eval;
-  if (!lexer_.ReadPath(&eval, err))
-    return false;
-  string path = eval.Evaluate(env_);
+bool ManifestParser::ApplyFileInclude(const Statement& statement,
+                                      bool new_scope, string* err) {
+  string path = statement.paths[0].Evaluate(env_);
 
   string contents;
   string read_err;
   if (!file_reader_->ReadFile(path, &contents, &read_err))
-    return lexer_.Error("loading '" + path + "': " + read_err, err);
+    return lexer_.ErrorAt(statement.pos,
+                          "loading '" + path + "': " + read_err, err);
+
+  ManifestFile file;
+  file.path = path;
+  file.hash = HashManifest(contents);
+  file.subninja = new_scope;
+  if (new_scope) {
+    file.parent_bindings = env_->Flatten();
+    file.globals_seen = state_->rules_.size() + state_->pools_.size();
+  }
+
+  if (new_scope && deferred_ && deferred_->fragments) {
+    // Parse it later, with the other subninja files.
+    Fragment* fragment = NewFragment(path, &contents, env_, env_->Flatten());
+    if (file_ >= 0) {
+      file.scope = fragment->env;
+      fragment->file = state_->manifest_files_.size();
+      state_->manifest_files_.push_back(file);
+    } else {
+      delete file.parent_bindings;
+    }
+
+    Deferred::Item item;
+    item.type = Deferred::Item::SUBNINJA;
+    item.index = deferred_->fragments->size();
+    deferred_->items.push_back(item);
+    deferred_->fragments->push_back(fragment);
+    return true;
+  }
 
   ManifestParser subparser(state_, file_reader_);
+  subparser.deferred_ = deferred_;
   if (new_scope) {
     subparser.env_ = new BindingEnv(env_);
   } else {
     subparser.env_ = env_;
   }
+  if (file_ >= 0) {
+    file.scope = subparser.env_;
+    subparser.file_ = state_->manifest_files_.size();
+    state_->manifest_files_.push_back(file);
+  } else {
+    delete file.parent_bindings;
+  }
+
+  return subparser.Parse(path, contents, err);
+}
+
+ManifestParser::Fragment* ManifestParser::NewFragment(
+    const string& path, string* contents, BindingEnv* parent,
+    BindingEnv* frozen_parent) {
+  Fragment* fragment = new Fragment;
+  fragment->path = path;
+  fragment->contents.swap(*contents);
+  fragment->parent = parent;
+  fragment->frozen_parent = frozen_parent;
+  fragment->env = new BindingEnv(fragment->frozen_parent);
+  // The rules and pools defined so far are visible to it.
+  for (map<string, const Rule*>::iterator i = state_->rules_.begin();
+       i != state_->rules_.end(); ++i) {
+    if (!fragment->state.LookupRule(i->first))
+      fragment->state.AddRule(i->second);
+  }
+  for (map<string, Pool*>::iterator i = state_->pools_.begin();
+       i != state_->pools_.end(); ++i) {
+    fragment->state.AddPool(i->second);
+  }
+  return fragment;
+}
+
+void ManifestParser::DefinesGlobals() {
+  if (file_ >= 0)
+    state_->manifest_files_[file_].defines_globals = true;
+}
 
-  if (!subparser.Parse(path, contents, err))
+bool ManifestParser::Reparse(size_t index, string* err) {
+  METRIC_RECORD("manifest reparse");
+  vector<ManifestFile>& files = state_->manifest_files_;
+  const ManifestFile file = files[index];
+  const string cant = "'" + file.path + "' can't be parsed on its own";
+  if (!file.subninja || !file.scope || !file.parent_bindings ||
+      file.globals_seen != state_->rules_.size() + state_->pools_.size()) {
+    *err = cant;
     return false;
+  }
 
-  if (!ExpectToken(Lexer::NEWLINE, err))
+  // The files parsed into its scope before, itself included.
+  vector<size_t> old_files;
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (!Within(files[i].scope, file.scope))
+      continue;
+    if (files[i].defines_globals) {
+      *err = cant;
+      return false;
+    }
+    old_files.push_back(i);
+  }
+
+  // Its edges, which have been kept next to each other.  Those of a file
+  // that had none go at the end.
+  vector<Edge*>& edges = state_->edges_;
+  size_t begin = edges.size(), end = edges.size(), count = 0;
+  for (size_t i = 0; i < edges.size(); ++i) {
+    if (!Within(edges[i]->env_, file.scope))
+      continue;
+    if (count++ == 0)
+      begin = i;
+    end = i + 1;
+  }
+  if (end - begin != count) {
+    *err = cant;
     return false;
+  }
 
-  return true;
-}
+  string contents;
+  string read_err;
+  if (!file_reader_->ReadFile(file.path, &contents, &read_err)) {
+    *err = "loading '" + file.path + "': " + read_err;
+    return false;
+  }
+  uint64_t hash = HashManifest(contents);
 
-bool ManifestParser::ExpectToken(Lexer::Token expected, string* err) {
-  Lexer::Token token = lexer_.ReadToken();
-  if (token != expected) {
-    string message = string("expected ") + Lexer::TokenName(expected);
-    message += string(", got ") + Lexer::TokenName(token);
-    message += Lexer::TokenErrorHint(expected);
-    return lexer_.Error(message, err);
+  // Parse it as a fragment, seeing the bindings of the subninja statement
+  // as they were back then.
+  Fragment* fragment =
+      NewFragment(file.path, &contents,
+                  static_cast<BindingEnv*>(file.scope->parent()),
+                  file.parent_bindings->Flatten());
+  fragment->file = index;
+  ParseFragment(fragment, file_reader_);
+  bool ok = fragment->ok;
+  if (!ok)
+    *err = fragment->err;
+  if (ok && !fragment->state.defaults_.empty()) {
+    *err = cant;
+    ok = false;
+  }
+  // Edges may use rules and pools defined elsewhere, but nothing may be
+  // defined here.
+  vector<Deferred::Item>& items = fragment->deferred.items;
+  for (vector<Deferred::Item>::iterator i = items.begin();
+       ok && i != items.end(); ++i) {
+    if (i->type == Deferred::Item::EDGE) {
+      ok = state_->LookupRule(i->name) != NULL;
+      *err = i->error;
+    } else if (i->type == Deferred::Item::EDGE_POOL) {
+      ok = state_->LookupPool(i->name) != NULL;
+      *err = i->error;
+    } else {
+      ok = false;
+      *err = cant;
+    }
+  }
+  vector<ManifestFile>& new_files = fragment->state.manifest_files_;
+  for (vector<ManifestFile>::iterator i = new_files.begin();
+       ok && i != new_files.end(); ++i) {
+    if (i->defines_globals) {
+      *err = cant;
+      ok = false;
+    }
+  }
+  if (!ok) {
+    delete fragment->frozen_parent;
+    delete fragment;
+    return false;
+  }
+  err->clear();
+
+  state_->RemoveEdges(begin, end);
+  size_t edge_base = edges.size();
+  MergeFragment(fragment);
+  Defined defined;
+  for (map<string, const Rule*>::iterator i = state_->rules_.begin();
+       i != state_->rules_.end(); ++i) {
+    defined.rules.insert(i->first);
+  }
+  for (map<string, Pool*>::iterator i = state_->pools_.begin();
+       i != state_->pools_.end(); ++i) {
+    defined.pools.insert(i->first);
+  }
+  // This can still fail on a pool that one of the rules it uses names.
+  if (!Replay(&fragment->deferred, &fragment->state, edge_base, &defined,
+              err)) {
+    delete fragment;
+    return false;
+  }
+  files[index].scope = fragment->env;
+  files[index].hash = hash;
+  delete fragment;
+  state_->MoveEdges(edge_base, begin);
+
+  // MergeFragment() appended the records of the files it includes now.
+  for (vector<size_t>::reverse_iterator i = old_files.rbegin();
+       i != old_files.rend(); ++i) {
+    if (*i == index)
+      continue;
+    delete files[*i].parent_bindings;
+    files.erase(files.begin() + *i);
   }
   return true;
 }
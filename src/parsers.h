@@ -15,6 +15,7 @@
 #ifndef NINJA_PARSERS_H_
 #define NINJA_PARSERS_H_
 
+#include <set>
 #include <string>
 #include <vector>
 #include <limits>
@@ -37,35 +38,143 @@ struct ManifestParser {
 
   ManifestParser(State* state, FileReader* file_reader);
 
+  /// Parse the files named by subninja statements on up to \a threads
+  /// threads.  Each is parsed into a separate fragment, and the fragments
+  /// are merged into the State in their original order once the top-level
+  /// file is done.  Rule and pool references that can't be resolved while
+  /// parsing are checked in that order during the merge, and report the
+  /// same errors as a serial parse; when several files contain errors, a
+  /// different one may come first.
+  ///
+  /// A top-level file larger than two chunks is also split into chunks
+  /// starting at statement boundaries, which are read on these threads
+  /// and then applied to the State in file order.
+  void set_parallelism(int threads) { parallelism_ = threads; }
+
+  /// Set the size, in bytes, of the chunks of a parallel parse.  Used by
+  /// tests.
+  void set_chunk_size(size_t bytes) { chunk_size_ = bytes; }
+
   /// Load and parse a file.
   bool Load(const string& filename, string* err);
 
   /// Parse a text string of input.  Used by tests.
   bool ParseTest(const string& input, string* err) {
-    return Parse("input", input, err);
+    return ParseTopLevel("input", input, err);
   }
 
+  /// Parse the subninja file State::manifest_files_[\a index] again,
+  /// replacing the edges and the records of files it produced before.
+  /// The file must be parseable on its own: neither it nor what it
+  /// includes may define rules, pools or defaults, now or before, and no
+  /// rules or pools may have been defined since its subninja statement.
+  /// Returns false otherwise, or if it fails to parse; the State must
+  /// then be loaded from scratch, which gives the definitive error.
+  bool Reparse(size_t index, string* err);
+
+  /// Run the parsers of subninja fragments; must be public for the
+  /// worker task in parsers.cc.
+  struct Fragment;
+  struct Deferred;
+  static void ParseFragment(Fragment* fragment, FileReader* file_reader);
+
+  /// Read the statements of a chunk of \a input; public for the same
+  /// reason.
+  struct Statement;
+  struct Chunk;
+  static void ReadChunk(const string& filename, const string& input,
+                        Chunk* chunk);
+
 private:
+  /// Parse a file and everything it includes, given its contents as a
+  /// string.
+  bool ParseTopLevel(const string& filename, const string& input,
+                     string* err);
+
   /// Parse a file, given its contents as a string.
   bool Parse(const string& filename, const string& input, string* err);
+  /// Parse a large file in chunks read in parallel.
+  bool ParseChunks(const string& filename, const string& input,
+                   string* err);
 
-  /// Parse various statement types.
-  bool ParseRule(string* err);
-  bool ParseLet(string* key, EvalString* val, string* err);
-  bool ParseEdge(string* err);
-  bool ParseDefault(string* err);
+  /// Read the statement that starts with \a token.  This only checks its
+  /// syntax, and depends on nothing but the input.
+  static bool ReadStatement(Lexer* lexer, Lexer::Token token,
+                            Statement* statement, string* err);
 
-  /// Parse either a 'subninja' or 'include' line.
-  bool ParseFileInclude(bool new_scope, string* err);
+  /// Read various statement types.
+  static bool ReadDefinition(Lexer* lexer, Statement* statement,
+                             string* err);
+  static bool ReadEdge(Lexer* lexer, Statement* statement, string* err);
+  static bool ReadDefault(Lexer* lexer, Statement* statement, string* err);
+  static bool ReadFileInclude(Lexer* lexer, Statement* statement,
+                              string* err);
+  static bool ReadLet(Lexer* lexer, string* key, EvalString* val,
+                      string* err);
+  /// Read paths up to the next delimiter, adding one to \a count for each.
+  static bool ReadPaths(Lexer* lexer, Statement* statement, int* count,
+                        string* err);
+  /// Read the indented variable bindings that follow a statement.
+  static bool ReadBindings(Lexer* lexer, Statement* statement, string* err);
 
   /// If the next token is not \a expected, produce an error string
   /// saying "expectd foo, got bar".
-  bool ExpectToken(Lexer::Token expected, string* err);
+  static bool ExpectToken(Lexer* lexer, Lexer::Token expected, string* err);
+
+  /// Evaluate a statement read by ReadStatement() in the current scope
+  /// and add what it defines to the State.
+  bool ApplyStatement(const Statement& statement, string* err);
+
+  /// Apply various statement types.
+  bool ApplyPool(const Statement& statement, string* err);
+  bool ApplyRule(const Statement& statement, string* err);
+  bool ApplyEdge(const Statement& statement, string* err);
+  bool ApplyDefault(const Statement& statement, string* err);
+
+  /// Apply either a 'subninja' or 'include' line.
+  bool ApplyFileInclude(const Statement& statement, bool new_scope,
+                        string* err);
+
+  /// Apply the statements of a chunk, then report the error that
+  /// stopped its reading, if any.
+  bool ApplyChunk(Chunk* chunk, string* err);
+
+  /// The names of the rules and pools defined so far during a merge.
+  struct Defined;
+
+  /// Parse the subninja fragments collected by a top-level parse and
+  /// merge them into the State.
+  bool FinishParallelParse(Deferred* deferred, Defined* defined,
+                           string* err);
+  /// Apply the statements of \a deferred, recorded while parsing into
+  /// \a from, in parse order.  Their edges start at \a edge_base in the
+  /// State's edges_.
+  bool Replay(Deferred* deferred, State* from, size_t edge_base,
+              Defined* defined, string* err);
+  /// Move the nodes and edges of \a fragment into the State.
+  void MergeFragment(Fragment* fragment);
+  /// Prepare a fragment for the subninja file \a path, whose scope is to
+  /// be nested in \a parent.  It's parsed seeing \a frozen_parent, the
+  /// bindings of \a parent as of the subninja statement, which it owns
+  /// until merged.
+  Fragment* NewFragment(const string& path, string* contents,
+                        BindingEnv* parent, BindingEnv* frozen_parent);
+
+  /// Note that the current file defines something global.
+  void DefinesGlobals();
 
   State* state_;
   BindingEnv* env_;
   FileReader* file_reader_;
   Lexer lexer_;
+  int parallelism_;
+  size_t chunk_size_;
+  /// While parsing in parallel, the statements that must be checked
+  /// during the merge.  Shared with the parsers of included files.
+  Deferred* deferred_;
+  /// The index of the file being parsed in the State's manifest_files_,
+  /// or -1 if it's not recorded.
+  int file_;
 };
 
 #endif  // NINJA_PARSERS_H_
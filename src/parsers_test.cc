@@ -424,6 +424,33 @@ TEST_F(ParserTest, Errors) {
               , err);
   }
 
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule cc\n"
+                                  "  command = foo\n"
+                                  "  depfile = $out.d\n"
+                                  "  deps = msvc\n",
+                                  &err));
+    EXPECT_EQ("input:4: unknown deps type 'msvc'\n"
+              "  deps = msvc\n"
+              "             ^ near here"
+              , err);
+  }
+
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule cc\n"
+                                  "  command = foo\n"
+                                  "  deps = gcc\n",
+                                  &err));
+    EXPECT_EQ("input:4: 'deps =' requires a 'depfile =' line\n"
+              , err);
+  }
+
   {
     State state;
     ManifestParser parser(&state, NULL);
@@ -578,6 +605,432 @@ TEST_F(ParserTest, MissingSubNinja) {
             , err);
 }
 
+/// Parse \a input serially and in parallel, expecting the same error.
+void ExpectParallelError(ParserTest* test, const char* input,
+                         const string& expected) {
+  State serial_state, parallel_state;
+  string serial_err, parallel_err;
+  ManifestParser serial(&serial_state, test);
+  EXPECT_FALSE(serial.ParseTest(input, &serial_err));
+  ManifestParser parallel(&parallel_state, test);
+  parallel.set_parallelism(4);
+  EXPECT_FALSE(parallel.ParseTest(input, &parallel_err));
+  EXPECT_EQ(expected, serial_err);
+  EXPECT_EQ(expected, parallel_err);
+}
+
+TEST_F(ParserTest, ParallelSubNinja) {
+  files_["a.ninja"] =
+    "var = inner\n"
+    "build $builddir/a: varref\n"
+    "subninja nested.ninja\n"
+    "include b.ninja\n";
+  files_["nested.ninja"] =
+    "build $builddir/nested: varref\n";
+  files_["b.ninja"] =
+    "build $builddir/b: varref\n";
+  ManifestParser parser(&state, this);
+  parser.set_parallelism(4);
+  string err;
+  ASSERT_TRUE(parser.ParseTest(
+"builddir = some_dir/\n"
+"rule varref\n"
+"  command = varref $var $late\n"
+"var = outer\n"
+"build $builddir/outer: varref\n"
+"subninja a.ninja\n"
+"builddir = other_dir/\n"
+"late = late\n"
+"build $builddir/outer2: varref\n", &err)) << err;
+  ASSERT_EQ(3u, files_read_.size());
+
+  // The subninja file saw builddir as it was at the subninja statement.
+  Node* node = state.LookupNode("some_dir/a");
+  ASSERT_TRUE(node);
+  EXPECT_TRUE(state.LookupNode("some_dir/nested"));
+  EXPECT_TRUE(state.LookupNode("some_dir/b"));
+  EXPECT_TRUE(state.LookupNode("other_dir/outer2"));
+
+  // Commands are evaluated in the final scopes.
+  ASSERT_EQ(5u, state.edges_.size());
+  EXPECT_EQ("varref outer late",
+            state.LookupNode("some_dir/outer")->in_edge()->EvaluateCommand());
+  EXPECT_EQ("varref inner late", node->in_edge()->EvaluateCommand());
+  EXPECT_EQ("varref inner late",
+            state.LookupNode("some_dir/b")->in_edge()->EvaluateCommand());
+}
+
+TEST_F(ParserTest, ParallelRules) {
+  // A rule defined in one subninja file is usable after it, anywhere.
+  files_["a.ninja"] = "rule r\n  command = r\n";
+  files_["b.ninja"] = "build b: r\n";
+  ManifestParser parser(&state, this);
+  parser.set_parallelism(4);
+  string err;
+  ASSERT_TRUE(parser.ParseTest(
+"subninja a.ninja\n"
+"subninja b.ninja\n"
+"build c: r\n", &err)) << err;
+  EXPECT_EQ("r", state.LookupNode("b")->in_edge()->rule_->name());
+  EXPECT_EQ("r", state.LookupNode("c")->in_edge()->rule_->name());
+
+  // But not before it.
+  ExpectParallelError(this,
+"build c: r\n"
+"subninja a.ninja\n",
+"input:1: unknown build rule 'r'\n"
+"build c: r\n"
+"       ^ near here");
+  ExpectParallelError(this,
+"subninja b.ninja\n"
+"subninja a.ninja\n",
+"b.ninja:1: unknown build rule 'r'\n"
+"build b: r\n"
+"       ^ near here");
+}
+
+TEST_F(ParserTest, ParallelDuplicateRule) {
+  files_["a.ninja"] = "rule r\n  command = r\n";
+  ExpectParallelError(this,
+"subninja a.ninja\n"
+"rule r\n"
+"  command = r\n",
+"duplicate rule 'r'");
+  ExpectParallelError(this,
+"subninja a.ninja\n"
+"subninja a.ninja\n",
+"duplicate rule 'r'");
+}
+
+TEST_F(ParserTest, ParallelErrorInSubNinja) {
+  files_["a.ninja"] = "build a: cat\nbuild\n";
+  ExpectParallelError(this,
+"rule cat\n"
+"  command = cat\n"
+"subninja a.ninja\n",
+"a.ninja:2: expected path\n"
+"build\n"
+"     ^ near here");
+}
+
+/// List the edges of \a state in order, with their commands.
+string DescribeEdges(State* state) {
+  string out;
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    for (vector<Node*>::iterator n = (*e)->outputs_.begin();
+         n != (*e)->outputs_.end(); ++n) {
+      out += (*n)->path() + " ";
+    }
+    out += ": " + (*e)->EvaluateCommand() + "\n";
+  }
+  return out;
+}
+
+/// Return the index of the record of \a path in \a state.
+size_t FindManifestFile(State* state, const string& path) {
+  for (size_t i = 0; i < state->manifest_files_.size(); ++i) {
+    if (state->manifest_files_[i].path == path)
+      return i;
+  }
+  return state->manifest_files_.size();
+}
+
+/// Parse \a input serially and in small chunks, expecting the same error.
+void ExpectChunkedError(ParserTest* test, const char* input,
+                        const string& expected) {
+  State serial_state, chunked_state;
+  string serial_err, chunked_err;
+  ManifestParser serial(&serial_state, test);
+  EXPECT_FALSE(serial.ParseTest(input, &serial_err));
+  ManifestParser chunked(&chunked_state, test);
+  chunked.set_parallelism(4);
+  chunked.set_chunk_size(8);
+  EXPECT_FALSE(chunked.ParseTest(input, &chunked_err));
+  EXPECT_EQ(expected, serial_err);
+  EXPECT_EQ(expected, chunked_err);
+}
+
+TEST_F(ParserTest, ParallelChunks) {
+  const char kInput[] =
+"rule cat\n"
+"  command = cat $in > $out $flags\n"
+"pool link\n"
+"  depth = 1\n"
+"flags = -a\n"
+"build a: cat in\n"
+"flags = -b\n"
+"build b c: cat a $\n"
+"in2 | implicit || order\n"
+"  pool = link\n"
+"  flags = $flags -c\n"
+"build d: cat $$\n"
+"unused = 1\n"
+"default b\n";
+  State serial_state;
+  ManifestParser serial(&serial_state, this);
+  string err;
+  ASSERT_TRUE(serial.ParseTest(kInput, &err)) << err;
+
+  ManifestParser parser(&state, this);
+  parser.set_parallelism(4);
+  parser.set_chunk_size(8);
+  ASSERT_TRUE(parser.ParseTest(kInput, &err)) << err;
+  EXPECT_EQ(DescribeEdges(&serial_state), DescribeEdges(&state));
+  EXPECT_EQ("cat a in2 > b c -b -c",
+            state.LookupNode("b")->in_edge()->EvaluateCommand());
+  EXPECT_EQ("link", state.LookupNode("b")->in_edge()->pool()->name());
+  EXPECT_TRUE(state.LookupNode("d")->in_edge());
+  ASSERT_EQ(1u, state.defaults_.size());
+  EXPECT_EQ("b", state.defaults_[0]->path());
+}
+
+TEST_F(ParserTest, ParallelChunkErrors) {
+  // Errors found while reading and while applying statements come in
+  // file order, pointing at the same place.
+  ExpectChunkedError(this,
+"rule cat\n"
+"  command = cat\n"
+"build a: cat\n"
+"build $empty: cat\n"
+"build c\n",
+"input:5: empty path\n");
+  ExpectChunkedError(this,
+"rule cat\n"
+"  command = cat\n"
+"build a: cat\n"
+"pool p\n"
+"  depth = x\n"
+"build c\n",
+"input:5: invalid pool depth\n"
+"  depth = x\n"
+"           ^ near here");
+  ExpectChunkedError(this,
+"rule cat\n"
+"  command = cat\n"
+"build a: cat\n"
+"build b: cat\n"
+"build c\n",
+"input:5: expected ':', got newline ($ also escapes ':')\n"
+"build c\n"
+"       ^ near here");
+}
+
+TEST_F(ParserTest, Reparse) {
+  files_["build.ninja"] =
+"builddir = some_dir\n"
+"rule varref\n"
+"  command = varref $var $late\n"
+"var = outer\n"
+"subninja a.ninja\n"
+"build $builddir/outer: varref\n"
+"subninja b.ninja\n"
+"builddir = other_dir\n"
+"late = late\n";
+  files_["a.ninja"] =
+"var = a\n"
+"build $builddir/a: varref\n"
+"include a_inc.ninja\n";
+  files_["a_inc.ninja"] = "build $builddir/a_inc: varref\n";
+  files_["b.ninja"] = "build $builddir/b: varref\n";
+  ManifestParser parser(&state, this);
+  string err;
+  ASSERT_TRUE(parser.Load("build.ninja", &err)) << err;
+  ASSERT_EQ(4u, state.manifest_files_.size());
+
+  // Drop the include, add an edge and change a binding.
+  files_["a.ninja"] =
+"var = A\n"
+"build $builddir/a: varref\n"
+"build $builddir/a2: varref in\n";
+  ASSERT_TRUE(parser.Reparse(FindManifestFile(&state, "a.ninja"), &err))
+      << err;
+  EXPECT_EQ(3u, state.manifest_files_.size());
+  EXPECT_EQ(3u, FindManifestFile(&state, "a_inc.ninja"));
+  EXPECT_FALSE(state.LookupNode("some_dir/a_inc")->in_edge());
+
+  State fresh;
+  ManifestParser fresh_parser(&fresh, this);
+  ASSERT_TRUE(fresh_parser.Load("build.ninja", &err)) << err;
+  EXPECT_EQ(DescribeEdges(&fresh), DescribeEdges(&state));
+  for (size_t i = 0; i < state.edges_.size(); ++i)
+    EXPECT_EQ(state.edges_[i], state.edges_[i]->outputs_[0]->in_edge());
+  Node* in = state.LookupNode("in");
+  ASSERT_TRUE(in);
+  ASSERT_EQ(1u, in->out_edges().size());
+  EXPECT_EQ(state.edges_[1], in->out_edges()[0]);
+}
+
+TEST_F(ParserTest, ReparseDefinesGlobals) {
+  files_["build.ninja"] =
+"rule r\n"
+"  command = r\n"
+"subninja a.ninja\n"
+"subninja b.ninja\n";
+  files_["a.ninja"] = "build a: r\n";
+  files_["b.ninja"] = "pool p\n  depth = 1\n";
+  ManifestParser parser(&state, this);
+  string err;
+  ASSERT_TRUE(parser.Load("build.ninja", &err)) << err;
+
+  // A pool defined after a.ninja could be used by it now.
+  EXPECT_FALSE(parser.Reparse(FindManifestFile(&state, "a.ninja"), &err));
+  EXPECT_EQ("'a.ninja' can't be parsed on its own", err);
+  // Its pool is visible everywhere.
+  EXPECT_FALSE(parser.Reparse(FindManifestFile(&state, "b.ninja"), &err));
+}
+
+TEST_F(ParserTest, ReparseNewRule) {
+  files_["build.ninja"] =
+"rule r\n"
+"  command = r\n"
+"subninja a.ninja\n";
+  files_["a.ninja"] = "build a: r\n";
+  ManifestParser parser(&state, this);
+  string err;
+  ASSERT_TRUE(parser.Load("build.ninja", &err)) << err;
+
+  files_["a.ninja"] = "rule s\n  command = s\nbuild a: s\n";
+  EXPECT_FALSE(parser.Reparse(FindManifestFile(&state, "a.ninja"), &err));
+  EXPECT_EQ("'a.ninja' can't be parsed on its own", err);
+}
+
+TEST_F(ParserTest, Pools) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link\n"
+"  depth = 4\n"
+"pool gen\n"
+"  depth = 0\n"
+"rule cat\n"
+"  command = cat $in > $out\n"
+"rule ld\n"
+"  command = ld $in -o $out\n"
+"  pool = link\n"
+"build a: ld a.o\n"
+"build b: ld b.o\n"
+"  pool = gen\n"
+"build c: cat c.o\n"
+"  pool = link\n"
+"build d: cat d.o\n"
+"build e: ld e.o\n"
+"  pool =\n"));
+
+  Pool* link = state.LookupPool("link");
+  ASSERT_TRUE(link);
+  EXPECT_EQ(4, link->depth());
+  EXPECT_EQ(0, state.LookupPool("gen")->depth());
+  EXPECT_EQ(link, state.LookupNode("a")->in_edge()->pool());
+  EXPECT_EQ(state.LookupPool("gen"), state.LookupNode("b")->in_edge()->pool());
+  EXPECT_EQ(link, state.LookupNode("c")->in_edge()->pool());
+  EXPECT_EQ(&State::kDefaultPool, state.LookupNode("d")->in_edge()->pool());
+  // An empty pool on the build statement overrides the rule's.
+  EXPECT_EQ(&State::kDefaultPool, state.LookupNode("e")->in_edge()->pool());
+}
+
+TEST_F(ParserTest, PoolNotInherited) {
+  // "pool" can't be bound at the top level of a manifest, but a scope
+  // may have it from elsewhere.  Only the edge and its rule count.
+  state.bindings_.AddBinding("pool", "link");
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link\n"
+"  depth = 1\n"
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build a: cat a.o\n"));
+  EXPECT_EQ(&State::kDefaultPool, state.LookupNode("a")->in_edge()->pool());
+}
+
+TEST_F(ParserTest, PoolErrors) {
+  ExpectParallelError(this, "pool\n",
+"input:1: expected pool name\n");
+  ExpectParallelError(this, "pool p\n",
+"input:2: expected 'depth =' line\n");
+  ExpectParallelError(this, "pool p\n  depth = -1\n",
+"input:2: invalid pool depth\n"
+"  depth = -1\n"
+"            ^ near here");
+  ExpectParallelError(this, "pool p\n  depth = 2x\n",
+"input:2: invalid pool depth\n"
+"  depth = 2x\n"
+"            ^ near here");
+  ExpectParallelError(this, "pool p\n  depth = 1\n  size = 1\n",
+"input:3: unexpected variable 'size'\n"
+"  size = 1\n"
+"          ^ near here");
+  ExpectParallelError(this, "pool p\n  depth = 1\npool p\n  depth = 2\n",
+"input:3: duplicate pool 'p'\n"
+"pool p\n"
+"      ^ near here");
+  ExpectParallelError(this,
+"rule r\n"
+"  command = r\n"
+"  pool = nope\n"
+"build out: r\n",
+"input:5: unknown pool name 'nope'\n");
+}
+
+TEST_F(ParserTest, ParallelPools) {
+  files_["a.ninja"] =
+    "pool link\n"
+    "  depth = 1\n"
+    "build a: cat\n"
+    "  pool = link\n"
+    "rule alink\n"
+    "  command = alink\n"
+    "  pool = link\n";
+  files_["b.ninja"] = "build b: ld\nbuild b2: alink\n"
+      "build b3: alink\n  pool =\n";
+  ManifestParser parser(&state, this);
+  parser.set_parallelism(4);
+  string err;
+  ASSERT_TRUE(parser.ParseTest(
+"rule cat\n"
+"  command = cat\n"
+"subninja a.ninja\n"
+"rule ld\n"
+"  command = ld\n"
+"  pool = link\n"
+"subninja b.ninja\n"
+"build c: cat\n"
+"  pool = link\n", &err)) << err;
+  Pool* link = state.LookupPool("link");
+  ASSERT_TRUE(link);
+  EXPECT_EQ(link, state.LookupNode("a")->in_edge()->pool());
+  EXPECT_EQ(link, state.LookupNode("b")->in_edge()->pool());
+  EXPECT_EQ(link, state.LookupNode("b2")->in_edge()->pool());
+  // An empty pool on the build statement overrides the rule's, even when
+  // the rule is only known later.
+  EXPECT_EQ(&State::kDefaultPool, state.LookupNode("b3")->in_edge()->pool());
+  EXPECT_EQ(link, state.LookupNode("c")->in_edge()->pool());
+
+  // Pools must still be defined before they're used...
+  ExpectParallelError(this,
+"rule cat\n"
+"  command = cat\n"
+"build c: cat\n"
+"  pool = link\n"
+"subninja a.ninja\n",
+"input:5: unknown pool name 'link'\n");
+  // ... and only once, wherever the second definition is.
+  ExpectParallelError(this,
+"rule cat\n"
+"  command = cat\n"
+"subninja a.ninja\n"
+"pool link\n"
+"  depth = 2\n",
+"input:4: duplicate pool 'link'\n"
+"pool link\n"
+"         ^ near here");
+  ExpectParallelError(this,
+"rule cat\n"
+"  command = cat\n"
+"subninja a.ninja\n"
+"subninja a.ninja\n",
+"a.ninja:1: duplicate pool 'link'\n"
+"pool link\n"
+"         ^ near here");
+}
+
 TEST_F(ParserTest, Include) {
   files_["include.ninja"] = "var = inner\n";
   ASSERT_NO_FATAL_FAILURE(AssertParse(
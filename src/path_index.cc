@@ -0,0 +1,122 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "path_index.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#include "edit_distance.h"
+#include "graph.h"
+#include "metrics.h"
+
+namespace {
+
+bool LengthThenPathLess(const Node* a, const Node* b) {
+  if (a->path().size() != b->path().size())
+    return a->path().size() < b->path().size();
+  return a->path() < b->path();
+}
+
+bool PathLess(const Node* a, const Node* b) {
+  return a->path() < b->path();
+}
+
+bool PathLessThanPrefix(const Node* node, const string& prefix) {
+  return node->path() < prefix;
+}
+
+}  // namespace
+
+void PathIndex::Build(const vector<Node*>& nodes) {
+  METRIC_RECORD("build path index");
+  by_path_ = nodes;
+  sort(by_path_.begin(), by_path_.end(), PathLess);
+
+  vector<Node*> by_length = nodes;
+  sort(by_length.begin(), by_length.end(), LengthThenPathLess);
+  by_length_.resize(by_length.size());
+  for (size_t i = 0; i < by_length.size(); ++i) {
+    Entry* entry = &by_length_[i];
+    entry->node = by_length[i];
+    entry->length = by_length[i]->path().size();
+    Count(by_length[i]->path(), entry->counts);
+  }
+}
+
+// static
+void PathIndex::Count(const string& path, unsigned char* counts) {
+  memset(counts, 0, kBuckets);
+  for (size_t i = 0; i < path.size(); ++i) {
+    unsigned char* count = &counts[(unsigned char)path[i] % kBuckets];
+    if (*count < 255)
+      ++*count;
+  }
+}
+
+Node* PathIndex::Spellcheck(const string& path, int max_distance) const {
+  unsigned char counts[kBuckets];
+  Count(path, counts);
+
+  // Skip to the shortest path that could be close enough.
+  size_t min_length =
+      path.size() > (size_t)max_distance ? path.size() - max_distance : 0;
+  size_t lo = 0, hi = by_length_.size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (by_length_[mid].length < min_length)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  // Only a strictly closer path replaces the best one so far, so the
+  // bound tightens as we go.
+  int limit = max_distance;
+  Node* result = NULL;
+  for (size_t i = lo; i < by_length_.size(); ++i) {
+    const Entry& entry = by_length_[i];
+    if (entry.length > path.size() + limit)
+      break;
+    if (entry.length + limit < path.size())
+      continue;
+    int histogram_distance = 0;
+    for (int b = 0; b < kBuckets; ++b)
+      histogram_distance += abs((int)entry.counts[b] - (int)counts[b]);
+    if ((histogram_distance + 1) / 2 > limit)
+      continue;
+    // A maximum of zero means unbounded to EditDistance().
+    int distance = limit == 0 ? (entry.node->path() == path ? 0 : 1) :
+        EditDistance(entry.node->path(), path, true, limit);
+    if (distance <= limit) {
+      result = entry.node;
+      limit = distance - 1;
+      if (limit < 0)
+        break;
+    }
+  }
+  return result;
+}
+
+void PathIndex::Complete(const string& prefix, vector<Node*>* nodes) const {
+  vector<Node*>::const_iterator i = lower_bound(
+      by_path_.begin(), by_path_.end(), prefix, PathLessThanPrefix);
+  for (; i != by_path_.end(); ++i) {
+    if ((*i)->path().compare(0, prefix.size(), prefix) != 0)
+      break;
+    nodes->push_back(*i);
+  }
+}
@@ -0,0 +1,68 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_PATH_INDEX_H_
+#define NINJA_PATH_INDEX_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+struct Node;
+
+/// An index over the paths of a set of nodes, for finding near misses
+/// and completions without comparing against every path in the graph.
+///
+/// Spellchecking looks only at paths whose length is within the allowed
+/// edit distance of the query, and skips most of those by comparing a
+/// histogram of their characters first: every insertion or deletion
+/// changes the histogram by one and every replacement by at most two, so
+/// it bounds the edit distance from below for the price of a few
+/// additions.
+struct PathIndex {
+  /// Index \a nodes, replacing whatever was indexed before.
+  void Build(const vector<Node*>& nodes);
+
+  /// The number of nodes indexed.
+  size_t size() const { return by_path_.size(); }
+
+  /// Return the node whose path is closest to \a path, if it is at most
+  /// \a max_distance edits away.  Ties go to the shortest, then the
+  /// alphabetically first path.
+  Node* Spellcheck(const string& path, int max_distance) const;
+
+  /// Append the nodes whose path starts with \a prefix to \a nodes,
+  /// sorted by path.
+  void Complete(const string& prefix, vector<Node*>* nodes) const;
+
+ private:
+  enum { kBuckets = 16 };
+
+  struct Entry {
+    Node* node;
+    size_t length;
+    /// Number of characters of the path falling into each bucket.
+    unsigned char counts[kBuckets];
+  };
+
+  static void Count(const string& path, unsigned char* counts);
+
+  /// All nodes, by path length and then path.
+  vector<Entry> by_length_;
+  /// All nodes, by path.
+  vector<Node*> by_path_;
+};
+
+#endif  // NINJA_PATH_INDEX_H_
@@ -0,0 +1,126 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "path_index.h"
+
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct PathIndexTest : public testing::Test {
+  void Add(const char* path) { nodes_.push_back(state_.GetNode(path)); }
+  void Build() { index_.Build(nodes_); }
+
+  State state_;
+  vector<Node*> nodes_;
+  PathIndex index_;
+};
+
+TEST_F(PathIndexTest, Spellcheck) {
+  Add("out/foo.o");
+  Add("out/bar.o");
+  Add("out/baz.o");
+  Add("src/foo.cc");
+  Build();
+
+  Node* node = index_.Spellcheck("out/fo.o", 3);
+  ASSERT_TRUE(node);
+  EXPECT_EQ("out/foo.o", node->path());
+
+  node = index_.Spellcheck("src/foo.c", 3);
+  ASSERT_TRUE(node);
+  EXPECT_EQ("src/foo.cc", node->path());
+
+  EXPECT_FALSE(index_.Spellcheck("something/else", 3));
+  EXPECT_FALSE(index_.Spellcheck("out/quux.o", 1));
+}
+
+TEST_F(PathIndexTest, SpellcheckTies) {
+  Add("out/baz.o");
+  Add("out/bar.o");
+  Add("out/ba.o");
+  Build();
+
+  // out/ba.o is as close as the others, but shorter.
+  Node* node = index_.Spellcheck("out/bat.o", 3);
+  ASSERT_TRUE(node);
+  EXPECT_EQ("out/ba.o", node->path());
+
+  // Among paths of the same length, the alphabetically first one wins.
+  node = index_.Spellcheck("out/bay.o", 1);
+  ASSERT_TRUE(node);
+  EXPECT_EQ("out/ba.o", node->path());
+  node = index_.Spellcheck("out/bbr.o", 1);
+  ASSERT_TRUE(node);
+  EXPECT_EQ("out/bar.o", node->path());
+}
+
+TEST_F(PathIndexTest, SpellcheckLengths) {
+  Add("a");
+  Add("abcdefgh");
+  Build();
+
+  // Too long or too short to be within two edits.
+  EXPECT_FALSE(index_.Spellcheck("abcd", 2));
+  Node* node = index_.Spellcheck("abcdef", 2);
+  ASSERT_TRUE(node);
+  EXPECT_EQ("abcdefgh", node->path());
+  node = index_.Spellcheck("ab", 2);
+  ASSERT_TRUE(node);
+  EXPECT_EQ("a", node->path());
+}
+
+TEST_F(PathIndexTest, Complete) {
+  Add("out/foo.o");
+  Add("src/foo.cc");
+  Add("out/bar.o");
+  Add("outside");
+  Build();
+
+  vector<Node*> nodes;
+  index_.Complete("out/", &nodes);
+  ASSERT_EQ(2u, nodes.size());
+  EXPECT_EQ("out/bar.o", nodes[0]->path());
+  EXPECT_EQ("out/foo.o", nodes[1]->path());
+
+  nodes.clear();
+  index_.Complete("out", &nodes);
+  EXPECT_EQ(3u, nodes.size());
+
+  nodes.clear();
+  index_.Complete("zzz", &nodes);
+  EXPECT_EQ(0u, nodes.size());
+
+  nodes.clear();
+  index_.Complete("", &nodes);
+  EXPECT_EQ(4u, nodes.size());
+}
+
+TEST(State, SpellcheckNodeSeesNewNodes) {
+  State state;
+  state.GetNode("foo.o");
+  Node* node = state.SpellcheckNode("fo.o");
+  ASSERT_TRUE(node);
+  EXPECT_EQ("foo.o", node->path());
+
+  state.GetNode("bar.o");
+  node = state.SpellcheckNode("bar");
+  ASSERT_TRUE(node);
+  EXPECT_EQ("bar.o", node->path());
+}
+
+}  // namespace
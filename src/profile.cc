@@ -0,0 +1,178 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "profile.h"
+
+#include <algorithm>
+
+#include "build_log.h"
+#include "deps_log.h"
+#include "graph.h"
+#include "state.h"
+
+namespace {
+
+bool SlowerFirst(const Profile::EdgeTime& a, const Profile::EdgeTime& b) {
+  return a.millis > b.millis;
+}
+
+bool MoreTimeFirst(const Profile::RuleTime& a, const Profile::RuleTime& b) {
+  return a.millis > b.millis;
+}
+
+bool MoreSlowdownFirst(const Profile::Change& a, const Profile::Change& b) {
+  return a.new_millis - a.old_millis > b.new_millis - b.old_millis;
+}
+
+/// The log entry of \a edge's first output that was logged; all of them
+/// are logged alike.
+BuildLog::LogEntry* LookupEdge(Edge* edge, BuildLog* log) {
+  for (vector<Node*>::iterator o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o) {
+    if (BuildLog::LogEntry* entry = log->LookupByOutput((*o)->path()))
+      return entry;
+  }
+  return NULL;
+}
+
+}  // namespace
+
+Profile::Profile(State* state, BuildLog* log, DepsLog* deps_log)
+    : state_(state), deps_log_(deps_log) {
+  for (vector<Edge*>::iterator e = state_->edges_.begin();
+       e != state_->edges_.end(); ++e) {
+    if ((*e)->is_phony())
+      continue;
+    if (BuildLog::LogEntry* entry = LookupEdge(*e, log)) {
+      int millis = entry->end_time - entry->start_time;
+      EdgeTime time = { *e, millis, entry->user_time + entry->system_time,
+                        entry->max_rss };
+      times_.push_back(time);
+      durations_[*e] = millis;
+    }
+  }
+}
+
+// static
+int Profile::Duration(Edge* edge, BuildLog* log) {
+  BuildLog::LogEntry* entry = LookupEdge(edge, log);
+  return entry ? entry->end_time - entry->start_time : -1;
+}
+
+vector<Profile::EdgeTime> Profile::Slowest(size_t count) const {
+  vector<EdgeTime> times = times_;
+  count = min(count, times.size());
+  stable_sort(times.begin(), times.end(), SlowerFirst);
+  times.resize(count);
+  return times;
+}
+
+vector<Profile::RuleTime> Profile::ByRule() const {
+  map<string, RuleTime> rules;
+  for (vector<EdgeTime>::const_iterator i = times_.begin();
+       i != times_.end(); ++i) {
+    const string& name = i->edge->rule().name();
+    RuleTime& rule = rules[name];
+    rule.rule = name;
+    ++rule.edges;
+    rule.millis += i->millis;
+    rule.cpu_millis += i->cpu_millis;
+    rule.max_rss = max(rule.max_rss, i->max_rss);
+  }
+  vector<RuleTime> times;
+  for (map<string, RuleTime>::iterator i = rules.begin(); i != rules.end();
+       ++i)
+    times.push_back(i->second);
+  stable_sort(times.begin(), times.end(), MoreTimeFirst);
+  return times;
+}
+
+int64_t Profile::CriticalPath(vector<Edge*>* path) {
+  int64_t longest = 0;
+  Edge* last = NULL;
+  for (vector<Edge*>::iterator e = state_->edges_.begin();
+       e != state_->edges_.end(); ++e) {
+    int64_t millis = CriticalTime(*e);
+    if (millis > longest) {
+      longest = millis;
+      last = *e;
+    }
+  }
+
+  path->clear();
+  for (Edge* edge = last; edge; edge = critical_[edge].previous) {
+    if (!edge->is_phony())
+      path->push_back(edge);
+  }
+  reverse(path->begin(), path->end());
+  return longest;
+}
+
+int64_t Profile::CriticalTime(Edge* edge) {
+  Critical& critical = critical_[edge];
+  if (critical.millis >= 0)
+    return critical.millis;
+  // Guard against cycles through recorded dependencies.
+  critical.millis = 0;
+
+  vector<Node*> inputs = edge->inputs_;
+  if (deps_log_) {
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      if (const DepsLog::Deps* deps = deps_log_->GetDeps(*o)) {
+        for (int i = 0; i < deps->node_count; ++i)
+          inputs.push_back(deps_log_->node(deps->node_ids[i]));
+        break;
+      }
+    }
+  }
+
+  int64_t before = 0;
+  Edge* previous = NULL;
+  for (vector<Node*>::iterator i = inputs.begin(); i != inputs.end(); ++i) {
+    Edge* in_edge = (*i)->in_edge();
+    if (!in_edge)
+      continue;
+    int64_t millis = CriticalTime(in_edge);
+    if (millis > before || !previous) {
+      before = millis;
+      previous = in_edge;
+    }
+  }
+
+  map<Edge*, int>::iterator duration = durations_.find(edge);
+  critical.millis =
+      before + (duration != durations_.end() ? duration->second : 0);
+  critical.previous = previous;
+  return critical.millis;
+}
+
+vector<Profile::Change> Profile::SlowerThan(BuildLog* old_log,
+                                            double min_ratio,
+                                            int min_millis) const {
+  vector<Change> changes;
+  for (vector<EdgeTime>::const_iterator i = times_.begin();
+       i != times_.end(); ++i) {
+    int old_millis = Duration(i->edge, old_log);
+    if (old_millis < 0)
+      continue;
+    if (i->millis - old_millis >= min_millis &&
+        i->millis >= old_millis * min_ratio) {
+      Change change = { i->edge, old_millis, i->millis };
+      changes.push_back(change);
+    }
+  }
+  stable_sort(changes.begin(), changes.end(), MoreSlowdownFirst);
+  return changes;
+}
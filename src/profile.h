@@ -0,0 +1,102 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_PROFILE_H_
+#define NINJA_PROFILE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "util.h"  // For int64_t.
+
+struct BuildLog;
+struct DepsLog;
+struct Edge;
+struct State;
+
+/// Summarizes the command timings recorded in a build log, for
+/// -t profile: the slowest commands, the time and memory spent per rule
+/// and the
+/// critical path, i.e. the longest chain of commands each needing the
+/// previous one, which bounds how fast a full build can ever be.
+struct Profile {
+  /// Look up the edges of \a state in \a log.  Dependencies recorded in
+  /// \a deps_log (which may be NULL) count towards the critical path.
+  Profile(State* state, BuildLog* log, DepsLog* deps_log);
+
+  /// How long \a edge took when it last ran, in milliseconds, according
+  /// to \a log; -1 if it isn't in the log.
+  static int Duration(Edge* edge, BuildLog* log);
+
+  struct EdgeTime {
+    Edge* edge;
+    int millis;
+    /// User plus system CPU time, and peak RSS in bytes; 0 if unknown.
+    int cpu_millis;
+    int64_t max_rss;
+  };
+  /// The \a count slowest commands, slowest first.
+  vector<EdgeTime> Slowest(size_t count) const;
+
+  struct RuleTime {
+    RuleTime() : edges(0), millis(0), cpu_millis(0), max_rss(0) {}
+    string rule;
+    int edges;
+    int64_t millis;
+    int64_t cpu_millis;
+    /// The peak RSS of the rule's most memory hungry command.
+    int64_t max_rss;
+  };
+  /// The total time spent running each rule's commands, most first.
+  vector<RuleTime> ByRule() const;
+
+  /// Return the length of the critical path in milliseconds, and fill in
+  /// \a path with its commands from first to last.
+  int64_t CriticalPath(vector<Edge*>* path);
+
+  struct Change {
+    Edge* edge;
+    int old_millis;
+    int new_millis;
+  };
+  /// The commands that took at least \a min_ratio times as long and at
+  /// least \a min_millis more than in \a old_log, most slowed down
+  /// first.
+  vector<Change> SlowerThan(BuildLog* old_log, double min_ratio,
+                            int min_millis) const;
+
+ private:
+  /// Return the length of the longest chain of commands ending with
+  /// \a edge, memoized in critical_.
+  int64_t CriticalTime(Edge* edge);
+
+  State* state_;
+  DepsLog* deps_log_;
+  /// Every edge found in the log, in manifest order, with its duration.
+  vector<EdgeTime> times_;
+  map<Edge*, int> durations_;
+
+  struct Critical {
+    Critical() : millis(-1), previous(NULL) {}
+    /// -1 while not known yet.
+    int64_t millis;
+    /// The edge before this one on its longest chain, if any.
+    Edge* previous;
+  };
+  map<Edge*, Critical> critical_;
+};
+
+#endif  // NINJA_PROFILE_H_
@@ -0,0 +1,118 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "profile.h"
+
+#include "build_log.h"
+#include "deps_log.h"
+#include "graph.h"
+#include "state.h"
+#include "subprocess.h"
+#include "test.h"
+
+namespace {
+
+struct ProfileTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule link\n"
+"  command = link $out\n"
+"build a.o: cat a.c\n"
+"build b.o: cat b.c\n"
+"build gen.h: cat gen.in\n"
+"build app: link a.o b.o\n"
+"build all: phony app\n"));
+    Record(&log_, "a.o", 100);
+    Record(&log_, "b.o", 300);
+    Record(&log_, "gen.h", 50);
+    Record(&log_, "app", 20);
+  }
+
+  /// Record that \a output took \a millis in \a log, a tenth of them on
+  /// the CPU, and as many KB of memory.
+  void Record(BuildLog* log, const string& output, int millis) {
+    ResourceUsage usage;
+    usage.user_millis = millis / 10;
+    usage.max_rss = millis << 10;
+    log->RecordCommand(GetNode(output)->in_edge(), 1000, 1000 + millis, 0,
+                       NULL, &usage);
+  }
+
+  BuildLog log_;
+};
+
+TEST_F(ProfileTest, Slowest) {
+  Profile profile(&state_, &log_, NULL);
+  vector<Profile::EdgeTime> slowest = profile.Slowest(2);
+  ASSERT_EQ(2u, slowest.size());
+  EXPECT_EQ("b.o", slowest[0].edge->outputs_[0]->path());
+  EXPECT_EQ(300, slowest[0].millis);
+  EXPECT_EQ("a.o", slowest[1].edge->outputs_[0]->path());
+
+  EXPECT_EQ(4u, profile.Slowest(10).size());
+}
+
+TEST_F(ProfileTest, ByRule) {
+  Profile profile(&state_, &log_, NULL);
+  vector<Profile::RuleTime> rules = profile.ByRule();
+  ASSERT_EQ(2u, rules.size());
+  EXPECT_EQ("cat", rules[0].rule);
+  EXPECT_EQ(3, rules[0].edges);
+  EXPECT_EQ(450, rules[0].millis);
+  EXPECT_EQ(45, rules[0].cpu_millis);
+  EXPECT_EQ(300 << 10, rules[0].max_rss);
+  EXPECT_EQ("link", rules[1].rule);
+  EXPECT_EQ(20, rules[1].millis);
+}
+
+TEST_F(ProfileTest, CriticalPath) {
+  Profile profile(&state_, &log_, NULL);
+  vector<Edge*> path;
+  EXPECT_EQ(320, profile.CriticalPath(&path));
+  ASSERT_EQ(2u, path.size());
+  EXPECT_EQ("b.o", path[0]->outputs_[0]->path());
+  EXPECT_EQ("app", path[1]->outputs_[0]->path());
+}
+
+TEST_F(ProfileTest, CriticalPathThroughDeps) {
+  // a.o was found to include the generated header.
+  DepsLog deps_log;
+  vector<Node*> deps;
+  deps.push_back(GetNode("gen.h"));
+  Record(&log_, "gen.h", 500);
+  deps_log.RecordDeps(GetNode("a.o"), 1, deps);
+
+  Profile profile(&state_, &log_, &deps_log);
+  vector<Edge*> path;
+  EXPECT_EQ(620, profile.CriticalPath(&path));
+  ASSERT_EQ(3u, path.size());
+  EXPECT_EQ("gen.h", path[0]->outputs_[0]->path());
+  EXPECT_EQ("a.o", path[1]->outputs_[0]->path());
+}
+
+TEST_F(ProfileTest, SlowerThan) {
+  BuildLog old_log;
+  Record(&old_log, "a.o", 50);    // Twice as slow now.
+  Record(&old_log, "b.o", 290);   // Not by much.
+  Record(&old_log, "app", 5);     // Too short to matter.
+
+  Profile profile(&state_, &log_, NULL);
+  vector<Profile::Change> changes = profile.SlowerThan(&old_log, 1.1, 20);
+  ASSERT_EQ(1u, changes.size());
+  EXPECT_EQ("a.o", changes[0].edge->outputs_[0]->path());
+  EXPECT_EQ(50, changes[0].old_millis);
+  EXPECT_EQ(100, changes[0].new_millis);
+}
+
+}  // namespace
@@ -0,0 +1,206 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "query.h"
+
+#include <algorithm>
+#include <set>
+
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+bool PathLess(const Node* a, const Node* b) {
+  return a->path() < b->path();
+}
+
+void AppendPaths(const char* key, const vector<Node*>& nodes, string* out) {
+  *out += ",\"";
+  *out += key;
+  *out += "\":[";
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (i)
+      *out += ",";
+    AppendJSONString(nodes[i]->path(), out);
+  }
+  *out += "]";
+}
+
+void AppendCommands(Edge* edge, set<Edge*>* seen, vector<string>* commands) {
+  if (!edge || !seen->insert(edge).second)
+    return;
+  for (vector<Node*>::iterator in = edge->inputs_.begin();
+       in != edge->inputs_.end(); ++in)
+    AppendCommands((*in)->in_edge(), seen, commands);
+  if (!edge->is_phony())
+    commands->push_back(edge->EvaluateCommandUncached());
+}
+
+}  // namespace
+
+void QueryService::Answer(const string& query, string* out) {
+  METRIC_RECORD("answer query");
+  string line = query;
+  if (!line.empty() && line[line.size() - 1] == '\r')
+    line.resize(line.size() - 1);
+  if (line.empty())
+    return;
+
+  // The argument is the rest of the line, as paths may contain spaces.
+  string command = line, arg;
+  string::size_type space = line.find(' ');
+  if (space != string::npos) {
+    command = line.substr(0, space);
+    arg = line.substr(space + 1);
+  }
+
+  *out += "{\"query\":";
+  AppendJSONString(line, out);
+
+  string err;
+  if (command == "targets") {
+    vector<Node*> nodes;
+    state_->NodesWithPrefix(arg, &nodes);
+    AppendPaths("result", nodes, out);
+  } else if (command == "inputs" || command == "outputs" ||
+             command == "deps" || command == "rdeps" ||
+             command == "commands") {
+    if (Node* node = Lookup(arg, &err))
+      AnswerNode(command, node, out);
+  } else {
+    const char* suggestion = SpellcheckString(command, "inputs", "outputs",
+        "deps", "rdeps", "commands", "targets", NULL);
+    err = "unknown query '" + command + "'";
+    if (suggestion)
+      err += string(", did you mean '") + suggestion + "'?";
+  }
+
+  if (!err.empty()) {
+    *out += ",\"error\":";
+    AppendJSONString(err, out);
+  }
+  *out += "}\n";
+}
+
+void QueryService::AnswerNode(const string& command, Node* node,
+                              string* out) {
+  if (command == "inputs") {
+    vector<Node*> explicit_deps, implicit_deps, order_only_deps;
+    if (Edge* edge = node->in_edge()) {
+      *out += ",\"rule\":";
+      AppendJSONString(edge->rule().name(), out);
+      for (int i = 0; i < (int)edge->inputs_.size(); ++i) {
+        if (edge->is_implicit(i))
+          implicit_deps.push_back(edge->inputs_[i]);
+        else if (edge->is_order_only(i))
+          order_only_deps.push_back(edge->inputs_[i]);
+        else
+          explicit_deps.push_back(edge->inputs_[i]);
+      }
+    }
+    AppendPaths("explicit", explicit_deps, out);
+    AppendPaths("implicit", implicit_deps, out);
+    AppendPaths("order_only", order_only_deps, out);
+  } else if (command == "outputs") {
+    vector<Node*> nodes;
+    for (vector<Edge*>::const_iterator e = node->out_edges().begin();
+         e != node->out_edges().end(); ++e) {
+      nodes.insert(nodes.end(), (*e)->outputs_.begin(),
+                   (*e)->outputs_.end());
+    }
+    AppendPaths("result", nodes, out);
+  } else if (command == "deps" || command == "rdeps") {
+    vector<Node*> nodes;
+    Closure(node, command == "deps", &nodes);
+    sort(nodes.begin(), nodes.end(), PathLess);
+    AppendPaths("result", nodes, out);
+  } else {
+    set<Edge*> seen;
+    vector<string> commands;
+    AppendCommands(node->in_edge(), &seen, &commands);
+    *out += ",\"result\":[";
+    for (size_t i = 0; i < commands.size(); ++i) {
+      if (i)
+        *out += ",";
+      AppendJSONString(commands[i], out);
+    }
+    *out += "]";
+  }
+}
+
+void QueryService::Run(FILE* in, FILE* out) {
+  char buf[4 << 10];
+  string line;
+  string answer;
+  while (fgets(buf, sizeof(buf), in)) {
+    line += buf;
+    if (line[line.size() - 1] != '\n' && !feof(in))
+      continue;  // The rest of a long line is still to come.
+    if (line[line.size() - 1] == '\n')
+      line.resize(line.size() - 1);
+    answer.clear();
+    Answer(line, &answer);
+    line.clear();
+    if (answer.empty())
+      continue;
+    // Flush every answer so that the asking tool can go on right away.
+    fwrite(answer.data(), 1, answer.size(), out);
+    fflush(out);
+  }
+}
+
+Node* QueryService::Lookup(const string& path, string* err) {
+  if (path.empty()) {
+    *err = "expected a path";
+    return NULL;
+  }
+  if (Node* node = state_->LookupNode(path))
+    return node;
+  *err = "unknown path '" + path + "'";
+  if (Node* suggestion = state_->SpellcheckNode(path))
+    *err += ", did you mean '" + suggestion->path() + "'?";
+  return NULL;
+}
+
+void QueryService::Closure(Node* node, bool forward, vector<Node*>* nodes) {
+  vector<bool> seen(state_->nodes_.size());
+  vector<Node*> stack(1, node);
+  seen[node->index()] = true;
+  while (!stack.empty()) {
+    Node* n = stack.back();
+    stack.pop_back();
+
+    vector<Node*> next;
+    if (forward) {
+      if (Edge* edge = n->in_edge())
+        next = edge->inputs_;
+    } else {
+      for (vector<Edge*>::const_iterator e = n->out_edges().begin();
+           e != n->out_edges().end(); ++e) {
+        next.insert(next.end(), (*e)->outputs_.begin(), (*e)->outputs_.end());
+      }
+    }
+    for (vector<Node*>::iterator i = next.begin(); i != next.end(); ++i) {
+      if (seen[(*i)->index()])
+        continue;
+      seen[(*i)->index()] = true;
+      nodes->push_back(*i);
+      stack.push_back(*i);
+    }
+  }
+}
@@ -0,0 +1,68 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_QUERY_H_
+#define NINJA_QUERY_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+struct Node;
+struct State;
+
+/// Answers questions about the graph as line-delimited JSON, for
+/// `-t query -`: tools asking thousands of them load the manifest once
+/// per session rather than once per question.
+///
+/// Each query is a line holding a command and an argument:
+///   inputs PATH     the rule building PATH and its explicit, implicit
+///                   and order-only inputs
+///   outputs PATH    the outputs of the edges using PATH
+///   deps PATH       everything PATH is built from, transitively
+///   rdeps PATH      everything built from PATH, transitively
+///   commands PATH   the commands rebuilding PATH, in the order to run them
+///   targets PREFIX  the paths starting with PREFIX
+/// Each answer is a single line holding a JSON object with the query
+/// and either its "result" (for inputs: "rule", "explicit", "implicit"
+/// and "order_only") or an "error".
+struct QueryService {
+  explicit QueryService(State* state) : state_(state) {}
+
+  /// Answer \a query, appending a line of JSON to \a out.  Blank queries
+  /// get no answer.
+  void Answer(const string& query, string* out);
+
+  /// Answer each line of \a in on \a out as it arrives, until the end of
+  /// \a in.
+  void Run(FILE* in, FILE* out);
+
+ private:
+  /// Answer a query about \a node: everything but targets.
+  void AnswerNode(const string& command, Node* node, string* out);
+
+  /// Return the node for \a path, or NULL after filling in \a err.
+  Node* Lookup(const string& path, string* err);
+
+  /// Append the nodes \a node is built from (\a forward) or used to
+  /// build, transitively, to \a nodes.
+  void Closure(Node* node, bool forward, vector<Node*>* nodes);
+
+  State* state_;
+};
+
+#endif  // NINJA_QUERY_H_
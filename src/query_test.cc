@@ -0,0 +1,96 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "query.h"
+
+#include "memory_stats.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct QueryTest : public StateTestWithBuiltinRules {
+  QueryTest() : service_(&state_) {}
+
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a.o: cat a.c | a.h || gen\n"
+"build b.o: cat b.c\n"
+"build gen: cat gen.in\n"
+"build app: cat a.o b.o\n"
+"build all: phony app\n"));
+  }
+
+  string Answer(const string& query) {
+    string out;
+    service_.Answer(query, &out);
+    return out;
+  }
+
+  QueryService service_;
+};
+
+TEST_F(QueryTest, Inputs) {
+  EXPECT_EQ("{\"query\":\"inputs a.o\",\"rule\":\"cat\","
+            "\"explicit\":[\"a.c\"],\"implicit\":[\"a.h\"],"
+            "\"order_only\":[\"gen\"]}\n", Answer("inputs a.o"));
+  EXPECT_EQ("{\"query\":\"inputs a.c\",\"explicit\":[],\"implicit\":[],"
+            "\"order_only\":[]}\n", Answer("inputs a.c"));
+}
+
+TEST_F(QueryTest, Outputs) {
+  EXPECT_EQ("{\"query\":\"outputs a.o\",\"result\":[\"app\"]}\n",
+            Answer("outputs a.o"));
+}
+
+TEST_F(QueryTest, Closures) {
+  EXPECT_EQ("{\"query\":\"deps app\",\"result\":[\"a.c\",\"a.h\",\"a.o\","
+            "\"b.c\",\"b.o\",\"gen\",\"gen.in\"]}\n", Answer("deps app"));
+  EXPECT_EQ("{\"query\":\"rdeps gen.in\",\"result\":[\"a.o\",\"all\","
+            "\"app\",\"gen\"]}\n", Answer("rdeps gen.in"));
+}
+
+TEST_F(QueryTest, Commands) {
+  // Inputs are built before what depends on them, order-only ones too.
+  EXPECT_EQ("{\"query\":\"commands all\",\"result\":[\"cat gen.in > gen\","
+            "\"cat a.c > a.o\",\"cat b.c > b.o\",\"cat a.o b.o > app\"]}\n",
+            Answer("commands all"));
+
+  // The service stays up between queries, so it keeps none of them.
+  MemoryStats stats;
+  stats.AddState(state_);
+  const MemoryStats::Item* evaluated = stats.Find("evaluated edge strings");
+  ASSERT_TRUE(evaluated);
+  EXPECT_EQ(0, evaluated->count);
+}
+
+TEST_F(QueryTest, Targets) {
+  EXPECT_EQ("{\"query\":\"targets a.\",\"result\":[\"a.c\",\"a.h\","
+            "\"a.o\"]}\n", Answer("targets a."));
+}
+
+TEST_F(QueryTest, Errors) {
+  EXPECT_EQ("", Answer(""));
+  EXPECT_EQ("{\"query\":\"inputs a.oo\","
+            "\"error\":\"unknown path 'a.oo', did you mean 'a.o'?\"}\n",
+            Answer("inputs a.oo\r"));
+  EXPECT_EQ("{\"query\":\"inputz a.o\","
+            "\"error\":\"unknown query 'inputz', did you mean 'inputs'?\"}\n",
+            Answer("inputz a.o"));
+  EXPECT_EQ("{\"query\":\"deps\",\"error\":\"expected a path\"}\n",
+            Answer("deps"));
+}
+
+}  // namespace
@@ -0,0 +1,577 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "remote.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <set>
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+/// Builds a message out of integers and strings.
+struct Writer {
+  void Int(uint32_t value) { data_.append((const char*)&value, 4); }
+  void Str(const string& value) {
+    Int(value.size());
+    data_.append(value);
+  }
+  string data_;
+};
+
+/// Reads back a message built by a Writer.  Once it runs past the end,
+/// ok() is false and everything reads as empty.
+struct Reader {
+  explicit Reader(const string& data) : data_(data), pos_(0), ok_(true) {}
+  uint32_t Int() {
+    uint32_t value = 0;
+    if (data_.size() - pos_ < 4) {
+      ok_ = false;
+      return 0;
+    }
+    memcpy(&value, data_.data() + pos_, 4);
+    pos_ += 4;
+    return value;
+  }
+  string Str() {
+    uint32_t len = Int();
+    if (!ok_ || data_.size() - pos_ < len) {
+      ok_ = false;
+      return string();
+    }
+    pos_ += len;
+    return data_.substr(pos_ - len, len);
+  }
+  bool ok() const { return ok_; }
+  void Fail() { ok_ = false; }
+
+  const string& data_;
+  size_t pos_;
+  bool ok_;
+};
+
+bool WriteAll(int fd, const string& data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t len = write(fd, data.data() + done, data.size() - done);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    done += len;
+  }
+  return true;
+}
+
+/// Read exactly \a len bytes from \a fd into \a data.
+bool ReadExactly(int fd, size_t len, string* data) {
+  data->resize(len);
+  size_t done = 0;
+  while (done < len) {
+    ssize_t ret = read(fd, &(*data)[done], len - done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    done += ret;
+  }
+  return true;
+}
+
+/// Read the secret a client starts its request with and compare it to
+/// \a secret, before anything else is read.
+bool CheckSecret(int connection, const string& secret) {
+  string len_data, sent;
+  if (!ReadExactly(connection, 4, &len_data))
+    return false;
+  Reader len_reader(len_data);
+  if (len_reader.Int() != secret.size() ||
+      !ReadExactly(connection, secret.size(), &sent))
+    return false;
+  // Look at every byte, so the time taken doesn't tell how many matched.
+  unsigned char diff = 0;
+  for (size_t i = 0; i < secret.size(); ++i)
+    diff |= sent[i] ^ secret[i];
+  return diff == 0;
+}
+
+/// Read from \a fd until the other end closes it.
+bool ReadAll(int fd, string* data) {
+  char buf[64 << 10];
+  for (;;) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0)
+      return false;
+    if (len == 0)
+      return true;
+    data->append(buf, len);
+  }
+}
+
+/// Connect to \a worker, "host:port".  Returns -1 with \a err set on
+/// failure.
+int Connect(const string& worker, string* err) {
+  string::size_type colon = worker.rfind(':');
+  if (colon == string::npos) {
+    *err = "expected host:port";
+    return -1;
+  }
+  string host = worker.substr(0, colon);
+  string port = worker.substr(colon + 1);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addrs;
+  int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+  if (ret != 0) {
+    *err = gai_strerror(ret);
+    return -1;
+  }
+  int fd = -1;
+  for (struct addrinfo* addr = addrs; addr; addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0)
+      break;
+    *err = strerror(errno);
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+/// Write \a contents to \a path, replacing it as a whole, with the
+/// permission bits \a mode.  Missing parent directories are created.
+bool WriteOutput(const string& path, uint32_t mode, const string& contents) {
+  RealDiskInterface disk_interface;
+  if (!disk_interface.MakeDirs(path))
+    return false;
+  string tmp_path = path + ".remote-tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode & 0777);
+  if (fd < 0)
+    return false;
+  bool ok = WriteAll(fd, contents);
+  if (close(fd) < 0)
+    ok = false;
+  if (ok && rename(tmp_path.c_str(), path.c_str()) < 0)
+    ok = false;
+  if (!ok)
+    unlink(tmp_path.c_str());
+  return ok;
+}
+
+/// Read \a path and its permission bits.  Returns false if it isn't a
+/// readable regular file.
+bool ReadInput(const string& path, uint32_t* mode, string* contents) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+    return false;
+  *mode = st.st_mode & 0777;
+  string err;
+  return ::ReadFile(path, contents, &err) == 0;
+}
+
+/// Run \a command with /bin/sh in \a dir (or the current directory if
+/// NULL), collecting what it prints in \a output.  Returns its exit
+/// status.
+int RunCommand(const string& command, const char* dir, string* output) {
+  int fds[2];
+  if (pipe(fds) < 0) {
+    *output = string("pipe: ") + strerror(errno) + "\n";
+    return 1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    *output = string("fork: ") + strerror(errno) + "\n";
+    return 1;
+  }
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_RDONLY);
+    if (devnull >= 0)
+      dup2(devnull, 0);
+    dup2(fds[1], 1);
+    dup2(fds[1], 2);
+    close(fds[0]);
+    close(fds[1]);
+    if (dir && chdir(dir) < 0)
+      _exit(1);
+    execl("/bin/sh", "/bin/sh", "-c", command.c_str(), (char*)NULL);
+    _exit(127);
+  }
+
+  close(fds[1]);
+  ReadAll(fds[0], output);
+  close(fds[0]);
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      return 1;
+  }
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return 128 + WTERMSIG(status);
+}
+
+/// Remove \a path and, if it is a directory, everything in it.
+void RemoveTree(const string& path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) < 0)
+    return;
+  if (S_ISDIR(st.st_mode)) {
+    if (DIR* dir = opendir(path.c_str())) {
+      while (struct dirent* entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") != 0 &&
+            strcmp(entry->d_name, "..") != 0)
+          RemoveTree(path + "/" + entry->d_name);
+      }
+      closedir(dir);
+    }
+    rmdir(path.c_str());
+  } else {
+    unlink(path.c_str());
+  }
+}
+
+/// Run the job a client sent on \a connection, in a fresh scratch
+/// directory, and send back the results.  Clients that don't know
+/// \a secret are hung up on.
+void ServeJob(int connection, const string& secret) {
+  if (!CheckSecret(connection, secret))
+    return;
+  string request;
+  if (!ReadAll(connection, &request))
+    return;
+  Reader in(request);
+  string command = in.Str();
+
+  string dir = GetTempDir() + "/ninja-worker-XXXXXX";
+  if (!mkdtemp(&dir[0]))
+    return;
+
+  Writer out;
+  string output;
+  int status = 0;
+  uint32_t input_count = in.Int();
+  for (uint32_t i = 0; i < input_count && in.ok(); ++i) {
+    string path = in.Str();
+    uint32_t mode = in.Int();
+    string contents = in.Str();
+    if (!in.ok())
+      break;
+    if (!RemoteJob::Portable(path) ||
+        !WriteOutput(dir + "/" + path, mode, contents)) {
+      output += "ninja worker: can't write input " + path + "\n";
+      status = 1;
+    }
+  }
+  vector<string> outputs;
+  uint32_t output_count = in.Int();
+  for (uint32_t i = 0; i < output_count && in.ok(); ++i)
+    outputs.push_back(in.Str());
+  if (!in.ok()) {
+    RemoveTree(dir);
+    return;
+  }
+
+  if (status == 0) {
+    // Commands may expect the directories of their outputs to exist.
+    RealDiskInterface disk_interface;
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      if (RemoteJob::Portable(outputs[i]))
+        disk_interface.MakeDirs(dir + "/" + outputs[i]);
+    }
+    status = RunCommand(command, dir.c_str(), &output);
+  }
+
+  out.Int(status);
+  out.Str(output);
+  out.Int(outputs.size());
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    uint32_t mode = 0;
+    string contents;
+    bool present = RemoteJob::Portable(outputs[i]) &&
+        ReadInput(dir + "/" + outputs[i], &mode, &contents);
+    out.Int(present);
+    out.Int(mode);
+    out.Str(contents);
+  }
+  RemoveTree(dir);
+  WriteAll(connection, out.data_);
+}
+
+}  // namespace
+
+// static
+bool RemoteJob::Portable(const string& path) {
+  if (path.empty() || path[0] == '/' || path[0] == '\\')
+    return false;
+  // A drive letter, as in "C:foo" or "C:\foo".
+  if (path.size() >= 2 && path[1] == ':' && isalpha((unsigned char)path[0]))
+    return false;
+  // No ".." anywhere, with either kind of slash.
+  size_t start = 0;
+  for (;;) {
+    size_t end = path.find_first_of("/\\", start);
+    if (path.compare(start, end - start, "..") == 0)
+      return false;
+    if (end == string::npos)
+      return true;
+    start = end + 1;
+  }
+}
+
+// static
+bool RemoteJob::FromEdge(Edge* edge, State* state,
+                         DiskInterface* disk_interface, RemoteJob* job) {
+  if (edge->rule().local() || edge->rule().generator())
+    return false;
+  for (vector<Node*>::iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i) {
+    if (!Portable((*i)->path()))
+      return false;
+    job->outputs.push_back((*i)->path());
+  }
+  vector<Node*> inputs(edge->inputs_.begin(),
+                       edge->inputs_.begin() + edge->order_only_end());
+  if (!edge->rule().depfile().empty()) {
+    string depfile = edge->EvaluateDepFile();
+    if (!Portable(depfile))
+      return false;
+    job->outputs.push_back(depfile);
+    // Deps from the deps log are complete, but those loaded from a
+    // depfile for the dirty scan may only be the ones that are built (see
+    // Edge::LoadDepFile()), so the depfile itself is read again.  Until a
+    // local run has told what the command reads, only the manifest's idea
+    // of its inputs is known, which usually lacks headers.
+    size_t known = inputs.size();
+    if (!edge->rule().deps().empty() && state->deps_log_) {
+      inputs.insert(inputs.end(),
+                    edge->inputs_.begin() + edge->order_only_end(),
+                    edge->inputs_.end());
+    } else {
+      string err;
+      if (!edge->ReadDepFile(state, disk_interface, &inputs, &err))
+        return false;
+    }
+    if (inputs.size() == known)
+      return false;
+  }
+  set<Node*> seen;
+  for (vector<Node*>::iterator i = inputs.begin(); i != inputs.end(); ++i) {
+    // A depfile usually repeats the explicit inputs.
+    if (!seen.insert(*i).second)
+      continue;
+    const string& path = (*i)->path();
+    if (Portable(path))
+      job->inputs.push_back(path);
+    else if (path[0] != '/')
+      return false;  // Outside the build directory.
+  }
+  job->command = edge->EvaluateCommand();
+  return true;
+}
+
+bool RemoteJob::Save(const string& path, string* err) const {
+  Writer out;
+  out.Str(worker);
+  out.Str(command);
+  out.Int(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i)
+    out.Str(inputs[i]);
+  out.Int(outputs.size());
+  for (size_t i = 0; i < outputs.size(); ++i)
+    out.Str(outputs[i]);
+
+  FILE* f = fopen(path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  bool ok = fwrite(out.data_.data(), 1, out.data_.size(), f) ==
+      out.data_.size();
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok)
+    *err = strerror(errno);
+  return ok;
+}
+
+bool RemoteJob::Load(const string& path, string* err) {
+  string data;
+  if (::ReadFile(path, &data, err) < 0)
+    return false;
+  Reader in(data);
+  worker = in.Str();
+  command = in.Str();
+  inputs.resize(in.Int());
+  for (size_t i = 0; i < inputs.size() && in.ok(); ++i)
+    inputs[i] = in.Str();
+  outputs.resize(in.Int());
+  for (size_t i = 0; i < outputs.size() && in.ok(); ++i)
+    outputs[i] = in.Str();
+  if (!in.ok()) {
+    *err = "truncated job file";
+    return false;
+  }
+  return true;
+}
+
+int RemoteJob::Run() const {
+  Writer request;
+  request.Str(secret);
+  request.Str(command);
+  vector<string> contents(inputs.size());
+  vector<uint32_t> modes(inputs.size());
+  vector<bool> present(inputs.size());
+  uint32_t input_count = 0;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    // Inputs that aren't files, e.g. directories, are left out.
+    present[i] = ReadInput(inputs[i], &modes[i], &contents[i]);
+    input_count += present[i];
+  }
+  request.Int(input_count);
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (!present[i])
+      continue;
+    request.Str(inputs[i]);
+    request.Int(modes[i]);
+    request.Str(contents[i]);
+    string().swap(contents[i]);
+  }
+  request.Int(outputs.size());
+  for (size_t i = 0; i < outputs.size(); ++i)
+    request.Str(outputs[i]);
+
+  string err;
+  string response;
+  int fd = Connect(worker, &err);
+  if (fd >= 0) {
+    if (!WriteAll(fd, request.data_) || shutdown(fd, SHUT_WR) < 0 ||
+        !ReadAll(fd, &response))
+      err = strerror(errno);
+    close(fd);
+  }
+
+  Reader in(response);
+  int status = in.Int();
+  string output = in.Str();
+  if (in.Int() != outputs.size())
+    in.Fail();
+  if (fd < 0 || !in.ok()) {
+    if (err.empty())
+      err = "incomplete response";
+    Warning("worker %s: %s; running locally", worker.c_str(), err.c_str());
+    output.clear();
+    status = RunCommand(command, NULL, &output);
+    fwrite(output.data(), 1, output.size(), stdout);
+    return status;
+  }
+
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    bool produced = in.Int() != 0;
+    uint32_t mode = in.Int();
+    string data = in.Str();
+    if (in.ok() && produced && !WriteOutput(outputs[i], mode, data)) {
+      output += "ninja: writing " + outputs[i] + ": " + strerror(errno) + "\n";
+      status = 1;
+    }
+  }
+  fwrite(output.data(), 1, output.size(), stdout);
+  return status;
+}
+
+bool RunRemoteWorker(const string& address, const string& port,
+                     const string& secret, string* err) {
+  if (secret.empty()) {
+    *err = "no secret to check clients against";
+    return false;
+  }
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo* addrs;
+  int ret = getaddrinfo(address.c_str(), port.c_str(), &hints, &addrs);
+  if (ret != 0) {
+    *err = gai_strerror(ret);
+    return false;
+  }
+  int fd = -1;
+  for (struct addrinfo* addr = addrs; addr; addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd < 0)
+      continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 && listen(fd, 64) == 0)
+      break;
+    *err = strerror(errno);
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+  if (fd < 0)
+    return false;
+
+  // Each job runs in a child of its own; nobody waits for them.
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  for (;;) {
+    int connection = accept(fd, NULL, NULL);
+    if (connection < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      *err = strerror(errno);
+      close(fd);
+      return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fd);
+      // The job's command must be waited for, unlike the job itself.
+      signal(SIGCHLD, SIG_DFL);
+      ServeJob(connection, secret);
+      _exit(0);
+    }
+    close(connection);
+  }
+}
@@ -0,0 +1,79 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_REMOTE_H_
+#define NINJA_REMOTE_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+struct DiskInterface;
+struct Edge;
+struct State;
+
+/// Running commands on other machines.
+///
+/// A worker, started with "ninja -t worker PORT", takes one job per TCP
+/// connection: the secret it shares with its clients, a command line,
+/// the paths and contents of the files it reads and the paths of the
+/// files it writes.  It recreates the inputs
+/// in a scratch directory, runs the command there and sends back its exit
+/// status, what it printed and the outputs it produced.
+///
+/// On the building side, each remote command runs as a local
+/// "ninja -t remote-run JOBFILE" process that ships the job to a worker
+/// and writes back the results, so that it can be waited for like any
+/// other command.
+struct RemoteJob {
+  /// The worker to run on, as "host:port".
+  string worker;
+  string command;
+  /// Relative paths of the files to send along.  Absolute paths (e.g. of
+  /// system headers) are expected to exist on the workers already.
+  vector<string> inputs;
+  vector<string> outputs;
+  /// What the worker expects clients to start with.  Not saved along
+  /// with the job.
+  string secret;
+
+  /// Return true if \a path can be recreated in a worker's scratch
+  /// directory, i.e. it is relative and no component of it is "..".
+  static bool Portable(const string& path);
+
+  /// Fill in \a job with what \a edge needs to run remotely, reading its
+  /// depfile, if any, through \a disk_interface.  Returns false if it
+  /// must run locally.
+  static bool FromEdge(Edge* edge, State* state, DiskInterface* disk_interface,
+                       RemoteJob* job);
+
+  /// Save the job to \a path, for a remote-run process to pick up.
+  bool Save(const string& path, string* err) const;
+  /// Load a job saved by Save().
+  bool Load(const string& path, string* err);
+
+  /// Run the job on its worker, writing back its outputs and printing
+  /// what its command printed.  If the worker can't be reached, the
+  /// command runs locally instead.  Returns the command's exit status.
+  int Run() const;
+};
+
+/// Run jobs sent to \a port of \a address by clients knowing \a secret,
+/// until killed.  Returns false with \a err set if it can't listen
+/// there.
+bool RunRemoteWorker(const string& address, const string& port,
+                     const string& secret, string* err);
+
+#endif  // NINJA_REMOTE_H_
@@ -0,0 +1,189 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "remote.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+#include "util.h"
+
+namespace {
+
+const char kJobFile[] = "RemoteTest-job";
+const char kOutFile[] = "RemoteTest-out";
+
+/// Wait until something listens on \a port of 127.0.0.1.
+bool WaitForListener(int port) {
+  for (int i = 0; i < 200; ++i) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bool connected = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(fd);
+    if (connected)
+      return true;
+    usleep(10000);
+  }
+  return false;
+}
+
+struct RemoteTest : public testing::Test {
+  virtual void TearDown() {
+    unlink(kJobFile);
+    unlink(kOutFile);
+  }
+};
+
+TEST_F(RemoteTest, Portable) {
+  EXPECT_TRUE(RemoteJob::Portable("foo.o"));
+  EXPECT_TRUE(RemoteJob::Portable("out/foo.o"));
+  EXPECT_TRUE(RemoteJob::Portable("..foo"));
+  EXPECT_FALSE(RemoteJob::Portable("/usr/include/stdio.h"));
+  EXPECT_FALSE(RemoteJob::Portable("../src/foo.c"));
+  EXPECT_FALSE(RemoteJob::Portable(".."));
+  EXPECT_FALSE(RemoteJob::Portable("a/../../etc/passwd"));
+  EXPECT_FALSE(RemoteJob::Portable("a/.."));
+  EXPECT_FALSE(RemoteJob::Portable("a\\..\\..\\b"));
+  EXPECT_FALSE(RemoteJob::Portable("C:\\Windows\\win.ini"));
+  EXPECT_FALSE(RemoteJob::Portable("c:foo"));
+  EXPECT_FALSE(RemoteJob::Portable("\\\\server\\share"));
+  EXPECT_FALSE(RemoteJob::Portable(""));
+  EXPECT_TRUE(RemoteJob::Portable("a/..b/c.."));
+}
+
+TEST_F(RemoteTest, FromEdge) {
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state,
+"rule cc\n"
+"  command = cc $in\n"
+"  depfile = $out.d\n"
+"rule gen\n"
+"  command = gen $out\n"
+"build gen.h: gen\n"
+"build out: cc in\n"));
+  VirtualFileSystem fs;
+  fs.Create("in", 1, "");
+  Edge* edge = state.GetNode("out")->in_edge();
+
+  // Not run yet, so what it reads isn't known.
+  string err;
+  ASSERT_TRUE(edge->RecomputeDirty(&state, &fs, &err)) << err;
+  RemoteJob job;
+  EXPECT_FALSE(RemoteJob::FromEdge(edge, &state, &fs, &job));
+
+  // With the output missing, the dirty scan only loads the built deps,
+  // here gen.h, but the job must carry the other headers too.
+  fs.Create("inc/h.h", 1, "");
+  fs.Create("out.d", 1, "out: in gen.h inc/h.h /usr/include/stdio.h\n");
+  state.Reset();
+  ASSERT_TRUE(edge->RecomputeDirty(&state, &fs, &err)) << err;
+  job = RemoteJob();
+  ASSERT_TRUE(RemoteJob::FromEdge(edge, &state, &fs, &job));
+  ASSERT_EQ(3u, job.inputs.size());
+  EXPECT_EQ("in", job.inputs[0]);
+  EXPECT_EQ("gen.h", job.inputs[1]);
+  EXPECT_EQ("inc/h.h", job.inputs[2]);
+  ASSERT_EQ(2u, job.outputs.size());
+  EXPECT_EQ("out.d", job.outputs[1]);
+  EXPECT_EQ("cc in", job.command);
+}
+
+TEST_F(RemoteTest, SaveLoad) {
+  RemoteJob job;
+  job.worker = "build1:8000";
+  job.command = "cc -c foo.c -o foo.o";
+  job.inputs.push_back("foo.c");
+  job.inputs.push_back("foo.h");
+  job.outputs.push_back("foo.o");
+  string err;
+  ASSERT_TRUE(job.Save(kJobFile, &err));
+  ASSERT_EQ("", err);
+
+  RemoteJob loaded;
+  ASSERT_TRUE(loaded.Load(kJobFile, &err));
+  EXPECT_EQ(job.worker, loaded.worker);
+  EXPECT_EQ(job.command, loaded.command);
+  EXPECT_EQ(job.inputs, loaded.inputs);
+  EXPECT_EQ(job.outputs, loaded.outputs);
+
+  // A truncated job is rejected.
+  FILE* f = fopen(kJobFile, "wb");
+  fwrite("\x10\0\0\0build", 1, 9, f);
+  fclose(f);
+  EXPECT_FALSE(loaded.Load(kJobFile, &err));
+}
+
+TEST_F(RemoteTest, UnreachableWorker) {
+  // Without a worker the command runs locally.
+  RemoteJob job;
+  job.worker = "localhost:1";
+  job.command = string("echo hi > ") + kOutFile + "; exit 3";
+  job.outputs.push_back(kOutFile);
+  EXPECT_EQ(3, job.Run());
+
+  string contents, err;
+  EXPECT_EQ(0, ReadFile(kOutFile, &contents, &err));
+  EXPECT_EQ("hi\n", contents);
+}
+
+TEST_F(RemoteTest, Secret) {
+  pid_t worker = fork();
+  ASSERT_GE(worker, 0);
+  if (worker == 0) {
+    string err;
+    RunRemoteWorker("127.0.0.1", "37519", "sesame", &err);
+    _exit(1);
+  }
+  ASSERT_TRUE(WaitForListener(37519));
+
+  // The command tells where it ran.
+  char cwd[1024];
+  ASSERT_TRUE(getcwd(cwd, sizeof(cwd)));
+  RemoteJob job;
+  job.worker = "127.0.0.1:37519";
+  job.command = string("pwd > ") + kOutFile;
+  job.outputs.push_back(kOutFile);
+  string contents, err;
+
+  // Without the secret the worker hangs up, and the command runs locally.
+  job.secret = "open";
+  EXPECT_EQ(0, job.Run());
+  EXPECT_EQ(0, ReadFile(kOutFile, &contents, &err));
+  EXPECT_EQ(string(cwd) + "\n", contents);
+
+  job.secret = "sesame";
+  EXPECT_EQ(0, job.Run());
+  contents.clear();
+  EXPECT_EQ(0, ReadFile(kOutFile, &contents, &err));
+  EXPECT_EQ(0u, contents.find(GetTempDir() + "/ninja-worker-"));
+
+  kill(worker, SIGTERM);
+  waitpid(worker, NULL, 0);
+}
+
+}  // namespace
@@ -0,0 +1,227 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "serve.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace {
+
+/// Fill \a addr with the address of the socket at \a path.
+bool MakeAddress(const string& path, sockaddr_un* addr, string* err) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr->sun_path)) {
+    *err = "socket path too long: " + path;
+    return false;
+  }
+  strcpy(addr->sun_path, path.c_str());
+  return true;
+}
+
+/// Connect to the socket at \a path; returns the connection or -1.
+int Connect(const string& path, string* err) {
+  sockaddr_un addr;
+  if (!MakeAddress(path, &addr, err))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    *err = strerror(errno);
+    return -1;
+  }
+  if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+    *err = strerror(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool WriteAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += written;
+    len -= written;
+  }
+  return true;
+}
+
+}  // namespace
+
+ServeSocket::~ServeSocket() {
+  if (fd_ < 0)
+    return;
+  close(fd_);
+  unlink(path_.c_str());
+}
+
+bool ServeSocket::Listen(const string& path, string* err) {
+  sockaddr_un addr;
+  if (!MakeAddress(path, &addr, err))
+    return false;
+
+  string connect_err;
+  int existing = Connect(path, &connect_err);
+  if (existing >= 0) {
+    close(existing);
+    *err = "a server is already listening at " + path;
+    return false;
+  }
+  // Nobody answered, so whatever is there is left over.
+  unlink(path.c_str());
+
+  fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd_ < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (bind(fd_, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd_, 8) < 0) {
+    *err = strerror(errno);
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  path_ = path;
+  return true;
+}
+
+int ServeSocket::Accept(vector<string>* args, string* err) {
+  for (;;) {
+    int connection = accept(fd_, NULL, NULL);
+    if (connection < 0) {
+      if (errno == EINTR)
+        continue;
+      *err = strerror(errno);
+      return -1;
+    }
+    if (ReadRequest(connection, request_timeout_millis_, args))
+      return connection;
+    // A client that went away or sent garbage gets no answer.
+    close(connection);
+  }
+}
+
+// static
+bool ServeSocket::ReadRequest(int connection, int timeout_millis,
+                              vector<string>* args) {
+  // The server does nothing else while it reads, so a client that
+  // connects and then sends nothing mustn't be able to wedge it.
+  int64_t deadline = GetTimeMillis() + timeout_millis;
+  string request;
+  char buf[4 << 10];
+  for (;;) {
+    int64_t left = deadline - GetTimeMillis();
+    if (left <= 0)
+      return false;
+    pollfd pfd = { connection, POLLIN, 0 };
+    int ret = poll(&pfd, 1, (int)left);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    ssize_t len = read(connection, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0)
+      return false;
+    if (len == 0)
+      break;
+    request.append(buf, len);
+  }
+
+  args->clear();
+  size_t start = 0;
+  for (size_t end; (end = request.find('\0', start)) != string::npos;
+       start = end + 1) {
+    args->push_back(request.substr(start, end - start));
+  }
+  return start == request.size();
+}
+
+// static
+void ServeSocket::Finish(int connection, int status) {
+  char byte = (char)status;
+  WriteAll(connection, &byte, 1);
+  close(connection);
+}
+
+int SendServeRequest(const string& path, const vector<string>& args,
+                     FILE* out, string* err) {
+  int fd = Connect(path, err);
+  if (fd < 0)
+    return -1;
+
+  string request;
+  for (vector<string>::const_iterator i = args.begin(); i != args.end(); ++i)
+    request.append(i->c_str(), i->size() + 1);
+  if (!WriteAll(fd, request.data(), request.size()) ||
+      shutdown(fd, SHUT_WR) < 0) {
+    *err = strerror(errno);
+    close(fd);
+    return -1;
+  }
+
+  // The last byte is the exit status, so always hold one back.
+  int pending = -1;
+  char buf[4 << 10];
+  for (;;) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      break;
+    if (pending >= 0)
+      fputc(pending, out);
+    fwrite(buf, 1, len - 1, out);
+    pending = (unsigned char)buf[len - 1];
+  }
+  close(fd);
+  fflush(out);
+
+  if (pending < 0) {
+    *err = "server closed the connection without a result";
+    return -1;
+  }
+  return pending;
+}
+
+void ManifestFiles::Record(const vector<string>& files, TimeStamp now,
+                           DiskInterface* disk_interface) {
+  paths_ = files;
+  mtimes_.clear();
+  for (vector<string>::const_iterator i = files.begin(); i != files.end(); ++i)
+    mtimes_.push_back(disk_interface->Stat(*i));
+  recorded_time_ = now;
+}
+
+bool ManifestFiles::Changed(DiskInterface* disk_interface) const {
+  for (size_t i = 0; i < paths_.size(); ++i) {
+    if (mtimes_[i] <= 0 || mtimes_[i] >= recorded_time_ ||
+        disk_interface->Stat(paths_[i]) != mtimes_[i])
+      return true;
+  }
+  return false;
+}
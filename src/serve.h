@@ -0,0 +1,91 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SERVE_H_
+#define NINJA_SERVE_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "disk_interface.h"
+
+/// The wire protocol of "ninja -t serve", which keeps a loaded build
+/// graph in memory and runs builds for clients connecting to a Unix
+/// domain socket.
+///
+/// A client sends its arguments, each terminated by a NUL byte, and
+/// shuts down its side of the connection.  The server sends back the
+/// output of the build followed by a single byte holding its exit status,
+/// then closes the connection.
+struct ServeSocket {
+  ServeSocket() : fd_(-1), request_timeout_millis_(5000) {}
+  ~ServeSocket();
+
+  /// Start listening at \a path.  Fails if another server is already
+  /// listening there; a socket left behind by one that died is replaced.
+  bool Listen(const string& path, string* err);
+
+  /// Wait for the next client and read its arguments.  Returns the
+  /// connection to write the output to, or -1 on error.  Clients that
+  /// don't send a well-formed request, or don't finish sending it within
+  /// the request timeout, are dropped.
+  int Accept(vector<string>* args, string* err);
+
+  /// How long a client may take to send its request.
+  void set_request_timeout(int millis) { request_timeout_millis_ = millis; }
+
+  /// Send \a status to the client on \a connection and close it.
+  static void Finish(int connection, int status);
+
+ private:
+  /// Read the arguments a client sent on \a connection, giving up after
+  /// \a timeout_millis.
+  static bool ReadRequest(int connection, int timeout_millis,
+                          vector<string>* args);
+
+  int fd_;
+  string path_;
+  int request_timeout_millis_;
+};
+
+/// Send \a args to the server at \a path, copying the output of the
+/// build to \a out.  Returns the build's exit status, or -1 with \a err
+/// set if no server could be reached.
+int SendServeRequest(const string& path, const vector<string>& args,
+                     FILE* out, string* err);
+
+/// The modification times of the manifest files a State was loaded
+/// from, to tell when it has to be loaded again.
+struct ManifestFiles {
+  ManifestFiles() : recorded_time_(0) {}
+
+  /// Remember the current mtimes of \a files, \a now being the current
+  /// time.
+  void Record(const vector<string>& files, TimeStamp now,
+              DiskInterface* disk_interface);
+  /// Return true if any of the files changed since Record().  A file
+  /// modified in the second it was recorded may have been modified again
+  /// without its mtime showing it, so it always counts as changed.
+  bool Changed(DiskInterface* disk_interface) const;
+
+ private:
+  vector<string> paths_;
+  vector<TimeStamp> mtimes_;
+  TimeStamp recorded_time_;
+};
+
+#endif  // NINJA_SERVE_H_
@@ -0,0 +1,177 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "serve.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "threads.h"
+
+namespace {
+
+const char kSocketPath[] = "serve_test_socket";
+
+/// Sends one request from another thread, as a client process would.
+struct ClientThread : public Thread {
+  explicit ClientThread(const vector<string>& args)
+      : args_(args), status_(-2) {}
+
+  virtual void Run() {
+    FILE* out = tmpfile();
+    status_ = SendServeRequest(kSocketPath, args_, out, &err_);
+    rewind(out);
+    char buf[256];
+    size_t len = fread(buf, 1, sizeof(buf), out);
+    output_.assign(buf, len);
+    fclose(out);
+  }
+
+  vector<string> args_;
+  int status_;
+  string output_;
+  string err_;
+};
+
+struct ServeTest : public testing::Test {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-ServeTest");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  ScopedTempDir temp_dir_;
+};
+
+TEST_F(ServeTest, Request) {
+  ServeSocket socket;
+  string err;
+  ASSERT_TRUE(socket.Listen(kSocketPath, &err)) << err;
+
+  vector<string> args;
+  args.push_back("out/a.o");
+  args.push_back("with space");
+  args.push_back("");
+  ClientThread client(args);
+  ASSERT_TRUE(client.Start());
+
+  vector<string> received;
+  int connection = socket.Accept(&received, &err);
+  ASSERT_GE(connection, 0) << err;
+  EXPECT_EQ(args, received);
+  const char kOutput[] = "ninja: build stopped\n";
+  ASSERT_EQ((ssize_t)strlen(kOutput),
+            write(connection, kOutput, strlen(kOutput)));
+  ServeSocket::Finish(connection, 3);
+  client.Join();
+
+  EXPECT_EQ(3, client.status_) << client.err_;
+  EXPECT_EQ(kOutput, client.output_);
+}
+
+TEST_F(ServeTest, NoArgsNoOutput) {
+  ServeSocket socket;
+  string err;
+  ASSERT_TRUE(socket.Listen(kSocketPath, &err)) << err;
+
+  ClientThread client((vector<string>()));
+  ASSERT_TRUE(client.Start());
+  vector<string> received(1);
+  int connection = socket.Accept(&received, &err);
+  ASSERT_GE(connection, 0) << err;
+  EXPECT_TRUE(received.empty());
+  ServeSocket::Finish(connection, 0);
+  client.Join();
+
+  EXPECT_EQ(0, client.status_) << client.err_;
+  EXPECT_EQ("", client.output_);
+}
+
+TEST_F(ServeTest, StalledClient) {
+  ServeSocket socket;
+  string err;
+  ASSERT_TRUE(socket.Listen(kSocketPath, &err)) << err;
+  socket.set_request_timeout(100);
+
+  // A client that connects but never finishes its request...
+  int stalled = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_GE(stalled, 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, kSocketPath);
+  ASSERT_EQ(0, connect(stalled, (sockaddr*)&addr, sizeof(addr)));
+  ASSERT_EQ(2, write(stalled, "a", 2));
+
+  // ...is dropped rather than keeping the next one waiting.
+  ClientThread client(vector<string>(1, "b"));
+  ASSERT_TRUE(client.Start());
+  vector<string> received;
+  int connection = socket.Accept(&received, &err);
+  ASSERT_GE(connection, 0) << err;
+  EXPECT_EQ(vector<string>(1, "b"), received);
+  ServeSocket::Finish(connection, 0);
+  client.Join();
+  EXPECT_EQ(0, client.status_) << client.err_;
+
+  char byte;
+  EXPECT_EQ(0, read(stalled, &byte, 1));
+  close(stalled);
+}
+
+TEST_F(ServeTest, NoServer) {
+  string err;
+  EXPECT_EQ(-1, SendServeRequest(kSocketPath, vector<string>(), stdout, &err));
+  EXPECT_NE("", err);
+}
+
+TEST_F(ServeTest, OneServerPerSocket) {
+  string err;
+  {
+    ServeSocket first;
+    ASSERT_TRUE(first.Listen(kSocketPath, &err)) << err;
+    ServeSocket second;
+    EXPECT_FALSE(second.Listen(kSocketPath, &err));
+    EXPECT_NE("", err);
+  }
+  // Once the first one is gone, the path can be reused.
+  ServeSocket third;
+  EXPECT_TRUE(third.Listen(kSocketPath, &err)) << err;
+}
+
+TEST(ManifestFiles, Changed) {
+  VirtualFileSystem fs;
+  fs.Create("build.ninja", 1, "");
+  fs.Create("sub.ninja", 1, "");
+  vector<string> files;
+  files.push_back("build.ninja");
+  files.push_back("sub.ninja");
+
+  ManifestFiles manifest_files;
+  manifest_files.Record(files, 5, &fs);
+  EXPECT_FALSE(manifest_files.Changed(&fs));
+  fs.Create("sub.ninja", 6, "");
+  EXPECT_TRUE(manifest_files.Changed(&fs));
+
+  // Written in the same second it was recorded, so it may still change.
+  manifest_files.Record(files, 6, &fs);
+  EXPECT_TRUE(manifest_files.Changed(&fs));
+}
+
+}  // namespace
@@ -0,0 +1,153 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "session.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <set>
+
+#include "parsers.h"
+#include "util.h"
+
+namespace {
+
+/// Reads manifests through a DiskInterface.
+struct DiskFileReader : public ManifestParser::FileReader {
+  explicit DiskFileReader(DiskInterface* disk_interface)
+      : disk_interface_(disk_interface) {}
+  virtual bool ReadFile(const string& path, string* content, string* err) {
+    // DiskInterface::ReadFile() takes a missing file to be empty.
+    if (disk_interface_->Stat(path) == 0) {
+      *err = strerror(ENOENT);
+      return false;
+    }
+    disk_interface_->ReadFileInto(path, content, err);
+    return err->empty();
+  }
+  DiskInterface* disk_interface_;
+};
+
+/// Add the out-of-date nodes \a node depends on, then \a node itself if
+/// it is, to \a dirty.
+void CollectDirty(Node* node, set<Node*>* seen, vector<Node*>* dirty) {
+  if (!seen->insert(node).second)
+    return;
+  // Nothing behind an edge that is ready gets built, order-only inputs
+  // included.
+  Edge* edge = node->in_edge();
+  if (edge && !edge->outputs_ready()) {
+    for (vector<Node*>::iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      CollectDirty(*i, seen, dirty);
+    }
+  }
+  if (node->dirty())
+    dirty->push_back(node);
+}
+
+}  // namespace
+
+Session::Session(const BuildConfig& config)
+    : config_(config), disk_interface_(&real_disk_interface_),
+      loaded_(false) {}
+
+bool Session::Load(const string& manifest, string* err) {
+  if (loaded_) {
+    *err = "already loaded";
+    return false;
+  }
+  loaded_ = true;
+  DiskFileReader file_reader(disk_interface_);
+  ManifestParser parser(&state_, &file_reader);
+  if (!parser.Load(manifest, err))
+    return false;
+
+  string log_dir = state_.bindings_.LookupVariable("builddir");
+  if (!log_dir.empty()) {
+    if (MakeDir(log_dir) < 0 && errno != EEXIST) {
+      *err = "creating build directory " + log_dir + ": " + strerror(errno);
+      return false;
+    }
+    log_dir += "/";
+  }
+
+  build_log_.SetConfig(&config_);
+  state_.build_log_ = &build_log_;
+  string log_path = log_dir + ".ninja_log";
+  if (!build_log_.Load(log_path, err)) {
+    *err = "loading build log " + log_path + ": " + *err;
+    return false;
+  }
+  StateBuildLogUser user(&state_, disk_interface_);
+  if (!build_log_.OpenForWrite(log_path, err, &user)) {
+    *err = "opening build log: " + *err;
+    return false;
+  }
+
+  state_.deps_log_ = &deps_log_;
+  string deps_path = log_dir + ".ninja_deps";
+  if (!deps_log_.Load(deps_path, &state_, err)) {
+    *err = "loading deps log " + deps_path + ": " + *err;
+    return false;
+  }
+  if (!deps_log_.OpenForWrite(deps_path, err)) {
+    *err = "opening deps log: " + *err;
+    return false;
+  }
+  return true;
+}
+
+void Session::Rescan() {
+  state_.Reset();
+  real_disk_interface_.ClearCache();
+}
+
+bool Session::DirtyNodes(const vector<Node*>& targets, vector<Node*>* dirty,
+                         string* err) {
+  Rescan();
+  set<Node*> seen;
+  for (vector<Node*>::const_iterator i = targets.begin(); i != targets.end();
+       ++i) {
+    Node* node = *i;
+    node->StatIfNecessary(disk_interface_);
+    if (Edge* edge = node->in_edge()) {
+      if (!edge->scanned() &&
+          !edge->RecomputeDirty(&state_, disk_interface_, err))
+        return false;
+    }
+    CollectDirty(node, &seen, dirty);
+  }
+  return true;
+}
+
+bool Session::Build(const vector<Node*>& targets, CommandRunner* runner,
+                    BuildObserver* observer, string* err) {
+  Rescan();
+  Builder builder(&state_, config_);
+  builder.disk_interface_ = disk_interface_;
+  if (runner)
+    builder.command_runner_ = runner;
+  builder.observer_ = observer;
+  for (vector<Node*>::const_iterator i = targets.begin(); i != targets.end();
+       ++i) {
+    // False with no error is a target that is already up to date.
+    if (!builder.AddTarget(*i, err) && !err->empty())
+      return false;
+  }
+  if (builder.AlreadyUpToDate())
+    return true;
+  return builder.Build(err);
+}
@@ -0,0 +1,84 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SESSION_H_
+#define NINJA_SESSION_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "build.h"
+#include "build_log.h"
+#include "deps_log.h"
+#include "disk_interface.h"
+#include "state.h"
+
+/// Ninja as a library: a manifest and its logs, loaded once and then kept
+/// for any number of queries and builds within the calling program.
+///
+/// The manifest is only read by Load().  Everything else starts from a
+/// fresh look at the disk, so files changed between calls are noticed.
+/// Nodes and edges handed out stay valid for the life of the session.
+struct Session {
+  explicit Session(const BuildConfig& config);
+
+  /// Parse \a manifest, then load the build and deps logs it keeps and
+  /// open them for writing.  May only be called once; later calls fail.
+  bool Load(const string& manifest, string* err);
+
+  /// The loaded graph, for queries beyond the ones below.
+  State* state() { return &state_; }
+
+  /// The node for \a path, or NULL if the manifest doesn't mention it.
+  Node* LookupNode(const string& path) { return state_.LookupNode(path); }
+  /// What a build without targets would build: the manifest's defaults,
+  /// or else its roots.
+  vector<Node*> DefaultTargets(string* err) {
+    return state_.DefaultNodes(err);
+  }
+
+  /// Fill \a dirty with the nodes \a targets depend on, themselves
+  /// included, that are out of date, inputs before what is built from
+  /// them.  Returns false on error.
+  bool DirtyNodes(const vector<Node*>& targets, vector<Node*>* dirty,
+                  string* err);
+
+  /// Bring \a targets up to date.  Commands run on \a runner, or on the
+  /// runner \a config asks for if NULL, and \a observer, if not NULL, is
+  /// told about them.  Returns false on error.
+  bool Build(const vector<Node*>& targets, CommandRunner* runner,
+             BuildObserver* observer, string* err);
+
+  /// Read and stat files through \a disk_interface rather than the real
+  /// disk.  The logs are always real files.
+  void set_disk_interface(DiskInterface* disk_interface) {
+    disk_interface_ = disk_interface;
+  }
+
+ private:
+  /// Forget what the last call learned about the disk.
+  void Rescan();
+
+  BuildConfig config_;
+  State state_;
+  BuildLog build_log_;
+  DepsLog deps_log_;
+  RealDiskInterface real_disk_interface_;
+  DiskInterface* disk_interface_;
+  /// Whether Load() was called.
+  bool loaded_;
+};
+
+#endif  // NINJA_SESSION_H_
@@ -0,0 +1,238 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "session.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "test.h"
+
+namespace {
+
+const char kManifest[] =
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build mid: cat in\n"
+"build out: cat mid\n"
+"build other: cat in\n"
+"rule true\n"
+"  command = true\n"
+"build stamp: true\n"
+"default out\n";
+
+/// Runs one command at a time by creating its outputs in a
+/// VirtualFileSystem.
+struct FakeCommandRunner : public CommandRunner {
+  explicit FakeCommandRunner(VirtualFileSystem* fs)
+      : fs_(fs), last_command_(NULL) {}
+
+  virtual bool CanRunMore() { return last_command_ == NULL; }
+  virtual bool StartCommand(Edge* edge) {
+    commands_ran_.push_back(edge->EvaluateCommand());
+    for (vector<Node*>::iterator out = edge->outputs_.begin();
+         out != edge->outputs_.end(); ++out) {
+      fs_->Create((*out)->path(), fs_->now_, "");
+    }
+    last_command_ = edge;
+    return true;
+  }
+  virtual Edge* WaitForCommand(bool* success, string* output,
+                               ResourceUsage* usage) {
+    Edge* edge = last_command_;
+    last_command_ = NULL;
+    *success = !edge || edge->EvaluateCommand() != fail_;
+    return edge;
+  }
+
+  VirtualFileSystem* fs_;
+  Edge* last_command_;
+  vector<string> commands_ran_;
+  /// A command that fails, if any.
+  string fail_;
+};
+
+/// Records what a build tells its observer.
+struct RecordingObserver : public BuildObserver {
+  RecordingObserver() : total_(0) {}
+  virtual void PlanHasTotalEdges(int total) { total_ = total; }
+  virtual void EdgeStarted(Edge* edge) {
+    events_.push_back("start " + edge->outputs_[0]->path());
+  }
+  virtual void EdgeFinished(Edge* edge, bool success, const string& output) {
+    events_.push_back((success ? "done " : "failed ") +
+                      edge->outputs_[0]->path());
+  }
+  int total_;
+  vector<string> events_;
+};
+
+struct SessionTest : public testing::Test {
+  SessionTest() : session_(QuietBuildConfig()) {}
+
+  virtual void SetUp() {
+    // The logs are real files.
+    temp_dir_.CreateAndEnter("SessionTest");
+    session_.set_disk_interface(&fs_);
+    fs_.Create("build.ninja", 1, kManifest);
+    fs_.Create("in", 1, "");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  /// The paths of the nodes session_.DirtyNodes() finds for \a target.
+  string Dirty(const string& target) {
+    vector<Node*> targets(1, session_.LookupNode(target));
+    vector<Node*> dirty;
+    string err;
+    EXPECT_TRUE(session_.DirtyNodes(targets, &dirty, &err));
+    EXPECT_EQ("", err);
+    string paths;
+    for (size_t i = 0; i < dirty.size(); ++i)
+      paths += (i ? " " : "") + dirty[i]->path();
+    return paths;
+  }
+
+  ScopedTempDir temp_dir_;
+  VirtualFileSystem fs_;
+  Session session_;
+};
+
+TEST_F(SessionTest, LoadAndLookUp) {
+  string err;
+  ASSERT_TRUE(session_.Load("build.ninja", &err));
+  ASSERT_EQ("", err);
+
+  Node* mid = session_.LookupNode("mid");
+  ASSERT_TRUE(mid);
+  ASSERT_TRUE(mid->in_edge());
+  EXPECT_EQ("cat", mid->in_edge()->rule().name());
+  EXPECT_FALSE(session_.LookupNode("missing"));
+
+  vector<Node*> defaults = session_.DefaultTargets(&err);
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, defaults.size());
+  EXPECT_EQ("out", defaults[0]->path());
+
+  EXPECT_FALSE(session_.Load("build.ninja", &err));
+  EXPECT_EQ("already loaded", err);
+}
+
+TEST_F(SessionTest, MissingManifest) {
+  string err;
+  EXPECT_FALSE(session_.Load("missing.ninja", &err));
+  EXPECT_EQ("loading 'missing.ninja': No such file or directory", err);
+}
+
+TEST_F(SessionTest, DirtyNodes) {
+  string err;
+  ASSERT_TRUE(session_.Load("build.ninja", &err));
+
+  EXPECT_EQ("mid out", Dirty("out"));
+  EXPECT_EQ("other", Dirty("other"));
+
+  // Each call looks at the disk again.
+  fs_.Create("mid", 2, "");
+  EXPECT_EQ("out", Dirty("out"));
+}
+
+TEST_F(SessionTest, Build) {
+  string err;
+  ASSERT_TRUE(session_.Load("build.ninja", &err));
+
+  FakeCommandRunner runner(&fs_);
+  RecordingObserver observer;
+  fs_.now_ = 2;
+  vector<Node*> targets(1, session_.LookupNode("out"));
+  EXPECT_TRUE(session_.Build(targets, &runner, &observer, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, runner.commands_ran_.size());
+  EXPECT_EQ("cat in > mid", runner.commands_ran_[0]);
+  EXPECT_EQ(2, observer.total_);
+  ASSERT_EQ(4u, observer.events_.size());
+  EXPECT_EQ("start mid", observer.events_[0]);
+  EXPECT_EQ("done out", observer.events_[3]);
+
+  // The session notices what the build did.
+  EXPECT_EQ("", Dirty("out"));
+  runner.commands_ran_.clear();
+  EXPECT_TRUE(session_.Build(targets, &runner, NULL, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0u, runner.commands_ran_.size());
+
+  // An input changing makes everything built from it dirty again.
+  fs_.Create("in", 3, "");
+  EXPECT_EQ("mid out", Dirty("out"));
+}
+
+TEST_F(SessionTest, BuildAfterFailure) {
+  fs_.Create("build.ninja", 1,
+"pool link\n"
+"  depth = 1\n"
+"rule cat\n"
+"  command = cat $in > $out\n"
+"rule fail\n"
+"  command = fail\n"
+"build mid: cat in\n"
+"build bad: fail mid\n"
+"build p1: cat in\n"
+"  pool = link\n"
+"build p2: cat in\n"
+"  pool = link\n"
+"build all: phony bad p1 p2\n");
+  string err;
+  ASSERT_TRUE(session_.Load("build.ninja", &err));
+
+  // The first build fails with one pooled edge scheduled and another
+  // waiting for the pool; the next must find the pool free again.
+  FakeCommandRunner runner(&fs_);
+  runner.fail_ = "fail";
+  fs_.now_ = 2;
+  vector<Node*> targets(1, session_.LookupNode("all"));
+  EXPECT_FALSE(session_.Build(targets, &runner, NULL, &err));
+  EXPECT_EQ("subcommand failed", err);
+  ASSERT_EQ(2u, runner.commands_ran_.size());
+
+  err.clear();
+  runner.commands_ran_.clear();
+  targets[0] = session_.LookupNode("p2");
+  EXPECT_TRUE(session_.Build(targets, &runner, NULL, &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(1u, runner.commands_ran_.size());
+}
+
+#ifndef _WIN32
+TEST_F(SessionTest, ManyBuilds) {
+  string err;
+  ASSERT_TRUE(session_.Load("build.ninja", &err));
+
+  // Each build makes a runner of its own, with descriptors for watching
+  // commands, which must go again with it.  Nothing creates the stamp,
+  // so every build runs the command.
+  int before = dup(0);
+  close(before);
+  vector<Node*> targets(1, session_.LookupNode("stamp"));
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_TRUE(session_.Build(targets, NULL, NULL, &err));
+    ASSERT_EQ("", err);
+  }
+  int after = dup(0);
+  close(after);
+  EXPECT_EQ(before, after);
+}
+#endif
+
+}  // namespace
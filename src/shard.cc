@@ -0,0 +1,164 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "shard.h"
+
+#include <algorithm>
+
+#include "graph.h"
+#include "profile.h"
+#include "state.h"
+
+namespace {
+
+struct Unit {
+  Edge* edge;
+  /// The non-phony commands building edge's outputs takes, edge included.
+  vector<Edge*> closure;
+  int64_t millis;
+};
+
+bool CostlierFirst(const Unit* a, const Unit* b) {
+  return a->millis > b->millis;
+}
+
+}  // namespace
+
+Sharder::Sharder(State* state, BuildLog* log)
+    : state_(state), millis_(state->edges_.size(), -1) {
+  int64_t total = 0;
+  int known = 0;
+  for (vector<Edge*>::iterator i = state->edges_.begin();
+       i != state->edges_.end(); ++i) {
+    if ((*i)->is_phony()) {
+      millis_[(*i)->index_] = 0;
+      continue;
+    }
+    int millis = log ? Profile::Duration(*i, log) : -1;
+    if (millis >= 0) {
+      millis_[(*i)->index_] = millis;
+      total += millis;
+      ++known;
+    }
+  }
+  // Nothing logged means all commands cost the same.
+  int64_t average = known ? max(total / known, (int64_t)1) : 1;
+  for (vector<int64_t>::iterator i = millis_.begin(); i != millis_.end(); ++i) {
+    if (*i < 0)
+      *i = average;
+  }
+}
+
+void Sharder::AddClosure(Edge* edge, int mark, vector<int>* marks,
+                         vector<Edge*>* closure) {
+  vector<Edge*> stack(1, edge);
+  (*marks)[edge->index_] = mark;
+  while (!stack.empty()) {
+    Edge* e = stack.back();
+    stack.pop_back();
+    if (!e->is_phony())
+      closure->push_back(e);
+    for (vector<Node*>::iterator i = e->inputs_.begin(); i != e->inputs_.end();
+         ++i) {
+      Edge* in = (*i)->in_edge();
+      if (in && (*marks)[in->index_] != mark) {
+        (*marks)[in->index_] = mark;
+        stack.push_back(in);
+      }
+    }
+  }
+}
+
+vector<Sharder::Shard> Sharder::Split(const vector<Node*>& targets,
+                                      int count) {
+  size_t edge_count = state_->edges_.size();
+
+  // Find the units, looking through phony edges.
+  vector<Unit> units;
+  vector<char> visited(edge_count, false);
+  vector<Node*> stack(targets.rbegin(), targets.rend());
+  while (!stack.empty()) {
+    Node* node = stack.back();
+    stack.pop_back();
+    Edge* edge = node->in_edge();
+    if (!edge || visited[edge->index_])
+      continue;
+    visited[edge->index_] = true;
+    if (edge->is_phony()) {
+      for (vector<Node*>::reverse_iterator i = edge->inputs_.rbegin();
+           i != edge->inputs_.rend(); ++i) {
+        stack.push_back(*i);
+      }
+    } else {
+      Unit unit;
+      unit.edge = edge;
+      unit.millis = 0;
+      units.push_back(unit);
+    }
+  }
+
+  // Drop the units others need anyway.
+  vector<char> needed(edge_count, false);
+  vector<int> marks(edge_count, -1);
+  for (vector<Unit>::iterator u = units.begin(); u != units.end(); ++u) {
+    AddClosure(u->edge, u - units.begin(), &marks, &u->closure);
+    for (vector<Edge*>::iterator e = u->closure.begin() + 1;
+         e != u->closure.end(); ++e) {
+      needed[(*e)->index_] = true;
+    }
+  }
+  vector<Unit*> placed;
+  for (vector<Unit>::iterator u = units.begin(); u != units.end(); ++u) {
+    if (needed[u->edge->index_])
+      continue;
+    for (vector<Edge*>::iterator e = u->closure.begin(); e != u->closure.end();
+         ++e) {
+      u->millis += millis_[(*e)->index_];
+    }
+    placed.push_back(&*u);
+  }
+  stable_sort(placed.begin(), placed.end(), CostlierFirst);
+
+  vector<Shard> shards(count);
+  vector<vector<char> > has(count, vector<char>(edge_count, false));
+  for (vector<Unit*>::iterator u = placed.begin(); u != placed.end(); ++u) {
+    int best = 0;
+    int64_t best_millis = 0;
+    for (int s = 0; s < count; ++s) {
+      int64_t millis = shards[s].millis;
+      for (vector<Edge*>::iterator e = (*u)->closure.begin();
+           e != (*u)->closure.end(); ++e) {
+        if (!has[s][(*e)->index_])
+          millis += millis_[(*e)->index_];
+      }
+      if (s == 0 || millis < best_millis) {
+        best = s;
+        best_millis = millis;
+      }
+    }
+
+    Shard& shard = shards[best];
+    shard.targets.push_back((*u)->edge->outputs_[0]);
+    shard.millis = best_millis;
+    for (vector<Edge*>::iterator e = (*u)->closure.begin();
+         e != (*u)->closure.end(); ++e) {
+      if (!has[best][(*e)->index_]) {
+        has[best][(*e)->index_] = true;
+        ++shard.edges;
+      }
+    }
+  }
+  return shards;
+}
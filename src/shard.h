@@ -0,0 +1,71 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_SHARD_H_
+#define NINJA_SHARD_H_
+
+#include <vector>
+using namespace std;
+
+#include "util.h"  // For int64_t.
+
+struct BuildLog;
+struct Edge;
+struct Node;
+struct State;
+
+/// Splits the work of building some targets into shards of about equal
+/// cost, each to be built on its own, e.g. on separate machines, for
+/// -t shard and --shard.
+///
+/// The units of work are the commands the targets ask for, looking
+/// through phony edges.  Each unit goes to one shard along with all it
+/// needs, so every shard builds on its own; what units on several shards
+/// need is built by each of them.  Units go, costliest first, to the
+/// shard they leave least costly, counting only the commands it doesn't
+/// have yet, which tends to keep units sharing dependencies together.  A unit that another needs anyway isn't placed
+/// by itself.
+///
+/// Commands cost their last duration in the build log, or the average
+/// of those if not logged.  Machines that are to agree on the split must
+/// therefore load the same log, or none.
+struct Sharder {
+  /// \a log may be NULL, in which case every command costs the same.
+  Sharder(State* state, BuildLog* log);
+
+  struct Shard {
+    Shard() : millis(0), edges(0) {}
+    /// What to build: one output of each unit.
+    vector<Node*> targets;
+    /// The cost of all commands building \a targets takes.
+    int64_t millis;
+    int edges;
+  };
+
+  /// Split the building of \a targets into \a count shards.
+  vector<Shard> Split(const vector<Node*>& targets, int count);
+
+ private:
+  /// Add \a edge and all the commands it needs to \a closure, skipping
+  /// the edges set to \a mark in \a marks and setting the others.
+  void AddClosure(Edge* edge, int mark, vector<int>* marks,
+                  vector<Edge*>* closure);
+
+  State* state_;
+  /// The cost of each edge, by Edge::index_.
+  vector<int64_t> millis_;
+};
+
+#endif  // NINJA_SHARD_H_
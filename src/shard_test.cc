@@ -0,0 +1,128 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shard.h"
+
+#include "build_log.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct ShardTest : public StateTestWithBuiltinRules {
+  /// Split the targets named in \a paths into \a count shards.
+  vector<Sharder::Shard> Split(const char* paths[], int n, int count,
+                               BuildLog* log) {
+    vector<Node*> targets;
+    for (int i = 0; i < n; ++i)
+      targets.push_back(GetNode(paths[i]));
+    Sharder sharder(&state_, log);
+    return sharder.Split(targets, count);
+  }
+
+  BuildLog log_;
+};
+
+TEST_F(ShardTest, Balance) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat a.in\n"
+"build b: cat b.in\n"
+"build c: cat c.in\n"
+"build d: cat d.in\n"
+"build all: phony a b c d\n"));
+  RecordDuration(&log_, "a", 500);
+  RecordDuration(&log_, "b", 300);
+  RecordDuration(&log_, "c", 200);
+  RecordDuration(&log_, "d", 100);
+
+  const char* paths[] = { "all" };
+  vector<Sharder::Shard> shards = Split(paths, 1, 2, &log_);
+  ASSERT_EQ(2u, shards.size());
+  ASSERT_EQ(2u, shards[0].targets.size());
+  EXPECT_EQ("a", shards[0].targets[0]->path());
+  EXPECT_EQ("d", shards[0].targets[1]->path());
+  EXPECT_EQ(600, shards[0].millis);
+  EXPECT_EQ(2, shards[0].edges);
+  ASSERT_EQ(2u, shards[1].targets.size());
+  EXPECT_EQ("b", shards[1].targets[0]->path());
+  EXPECT_EQ("c", shards[1].targets[1]->path());
+  EXPECT_EQ(500, shards[1].millis);
+}
+
+TEST_F(ShardTest, SharedDependencies) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build gen.h: cat gen.in\n"
+"build a: cat a.in | gen.h\n"
+"build b: cat b.in | gen.h\n"
+"build c: cat c.in\n"));
+  RecordDuration(&log_, "gen.h", 100);
+  RecordDuration(&log_, "a", 100);
+  RecordDuration(&log_, "b", 100);
+  RecordDuration(&log_, "c", 400);
+
+  // a and b share gen.h, so they end up together.
+  const char* paths[] = { "a", "b", "c" };
+  vector<Sharder::Shard> shards = Split(paths, 3, 2, &log_);
+  ASSERT_EQ(2u, shards.size());
+  ASSERT_EQ(1u, shards[0].targets.size());
+  EXPECT_EQ("c", shards[0].targets[0]->path());
+  ASSERT_EQ(2u, shards[1].targets.size());
+  EXPECT_EQ("a", shards[1].targets[0]->path());
+  EXPECT_EQ("b", shards[1].targets[1]->path());
+  EXPECT_EQ(300, shards[1].millis);
+  EXPECT_EQ(3, shards[1].edges);
+
+  // Split three ways, each shard with a or b builds gen.h for itself.
+  shards = Split(paths, 3, 3, &log_);
+  EXPECT_EQ(400, shards[0].millis);
+  EXPECT_EQ(200, shards[1].millis);
+  EXPECT_EQ(200, shards[2].millis);
+  EXPECT_EQ(2, shards[2].edges);
+}
+
+TEST_F(ShardTest, NeededTargets) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a.o: cat a.c\n"
+"build app: cat a.o\n"));
+
+  // a.o is built along with app, not on a shard of its own.
+  const char* paths[] = { "a.o", "app" };
+  vector<Sharder::Shard> shards = Split(paths, 2, 2, NULL);
+  ASSERT_EQ(1u, shards[0].targets.size());
+  EXPECT_EQ("app", shards[0].targets[0]->path());
+  EXPECT_EQ(2, shards[0].edges);
+  EXPECT_TRUE(shards[1].targets.empty());
+  EXPECT_EQ(0, shards[1].edges);
+}
+
+TEST_F(ShardTest, UnknownDurations) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat a.in\n"
+"build b: cat b.in\n"
+"build c: cat c.in\n"));
+  RecordDuration(&log_, "a", 100);
+  RecordDuration(&log_, "b", 300);
+
+  // c costs the average of what is known.
+  const char* paths[] = { "a", "b", "c" };
+  vector<Sharder::Shard> shards = Split(paths, 3, 2, &log_);
+  EXPECT_EQ(300, shards[0].millis);
+  EXPECT_EQ(300, shards[1].millis);
+  ASSERT_EQ(2u, shards[1].targets.size());
+  EXPECT_EQ("c", shards[1].targets[0]->path());
+  EXPECT_EQ("a", shards[1].targets[1]->path());
+}
+
+}  // namespace
@@ -0,0 +1,217 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "simulate.h"
+
+#include <algorithm>
+#include <queue>
+
+#include "build.h"
+#include "graph.h"
+#include "profile.h"
+#include "state.h"
+
+namespace {
+
+/// A CommandRunner that doesn't run anything, but finishes each command
+/// once its duration has passed on a virtual clock.
+struct SimulatedCommandRunner : public CommandRunner {
+  SimulatedCommandRunner(const Simulation* simulation, int parallelism)
+      : simulation_(simulation), parallelism_(parallelism), now_(0),
+        started_(0) {}
+  virtual ~SimulatedCommandRunner() {}
+  virtual bool CanRunMore() {
+    return (int)running_.size() < parallelism_;
+  }
+  virtual bool StartCommand(Edge* edge) {
+    Running running;
+    running.end_millis = now_ + simulation_->Duration(edge);
+    running.order = started_++;
+    running.edge = edge;
+    running_.push(running);
+    return true;
+  }
+  virtual Edge* WaitForCommand(bool* success, string* output,
+                               ResourceUsage* usage) {
+    if (running_.empty())
+      return NULL;
+    Running running = running_.top();
+    running_.pop();
+    now_ = running.end_millis;
+    *success = true;
+    return running.edge;
+  }
+
+  /// The virtual time, in milliseconds since the build started.
+  int64_t now() const { return now_; }
+
+ private:
+  struct Running {
+    int64_t end_millis;
+    /// Commands finishing at the same time do so in the order they
+    /// started.
+    int order;
+    Edge* edge;
+
+    bool operator<(const Running& other) const {
+      // The top of the priority_queue finishes first.
+      if (end_millis != other.end_millis)
+        return end_millis > other.end_millis;
+      return order > other.order;
+    }
+  };
+
+  const Simulation* simulation_;
+  int parallelism_;
+  int64_t now_;
+  int started_;
+  priority_queue<Running> running_;
+};
+
+/// The longest chain of commands ending with each edge finished so far,
+/// and the edge before it on that chain.  The Plan finishes most phony
+/// edges without handing them out, so their chains are worked out when
+/// an edge depending on them finishes.
+struct Chains {
+  explicit Chains(size_t edge_count)
+      : millis_(edge_count, -1), previous_(edge_count, NULL) {}
+
+  /// Record that \a edge, which took \a duration, finished, and return
+  /// the length of its chain.
+  int64_t Finish(Edge* edge, int64_t duration) {
+    int64_t chain = 0;
+    for (vector<Node*>::iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      Edge* in = (*i)->in_edge();
+      if (!in)
+        continue;
+      int64_t in_chain = millis_[in->index_];
+      if (in_chain < 0 && in->is_phony())
+        in_chain = Finish(in, 0);
+      if (in_chain > chain) {
+        chain = in_chain;
+        previous_[edge->index_] = in;
+      }
+    }
+    chain += duration;
+    millis_[edge->index_] = chain;
+    return chain;
+  }
+
+  int64_t millis(Edge* edge) const { return millis_[edge->index_]; }
+  Edge* previous(Edge* edge) const { return previous_[edge->index_]; }
+
+ private:
+  vector<int64_t> millis_;
+  vector<Edge*> previous_;
+};
+
+}  // namespace
+
+Simulation::Simulation(State* state, BuildLog* log)
+    : state_(state), log_(log), millis_(state->edges_.size(), -1),
+      average_millis_(1) {
+  int64_t total = 0;
+  int known = 0;
+  for (vector<Edge*>::iterator i = state->edges_.begin();
+       i != state->edges_.end(); ++i) {
+    if ((*i)->is_phony() || !log)
+      continue;
+    int millis = Profile::Duration(*i, log);
+    if (millis >= 0) {
+      millis_[(*i)->index_] = millis;
+      total += millis;
+      ++known;
+    }
+  }
+  if (known && total / known > 0)
+    average_millis_ = total / known;
+}
+
+int64_t Simulation::Duration(Edge* edge) const {
+  if (edge->is_phony())
+    return 0;
+  int64_t millis = millis_[edge->index_];
+  return millis >= 0 ? millis : average_millis_;
+}
+
+bool Simulation::Run(const vector<Node*>& targets, int parallelism,
+                     Result* result, string* err) {
+  // Everything that is built needs building.
+  for (vector<Edge*>::iterator i = state_->edges_.begin();
+       i != state_->edges_.end(); ++i) {
+    (*i)->set_outputs_ready(false);
+    for (vector<Node*>::iterator o = (*i)->outputs_.begin();
+         o != (*i)->outputs_.end(); ++o) {
+      (*o)->set_dirty(true);
+    }
+  }
+
+  Plan plan;
+  for (vector<Node*>::const_iterator i = targets.begin(); i != targets.end();
+       ++i) {
+    if (!plan.AddTarget(*i, err) && !err->empty())
+      return false;
+  }
+  plan.ComputeCriticalPath(log_);
+
+  Chains chains(state_->edges_.size());
+  Edge* last = NULL;
+
+  // As in Builder::Build(), start what can be started, then wait.
+  *result = Result();
+  SimulatedCommandRunner runner(this, parallelism);
+  int pending = 0;
+  while (plan.more_to_do()) {
+    Edge* edge = NULL;
+    if (runner.CanRunMore() && (edge = plan.FindWork()) != NULL) {
+      if (!edge->is_phony()) {
+        runner.StartCommand(edge);
+        ++pending;
+        continue;
+      }
+    } else if (!plan.more_to_do()) {
+      // FindWork() finished the last phony edges.
+      break;
+    } else if (pending) {
+      bool success;
+      string output;
+      edge = runner.WaitForCommand(&success, &output, NULL);
+      --pending;
+      ++result->commands;
+      result->busy_millis += Duration(edge);
+      if (millis_[edge->index_] < 0)
+        ++result->unknown;
+    } else {
+      *err = "stuck [this is a bug]";
+      return false;
+    }
+
+    int64_t chain = chains.Finish(edge, Duration(edge));
+    if (!last || chain > chains.millis(last))
+      last = edge;
+    plan.EdgeFinished(edge);
+  }
+  result->wall_millis = runner.now();
+
+  if (last) {
+    result->critical_millis = chains.millis(last);
+    for (Edge* edge = last; edge; edge = chains.previous(edge)) {
+      if (!edge->is_phony())
+        result->critical_path.push_back(edge);
+    }
+    reverse(result->critical_path.begin(), result->critical_path.end());
+  }
+  return true;
+}
@@ -0,0 +1,75 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SIMULATE_H_
+#define NINJA_SIMULATE_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "util.h"  // For int64_t.
+
+struct BuildLog;
+struct Edge;
+struct Node;
+struct State;
+
+/// Replays a build on a virtual clock instead of running it, for
+/// -t simulate: each command takes as long as it last did according to
+/// the build log, or the average of those if not logged.  Commands are
+/// scheduled by the same Plan, pools and limit on parallelism as in a
+/// real build, so that the effect of changes to them can be measured
+/// without running anything.
+///
+/// The build simulated is from scratch, where only the manifest is known
+/// of the dependencies; hence the deps log isn't used.
+struct Simulation {
+  /// \a log may be NULL, in which case every command costs the same.
+  Simulation(State* state, BuildLog* log);
+
+  struct Result {
+    Result() : commands(0), unknown(0), wall_millis(0), busy_millis(0),
+               critical_millis(0) {}
+    int commands;
+    /// How many commands weren't in the log.
+    int unknown;
+    /// From the first command starting to the last finishing.
+    int64_t wall_millis;
+    /// The sum of the commands' durations.
+    int64_t busy_millis;
+    /// The longest chain of commands each needing the one before, from
+    /// first to last, which no parallelism makes any faster.
+    int64_t critical_millis;
+    vector<Edge*> critical_path;
+  };
+
+  /// Simulate building \a targets with up to \a parallelism commands at
+  /// once.  Returns false with \a err set if the plan can't be made, e.g.
+  /// because of a dependency cycle.
+  bool Run(const vector<Node*>& targets, int parallelism, Result* result,
+           string* err);
+
+  /// How long \a edge is taken to run, in milliseconds.
+  int64_t Duration(Edge* edge) const;
+
+ private:
+  State* state_;
+  BuildLog* log_;
+  /// The duration of each edge, by Edge::index_; -1 where not logged.
+  vector<int64_t> millis_;
+  int64_t average_millis_;
+};
+
+#endif  // NINJA_SIMULATE_H_
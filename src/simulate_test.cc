@@ -0,0 +1,104 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "simulate.h"
+
+#include "build_log.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct SimulateTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a.o: cat a.c\n"
+"build b.o: cat b.c\n"
+"build c.o: cat c.c\n"
+"build app: cat a.o b.o\n"
+"build all: phony app c.o\n"));
+    RecordDuration(&log_, "a.o", 100);
+    RecordDuration(&log_, "b.o", 300);
+    RecordDuration(&log_, "c.o", 200);
+    RecordDuration(&log_, "app", 50);
+  }
+
+  /// Simulate building \a target with \a parallelism jobs.
+  Simulation::Result Run(int parallelism, const string& target = "all") {
+    Simulation simulation(&state_, &log_);
+    vector<Node*> targets(1, GetNode(target));
+    Simulation::Result result;
+    string err;
+    EXPECT_TRUE(simulation.Run(targets, parallelism, &result, &err));
+    EXPECT_EQ("", err);
+    return result;
+  }
+
+  BuildLog log_;
+};
+
+TEST_F(SimulateTest, Serial) {
+  Simulation::Result result = Run(1);
+  EXPECT_EQ(4, result.commands);
+  EXPECT_EQ(0, result.unknown);
+  EXPECT_EQ(650, result.wall_millis);
+  EXPECT_EQ(650, result.busy_millis);
+}
+
+TEST_F(SimulateTest, Parallel) {
+  // b.o, then app, is the critical path; with enough jobs nothing else
+  // holds it up.
+  Simulation::Result result = Run(3);
+  EXPECT_EQ(350, result.wall_millis);
+  EXPECT_EQ(650, result.busy_millis);
+  EXPECT_EQ(350, result.critical_millis);
+  ASSERT_EQ(2u, result.critical_path.size());
+  EXPECT_EQ("b.o", result.critical_path[0]->outputs_[0]->path());
+  EXPECT_EQ("app", result.critical_path[1]->outputs_[0]->path());
+
+  // Longest chains go first, so two jobs are as good.
+  EXPECT_EQ(350, Run(2).wall_millis);
+}
+
+TEST_F(SimulateTest, Pool) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool serial\n"
+"  depth = 1\n"
+"build x: cat x.in\n"
+"  pool = serial\n"
+"build y: cat y.in\n"
+"  pool = serial\n"
+"build both: phony x y\n"));
+  RecordDuration(&log_, "x", 100);
+  RecordDuration(&log_, "y", 100);
+
+  Simulation::Result result = Run(4, "both");
+  EXPECT_EQ(200, result.wall_millis);
+  EXPECT_EQ(100, result.critical_millis);
+}
+
+TEST_F(SimulateTest, UnknownDurations) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build new.o: cat new.c\n"
+"build everything: phony all new.o\n"));
+
+  // new.o costs the average of what is known, 650 / 4.
+  Simulation::Result result = Run(1, "everything");
+  EXPECT_EQ(5, result.commands);
+  EXPECT_EQ(1, result.unknown);
+  EXPECT_EQ(650 + 162, result.wall_millis);
+}
+
+}  // namespace
@@ -0,0 +1,288 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stat_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "util.h"
+
+namespace {
+
+const char kFileSignature[] = "# ninja stat cache v1\n";
+
+/// The directory to stat for \a path: its DirName(), or "." for a bare
+/// filename.
+string StatDir(const string& path) {
+  string dir = DirName(path);
+  return dir.empty() ? "." : dir;
+}
+
+}  // namespace
+
+CachingDiskInterface::CachingDiskInterface(DiskInterface* disk_interface)
+    : disk_interface_(disk_interface), saved_time_(0) {}
+
+bool CachingDiskInterface::Load(const string& path, string* err) {
+  METRIC_RECORD(".ninja_stat load");
+  FILE* file = fopen(path.c_str(), "r");
+  if (!file) {
+    if (errno == ENOENT)
+      return true;
+    *err = strerror(errno);
+    return false;
+  }
+
+  char buf[256 << 10];
+  if (!fgets(buf, sizeof(buf), file) || strcmp(buf, kFileSignature) != 0) {
+    // Unknown format; start over.
+    fclose(file);
+    return true;
+  }
+
+  saved_time_ = disk_interface_->Stat(path);
+
+  while (fgets(buf, sizeof(buf), file)) {
+    // Each line is: type '\t' mtime '\t' path '\n'.
+    char type = buf[0];
+    if ((type != 'd' && type != 'f') || buf[1] != '\t')
+      continue;
+    char* start = buf + 2;
+    char* end = strchr(start, '\t');
+    if (!end)
+      continue;
+    *end = 0;
+    TimeStamp mtime = atol(start);
+    start = end + 1;
+    end = strchr(start, '\n');
+    if (!end)
+      continue;
+    string entry_path(start, end - start);
+
+    if (type == 'd')
+      dirs_[entry_path].mtime = mtime;
+    else
+      files_[entry_path].mtime = mtime;
+  }
+
+  fclose(file);
+  return true;
+}
+
+bool CachingDiskInterface::Save(const string& path, string* err) {
+  METRIC_RECORD(".ninja_stat save");
+  // Rewrite the file in place: replacing it would change the mtime of the
+  // directory it lives in, which would then never look unchanged.  A
+  // partially written file only loses entries, which is harmless.
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  fputs(kFileSignature, file);
+  for (Dirs::iterator i = dirs_.begin(); i != dirs_.end(); ++i) {
+    if (i->second.mtime > 0)
+      fprintf(file, "d\t%d\t%s\n", i->second.mtime, i->first.c_str());
+  }
+  for (Files::iterator i = files_.begin(); i != files_.end(); ++i) {
+    // Entries we didn't refresh are only good while their directory is.
+    if (!i->second.fresh) {
+      Dirs::iterator dir = dirs_.find(StatDir(i->first));
+      if (dir == dirs_.end() || dir->second.state == DirEntry::CHANGED ||
+          dir->second.mtime <= 0)
+        continue;
+    }
+    fprintf(file, "f\t%d\t%s\n", i->second.mtime, i->first.c_str());
+  }
+
+  if (fclose(file) != 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+TimeStamp CachingDiskInterface::Stat(const string& path) {
+  DirEntry* dir = CheckDir(path);
+  TimeStamp mtime;
+  if (Lookup(path, dir, &mtime))
+    return mtime;
+
+  mtime = disk_interface_->Stat(path);
+  if (mtime >= 0) {
+    FileEntry& entry = files_[path];
+    entry.mtime = mtime;
+    entry.fresh = true;
+  }
+  return mtime;
+}
+
+void CachingDiskInterface::StatBatch(const vector<const string*>& paths,
+                                     vector<TimeStamp>* mtimes) {
+  // First check all the directories involved, as one batch.
+  vector<DirEntry*> path_dirs(paths.size());
+  vector<string> dir_names;
+  vector<DirEntry*> dir_entries;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    string dir_name = StatDir(*paths[i]);
+    DirEntry* dir = &dirs_[dir_name];
+    if (dir->state == DirEntry::UNCHECKED) {
+      dir->state = DirEntry::CHECKING;
+      dir_names.push_back(dir_name);
+      dir_entries.push_back(dir);
+    }
+    path_dirs[i] = dir;
+  }
+  if (!dir_names.empty()) {
+    vector<const string*> dir_paths;
+    for (size_t i = 0; i < dir_names.size(); ++i)
+      dir_paths.push_back(&dir_names[i]);
+    vector<TimeStamp> dir_mtimes;
+    disk_interface_->StatBatch(dir_paths, &dir_mtimes);
+    for (size_t i = 0; i < dir_entries.size(); ++i)
+      CheckedDir(dir_entries[i], dir_mtimes[i]);
+  }
+
+  // Then stat whatever the cache can't answer.
+  mtimes->resize(paths.size());
+  vector<size_t> misses;
+  vector<const string*> miss_paths;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!Lookup(*paths[i], path_dirs[i], &(*mtimes)[i])) {
+      misses.push_back(i);
+      miss_paths.push_back(paths[i]);
+    }
+  }
+  if (misses.empty())
+    return;
+
+  vector<TimeStamp> miss_mtimes;
+  disk_interface_->StatBatch(miss_paths, &miss_mtimes);
+  for (size_t i = 0; i < misses.size(); ++i) {
+    TimeStamp mtime = miss_mtimes[i];
+    (*mtimes)[misses[i]] = mtime;
+    if (mtime >= 0) {
+      FileEntry& entry = files_[*miss_paths[i]];
+      entry.mtime = mtime;
+      entry.fresh = true;
+    }
+  }
+}
+
+bool CachingDiskInterface::MakeDir(const string& path) {
+  files_.erase(path);
+  ForgetDir(path);
+  return disk_interface_->MakeDir(path);
+}
+
+void CachingDiskInterface::MakeDirBatch(const vector<const string*>& paths,
+                                        vector<int>* results) {
+  for (size_t i = 0; i < paths.size(); ++i) {
+    files_.erase(*paths[i]);
+    ForgetDir(*paths[i]);
+  }
+  disk_interface_->MakeDirBatch(paths, results);
+}
+
+string CachingDiskInterface::ReadFile(const string& path, string* err) {
+  return disk_interface_->ReadFile(path, err);
+}
+
+void CachingDiskInterface::ReadFileInto(const string& path, string* contents,
+                                        string* err) {
+  disk_interface_->ReadFileInto(path, contents, err);
+}
+
+void CachingDiskInterface::ReadFileBlocks(const string& path, size_t block_size,
+                                          BlockSink* sink, string* err) {
+  disk_interface_->ReadFileBlocks(path, block_size, sink, err);
+}
+
+int CachingDiskInterface::RemoveFile(const string& path) {
+  files_.erase(path);
+  ForgetDir(path);
+  return disk_interface_->RemoveFile(path);
+}
+
+void CachingDiskInterface::RemoveFileBatch(const vector<const string*>& paths,
+                                           vector<int>* results) {
+  for (size_t i = 0; i < paths.size(); ++i) {
+    files_.erase(*paths[i]);
+    ForgetDir(*paths[i]);
+  }
+  disk_interface_->RemoveFileBatch(paths, results);
+}
+
+int CachingDiskInterface::RemoveDir(const string& path) {
+  ForgetDir(path);
+  DirEntry& dir = dirs_[path];
+  dir.state = DirEntry::CHANGED;
+  dir.mtime = -1;
+  return disk_interface_->RemoveDir(path);
+}
+
+bool CachingDiskInterface::SetMTime(const string& path, TimeStamp mtime) {
+  files_.erase(path);
+  return disk_interface_->SetMTime(path, mtime);
+}
+
+bool CachingDiskInterface::CloneFile(const string& from, const string& to) {
+  files_.erase(to);
+  ForgetDir(to);
+  return disk_interface_->CloneFile(from, to);
+}
+
+void CachingDiskInterface::Invalidate(const string& path) {
+  files_.erase(path);
+  disk_interface_->Invalidate(path);
+}
+
+bool CachingDiskInterface::Lookup(const string& path, DirEntry* dir,
+                                  TimeStamp* mtime) {
+  Files::iterator i = files_.find(path);
+  if (i == files_.end())
+    return false;
+  if (!i->second.fresh && dir->state != DirEntry::VALID)
+    return false;
+  *mtime = i->second.mtime;
+  return true;
+}
+
+void CachingDiskInterface::CheckedDir(DirEntry* dir, TimeStamp mtime) {
+  if (mtime > 0 && mtime == dir->mtime && mtime < saved_time_)
+    dir->state = DirEntry::VALID;
+  else
+    dir->state = DirEntry::CHANGED;
+  dir->mtime = mtime;
+}
+
+CachingDiskInterface::DirEntry* CachingDiskInterface::CheckDir(
+    const string& path) {
+  string dir_name = StatDir(path);
+  DirEntry* dir = &dirs_[dir_name];
+  if (dir->state == DirEntry::UNCHECKED)
+    CheckedDir(dir, disk_interface_->Stat(dir_name));
+  return dir;
+}
+
+void CachingDiskInterface::ForgetDir(const string& path) {
+  DirEntry& dir = dirs_[StatDir(path)];
+  dir.state = DirEntry::CHANGED;
+  dir.mtime = -1;
+}
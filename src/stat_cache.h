@@ -0,0 +1,114 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_STAT_CACHE_H_
+#define NINJA_STAT_CACHE_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "disk_interface.h"
+#include "hash_map.h"
+
+/// A DiskInterface decorator that remembers mtimes across runs.
+///
+/// A directory's mtime changes whenever an entry is added to, removed
+/// from or renamed within it.  The cache stores the mtime of each
+/// directory along with the mtimes of the files in it; on the next run
+/// the cached mtime of a file is trusted as long as its directory's mtime
+/// is unchanged, which costs one stat() per directory rather than one per
+/// file.
+///
+/// Modifying a file in place, rather than replacing it, does not touch
+/// its directory.  The Builder invalidates the outputs of commands it
+/// runs, but in-place edits made outside of ninja go unnoticed; hence the
+/// cache is opt-in.
+struct CachingDiskInterface : public DiskInterface {
+  explicit CachingDiskInterface(DiskInterface* disk_interface);
+
+  /// Load the cache saved by a previous run.  A missing file is not an
+  /// error.
+  bool Load(const string& path, string* err);
+  /// Write out everything that can be trusted by the next run.
+  bool Save(const string& path, string* err);
+
+  // DiskInterface
+  virtual TimeStamp Stat(const string& path);
+  virtual void StatBatch(const vector<const string*>& paths,
+                         vector<TimeStamp>* mtimes);
+  virtual bool MakeDir(const string& path);
+  virtual void MakeDirBatch(const vector<const string*>& paths,
+                            vector<int>* results);
+  virtual string ReadFile(const string& path, string* err);
+  virtual void ReadFileInto(const string& path, string* contents,
+                            string* err);
+  virtual void ReadFileBlocks(const string& path, size_t block_size,
+                              BlockSink* sink, string* err);
+  virtual bool ReadsInBackground() const {
+    return disk_interface_->ReadsInBackground();
+  }
+  virtual int RemoveFile(const string& path);
+  virtual void RemoveFileBatch(const vector<const string*>& paths,
+                               vector<int>* results);
+  virtual int RemoveDir(const string& path);
+  virtual bool SetMTime(const string& path, TimeStamp mtime);
+  virtual bool CloneFile(const string& from, const string& to);
+  virtual void Invalidate(const string& path);
+
+ private:
+  struct DirEntry {
+    DirEntry() : mtime(-1), state(UNCHECKED) {}
+    TimeStamp mtime;
+    enum {
+      UNCHECKED,  // Not yet compared against the disk this run.
+      CHECKING,   // Queued for a batched check.
+      VALID,      // Unchanged since it was cached.
+      CHANGED     // Changed, or we can't tell.
+    } state;
+  };
+
+  struct FileEntry {
+    FileEntry() : mtime(-1), fresh(false) {}
+    TimeStamp mtime;
+    /// True if stat()ed during this run, so it's valid regardless of the
+    /// state of its directory.
+    bool fresh;
+  };
+
+  /// Look up \a path, returning true and setting \a mtime if the cached
+  /// value can be trusted.  \a dir must already have been checked.
+  bool Lookup(const string& path, DirEntry* dir, TimeStamp* mtime);
+  /// Record the current mtime of a directory (or -1 if unknown).
+  void CheckedDir(DirEntry* dir, TimeStamp mtime);
+  /// Return the entry for the directory containing \a path, checking it
+  /// against the disk if needed.
+  DirEntry* CheckDir(const string& path);
+  /// Note that \a path's directory has been modified by us.
+  void ForgetDir(const string& path);
+
+  DiskInterface* disk_interface_;
+
+  typedef hash_map<string, DirEntry> Dirs;
+  Dirs dirs_;
+  typedef hash_map<string, FileEntry> Files;
+  Files files_;
+
+  /// The time the cache was last saved.  A directory modified in that
+  /// same second may have changed again after the save without its mtime
+  /// showing it, so it isn't trusted.
+  TimeStamp saved_time_;
+};
+
+#endif  // NINJA_STAT_CACHE_H_
@@ -0,0 +1,141 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stat_cache.h"
+
+#include "test.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char kTestFilename[] = "StatCacheTest-tempfile";
+
+/// A VirtualFileSystem that records which paths were stat()ed.
+struct CountingFileSystem : public VirtualFileSystem {
+  virtual TimeStamp Stat(const string& path) {
+    stats_.push_back(path);
+    return VirtualFileSystem::Stat(path);
+  }
+  vector<string> stats_;
+};
+
+struct StatCacheTest : public testing::Test {
+  virtual void SetUp() {
+    fs_.Create("dir", 10, "");
+    fs_.Create("dir/a", 5, "");
+    fs_.Create("dir/b", 6, "");
+    // The cache file's own mtime tells when it was saved.
+    fs_.Create(kTestFilename, 20, "");
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+
+  /// Stat dir/a and dir/b through a cache saved by an earlier run.
+  void SaveAndReload(CachingDiskInterface* cache) {
+    CachingDiskInterface first(&fs_);
+    string err;
+    ASSERT_TRUE(first.Load(kTestFilename, &err));
+    EXPECT_EQ(5, first.Stat("dir/a"));
+    EXPECT_EQ(6, first.Stat("dir/b"));
+    ASSERT_TRUE(first.Save(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    ASSERT_TRUE(cache->Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    fs_.stats_.clear();
+  }
+
+  CountingFileSystem fs_;
+};
+
+TEST_F(StatCacheTest, CachesWithinRun) {
+  CachingDiskInterface cache(&fs_);
+  EXPECT_EQ(5, cache.Stat("dir/a"));
+  EXPECT_EQ(5, cache.Stat("dir/a"));
+  EXPECT_EQ(0, cache.Stat("dir/missing"));
+  EXPECT_EQ(0, cache.Stat("dir/missing"));
+  // One stat for the directory, one for each file.
+  ASSERT_EQ(3u, fs_.stats_.size());
+  EXPECT_EQ("dir", fs_.stats_[0]);
+}
+
+TEST_F(StatCacheTest, UnchangedDirectory) {
+  CachingDiskInterface cache(&fs_);
+  SaveAndReload(&cache);
+
+  EXPECT_EQ(5, cache.Stat("dir/a"));
+  EXPECT_EQ(6, cache.Stat("dir/b"));
+  ASSERT_EQ(1u, fs_.stats_.size());
+  EXPECT_EQ("dir", fs_.stats_[0]);
+}
+
+TEST_F(StatCacheTest, ChangedDirectory) {
+  CachingDiskInterface cache(&fs_);
+  SaveAndReload(&cache);
+
+  // Replacing a file changes its directory's mtime.
+  fs_.Create("dir", 15, "");
+  fs_.Create("dir/a", 15, "");
+  EXPECT_EQ(15, cache.Stat("dir/a"));
+  EXPECT_EQ(6, cache.Stat("dir/b"));
+  EXPECT_EQ(3u, fs_.stats_.size());
+}
+
+TEST_F(StatCacheTest, RacyDirectory) {
+  // The directory was modified in the same second the cache was saved,
+  // so it may have changed again unnoticed.
+  fs_.Create("dir", 20, "");
+  CachingDiskInterface cache(&fs_);
+  SaveAndReload(&cache);
+
+  EXPECT_EQ(5, cache.Stat("dir/a"));
+  EXPECT_EQ(2u, fs_.stats_.size());
+}
+
+TEST_F(StatCacheTest, Invalidate) {
+  CachingDiskInterface cache(&fs_);
+  SaveAndReload(&cache);
+
+  // Rewriting a file in place doesn't touch the directory.
+  fs_.Create("dir/a", 12, "");
+  EXPECT_EQ(5, cache.Stat("dir/a"));
+  cache.Invalidate("dir/a");
+  EXPECT_EQ(12, cache.Stat("dir/a"));
+}
+
+TEST_F(StatCacheTest, StatBatch) {
+  CachingDiskInterface cache(&fs_);
+  SaveAndReload(&cache);
+  fs_.Create("other", 10, "");
+  fs_.Create("other/c", 7, "");
+
+  string a = "dir/a", c = "other/c";
+  vector<const string*> paths;
+  paths.push_back(&a);
+  paths.push_back(&c);
+  vector<TimeStamp> mtimes;
+  cache.StatBatch(paths, &mtimes);
+  ASSERT_EQ(2u, mtimes.size());
+  EXPECT_EQ(5, mtimes[0]);
+  EXPECT_EQ(7, mtimes[1]);
+  // Both directories, then the one file that wasn't cached.
+  ASSERT_EQ(3u, fs_.stats_.size());
+  EXPECT_EQ("other/c", fs_.stats_[2]);
+}
+
+}  // namespace
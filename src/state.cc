@@ -16,18 +16,58 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
 
-#include "edit_distance.h"
 #include "graph.h"
 #include "metrics.h"
 #include "util.h"
 
+void Pool::EdgeScheduled(Edge* edge) {
+  NINJA_UNUSED_ARG(edge);
+  if (depth_ != 0)
+    ++current_use_;
+}
+
+void Pool::EdgeFinished(Edge* edge) {
+  NINJA_UNUSED_ARG(edge);
+  if (depth_ != 0)
+    --current_use_;
+}
+
+void Pool::DelayEdge(Edge* edge) {
+  assert(depth_ != 0);
+  delayed_.push(edge);
+}
+
+void Pool::RetrieveReadyEdges(EdgePriorityQueue* ready_queue) {
+  while (!delayed_.empty() && current_use_ < depth_) {
+    Edge* edge = delayed_.pop();
+    EdgeScheduled(edge);
+    ready_queue->push(edge);
+  }
+}
+
 const Rule State::kPhonyRule("phony");
+Pool State::kDefaultPool("", 0);
 
-State::State() : build_log_(NULL) {
+State::State() : build_log_(NULL), deps_log_(NULL) {
   AddRule(&kPhonyRule);
 }
 
+State::~State() {
+  for (vector<ManifestFile>::iterator i = manifest_files_.begin();
+       i != manifest_files_.end(); ++i) {
+    delete i->parent_bindings;
+  }
+  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
+    i->second->~Node();
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e)
+    (*e)->~Edge();
+}
+
 void State::AddRule(const Rule* rule) {
   assert(LookupRule(rule->name()) == NULL);
   rules_[rule->name()] = rule;
@@ -40,19 +80,35 @@ const Rule* State::LookupRule(const string& rule_name) {
   return i->second;
 }
 
+void State::AddPool(Pool* pool) {
+  assert(LookupPool(pool->name()) == NULL);
+  pools_[pool->name()] = pool;
+}
+
+Pool* State::LookupPool(const string& pool_name) {
+  map<string, Pool*>::iterator i = pools_.find(pool_name);
+  if (i == pools_.end())
+    return NULL;
+  return i->second;
+}
+
 Edge* State::AddEdge(const Rule* rule) {
-  Edge* edge = new Edge();
+  Edge* edge = new (arena_.Alloc(sizeof(Edge)))
+      Edge(&graph_state_, graph_state_.AddEdge());
   edge->rule_ = rule;
+  edge->pool_ = &kDefaultPool;
   edge->env_ = &bindings_;
   edges_.push_back(edge);
   return edge;
 }
 
 Node* State::GetNode(StringPiece path) {
-  Node* node = LookupNode(path);
-  if (node)
-    return node;
-  node = new Node(path.AsString());
+  Paths::iterator i = paths_.find(path);
+  if (i != paths_.end())
+    return i->second;
+  Node* node = new (arena_.Alloc(sizeof(Node)))
+      Node(path, &graph_state_, graph_state_.AddNode());
+  nodes_.push_back(node);
   paths_[node->path()] = node;
   return node;
 }
@@ -66,20 +122,17 @@ Node* State::LookupNode(StringPiece path) {
 }
 
 Node* State::SpellcheckNode(const string& path) {
-  const bool kAllowReplacements = true;
   const int kMaxValidEditDistance = 3;
 
-  int min_distance = kMaxValidEditDistance + 1;
-  Node* result = NULL;
-  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i) {
-    int distance = EditDistance(
-        i->first, path, kAllowReplacements, kMaxValidEditDistance);
-    if (distance < min_distance && i->second) {
-      min_distance = distance;
-      result = i->second;
-    }
-  }
-  return result;
+  if (path_index_.size() != nodes_.size())
+    path_index_.Build(nodes_);
+  return path_index_.Spellcheck(path, kMaxValidEditDistance);
+}
+
+void State::NodesWithPrefix(const string& prefix, vector<Node*>* nodes) {
+  if (path_index_.size() != nodes_.size())
+    path_index_.Build(nodes_);
+  path_index_.Complete(prefix, nodes);
 }
 
 void State::AddIn(Edge* edge, StringPiece path) {
@@ -132,10 +185,125 @@ vector<Node*> State::DefaultNodes(string* err) {
 }
 
 void State::Reset() {
-  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
-    i->second->ResetState();
-  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e)
-    (*e)->outputs_ready_ = false;
+  graph_state_.Reset();
+  ResetPools();
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    if ((*e)->loaded_deps_)
+      (*e)->ForgetLoadedDeps();
+  }
+}
+
+namespace {
+
+/// Mark \a edge as not yet scanned, adding its outputs to \a nodes.
+void ResetEdge(Edge* edge, vector<Node*>* nodes) {
+  // An edge that wasn't scanned has nothing built from it that was.
+  if (!edge->scanned())
+    return;
+  edge->set_scanned(false);
+  edge->set_outputs_ready(false);
+  if (edge->loaded_deps_)
+    edge->ForgetLoadedDeps();
+  nodes->insert(nodes->end(), edge->outputs_.begin(), edge->outputs_.end());
+}
+
+}  // namespace
+
+void State::ResetFrom(Node* node) {
+  vector<Node*> stack(1, node);
+  vector<Edge*> out_edges;
+  while (!stack.empty()) {
+    Node* node = stack.back();
+    stack.pop_back();
+    // Nothing that depends on a node can have been scanned without it.
+    if (!node->status_known())
+      continue;
+    node->ResetState();
+
+    // The node may be an output that was changed behind our back.
+    if (Edge* edge = node->in_edge())
+      ResetEdge(edge, &stack);
+    // Forgetting loaded deps modifies out_edges(), so work on a copy.
+    out_edges = node->out_edges();
+    for (vector<Edge*>::iterator e = out_edges.begin(); e != out_edges.end();
+         ++e) {
+      ResetEdge(*e, &stack);
+    }
+  }
+}
+
+void State::ResetPools() {
+  for (map<string, Pool*>::iterator i = pools_.begin(); i != pools_.end(); ++i)
+    i->second->Reset();
+}
+
+void State::ResetDirtyNodes() {
+  ResetPools();
+  // An edge that ran may have been cleaned by a restat since, but its
+  // depfile may have changed all the same.
+  vector<char>& ran = graph_state_.edge_ran;
+  if (!ran.empty()) {
+    char* begin = &ran[0];
+    char* end = begin + ran.size();
+    for (char* p = begin; (p = (char*)memchr(p, 1, end - p)) != NULL; ++p) {
+      *p = 0;
+      Edge* edge = edges_[p - begin];
+      for (vector<Node*>::iterator i = edge->outputs_.begin();
+           i != edge->outputs_.end(); ++i) {
+        ResetFrom(*i);
+      }
+    }
+  }
+
+  const vector<char>& dirty = graph_state_.node_dirty;
+  if (dirty.empty())
+    return;
+  const char* begin = &dirty[0];
+  const char* end = begin + dirty.size();
+  for (const char* p = begin;
+       (p = (const char*)memchr(p, 1, end - p)) != NULL; ++p) {
+    ResetFrom(nodes_[p - begin]);
+  }
+}
+
+void State::RemoveEdges(size_t begin, size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    Edge* edge = edges_[i];
+    for (vector<Node*>::iterator n = edge->inputs_.begin();
+         n != edge->inputs_.end(); ++n) {
+      (*n)->RemoveOutEdge(edge);
+    }
+    for (vector<Node*>::iterator n = edge->outputs_.begin();
+         n != edge->outputs_.end(); ++n) {
+      if ((*n)->in_edge() == edge)
+        (*n)->set_in_edge(NULL);
+    }
+    // Its memory stays with the arena.
+    edge->~Edge();
+  }
+  edges_.erase(edges_.begin() + begin, edges_.begin() + end);
+  graph_state_.edge_outputs_ready.resize(edges_.size());
+  graph_state_.edge_scanned.resize(edges_.size());
+  graph_state_.edge_want.resize(edges_.size());
+  graph_state_.edge_ran.resize(edges_.size());
+  RenumberEdges(begin);
+}
+
+void State::MoveEdges(size_t from, size_t to) {
+  rotate(edges_.begin() + to, edges_.begin() + from, edges_.end());
+  RenumberEdges(to);
+}
+
+void State::RenumberEdges(size_t begin) {
+  // The per-build state of the edges that moved no longer lines up;
+  // none of them can be part of a build yet.
+  for (size_t i = begin; i < edges_.size(); ++i) {
+    edges_[i]->index_ = i;
+    graph_state_.edge_outputs_ready[i] = false;
+    graph_state_.edge_scanned[i] = false;
+    graph_state_.edge_want[i] = Edge::kNotInPlan;
+    graph_state_.edge_ran[i] = false;
+  }
 }
 
 void State::Dump() {
@@ -21,28 +21,107 @@
 #include <vector>
 using namespace std;
 
+#include "arena.h"
 #include "eval_env.h"
+#include "graph.h"
 #include "hash_map.h"
+#include "path_index.h"
 
 struct BuildLog;
-struct Edge;
-struct Node;
-struct Rule;
+
+/// A pool limits how many of the edges assigned to it run at once,
+/// regardless of the global -j limit, e.g. to keep memory-hungry link
+/// steps from running all at the same time.
+struct Pool {
+  Pool(const string& name, int depth)
+      : name_(name), current_use_(0), depth_(depth) {}
+
+  const string& name() const { return name_; }
+  /// The number of edges that may run at once, or 0 for no limit.
+  int depth() const { return depth_; }
+  int current_use() const { return current_use_; }
+
+  /// True if edges of this pool have to wait for a free slot.
+  bool ShouldDelayEdge() const { return depth_ != 0; }
+
+  /// Note that \a edge was handed out to run, or has finished.
+  void EdgeScheduled(Edge* edge);
+  void EdgeFinished(Edge* edge);
+
+  /// Hold back \a edge until there's room for it.
+  void DelayEdge(Edge* edge);
+
+  /// Move as many delayed edges as there's room for into \a ready_queue,
+  /// longest critical path first.
+  void RetrieveReadyEdges(EdgePriorityQueue* ready_queue);
+
+  /// Re-sort the delayed edges after their critical times changed.
+  void ReorderDelayedEdges() { delayed_.Reorder(); }
+
+  /// Forget the edges of a build that is over, including those it gave
+  /// up on while they ran or waited.
+  void Reset() {
+    current_use_ = 0;
+    delayed_.clear();
+  }
+
+ private:
+  string name_;
+  int current_use_;
+  int depth_;
+  EdgePriorityQueue delayed_;
+};
+
+/// What the parser noted about one of the manifest files it read, for
+/// ManifestParser::Reparse().
+struct ManifestFile {
+  ManifestFile()
+      : hash(0), scope(NULL), parent_bindings(NULL), subninja(false),
+        defines_globals(false), globals_seen(0) {}
+
+  string path;
+  /// BuildLog::LogEntry::HashContents() of the contents that were parsed.
+  uint64_t hash;
+  /// The scope the file's statements went into: its own for a subninja
+  /// file, the including file's otherwise.
+  BindingEnv* scope;
+  /// For a subninja file, the bindings visible from the subninja
+  /// statement as they were then; owned by the State.
+  BindingEnv* parent_bindings;
+  bool subninja;
+  /// Whether the file defines rules, pools or defaults, which aren't
+  /// private to its scope.
+  bool defines_globals;
+  /// For a subninja file, how many rules and pools were defined when the
+  /// subninja statement was reached.
+  size_t globals_seen;
+};
 
 /// Global state (file status, loaded rules) for a single run.
 struct State {
   static const Rule kPhonyRule;
+  /// The pool of edges not assigned to one, which has no limit.
+  static Pool kDefaultPool;
 
   State();
+  ~State();
 
   void AddRule(const Rule* rule);
   const Rule* LookupRule(const string& rule_name);
 
+  void AddPool(Pool* pool);
+  Pool* LookupPool(const string& pool_name);
+
   Edge* AddEdge(const Rule* rule);
 
   Node* GetNode(StringPiece path);
   Node* LookupNode(StringPiece path);
+  /// Return the node whose path is the closest match for \a path, if
+  /// any is close enough to be a likely typo.
   Node* SpellcheckNode(const string& path);
+  /// Append the nodes whose path starts with \a prefix to \a nodes,
+  /// sorted by path.
+  void NodesWithPrefix(const string& prefix, vector<Node*>* nodes);
 
   void AddIn(Edge* edge, StringPiece path);
   void AddOut(Edge* edge, StringPiece path);
@@ -50,8 +129,27 @@ struct State {
 
   /// Reset state.  Keeps all nodes and edges, but restores them to the
   /// state where we haven't yet examined the disk for dirty state.
+  /// Dependencies loaded from depfiles and the deps log are dropped,
+  /// since they may have changed by then.
   void Reset();
 
+  /// Empty every pool of what the last build left in it.
+  void ResetPools();
+
+  /// Forget what the last scan found out about \a node and everything
+  /// built from it, so that the next one examines them again.  The rest
+  /// of the graph keeps its state, unlike with Reset().
+  void ResetFrom(Node* node);
+
+  /// ResetFrom() every node that is dirty, i.e. still needs to be built,
+  /// and the outputs of every edge that ran since the last reset.
+  void ResetDirtyNodes();
+
+  /// Detach edges_[begin, end) from their nodes and drop them.
+  void RemoveEdges(size_t begin, size_t end);
+  /// Move edges_[from, edges_.size()) to \a to, ahead of the edges there.
+  void MoveEdges(size_t from, size_t to);
+
   /// Dump the nodes (useful for debugging).
   void Dump();
 
@@ -60,19 +158,49 @@ struct State {
   vector<Node*> RootNodes(string* error);
   vector<Node*> DefaultNodes(string* error);
 
+  /// Storage for all nodes and edges, which live as long as the State.
+  Arena arena_;
+
+  /// The per-build state of all nodes and edges.
+  GraphState graph_state_;
+
   /// Mapping of path -> Node.
   typedef ExternalStringHashMap<Node*>::Type Paths;
   Paths paths_;
 
+  /// All the nodes of the graph, by Node::index().
+  vector<Node*> nodes_;
+
   /// All the rules used in the graph.
   map<string, const Rule*> rules_;
 
+  /// All the pools declared in the manifest.
+  map<string, Pool*> pools_;
+
   /// All the edges of the graph.
   vector<Edge*> edges_;
 
   BindingEnv bindings_;
   vector<Node*> defaults_;
   struct BuildLog* build_log_;
+  struct DepsLog* deps_log_;
+
+  /// Index of the paths of nodes_ for SpellcheckNode() and
+  /// NodesWithPrefix(), built on first use and rebuilt
+  /// whenever nodes have been added since.
+  PathIndex path_index_;
+
+  /// Scratch space that Edge::LoadDepFile() reads depfiles into, reused
+  /// so that checking thousands of them doesn't allocate for each.
+  string depfile_buffer_;
+
+  /// The manifest files the state was parsed from, in the order their
+  /// statements were reached.
+  vector<ManifestFile> manifest_files_;
+
+ private:
+  /// Renumber edges_ from \a begin on, after they moved.
+  void RenumberEdges(size_t begin);
 };
 
 #endif  // NINJA_STATE_H_
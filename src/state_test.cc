@@ -16,6 +16,7 @@
 
 #include "graph.h"
 #include "state.h"
+#include "test.h"
 
 namespace {
 
@@ -41,4 +42,84 @@ TEST(State, Basic) {
   EXPECT_FALSE(state.GetNode("out")->dirty());
 }
 
+TEST(State, Reset) {
+  State state;
+  Edge* edge = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(edge, "in");
+  state.AddOut(edge, "out");
+  Node* in = state.GetNode("in");
+  Node* out = state.GetNode("out");
+  EXPECT_EQ(0, in->index());
+  EXPECT_EQ(1, out->index());
+  EXPECT_EQ(0, edge->index_);
+
+  in->MarkMissing();
+  out->set_mtime(3);
+  out->MarkDirty();
+  edge->set_outputs_ready(true);
+  edge->set_scanned(true);
+  state.Reset();
+
+  EXPECT_FALSE(in->status_known());
+  EXPECT_FALSE(out->status_known());
+  EXPECT_FALSE(out->dirty());
+  EXPECT_FALSE(edge->outputs_ready());
+  EXPECT_FALSE(edge->scanned());
+}
+
+TEST(State, ResetFrom) {
+  // in -> mid -> out, and an unrelated other -> other.o.
+  State state;
+  Edge* first = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(first, "in");
+  state.AddOut(first, "mid");
+  Edge* second = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(second, "mid");
+  state.AddOut(second, "out");
+  Edge* other = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(other, "other");
+  state.AddOut(other, "other.o");
+
+  VirtualFileSystem fs;
+  fs.Create("in", 1, "");
+  fs.Create("other", 1, "");
+  string err;
+  EXPECT_TRUE(second->RecomputeDirty(&state, &fs, &err));
+  EXPECT_TRUE(other->RecomputeDirty(&state, &fs, &err));
+  ASSERT_EQ("", err);
+
+  state.ResetFrom(state.GetNode("mid"));
+  EXPECT_TRUE(state.GetNode("in")->status_known());
+  EXPECT_FALSE(state.GetNode("mid")->status_known());
+  EXPECT_FALSE(state.GetNode("out")->status_known());
+  // The edge making mid is checked again too, in case mid was modified.
+  EXPECT_FALSE(first->scanned());
+  EXPECT_FALSE(second->scanned());
+  EXPECT_TRUE(other->scanned());
+  EXPECT_TRUE(state.GetNode("other.o")->status_known());
+}
+
+TEST(State, ResetDirtyNodes) {
+  State state;
+  Edge* edge = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(edge, "missing");
+  state.AddOut(edge, "out");
+  Edge* other = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(other, "present");
+  state.AddOut(other, "other.o");
+
+  VirtualFileSystem fs;
+  fs.Create("present", 1, "");
+  string err;
+  EXPECT_TRUE(edge->RecomputeDirty(&state, &fs, &err));
+  EXPECT_TRUE(other->RecomputeDirty(&state, &fs, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(state.GetNode("missing")->dirty());
+
+  state.ResetDirtyNodes();
+  EXPECT_FALSE(edge->scanned());
+  EXPECT_FALSE(state.GetNode("out")->status_known());
+  EXPECT_TRUE(other->scanned());
+}
+
 }  // namespace
@@ -14,9 +14,15 @@
 
 #include "subprocess.h"
 
+// Have GetProcessMemoryInfo() come from kernel32 rather than psapi.dll.
+#ifndef PSAPI_VERSION
+#define PSAPI_VERSION 2
+#endif
+#include <psapi.h>
 #include <stdio.h>
 
 #include <algorithm>
+#include <functional>
 
 #include "util.h"
 
@@ -28,7 +34,8 @@ void Win32Fatal(const char* function) {
 
 }  // anonymous namespace
 
-Subprocess::Subprocess() : child_(NULL) , overlapped_() {
+Subprocess::Subprocess()
+    : child_(NULL), pipe_(NULL), overlapped_(), overlapped_buf_(4 << 10) {
 }
 
 Subprocess::~Subprocess() {
@@ -75,6 +82,7 @@ HANDLE Subprocess::SetupPipe(HANDLE ioport) {
 
 bool Subprocess::Start(SubprocessSet* set, const string& command) {
   HANDLE child_pipe = SetupPipe(set->ioport_);
+  output_.SetLimit(set->output_limit_, set->spill_dir_);
 
   STARTUPINFOA startup_info;
   memset(&startup_info, 0, sizeof(startup_info));
@@ -90,19 +98,24 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   memset(&process_info, 0, sizeof(process_info));
 
   // Do not prepend 'cmd /c' on Windows, this breaks command
-  // lines greater than 8,191 chars.
+  // lines greater than 8,191 chars.  Start suspended so that the child
+  // can't spawn anything before it's in the job.
+  DWORD flags = set->job_ ? CREATE_SUSPENDED : 0;
   if (!CreateProcessA(NULL, (char*)command.c_str(), NULL, NULL,
-                      /* inherit handles */ TRUE, 0,
+                      /* inherit handles */ TRUE, flags,
                       NULL, NULL,
                       &startup_info, &process_info)) {
     DWORD error = GetLastError();
+    const char kNotFound[] =
+        "CreateProcess failed: The system cannot find the file specified.\n";
     if (error == ERROR_FILE_NOT_FOUND) { // file (program) not found error is treated as a normal build action failure
       if (child_pipe)
         CloseHandle(child_pipe);
       CloseHandle(pipe_);
       pipe_ = NULL;
       // child_ is already NULL;
-      buf_ = "CreateProcess failed: The system cannot find the file specified.\n";
+      output_.Append(kNotFound, sizeof(kNotFound) - 1);
+      output_.Finish();
       return true;
     } else {
       Win32Fatal("CreateProcess");    // pass all other errors to Win32Fatal
@@ -113,6 +126,12 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   if (child_pipe)
     CloseHandle(child_pipe);
 
+  if (set->job_) {
+    // This fails if we're in a job that doesn't allow nesting (before
+    // Windows 8); the child then just runs outside of ours.
+    AssignProcessToJobObject(set->job_, process_info.hProcess);
+    ResumeThread(process_info.hThread);
+  }
   CloseHandle(process_info.hThread);
   child_ = process_info.hProcess;
 
@@ -125,20 +144,28 @@ void Subprocess::OnPipeReady() {
     if (GetLastError() == ERROR_BROKEN_PIPE) {
       CloseHandle(pipe_);
       pipe_ = NULL;
+      output_.Finish();
       return;
     }
     Win32Fatal("GetOverlappedResult");
   }
 
-  if (bytes)
-    buf_.append(overlapped_buf_, bytes);
+  // Read in chunks that grow while the command keeps the pipe full.
+  const size_t kMaxReadSize = 1 << 20;
+  if (bytes) {
+    output_.Append(&overlapped_buf_[0], bytes);
+    if (bytes == overlapped_buf_.size() &&
+        overlapped_buf_.size() < kMaxReadSize)
+      overlapped_buf_.resize(overlapped_buf_.size() * 2);
+  }
 
   memset(&overlapped_, 0, sizeof(overlapped_));
-  if (!::ReadFile(pipe_, overlapped_buf_, sizeof(overlapped_buf_),
+  if (!::ReadFile(pipe_, &overlapped_buf_[0], (DWORD)overlapped_buf_.size(),
                   &bytes, &overlapped_)) {
     if (GetLastError() == ERROR_BROKEN_PIPE) {
       CloseHandle(pipe_);
       pipe_ = NULL;
+      output_.Finish();
       return;
     }
     if (GetLastError() != ERROR_IO_PENDING)
@@ -160,27 +187,72 @@ bool Subprocess::Finish() {
   DWORD exit_code = 0;
   GetExitCodeProcess(child_, &exit_code);
 
+  // Only the process itself counts; those it started aren't tracked.
+  FILETIME creation, exit, kernel, user;
+  if (GetProcessTimes(child_, &creation, &exit, &kernel, &user)) {
+    ULARGE_INTEGER ticks;  // In units of 100ns.
+    ticks.LowPart = user.dwLowDateTime;
+    ticks.HighPart = user.dwHighDateTime;
+    usage_.user_millis = (int)(ticks.QuadPart / 10000);
+    ticks.LowPart = kernel.dwLowDateTime;
+    ticks.HighPart = kernel.dwHighDateTime;
+    usage_.system_millis = (int)(ticks.QuadPart / 10000);
+  }
+  PROCESS_MEMORY_COUNTERS memory;
+  if (GetProcessMemoryInfo(child_, &memory, sizeof(memory)))
+    usage_.max_rss = memory.PeakWorkingSetSize;
+
   CloseHandle(child_);
   child_ = NULL;
 
   return exit_code == 0;
 }
 
+bool Subprocess::StartWorker(SubprocessSet*, const string&) {
+  // Not supported; the caller runs commands the usual way instead.
+  return false;
+}
+
+bool Subprocess::Request(const string&) {
+  return false;
+}
+
+bool Subprocess::Idle() const {
+  return false;
+}
+
 bool Subprocess::Done() const {
   return pipe_ == NULL;
 }
 
 const string& Subprocess::GetOutput() const {
-  return buf_;
+  return output_.str();
 }
 
-SubprocessSet::SubprocessSet() {
+SubprocessSet::SubprocessSet()
+    : direct_exec_(false), output_limit_(0), stream_after_(0),
+      woken_(false) {
   ioport_ = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
   if (!ioport_)
     Win32Fatal("CreateIoCompletionPort");
+
+  job_ = CreateJobObject(NULL, NULL);
+  if (job_) {
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION info;
+    memset(&info, 0, sizeof(info));
+    info.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+    if (!SetInformationJobObject(job_, JobObjectExtendedLimitInformation,
+                                 &info, sizeof(info))) {
+      CloseHandle(job_);
+      job_ = NULL;
+    }
+  }
 }
 
 SubprocessSet::~SubprocessSet() {
+  // Any children still running are killed along with the job.
+  if (job_)
+    CloseHandle(job_);
   CloseHandle(ioport_);
 }
 
@@ -191,27 +263,51 @@ void SubprocessSet::Add(Subprocess* subprocess) {
     finished_.push(subprocess);
 }
 
-void SubprocessSet::DoWork() {
-  DWORD bytes_read;
-  Subprocess* subproc;
-  OVERLAPPED* overlapped;
-
-  if (!GetQueuedCompletionStatus(ioport_, &bytes_read, (PULONG_PTR)&subproc,
-                                 &overlapped, INFINITE)) {
-    if (GetLastError() != ERROR_BROKEN_PIPE)
-      Win32Fatal("GetQueuedCompletionStatus");
+void SubprocessSet::DoWork(int timeout_millis) {
+  // Each pipe has at most one read pending, so a batch holds at most one
+  // completion per subprocess.
+  OVERLAPPED_ENTRY entries[64];
+  ULONG count;
+  if (!GetQueuedCompletionStatusEx(ioport_, entries,
+                                   sizeof(entries) / sizeof(entries[0]),
+                                   &count,
+                                   timeout_millis < 0 ? INFINITE
+                                                      : timeout_millis,
+                                   FALSE)) {
+    if (GetLastError() == WAIT_TIMEOUT)
+      return;
+    Win32Fatal("GetQueuedCompletionStatusEx");
   }
 
-  subproc->OnPipeReady();
-
-  if (subproc->Done()) {
-    vector<Subprocess*>::iterator end =
-        std::remove(running_.begin(), running_.end(), subproc);
-    if (running_.end() != end) {
+  // A broken pipe shows up in OnPipeReady()'s GetOverlappedResult().
+  bool any_done = false;
+  for (ULONG i = 0; i < count; ++i) {
+    Subprocess* subproc = (Subprocess*)entries[i].lpCompletionKey;
+    // Posted by Wake().
+    if (!subproc) {
+      woken_ = true;
+      continue;
+    }
+    // E.g. the connect of a pipe closed when the command couldn't start.
+    if (subproc->Done())
+      continue;
+    subproc->OnPipeReady();
+    if (subproc->Done()) {
       finished_.push(subproc);
-      running_.resize(end - running_.begin());
+      any_done = true;
     }
   }
+
+  if (any_done) {
+    vector<Subprocess*>::iterator end =
+        std::remove_if(running_.begin(), running_.end(),
+                       std::mem_fun(&Subprocess::Done));
+    running_.resize(end - running_.begin());
+  }
+}
+
+void SubprocessSet::Wake() {
+  PostQueuedCompletionStatus(ioport_, 0, 0, NULL);
 }
 
 Subprocess* SubprocessSet::NextFinished() {
@@ -15,28 +15,124 @@
 #include "subprocess.h"
 
 #include <algorithm>
-#include <map>
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
+extern char** environ;
+
+#if defined(linux)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+#include <sys/types.h>
+#include <sys/event.h>
+#define USE_KQUEUE
+#endif
+
 #include "util.h"
 
-Subprocess::Subprocess() : fd_(-1), pid_(-1) {
+#if defined(__GLIBC__) && \
+    (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 24))
+#define EXEC_ERRORS_ASYNC true
+#else
+#define EXEC_ERRORS_ASYNC false
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // SO_NOSIGPIPE is set instead.
+#endif
+
+Subprocess::Subprocess()
+    : fd_(-1), pid_(-1), set_(NULL), read_size_(4 << 10), start_millis_(0),
+      worker_(false), busy_(false), exit_status_(0), direct_(false),
+      wait_status_(0) {
 }
 Subprocess::~Subprocess() {
-  if (fd_ >= 0)
+  if (fd_ >= 0) {
+    // An idle worker isn't watched.  Closing its end tells it to exit.
+    if (set_ && (!worker_ || busy_))
+      set_->Unwatch(this);
     close(fd_);
+    fd_ = -1;
+  }
   // Reap child if forgotten.
   if (pid_ != -1)
     Finish();
 }
 
+namespace {
+
+/// How long a worker gets to exit, once its pipe is closed, before it is
+/// sent SIGTERM, and then again before SIGKILL.
+const int kWorkerGraceMillis = 500;
+
+/// Reap \a pid if it exits within \a timeout_millis.
+bool WaitWithTimeout(pid_t pid, int timeout_millis, int* status,
+                     struct rusage* rusage) {
+  for (int waited = 0; ; waited += 10) {
+    pid_t ret = wait4(pid, status, WNOHANG, rusage);
+    if (ret == pid)
+      return true;
+    if (ret < 0 && errno != EINTR)
+      Fatal("wait4(%d): %s", pid, strerror(errno));
+    if (waited >= timeout_millis)
+      return false;
+    usleep(10 * 1000);
+  }
+}
+
+/// Reap a worker whose pipe is closed, which tells it to exit.  One that
+/// broke the protocol may not be listening, so it is terminated, and then
+/// killed, rather than waited for forever.
+void ReapWorker(pid_t pid, int* status, struct rusage* rusage) {
+  if (WaitWithTimeout(pid, kWorkerGraceMillis, status, rusage))
+    return;
+  kill(pid, SIGTERM);
+  if (WaitWithTimeout(pid, kWorkerGraceMillis, status, rusage))
+    return;
+  kill(pid, SIGKILL);
+  if (wait4(pid, status, 0, rusage) < 0)
+    Fatal("wait4(%d): %s", pid, strerror(errno));
+}
+
+/// Split \a command into words if it can be run without /bin/sh, i.e.
+/// it's just a program and arguments separated by spaces.  Anything
+/// the shell might interpret -- quoting, expansion, redirection,
+/// globbing, comments, variable assignments -- disqualifies it.
+bool SplitSimpleCommand(const string& command, vector<string>* words) {
+  words->clear();
+  string word;
+  for (size_t i = 0; i <= command.size(); ++i) {
+    char c = i < command.size() ? command[i] : ' ';
+    if (c == ' ' || c == '\t') {
+      if (!word.empty())
+        words->push_back(word);
+      word.clear();
+      continue;
+    }
+    if (!isalnum((unsigned char)c) && !strchr("-_./+,:@%=", c))
+      return false;
+    if (c == '=' && words->empty())
+      return false;
+    word.push_back(c);
+  }
+  return !words->empty();
+}
+
+}  // anonymous namespace
+
 bool Subprocess::Start(SubprocessSet* set, const string& command) {
   int output_pipe[2];
   if (pipe(output_pipe) < 0)
@@ -44,101 +140,431 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   fd_ = output_pipe[0];
   SetCloseOnExec(fd_);
 
-  pid_ = fork();
-  if (pid_ < 0)
-    Fatal("fork: %s", strerror(errno));
-
-  if (pid_ == 0) {
-    close(output_pipe[0]);
-
-    // Track which fd we use to report errors on.
-    int error_pipe = output_pipe[1];
-    do {
-      // Open /dev/null over stdin.
-      int devnull = open("/dev/null", O_WRONLY);
-      if (devnull < 0)
-        break;
-      if (dup2(devnull, 0) < 0)
-        break;
-      close(devnull);
-
-      if (dup2(output_pipe[1], 1) < 0 ||
-          dup2(output_pipe[1], 2) < 0)
-        break;
-
-      // Now can use stderr for errors.
-      error_pipe = 2;
-      close(output_pipe[1]);
-
-      execl("/bin/sh", "/bin/sh", "-c", command.c_str(), (char *) NULL);
-    } while (false);
-
-    // If we get here, something went wrong; the execl should have
-    // replaced us.
-    char* err = strerror(errno);
-    if (write(error_pipe, err, strlen(err)) < 0) {
-      // If the write fails, there's nothing we can do.
-      // But this block seems necessary to silence the warning.
+  Spawn(set, command, output_pipe[1]);
+  set_->Watch(this);
+  output_.SetLimit(set->output_limit_, set->spill_dir_);
+  start_millis_ = GetTimeMillis();
+  return true;
+}
+
+bool Subprocess::StartWorker(SubprocessSet* set, const string& command) {
+  // A socket rather than pipes, so that writing to a worker that died
+  // fails instead of raising SIGPIPE.
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    Fatal("socketpair: %s", strerror(errno));
+  fd_ = fds[0];
+  SetCloseOnExec(fd_);
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+  worker_ = true;
+  Spawn(set, command, fds[1]);
+  return true;
+}
+
+bool Subprocess::Request(const string& command) {
+  assert(worker_ && !busy_);
+  if (fd_ < 0)
+    return false;
+  // Each request is its length in decimal, a newline, then the command.
+  char header[32];
+  snprintf(header, sizeof(header), "%lu\n", (unsigned long)command.size());
+  string message = header + command;
+  for (size_t sent = 0; sent < message.size(); ) {
+    ssize_t len = send(fd_, message.data() + sent, message.size() - sent,
+                       MSG_NOSIGNAL);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
     }
-    _exit(1);
+    sent += len;
   }
 
-  close(output_pipe[1]);
+  output_ = CommandOutput();
+  output_.SetLimit(set_->output_limit_, set_->spill_dir_);
+  response_.clear();
+  busy_ = true;
+  set_->Watch(this);
+  start_millis_ = GetTimeMillis();
   return true;
 }
 
+bool Subprocess::Idle() const {
+  return worker_ && !busy_ && fd_ >= 0;
+}
+
+void Subprocess::Spawn(SubprocessSet* set, const string& command,
+                       int child_fd, bool shell) {
+  // posix_spawn() avoids copying our page tables into the child, which
+  // fork() does even though the child execs right away.  The posix_spawn
+  // functions return an error number rather than setting errno.
+  posix_spawn_file_actions_t actions;
+  int err = posix_spawn_file_actions_init(&actions);
+  if (err != 0)
+    Fatal("posix_spawn_file_actions_init: %s", strerror(err));
+  err = worker_
+      ? posix_spawn_file_actions_adddup2(&actions, child_fd, 0)
+      : posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY,
+                                         0);
+  if (err == 0)
+    err = posix_spawn_file_actions_adddup2(&actions, child_fd, 1);
+  if (err == 0 && !worker_)
+    err = posix_spawn_file_actions_adddup2(&actions, child_fd, 2);
+  if (err == 0)
+    err = posix_spawn_file_actions_addclose(&actions, child_fd);
+  if (err != 0)
+    Fatal("posix_spawn_file_actions: %s", strerror(err));
+
+  posix_spawnattr_t attr;
+  err = posix_spawnattr_init(&attr);
+  if (err != 0)
+    Fatal("posix_spawnattr_init: %s", strerror(err));
+#ifdef POSIX_SPAWN_USEVFORK
+  err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+  if (err != 0)
+    Fatal("posix_spawnattr_setflags: %s", strerror(err));
+#endif
+
+  err = -1;
+  direct_ = false;
+  vector<string> words;
+  if (!shell && set->direct_exec() && SplitSimpleCommand(command, &words)) {
+    vector<char*> argv;
+    for (vector<string>::iterator i = words.begin(); i != words.end(); ++i)
+      argv.push_back(const_cast<char*>(i->c_str()));
+    argv.push_back(NULL);
+    // If this fails (say, the program is a shell builtin), retry through
+    // the shell, which also gives the usual error message.
+    err = posix_spawnp(&pid_, argv[0], &actions, &attr, &argv[0], environ);
+    if (err == 0 && set->exec_errors_async_) {
+      // It may still fail in the child; see RetryThroughShell().
+      direct_ = true;
+      command_ = command;
+    }
+  }
+  if (err != 0) {
+    const char* argv[] = { "/bin/sh", "-c", command.c_str(), NULL };
+    err = posix_spawn(&pid_, argv[0], &actions, &attr,
+                      const_cast<char**>(argv), environ);
+  }
+  if (err != 0)
+    Fatal("posix_spawn: %s", strerror(err));
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+
+  close(child_fd);
+  set_ = set;
+}
+
 void Subprocess::OnPipeReady() {
-  char buf[4 << 10];
-  ssize_t len = read(fd_, buf, sizeof(buf));
+  if (worker_) {
+    char buf[4 << 10];
+    ssize_t len = read(fd_, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      return;
+    if (len <= 0) {
+      WorkerGone("exited");
+      return;
+    }
+    response_.append(buf, len);
+    ParseResponse();
+    return;
+  }
+
+  // Read straight into the output, in chunks that grow while the command
+  // keeps the pipe full.
+  const size_t kMaxReadSize = 1 << 20;
+  ssize_t len = read(fd_, output_.Reserve(read_size_), read_size_);
+  output_.Commit(len > 0 ? len : 0);
   if (len > 0) {
-    buf_.append(buf, len);
+    if ((size_t)len == read_size_ && read_size_ < kMaxReadSize)
+      read_size_ *= 2;
   } else {
     if (len < 0)
       Fatal("read: %s", strerror(errno));
+    if (set_)
+      set_->Unwatch(this);
     close(fd_);
     fd_ = -1;
+    if (direct_ && !output_.streaming() && output_.str().empty() &&
+        RetryThroughShell()) {
+      return;
+    }
+    output_.Finish();
   }
 }
 
+void Subprocess::ParseResponse() {
+  // Each response is the exit status and the length of the output in
+  // decimal, separated by a space, a newline, then the output.
+  size_t newline = response_.find('\n');
+  if (newline == string::npos) {
+    if (response_.size() > 64)
+      WorkerGone("sent a malformed response");
+    return;
+  }
+  int status;
+  unsigned long size;
+  char extra;
+  if (sscanf(response_.substr(0, newline).c_str(), "%d %lu%c", &status, &size,
+             &extra) != 2) {
+    WorkerGone("sent a malformed response");
+    return;
+  }
+  if (response_.size() - newline - 1 < size)
+    return;
+  if (response_.size() - newline - 1 > size) {
+    WorkerGone("sent more than asked for");
+    return;
+  }
+
+  output_.Append(response_.data() + newline + 1, size);
+  output_.Finish();
+  response_.clear();
+  exit_status_ = status;
+  busy_ = false;
+  set_->Unwatch(this);
+}
+
+void Subprocess::WorkerGone(const char* why) {
+  set_->Unwatch(this);
+  close(fd_);
+  fd_ = -1;
+  busy_ = false;
+  exit_status_ = -1;
+  string message = string("ninja: persistent worker ") + why + "\n";
+  output_.Append(message.data(), message.size());
+  output_.Finish();
+}
+
+bool Subprocess::RetryThroughShell() {
+  direct_ = false;
+  // The child closed its output, so it's exiting.
+  Reap();
+  if (!WIFEXITED(wait_status_) || WEXITSTATUS(wait_status_) != 127)
+    return false;
+
+  int output_pipe[2];
+  if (pipe(output_pipe) < 0)
+    Fatal("pipe: %s", strerror(errno));
+  fd_ = output_pipe[0];
+  SetCloseOnExec(fd_);
+  Spawn(set_, command_, output_pipe[1], true);
+  set_->Watch(this);
+  return true;
+}
+
 bool Subprocess::Finish() {
+  // A worker is reaped once it's gone, which fails its last request.
+  if (worker_ && fd_ >= 0)
+    return exit_status_ == 0;
+  // A command retried through the shell may have been reaped already.
+  if (pid_ != -1)
+    Reap();
+  if (worker_)
+    return false;
+  return WIFEXITED(wait_status_) && WEXITSTATUS(wait_status_) == 0;
+}
+
+void Subprocess::Reap() {
   assert(pid_ != -1);
-  int status;
-  if (waitpid(pid_, &status, 0) < 0)
-    Fatal("waitpid(%d): %s", pid_, strerror(errno));
+  struct rusage rusage;
+  if (worker_)
+    ReapWorker(pid_, &wait_status_, &rusage);
+  else if (wait4(pid_, &wait_status_, 0, &rusage) < 0)
+    Fatal("wait4(%d): %s", pid_, strerror(errno));
   pid_ = -1;
 
-  if (WIFEXITED(status)) {
-    int exit = WEXITSTATUS(status);
-    if (exit == 0)
-      return true;
-  }
-  return false;
+  usage_.user_millis = (int)(rusage.ru_utime.tv_sec * 1000 +
+                             rusage.ru_utime.tv_usec / 1000);
+  usage_.system_millis = (int)(rusage.ru_stime.tv_sec * 1000 +
+                               rusage.ru_stime.tv_usec / 1000);
+#ifdef __APPLE__
+  usage_.max_rss = rusage.ru_maxrss;  // Already in bytes.
+#else
+  usage_.max_rss = (int64_t)rusage.ru_maxrss * 1024;
+#endif
 }
 
 bool Subprocess::Done() const {
-  return fd_ == -1;
+  return worker_ ? !busy_ : fd_ == -1;
 }
 
 const string& Subprocess::GetOutput() const {
-  return buf_;
+  return output_.str();
 }
 
-SubprocessSet::SubprocessSet() {}
-SubprocessSet::~SubprocessSet() {}
+SubprocessSet::SubprocessSet()
+    : direct_exec_(false), output_limit_(0), stream_after_(0),
+      woken_(false), streaming_(NULL),
+      exec_errors_async_(EXEC_ERRORS_ASYNC) {
+  if (pipe(wake_fds_) < 0)
+    Fatal("pipe: %s", strerror(errno));
+  for (int i = 0; i < 2; ++i) {
+    SetCloseOnExec(wake_fds_[i]);
+    fcntl(wake_fds_[i], F_SETFL, fcntl(wake_fds_[i], F_GETFL) | O_NONBLOCK);
+  }
+
+  // If the descriptor can't be created we just use poll() instead.
+#if defined(USE_EPOLL)
+  poller_ = epoll_create(64);
+#elif defined(USE_KQUEUE)
+  poller_ = kqueue();
+#else
+  poller_ = -1;
+#endif
+  if (poller_ < 0)
+    return;
+  SetCloseOnExec(poller_);
+  // The wake pipe is told from the subprocesses by its lack of one.
+#if defined(USE_EPOLL)
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(poller_, EPOLL_CTL_ADD, wake_fds_[0], &event) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#elif defined(USE_KQUEUE)
+  struct kevent event;
+  EV_SET(&event, wake_fds_[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+  if (kevent(poller_, &event, 1, NULL, 0, NULL) < 0)
+    Fatal("kevent: %s", strerror(errno));
+#endif
+}
+
+SubprocessSet::~SubprocessSet() {
+  if (poller_ >= 0)
+    close(poller_);
+  close(wake_fds_[0]);
+  close(wake_fds_[1]);
+}
+
+void SubprocessSet::Wake() {
+  // A full pipe already has a wakeup in it.
+  char byte = 0;
+  while (write(wake_fds_[1], &byte, 1) < 0 && errno == EINTR) {}
+}
+
+void SubprocessSet::OnWake() {
+  char buf[64];
+  while (read(wake_fds_[0], buf, sizeof(buf)) > 0) {}
+  woken_ = true;
+}
 
 void SubprocessSet::Add(Subprocess* subprocess) {
   running_.push_back(subprocess);
 }
 
-void SubprocessSet::DoWork() {
-  vector<pollfd> fds;
+void SubprocessSet::Watch(Subprocess* subprocess) {
+  if (poller_ < 0)
+    return;
+#if defined(USE_EPOLL)
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = subprocess;
+  if (epoll_ctl(poller_, EPOLL_CTL_ADD, subprocess->fd_, &event) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#elif defined(USE_KQUEUE)
+  struct kevent event;
+  EV_SET(&event, subprocess->fd_, EVFILT_READ, EV_ADD, 0, 0, subprocess);
+  if (kevent(poller_, &event, 1, NULL, 0, NULL) < 0)
+    Fatal("kevent: %s", strerror(errno));
+#else
+  NINJA_UNUSED_ARG(subprocess);
+#endif
+}
+
+void SubprocessSet::Unwatch(Subprocess* subprocess) {
+  if (poller_ < 0)
+    return;
+#if defined(USE_EPOLL)
+  // Closing the pipe isn't enough: a child forked meanwhile may still
+  // hold a copy of it until it execs, which keeps the registration alive.
+  epoll_event event;
+  if (epoll_ctl(poller_, EPOLL_CTL_DEL, subprocess->fd_, &event) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#else
+  // kqueue drops events for a descriptor as soon as we close it.
+  NINJA_UNUSED_ARG(subprocess);
+#endif
+}
 
-  map<int, Subprocess*> fd_to_subprocess;
+void SubprocessSet::OnReady(Subprocess* subprocess) {
+  subprocess->OnPipeReady();
+  if (!subprocess->Done()) {
+    if (stream_after_ > 0 && !streaming_ &&
+        GetTimeMillis() - subprocess->start_millis_ >= stream_after_) {
+      streaming_ = subprocess;
+      printf("\n[%s]\n", subprocess->label_.c_str());
+      subprocess->output_.Stream(stdout);
+    }
+    return;
+  }
+  if (subprocess == streaming_)
+    streaming_ = NULL;
+  finished_.push(subprocess);
+  // Order doesn't matter, so swap the last one into its place.
+  vector<Subprocess*>::iterator i =
+      std::find(running_.begin(), running_.end(), subprocess);
+  if (i == running_.end())
+    return;
+  *i = running_.back();
+  running_.pop_back();
+}
+
+void SubprocessSet::DoWork(int timeout_millis) {
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+  if (poller_ >= 0) {
+    const int kMaxEvents = 64;
+#if defined(USE_EPOLL)
+    epoll_event events[kMaxEvents];
+    int ret = epoll_wait(poller_, events, kMaxEvents, timeout_millis);
+#else
+    struct kevent events[kMaxEvents];
+    timespec timeout;
+    timeout.tv_sec = timeout_millis / 1000;
+    timeout.tv_nsec = (timeout_millis % 1000) * 1000000;
+    int ret = kevent(poller_, NULL, 0, events, kMaxEvents,
+                     timeout_millis < 0 ? NULL : &timeout);
+#endif
+    if (ret == -1) {
+      if (errno != EINTR)
+        perror("ninja: wait");
+      return;
+    }
+
+    for (int i = 0; i < ret; ++i) {
+#if defined(USE_EPOLL)
+      Subprocess* subprocess = static_cast<Subprocess*>(events[i].data.ptr);
+#else
+      Subprocess* subprocess = static_cast<Subprocess*>(events[i].udata);
+#endif
+      if (subprocess)
+        OnReady(subprocess);
+      else
+        OnWake();
+    }
+    return;
+  }
+#endif
+  PollRunning(timeout_millis);
+}
+
+void SubprocessSet::PollRunning(int timeout_millis) {
+  vector<pollfd> fds(1);
+  vector<Subprocess*> subprocs(1, (Subprocess*)NULL);
+  fds[0].fd = wake_fds_[0];
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
   for (vector<Subprocess*>::iterator i = running_.begin();
        i != running_.end(); ++i) {
     int fd = (*i)->fd_;
     if (fd >= 0) {
-      fd_to_subprocess[fd] = *i;
+      subprocs.push_back(*i);
       fds.resize(fds.size() + 1);
       pollfd* newfd = &fds.back();
       newfd->fd = fd;
@@ -147,23 +573,18 @@ void SubprocessSet::DoWork() {
     }
   }
 
-  int ret = poll(&fds.front(), fds.size(), -1);
+  int ret = poll(&fds.front(), fds.size(), timeout_millis);
   if (ret == -1) {
     if (errno != EINTR)
       perror("ninja: poll");
     return;
   }
 
-  for (size_t i = 0; i < fds.size(); ++i) {
-    if (fds[i].revents) {
-      Subprocess* subproc = fd_to_subprocess[fds[i].fd];
-      subproc->OnPipeReady();
-      if (subproc->Done()) {
-        finished_.push(subproc);
-        std::remove(running_.begin(), running_.end(), subproc);
-        running_.resize(running_.size() - 1);
-      }
-    }
+  if (fds[0].revents)
+    OnWake();
+  for (size_t i = 1; i < fds.size(); ++i) {
+    if (fds[i].revents)
+      OnReady(subprocs[i]);
   }
 }
 
@@ -15,6 +15,7 @@
 #ifndef NINJA_SUBPROCESS_H_
 #define NINJA_SUBPROCESS_H_
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <queue>
@@ -24,6 +25,19 @@ using namespace std;
 #include <windows.h>
 #endif
 
+#include "command_output.h"
+
+/// What a finished command used, as far as the system tells; zero where
+/// it doesn't.
+struct ResourceUsage {
+  ResourceUsage() : user_millis(0), system_millis(0), max_rss(0) {}
+  /// CPU time spent by the command and the processes it waited for.
+  int user_millis;
+  int system_millis;
+  /// The peak resident set size, in bytes, of its largest process.
+  int64_t max_rss;
+};
+
 /// Subprocess wraps a single async subprocess.  It is entirely
 /// passive: it expects the caller to notify it when its fds are ready
 /// for reading, as well as call Finish() to reap the child once done()
@@ -36,12 +50,32 @@ struct Subprocess {
   /// Returns true on successful process exit.
   bool Finish();
 
+  /// Start \a command as a persistent worker, which runs one command
+  /// sent by Request() at a time and stays around for the next.  Its
+  /// stdin and stdout carry the requests and their results; its stderr is
+  /// ours.  Returns false where workers aren't supported (Windows).
+  bool StartWorker(struct SubprocessSet* set, const string& command);
+  /// Send \a command to an Idle() worker.  Once Done(), Finish() tells if
+  /// it succeeded and GetOutput() what it printed, and the worker is idle
+  /// again unless it exited.  Returns false if the worker is gone.
+  bool Request(const string& command);
+  /// Whether this is a worker waiting for a request.
+  bool Idle() const;
+
   bool Done() const;
 
   const string& GetOutput() const;
+  /// What the command used; set by Finish().
+  const ResourceUsage& usage() const { return usage_; }
+
+  /// What to call the command when its output is streamed, e.g. its
+  /// description.
+  void set_label(const string& label) { label_ = label; }
 
  private:
-  string buf_;
+  CommandOutput output_;
+  string label_;
+  ResourceUsage usage_;
 
 #ifdef _WIN32
   /// Set up pipe_ as the parent-side pipe of the subprocess; return the
@@ -51,31 +85,134 @@ struct Subprocess {
   HANDLE child_;
   HANDLE pipe_;
   OVERLAPPED overlapped_;
-  char overlapped_buf_[4 << 10];
+  /// Where the pending read goes; grows while reads fill it.
+  vector<char> overlapped_buf_;
 #else
   int fd_;
   pid_t pid_;
+  /// The set whose poller fd_ is registered with.
+  SubprocessSet* set_;
+  /// How much to read at a time; grows while reads fill it.
+  size_t read_size_;
+  /// When the command started, for SubprocessSet::stream_after().
+  int64_t start_millis_;
+
+  /// Spawn \a command with \a child_fd as its stdin and stdout, and for a
+  /// plain command its stderr too.  Unless \a shell, a simple command may
+  /// be run directly (see SubprocessSet::direct_exec()).
+  void Spawn(SubprocessSet* set, const string& command, int child_fd,
+             bool shell = false);
+  /// Wait for the child to exit, filling in wait_status_ and usage_.
+  void Reap();
+  /// Called once a command run directly closed its output without
+  /// printing anything.  If the exec failed in the child, run the command
+  /// again through the shell, as a failure posix_spawn() reported would
+  /// have been.  Returns true if it did.
+  bool RetryThroughShell();
+  /// Parse what a worker sent so far, finishing the request if complete.
+  void ParseResponse();
+  /// Note that a worker exited or broke the protocol, failing the request.
+  void WorkerGone(const char* why);
+
+  /// For a worker: whether a request is outstanding, what came back that
+  /// doesn't make up a whole response yet, and the last exit status.
+  bool worker_;
+  bool busy_;
+  string response_;
+  int exit_status_;
+
+  /// Whether the command was run directly, and what it was.
+  bool direct_;
+  string command_;
+  /// What wait4() reported, once reaped.
+  int wait_status_;
 #endif
 
   friend struct SubprocessSet;
 };
 
-/// SubprocessSet runs a poll() loop around a set of Subprocesses.
-/// DoWork() waits for any state change in subprocesses; finished_
-/// is a queue of subprocesses as they finish.
+/// SubprocessSet runs an event loop around a set of Subprocesses.
+/// DoWork() waits for any state change in subprocesses, or until a
+/// timeout in milliseconds passes if not negative; finished_ is a queue
+/// of subprocesses as they finish.
+///
+/// Where available, pipes are registered once with a persistent epoll
+/// (Linux) or kqueue (BSD, Mac) descriptor, so a wakeup costs time in
+/// the number of ready subprocesses rather than the number running.
+/// Elsewhere, or if that descriptor can't be created, DoWork() falls
+/// back to poll().  On Windows, pipes share an I/O completion port, and
+/// DoWork() handles all the completions that are ready in one go.
 struct SubprocessSet {
   SubprocessSet();
   ~SubprocessSet();
 
   void Add(Subprocess* subprocess);
-  void DoWork();
+  void DoWork(int timeout_millis = -1);
   Subprocess* NextFinished();
 
+  /// Make a DoWork() in progress, or the next one, return soon.  May be
+  /// called from any thread.
+  void Wake();
+  /// Whether a DoWork() returned because of Wake() since the last call.
+  bool Woken() {
+    bool woken = woken_;
+    woken_ = false;
+    return woken;
+  }
+
+  /// Whether to run commands consisting of just a program and plain
+  /// arguments directly rather than through the shell.  Only honored on
+  /// POSIX systems.
+  bool direct_exec() const { return direct_exec_; }
+  void set_direct_exec(bool direct_exec) { direct_exec_ = direct_exec; }
+
+  /// Keep at most about \a limit bytes of each command's output (0 for no
+  /// limit), spilling all of it to a file in \a spill_dir if not empty.
+  void set_output_limit(size_t limit, const string& spill_dir) {
+    output_limit_ = limit;
+    spill_dir_ = spill_dir;
+  }
+  /// Once a command has run for \a millis milliseconds (if positive),
+  /// pass its output through to stdout as it arrives rather than keeping
+  /// it, unless another command's output already is.  Only honored on
+  /// POSIX systems.
+  void set_stream_after(int millis) { stream_after_ = millis; }
+
   vector<Subprocess*> running_;
   queue<Subprocess*> finished_;
+  bool direct_exec_;
+  size_t output_limit_;
+  string spill_dir_;
+  int stream_after_;
+  bool woken_;
 
 #ifdef _WIN32
   HANDLE ioport_;
+  /// A job object holding all the children, so that any still running
+  /// die with us.  NULL if it couldn't be created.
+  HANDLE job_;
+#else
+  /// Register or unregister \a subprocess's pipe with poller_.
+  void Watch(Subprocess* subprocess);
+  void Unwatch(Subprocess* subprocess);
+  /// Read from a subprocess whose pipe is ready, moving it to finished_
+  /// once it's done.
+  void OnReady(Subprocess* subprocess);
+  /// Wait for any of running_ with a poll() call built from scratch.
+  void PollRunning(int timeout_millis);
+  /// Empty wake_fds_ after Wake(), noting it in woken_.
+  void OnWake();
+
+  /// The epoll or kqueue descriptor, or -1 to use poll().
+  int poller_;
+  /// A non-blocking pipe Wake() writes to, watched alongside the
+  /// subprocesses.
+  int wake_fds_[2];
+  /// The subprocess whose output is being streamed, if any.
+  Subprocess* streaming_;
+  /// Whether posix_spawn() may succeed even though the exec in the child
+  /// failed, the child then exiting with 127, as in glibc before 2.24.
+  bool exec_errors_async_;
 #endif
 };
 
@@ -14,7 +14,14 @@
 
 #include "subprocess.h"
 
+#include <stdio.h>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "test.h"
+#include "util.h"
 
 namespace {
 
@@ -77,6 +84,21 @@ TEST_F(SubprocessTest, SetWithSingle) {
   ASSERT_EQ(1u, subprocs_.finished_.size());
 }
 
+TEST_F(SubprocessTest, ResourceUsage) {
+  Subprocess* subproc = new Subprocess;
+  EXPECT_TRUE(subproc->Start(&subprocs_, kSimpleCommand));
+  subprocs_.Add(subproc);
+
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+  }
+  ASSERT_TRUE(subproc->Finish());
+  // Any process takes up some memory.
+  EXPECT_GT(subproc->usage().max_rss, 0);
+  EXPECT_GE(subproc->usage().user_millis, 0);
+  EXPECT_GE(subproc->usage().system_millis, 0);
+}
+
 TEST_F(SubprocessTest, SetWithMulti) {
   Subprocess* processes[3];
   const char* kCommands[3] = {
@@ -118,3 +140,220 @@ TEST_F(SubprocessTest, SetWithMulti) {
   }
 }
 
+
+// Run more commands at once than DoWork() handles in one wakeup.
+TEST_F(SubprocessTest, Timeout) {
+  Subprocess* subproc = new Subprocess;
+#ifdef _WIN32
+  EXPECT_TRUE(subproc->Start(&subprocs_, "cmd /c ping -n 2 127.0.0.1"));
+#else
+  EXPECT_TRUE(subproc->Start(&subprocs_, "sleep 1"));
+#endif
+  subprocs_.Add(subproc);
+
+  // Returns without the command having finished.
+  subprocs_.DoWork(10);
+  EXPECT_FALSE(subproc->Done());
+
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_TRUE(subproc->Finish());
+}
+
+TEST_F(SubprocessTest, Wake) {
+  Subprocess* subproc = new Subprocess;
+#ifdef _WIN32
+  EXPECT_TRUE(subproc->Start(&subprocs_, "cmd /c ping -n 2 127.0.0.1"));
+#else
+  EXPECT_TRUE(subproc->Start(&subprocs_, "sleep 1"));
+#endif
+  subprocs_.Add(subproc);
+
+  // An earlier Wake() makes the next DoWork() return at once.
+  EXPECT_FALSE(subprocs_.Woken());
+  subprocs_.Wake();
+  subprocs_.DoWork();
+  EXPECT_TRUE(subprocs_.Woken());
+  EXPECT_FALSE(subprocs_.Woken());
+  EXPECT_FALSE(subproc->Done());
+
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_TRUE(subproc->Finish());
+}
+
+TEST_F(SubprocessTest, SetWithLots) {
+  const size_t kNumProcs = 100;
+  vector<Subprocess*> procs;
+  for (size_t i = 0; i < kNumProcs; ++i) {
+    Subprocess* subproc = new Subprocess;
+#ifdef _WIN32
+    ASSERT_TRUE(subproc->Start(&subprocs_, "cmd /c echo hi"));
+#else
+    ASSERT_TRUE(subproc->Start(&subprocs_, "echo hi"));
+#endif
+    subprocs_.Add(subproc);
+    procs.push_back(subproc);
+  }
+
+  while (!subprocs_.running_.empty())
+    subprocs_.DoWork();
+
+  ASSERT_EQ(kNumProcs, subprocs_.finished_.size());
+  for (size_t i = 0; i < kNumProcs; ++i) {
+    ASSERT_TRUE(procs[i]->Done());
+    ASSERT_TRUE(procs[i]->Finish());
+    ASSERT_NE("", procs[i]->GetOutput());
+    delete procs[i];
+  }
+}
+
+#ifndef _WIN32
+// Commands that need the shell still get it with direct exec enabled.
+TEST_F(SubprocessTest, DirectExec) {
+  subprocs_.set_direct_exec(true);
+  const char* kCommands[][2] = {
+    { "echo  hi   there", "hi there\n" },
+    { "echo -DFOO=1 a.c", "-DFOO=1 a.c\n" },
+    { "echo 'a  b'", "a  b\n" },
+    { "echo a > /dev/null; echo b", "b\n" },
+    { "FOO=bar env | grep ^FOO=", "FOO=bar\n" },
+    // A builtin, not a program.
+    { "cd /", "" },
+  };
+  for (size_t i = 0; i < sizeof(kCommands) / sizeof(kCommands[0]); ++i) {
+    Subprocess subproc;
+    ASSERT_TRUE(subproc.Start(&subprocs_, kCommands[i][0]));
+    subprocs_.Add(&subproc);
+    while (!subproc.Done())
+      subprocs_.DoWork();
+    EXPECT_TRUE(subproc.Finish()) << kCommands[i][0];
+    EXPECT_EQ(kCommands[i][1], subproc.GetOutput());
+    ASSERT_EQ(&subproc, subprocs_.NextFinished());
+  }
+}
+
+TEST_F(SubprocessTest, DirectExecNoSuchCommand) {
+  subprocs_.set_direct_exec(true);
+  Subprocess subproc;
+  ASSERT_TRUE(subproc.Start(&subprocs_, "ninja_no_such_command"));
+  subprocs_.Add(&subproc);
+  while (!subproc.Done())
+    subprocs_.DoWork();
+  EXPECT_FALSE(subproc.Finish());
+  EXPECT_NE("", subproc.GetOutput());
+}
+
+// Where a failed exec only shows as the child exiting with 127, the
+// command is run again through the shell.
+TEST_F(SubprocessTest, DirectExecFailsInChild) {
+  subprocs_.set_direct_exec(true);
+  subprocs_.exec_errors_async_ = true;
+  // Stands in for a program that can't be exec()ed: the first run exits
+  // with 127 without a word, the second, through the shell, works.
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("Ninja-SubprocessTest");
+  FILE* f = fopen("tool", "w");
+  ASSERT_TRUE(f);
+  fprintf(f, "#!/bin/sh\n"
+             "test -e ran || { touch ran; exit 127; }\n"
+             "echo retried $1\n");
+  ASSERT_EQ(0, fclose(f));
+  ASSERT_EQ(0, chmod("tool", 0755));
+
+  Subprocess subproc;
+  ASSERT_TRUE(subproc.Start(&subprocs_, "./tool arg"));
+  subprocs_.Add(&subproc);
+  while (!subproc.Done())
+    subprocs_.DoWork();
+  EXPECT_TRUE(subproc.Finish());
+  EXPECT_EQ("retried arg\n", subproc.GetOutput());
+  ASSERT_EQ(&subproc, subprocs_.NextFinished());
+
+  // Those that print something failed for real.
+  unlink("ran");
+  f = fopen("tool", "w");
+  ASSERT_TRUE(f);
+  fprintf(f, "#!/bin/sh\n"
+             "test -e ran && echo retried\n"
+             "touch ran; echo failed; exit 127\n");
+  ASSERT_EQ(0, fclose(f));
+  Subprocess failed;
+  ASSERT_TRUE(failed.Start(&subprocs_, "./tool"));
+  subprocs_.Add(&failed);
+  while (!failed.Done())
+    subprocs_.DoWork();
+  EXPECT_FALSE(failed.Finish());
+  EXPECT_EQ("failed\n", failed.GetOutput());
+  temp_dir.Cleanup();
+}
+
+// A worker running each command it's sent through the shell, numbering
+// its answers.
+const char kShellWorker[] =
+    "while read n; do"
+    "  c=$(head -c $n); o=$(sh -c \"$c\" 2>&1); s=$?; i=$((i+1));"
+    "  o=\"$i:$o\"; printf '%d %d\\n%s' $s ${#o} \"$o\";"
+    "done";
+
+TEST_F(SubprocessTest, Worker) {
+  Subprocess worker;
+  ASSERT_TRUE(worker.StartWorker(&subprocs_, kShellWorker));
+  EXPECT_TRUE(worker.Idle());
+
+  ASSERT_TRUE(worker.Request("echo hello"));
+  EXPECT_FALSE(worker.Idle());
+  subprocs_.Add(&worker);
+  while (!worker.Done())
+    subprocs_.DoWork();
+  EXPECT_TRUE(worker.Finish());
+  EXPECT_EQ("1:hello", worker.GetOutput());
+  ASSERT_EQ(&worker, subprocs_.NextFinished());
+  EXPECT_TRUE(worker.Idle());
+
+  // The same process answers the next request.
+  ASSERT_TRUE(worker.Request("echo oops; false"));
+  subprocs_.Add(&worker);
+  while (!worker.Done())
+    subprocs_.DoWork();
+  EXPECT_FALSE(worker.Finish());
+  EXPECT_EQ("2:oops", worker.GetOutput());
+  EXPECT_TRUE(worker.Idle());
+}
+
+TEST_F(SubprocessTest, WorkerExits) {
+  Subprocess worker;
+  ASSERT_TRUE(worker.StartWorker(&subprocs_, "read n; echo 0 10"));
+  ASSERT_TRUE(worker.Request("true"));
+  subprocs_.Add(&worker);
+  while (!worker.Done())
+    subprocs_.DoWork();
+  EXPECT_FALSE(worker.Finish());
+  EXPECT_EQ("ninja: persistent worker exited\n", worker.GetOutput());
+  EXPECT_FALSE(worker.Idle());
+  EXPECT_FALSE(worker.Request("true"));
+}
+
+TEST_F(SubprocessTest, WorkerIgnoringEOF) {
+  int64_t start = GetTimeMillis();
+  {
+    // Neither the closed pipe nor SIGTERM stops it.
+    Subprocess worker;
+    ASSERT_TRUE(worker.StartWorker(&subprocs_,
+        "trap '' TERM; read n; echo garbage; while :; do sleep 1; done"));
+    ASSERT_TRUE(worker.Request("true"));
+    subprocs_.Add(&worker);
+    while (!worker.Done())
+      subprocs_.DoWork();
+    EXPECT_FALSE(worker.Finish());
+    EXPECT_EQ("ninja: persistent worker sent a malformed response\n",
+              worker.GetOutput());
+  }
+  {
+    // Destroying an idle worker reaps it too.
+    Subprocess worker;
+    ASSERT_TRUE(worker.StartWorker(&subprocs_, "exec sleep 30"));
+  }
+  EXPECT_LT(GetTimeMillis() - start, 10000);
+}
+#endif
@@ -18,6 +18,9 @@
 
 #include <errno.h>
 
+#include "build.h"
+#include "build_log.h"
+#include "graph.h"
 #include "parsers.h"
 #include "util.h"
 
@@ -82,6 +85,12 @@ Node* StateTestWithBuiltinRules::GetNode(const string& path) {
   return state_.GetNode(path);
 }
 
+void StateTestWithBuiltinRules::RecordDuration(BuildLog* log,
+                                               const string& output,
+                                               int millis) {
+  log->RecordCommand(GetNode(output)->in_edge(), 1000, 1000 + millis);
+}
+
 void AssertParse(State* state, const char* input) {
   ManifestParser parser(state, NULL);
   string err;
@@ -89,6 +98,12 @@ void AssertParse(State* state, const char* input) {
   ASSERT_EQ("", err);
 }
 
+BuildConfig QuietBuildConfig() {
+  BuildConfig config;
+  config.verbosity = BuildConfig::QUIET;
+  return config;
+}
+
 void VirtualFileSystem::Create(const string& path, int time,
                                const string& contents) {
   files_[path].mtime = time;
@@ -129,6 +144,44 @@ int VirtualFileSystem::RemoveFile(const string& path) {
   }
 }
 
+int VirtualFileSystem::RemoveDir(const string& path) {
+  vector<string>::iterator dir =
+      find(directories_made_.begin(), directories_made_.end(), path);
+  if (dir == directories_made_.end())
+    return 1;
+  // Refuse if any file or directory lies beneath it.
+  string prefix = path + "/";
+  FileMap::iterator i = files_.lower_bound(prefix);
+  if (i != files_.end() && i->first.compare(0, prefix.size(), prefix) == 0)
+    return 1;
+  for (vector<string>::iterator d = directories_made_.begin();
+       d != directories_made_.end(); ++d) {
+    if (d->compare(0, prefix.size(), prefix) == 0)
+      return 1;
+  }
+  directories_made_.erase(dir);
+  directories_removed_.insert(path);
+  return 0;
+}
+
+bool VirtualFileSystem::SetMTime(const string& path, TimeStamp mtime) {
+  FileMap::iterator i = files_.find(path);
+  if (i == files_.end())
+    return false;
+  i->second.mtime = mtime;
+  return true;
+}
+
+bool VirtualFileSystem::CloneFile(const string& from, const string& to) {
+  FileMap::iterator i = files_.find(from);
+  if (i == files_.end())
+    return false;
+  Entry entry = i->second;
+  entry.mtime = now_;
+  files_[to] = entry;
+  return true;
+}
+
 void ScopedTempDir::CreateAndEnter(const string& name) {
   // First change into the system temp dir and save it for cleanup.
   start_dir_ = GetSystemTempDir();
@@ -23,6 +23,8 @@
 
 // Support utilites for tests.
 
+struct BuildConfig;
+struct BuildLog;
 struct Node;
 
 /// A base test fixture that includes a State object with a
@@ -31,15 +33,23 @@ struct StateTestWithBuiltinRules : public testing::Test {
   StateTestWithBuiltinRules();
   Node* GetNode(const string& path);
 
+  /// Record in \a log that building \a output took \a millis.
+  void RecordDuration(BuildLog* log, const string& output, int millis);
+
   State state_;
 };
 
 void AssertParse(State* state, const char* input);
 
+/// A BuildConfig that doesn't print the build's progress.
+BuildConfig QuietBuildConfig();
+
 /// An implementation of DiskInterface that uses an in-memory representation
 /// of disk state.  It also logs file accesses and directory creations
 /// so it can be used by tests to verify disk access patterns.
 struct VirtualFileSystem : public DiskInterface {
+  VirtualFileSystem() : now_(1) {}
+
   /// "Create" a file with a given mtime and contents.
   void Create(const string& path, int time, const string& contents);
 
@@ -48,6 +58,9 @@ struct VirtualFileSystem : public DiskInterface {
   virtual bool MakeDir(const string& path);
   virtual string ReadFile(const string& path, string* err);
   virtual int RemoveFile(const string& path);
+  virtual int RemoveDir(const string& path);
+  virtual bool SetMTime(const string& path, TimeStamp mtime);
+  virtual bool CloneFile(const string& from, const string& to);
 
   /// An entry for a single in-memory file.
   struct Entry {
@@ -55,11 +68,14 @@ struct VirtualFileSystem : public DiskInterface {
     string contents;
   };
 
+  /// The mtime given to copies made by CloneFile().
+  int now_;
   vector<string> directories_made_;
   vector<string> files_read_;
   typedef map<string, Entry> FileMap;
   FileMap files_;
   set<string> files_removed_;
+  set<string> directories_removed_;
 };
 
 struct ScopedTempDir {
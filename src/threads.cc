@@ -0,0 +1,253 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "threads.h"
+
+#include <vector>
+using namespace std;
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+#ifdef _WIN32
+Mutex::Mutex() { InitializeCriticalSection(&lock_); }
+Mutex::~Mutex() { DeleteCriticalSection(&lock_); }
+void Mutex::Acquire() { EnterCriticalSection(&lock_); }
+void Mutex::Release() { LeaveCriticalSection(&lock_); }
+#else
+Mutex::Mutex() { pthread_mutex_init(&lock_, NULL); }
+Mutex::~Mutex() { pthread_mutex_destroy(&lock_); }
+void Mutex::Acquire() { pthread_mutex_lock(&lock_); }
+void Mutex::Release() { pthread_mutex_unlock(&lock_); }
+#endif
+
+#ifdef _WIN32
+Event::Event() {
+  event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!event_)
+    Fatal("CreateEvent: %s", GetLastErrorString().c_str());
+}
+
+Event::~Event() { CloseHandle(event_); }
+
+void Event::Signal() { SetEvent(event_); }
+
+bool Event::Wait(int timeout_millis) {
+  return WaitForSingleObject(event_, timeout_millis < 0 ? INFINITE
+                                                        : timeout_millis) ==
+      WAIT_OBJECT_0;
+}
+#else
+Event::Event() {
+  if (pipe(fds_) < 0)
+    Fatal("pipe: %s", strerror(errno));
+  for (int i = 0; i < 2; ++i) {
+    SetCloseOnExec(fds_[i]);
+    fcntl(fds_[i], F_SETFL, fcntl(fds_[i], F_GETFL) | O_NONBLOCK);
+  }
+}
+
+Event::~Event() {
+  close(fds_[0]);
+  close(fds_[1]);
+}
+
+void Event::Signal() {
+  // If the pipe is full, the waiter has plenty to wake up to already.
+  char byte = 0;
+  ssize_t ignored = write(fds_[1], &byte, 1);
+  (void)ignored;
+}
+
+bool Event::Wait(int timeout_millis) {
+  pollfd fd;
+  fd.fd = fds_[0];
+  fd.events = POLLIN;
+  int ret;
+  while ((ret = poll(&fd, 1, timeout_millis)) < 0 && errno == EINTR) {}
+  if (ret <= 0)
+    return false;
+  char buf[64];
+  while (read(fds_[0], buf, sizeof(buf)) > 0) {}
+  return true;
+}
+#endif
+
+Thread::Thread() : started_(false) {}
+
+#ifdef _WIN32
+bool Thread::Start() {
+  thread_ = CreateThread(NULL, 0, ThreadMain, this, 0, NULL);
+  started_ = thread_ != NULL;
+  return started_;
+}
+
+void Thread::Join() {
+  if (!started_)
+    return;
+  WaitForSingleObject(thread_, INFINITE);
+  CloseHandle(thread_);
+  started_ = false;
+}
+
+// static
+DWORD WINAPI Thread::ThreadMain(void* arg) {
+  static_cast<Thread*>(arg)->Run();
+  return 0;
+}
+#else
+namespace {
+
+/// Blocks SIGALRM in the calling thread for its lifetime, and so in the
+/// threads it starts meanwhile, which inherit the mask.  The jobserver's
+/// TimedRead() relies on the signal landing on the thread reading.
+struct ScopedAlarmBlock {
+  ScopedAlarmBlock() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set_);
+  }
+  ~ScopedAlarmBlock() { pthread_sigmask(SIG_SETMASK, &old_set_, NULL); }
+
+  sigset_t old_set_;
+};
+
+}  // namespace
+
+bool Thread::Start() {
+  ScopedAlarmBlock block;
+  started_ = pthread_create(&thread_, NULL, ThreadMain, this) == 0;
+  return started_;
+}
+
+void Thread::Join() {
+  if (!started_)
+    return;
+  pthread_join(thread_, NULL);
+  started_ = false;
+}
+
+// static
+void* Thread::ThreadMain(void* arg) {
+  static_cast<Thread*>(arg)->Run();
+  return NULL;
+}
+#endif
+
+namespace {
+
+/// State shared by all threads working on one RunInParallel() call.
+/// Items are handed out in small chunks so that a few slow items (e.g. a
+/// stat() on a cold NFS directory) don't leave the other threads idle.
+struct WorkQueue {
+  WorkQueue(ParallelTask* task, size_t count, size_t chunk_size)
+      : task_(task), count_(count), chunk_size_(chunk_size), next_(0) {}
+
+  /// Grab the next chunk; returns false when there's nothing left.
+  bool Next(size_t* begin, size_t* end) {
+    ScopedLock lock(&mutex_);
+    if (next_ >= count_)
+      return false;
+    *begin = next_;
+    next_ += chunk_size_;
+    if (next_ > count_)
+      next_ = count_;
+    *end = next_;
+    return true;
+  }
+
+  void Drain() {
+    size_t begin, end;
+    while (Next(&begin, &end))
+      task_->Run(begin, end);
+  }
+
+  ParallelTask* task_;
+  size_t count_;
+  size_t chunk_size_;
+  size_t next_;
+  Mutex mutex_;
+};
+
+#ifdef _WIN32
+DWORD WINAPI WorkerMain(void* arg) {
+  static_cast<WorkQueue*>(arg)->Drain();
+  return 0;
+}
+#else
+void* WorkerMain(void* arg) {
+  static_cast<WorkQueue*>(arg)->Drain();
+  return NULL;
+}
+#endif
+
+}  // namespace
+
+void RunInParallel(ParallelTask* task, size_t count, int thread_count) {
+  if (count == 0)
+    return;
+  if (thread_count <= 1 || count == 1) {
+    task->Run(0, count);
+    return;
+  }
+  if ((size_t)thread_count > count)
+    thread_count = count;
+
+  // Aim for a few chunks per thread, but keep them small enough to
+  // balance uneven items.
+  size_t chunk_size = count / (thread_count * 4);
+  if (chunk_size < 1)
+    chunk_size = 1;
+  if (chunk_size > 64)
+    chunk_size = 64;
+  WorkQueue queue(task, count, chunk_size);
+
+  // If a thread fails to start, the remaining ones (and at worst the
+  // calling thread alone) simply pick up its share.
+#ifdef _WIN32
+  vector<HANDLE> threads;
+  for (int i = 1; i < thread_count; ++i) {
+    HANDLE thread = CreateThread(NULL, 0, WorkerMain, &queue, 0, NULL);
+    if (thread)
+      threads.push_back(thread);
+  }
+  queue.Drain();
+  for (size_t i = 0; i < threads.size(); ++i) {
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+  }
+#else
+  vector<pthread_t> threads;
+  {
+    ScopedAlarmBlock block;
+    for (int i = 1; i < thread_count; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, WorkerMain, &queue) == 0)
+        threads.push_back(thread);
+    }
+  }
+  queue.Drain();
+  for (size_t i = 0; i < threads.size(); ++i)
+    pthread_join(threads[i], NULL);
+#endif
+}
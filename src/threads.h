@@ -0,0 +1,123 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_THREADS_H_
+#define NINJA_THREADS_H_
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/// A minimal portable mutex.
+struct Mutex {
+  Mutex();
+  ~Mutex();
+  void Acquire();
+  void Release();
+
+ private:
+#ifdef _WIN32
+  CRITICAL_SECTION lock_;
+#else
+  pthread_mutex_t lock_;
+#endif
+  // Not copyable.
+  Mutex(const Mutex&);
+  void operator=(const Mutex&);
+};
+
+/// Holds a Mutex for the lifetime of the object.
+struct ScopedLock {
+  explicit ScopedLock(Mutex* mutex) : mutex_(mutex) { mutex_->Acquire(); }
+  ~ScopedLock() { mutex_->Release(); }
+
+ private:
+  Mutex* mutex_;
+};
+
+/// Lets one thread wake another.  Signals don't queue up: several
+/// Signal() calls may wake a single Wait(), and Wait() may also return
+/// early, so waiters check what they're waiting for.  On POSIX systems
+/// Signal() is async-signal-safe.
+struct Event {
+  Event();
+  ~Event();
+  void Signal();
+  /// Wait for a Signal(), or until \a timeout_millis pass if not
+  /// negative.  Returns false on timeout.
+  bool Wait(int timeout_millis = -1);
+
+ private:
+#ifdef _WIN32
+  HANDLE event_;
+#else
+  /// A pipe, as the one portable thing a signal handler can write to.
+  int fds_[2];
+#endif
+  // Not copyable.
+  Event(const Event&);
+  void operator=(const Event&);
+};
+
+/// A thread of execution running a subclass's Run().  Join() must be
+/// called before a started Thread is destroyed.  On POSIX systems the
+/// thread never takes SIGALRM, which is left to the main thread.
+struct Thread {
+  Thread();
+  virtual ~Thread() {}
+
+  /// Start running Run() on a new thread.  Returns false if no thread
+  /// could be created, in which case nothing runs.
+  bool Start();
+  /// Wait for Run() to return.  Does nothing if the thread wasn't started.
+  void Join();
+
+ protected:
+  virtual void Run() = 0;
+
+ private:
+#ifdef _WIN32
+  static DWORD WINAPI ThreadMain(void* arg);
+  HANDLE thread_;
+#else
+  static void* ThreadMain(void* arg);
+  pthread_t thread_;
+#endif
+  bool started_;
+
+  // Not copyable.
+  Thread(const Thread&);
+  void operator=(const Thread&);
+};
+
+/// A piece of work that can be split into independent items, identified
+/// by their index.
+struct ParallelTask {
+  virtual ~ParallelTask() {}
+
+  /// Process items [begin, end).  Called concurrently from several
+  /// threads, each with a disjoint range.
+  virtual void Run(size_t begin, size_t end) = 0;
+};
+
+/// Process items [0, count) of \a task on up to \a thread_count threads,
+/// the calling thread included, and return once all of them are done.
+/// The threads started block SIGALRM, as Thread does.
+void RunInParallel(ParallelTask* task, size_t count, int thread_count);
+
+#endif  // NINJA_THREADS_H_
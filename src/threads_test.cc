@@ -0,0 +1,133 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "threads.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+#include <vector>
+using namespace std;
+
+#include <gtest/gtest.h>
+
+namespace {
+
+/// Counts how often each item was processed.
+struct CountTask : public ParallelTask {
+  CountTask(size_t count) : hits_(count, 0), calls_(0) {}
+
+  virtual void Run(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      ++hits_[i];
+    ScopedLock lock(&mutex_);
+    ++calls_;
+  }
+
+  vector<int> hits_;
+  int calls_;
+  Mutex mutex_;
+};
+
+TEST(RunInParallel, Empty) {
+  CountTask task(0);
+  RunInParallel(&task, 0, 4);
+  EXPECT_EQ(0, task.calls_);
+}
+
+TEST(RunInParallel, SingleThread) {
+  CountTask task(10);
+  RunInParallel(&task, 10, 1);
+  EXPECT_EQ(1, task.calls_);
+  for (int i = 0; i < 10; ++i)
+    EXPECT_EQ(1, task.hits_[i]);
+}
+
+TEST(RunInParallel, EachItemOnce) {
+  const size_t kCount = 10000;
+  CountTask task(kCount);
+  RunInParallel(&task, kCount, 8);
+  EXPECT_GT(task.calls_, 1);
+  for (size_t i = 0; i < kCount; ++i)
+    ASSERT_EQ(1, task.hits_[i]) << i;
+}
+
+TEST(RunInParallel, MoreThreadsThanItems) {
+  CountTask task(3);
+  RunInParallel(&task, 3, 16);
+  for (int i = 0; i < 3; ++i)
+    EXPECT_EQ(1, task.hits_[i]);
+}
+
+struct FlagThread : public Thread {
+  FlagThread() : ran_(false) {}
+  virtual void Run() { ran_ = true; }
+  bool ran_;
+};
+
+TEST(Thread, StartJoin) {
+  FlagThread thread;
+  ASSERT_TRUE(thread.Start());
+  thread.Join();
+  EXPECT_TRUE(thread.ran_);
+  // A second Join() is harmless.
+  thread.Join();
+}
+
+#ifndef _WIN32
+struct MaskThread : public Thread {
+  MaskThread() : alarm_blocked_(false) {}
+  virtual void Run() {
+    sigset_t set;
+    pthread_sigmask(SIG_BLOCK, NULL, &set);
+    alarm_blocked_ = sigismember(&set, SIGALRM) == 1;
+  }
+  bool alarm_blocked_;
+};
+
+TEST(Thread, BlocksAlarm) {
+  MaskThread thread;
+  ASSERT_TRUE(thread.Start());
+  thread.Join();
+  EXPECT_TRUE(thread.alarm_blocked_);
+
+  // The starting thread is left as it was.
+  sigset_t set;
+  pthread_sigmask(SIG_BLOCK, NULL, &set);
+  EXPECT_FALSE(sigismember(&set, SIGALRM));
+}
+#endif
+
+struct SignalThread : public Thread {
+  virtual void Run() { event_.Signal(); }
+  Event event_;
+};
+
+TEST(Event, SignalWait) {
+  Event event;
+  EXPECT_FALSE(event.Wait(0));
+  event.Signal();
+  event.Signal();
+  EXPECT_TRUE(event.Wait(0));
+  // Signals don't queue up.
+  EXPECT_FALSE(event.Wait(0));
+
+  SignalThread thread;
+  ASSERT_TRUE(thread.Start());
+  EXPECT_TRUE(thread.event_.Wait());
+  thread.Join();
+}
+
+}  // namespace
@@ -0,0 +1,139 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trace.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "graph.h"
+#include "metrics.h"
+
+Trace* g_trace = NULL;
+
+Trace::Trace() : start_(GetTimeMicros()) {
+#ifdef _WIN32
+  main_thread_ = GetCurrentThreadId();
+#else
+  main_thread_ = pthread_self();
+#endif
+}
+
+void Trace::EdgeStarted(Edge* edge) {
+  Running running;
+  running.slot = find(slots_.begin(), slots_.end(), (Edge*)NULL) -
+      slots_.begin();
+  if (running.slot == slots_.size())
+    slots_.push_back(NULL);
+  slots_[running.slot] = edge;
+  running.start = GetTimeMicros() - start_;
+  running_[edge] = running;
+  AddRunningCounter(running.start);
+}
+
+void Trace::EdgeFinished(Edge* edge, bool success) {
+  RunningMap::iterator i = running_.find(edge);
+  if (i == running_.end())
+    return;
+  Running running = i->second;
+  running_.erase(i);
+  slots_[running.slot] = NULL;
+  int64_t end = GetTimeMicros() - start_;
+
+  string output = edge->outputs_.empty() ? "" : edge->outputs_[0]->path();
+  string args = "\"rule\":";
+  AppendJSONString(edge->rule().name(), &args);
+  args += ",\"output\":";
+  AppendJSONString(output, &args);
+  if (!success)
+    args += ",\"failed\":true";
+  AddEvent("X", output, "edge", running.start, end - running.start,
+           running.slot + 1, args);
+  AddRunningCounter(end);
+}
+
+void Trace::JobLimit(int limit) {
+  char args[32];
+  snprintf(args, sizeof(args), "\"jobs\":%d", limit);
+  AddEvent("C", "job limit", "edge", GetTimeMicros() - start_, 0, 0, args);
+}
+
+void Trace::Span(const string& name, int64_t start, int64_t dur) {
+  if (dur < kMinSpanMicros)
+    return;
+#ifdef _WIN32
+  if (GetCurrentThreadId() != main_thread_)
+    return;
+#else
+  if (!pthread_equal(pthread_self(), main_thread_))
+    return;
+#endif
+  AddEvent("X", name, "phase", start - start_, dur, 0, "");
+}
+
+void Trace::AddEvent(const char* phase, const string& name,
+                     const char* category, int64_t ts, int64_t dur, int tid,
+                     const string& args) {
+  char buf[128];
+  if (!events_.empty())
+    events_ += ",\n";
+  events_ += "{\"name\":";
+  AppendJSONString(name, &events_);
+  snprintf(buf, sizeof(buf),
+           ",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%lld,\"pid\":1,\"tid\":%d",
+           category, phase, (long long)ts, tid);
+  events_ += buf;
+  if (phase[0] == 'X') {
+    snprintf(buf, sizeof(buf), ",\"dur\":%lld", (long long)dur);
+    events_ += buf;
+  }
+  events_ += ",\"args\":{" + args + "}}";
+}
+
+void Trace::AddRunningCounter(int64_t ts) {
+  char args[32];
+  snprintf(args, sizeof(args), "\"jobs\":%d", (int)running_.size());
+  AddEvent("C", "running", "edge", ts, 0, 0, args);
+}
+
+bool Trace::Save(const string& path, string* err) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  // Name the lanes before anything else.
+  string contents = "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                    "\"tid\":0,\"args\":{\"name\":\"ninja\"}}";
+  for (size_t i = 1; i <= slots_.size(); ++i) {
+    char buf[128];
+    snprintf(buf, sizeof(buf),
+             ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+             "\"args\":{\"name\":\"slot %d\"}}", (int)i, (int)i);
+    contents += buf;
+  }
+  if (!events_.empty())
+    contents += ",\n" + events_;
+  fprintf(file, "[\n%s\n]\n", contents.c_str());
+
+  if (fclose(file) != 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,92 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_TRACE_H_
+#define NINJA_TRACE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "util.h"  // For int64_t.
+
+struct Edge;
+
+/// Records what a build did and when, for viewing in Chrome's
+/// about:tracing (or anything else reading its trace event format).
+///
+/// Each command is drawn in the lane of the job slot it ran in, with a
+/// counter of the number of commands running.  The spans measured by
+/// METRIC_RECORD show up in a lane of their own, which makes the time
+/// spent loading the manifest and the logs or scanning for dirty files
+/// visible.
+struct Trace {
+  Trace();
+
+  static const int64_t kMinSpanMicros = 100;
+
+  /// Note the start and end of a command.
+  void EdgeStarted(Edge* edge);
+  void EdgeFinished(Edge* edge, bool success);
+  /// Note that the number of commands allowed to run at once changed.
+  void JobLimit(int limit);
+
+  /// Note that \a name took \a dur micros from \a start (a
+  /// GetTimeMicros() value).  Only spans recorded on the thread that
+  /// created the Trace are kept, so that they nest properly, and only
+  /// those taking at least kMinSpanMicros: a large build canonicalizes
+  /// paths and looks up nodes millions of times.
+  void Span(const string& name, int64_t start, int64_t dur);
+
+  /// Write out everything recorded so far.
+  bool Save(const string& path, string* err);
+
+ private:
+  /// Append an event to events_, with \a args being the contents of its
+  /// "args" object.
+  void AddEvent(const char* phase, const string& name, const char* category,
+                int64_t ts, int64_t dur, int tid, const string& args);
+  void AddRunningCounter(int64_t ts);
+
+  /// When the trace began; all timestamps are relative to it.
+  int64_t start_;
+  /// The slot each running command occupies (or NULL if free); a
+  /// command's lane is its index plus one.
+  vector<Edge*> slots_;
+  struct Running {
+    size_t slot;
+    int64_t start;
+  };
+  typedef map<Edge*, Running> RunningMap;
+  RunningMap running_;
+  /// The events recorded so far, as a comma-separated list of objects.
+  string events_;
+#ifdef _WIN32
+  DWORD main_thread_;
+#else
+  pthread_t main_thread_;
+#endif
+};
+
+/// The trace of this run, if -d trace is on.
+extern Trace* g_trace;
+
+#endif  // NINJA_TRACE_H_
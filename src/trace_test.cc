@@ -0,0 +1,94 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trace.h"
+
+#include "graph.h"
+#include "metrics.h"
+#include "test.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char kTestFilename[] = "TraceTest-tempfile";
+
+struct TraceTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat in\n"
+"build b: cat in\n"
+"build c: cat in\n"));
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+
+  /// Save \a trace and return what was written.
+  string Saved(Trace* trace) {
+    string err, contents;
+    EXPECT_TRUE(trace->Save(kTestFilename, &err));
+    EXPECT_EQ("", err);
+    EXPECT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+    return contents;
+  }
+};
+
+TEST_F(TraceTest, Empty) {
+  Trace trace;
+  EXPECT_EQ("[\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+            "\"args\":{\"name\":\"ninja\"}}\n]\n", Saved(&trace));
+}
+
+TEST_F(TraceTest, Slots) {
+  Edge* a = GetNode("a")->in_edge();
+  Edge* b = GetNode("b")->in_edge();
+  Edge* c = GetNode("c")->in_edge();
+
+  Trace trace;
+  trace.EdgeStarted(a);
+  trace.EdgeStarted(b);
+  trace.EdgeFinished(a, true);
+  // c takes the lane a left free.
+  trace.EdgeStarted(c);
+  trace.EdgeFinished(c, false);
+  trace.EdgeFinished(b, true);
+
+  string contents = Saved(&trace);
+  EXPECT_NE(string::npos, contents.find("\"args\":{\"name\":\"slot 2\"}"));
+  EXPECT_EQ(string::npos, contents.find("slot 3"));
+  EXPECT_NE(string::npos, contents.find(
+      "{\"name\":\"c\",\"cat\":\"edge\",\"ph\":\"X\""));
+  EXPECT_NE(string::npos, contents.find(
+      "\"tid\":1,\"dur\":"));
+  EXPECT_NE(string::npos, contents.find(
+      "\"args\":{\"rule\":\"cat\",\"output\":\"c\",\"failed\":true}"));
+  EXPECT_NE(string::npos, contents.find("\"args\":{\"jobs\":2}"));
+  EXPECT_NE(string::npos, contents.find("\"args\":{\"jobs\":0}"));
+}
+
+TEST_F(TraceTest, Span) {
+  Trace trace;
+  trace.Span("load \"x\"\n", GetTimeMicros(), 420);
+  trace.Span("quick", GetTimeMicros(), 42);
+  string contents = Saved(&trace);
+  EXPECT_NE(string::npos, contents.find(
+      "{\"name\":\"load \\\"x\\\"\\u000a\",\"cat\":\"phase\",\"ph\":\"X\""));
+  EXPECT_NE(string::npos, contents.find("\"tid\":0,\"dur\":420,"));
+  EXPECT_EQ(string::npos, contents.find("quick"));
+}
+
+}  // namespace
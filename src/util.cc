@@ -28,7 +28,18 @@
 #include <sys/types.h>
 
 #ifndef _WIN32
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <sys/sysctl.h>
+#elif defined(__FreeBSD__)
+#include <sys/sysctl.h>
+#elif defined(linux)
+#include <sys/sysinfo.h>
 #endif
 
 #include <vector>
@@ -37,6 +48,7 @@
 #include <direct.h>  // _mkdir
 #endif
 
+#include "byte_scan.h"
 #include "edit_distance.h"
 #include "metrics.h"
 
@@ -88,6 +100,32 @@ bool CanonicalizePath(string* path, string* err) {
   return true;
 }
 
+string DirName(const string& path) {
+#ifdef _WIN32
+  const char kPathSeparators[] = "\\/";
+#else
+  const char kPathSeparators[] = "/";
+#endif
+  string::size_type slash_pos = path.find_last_of(kPathSeparators);
+  if (slash_pos == string::npos)
+    return string();  // Nothing to do.
+  while (slash_pos > 0 && strchr(kPathSeparators, path[slash_pos - 1]))
+    --slash_pos;
+  if (slash_pos == 0)
+    return path.substr(0, 1);
+  return path.substr(0, slash_pos);
+}
+
+string GetTempDir() {
+#ifdef _WIN32
+  const char* tmpdir = getenv("TEMP");
+  return tmpdir && *tmpdir ? tmpdir : ".";
+#else
+  const char* tmpdir = getenv("TMPDIR");
+  return tmpdir && *tmpdir ? tmpdir : "/tmp";
+#endif
+}
+
 bool CanonicalizePath(char* path, int* len, string* err) {
   // WARNING: this function is performance-critical; please benchmark
   // any changes you make to it.
@@ -97,14 +135,35 @@ bool CanonicalizePath(char* path, int* len, string* err) {
     return false;
   }
 
+  char* start = path;
+  const char* end = start + *len;
+
+  // Most paths are already canonical: past any leading "/" and "../"s,
+  // which are kept as they are, there is no empty, "." or ".." component
+  // and no trailing slash.  (Names starting with a dot take the slow path
+  // too.)
+  const char* rest = start;
+  if (*rest == '/')
+    ++rest;
+  while (end - rest >= 3 && rest[0] == '.' && rest[1] == '.' &&
+         rest[2] == '/') {
+    rest += 3;
+  }
+  if (rest < end && *rest != '.' && *rest != '/' && end[-1] != '/' &&
+      !HasSlashBeforeSlashOrDot(rest, end)) {
+    return true;
+  }
+
+  // Most paths fit in the array; deeper ones spill onto the heap.
   const int kMaxPathComponents = 30;
-  char* components[kMaxPathComponents];
+  char* fixed_components[kMaxPathComponents];
+  vector<char*> more_components;
+  char** components = fixed_components;
+  int component_capacity = kMaxPathComponents;
   int component_count = 0;
 
-  char* start = path;
   char* dst = start;
   const char* src = start;
-  const char* end = start + *len;
 
   if (*src == '/') {
     ++src;
@@ -136,8 +195,15 @@ bool CanonicalizePath(char* path, int* len, string* err) {
     }
 
     if (sep > src) {
-      if (component_count == kMaxPathComponents)
-        Fatal("path has too many components");
+      if (component_count == component_capacity) {
+        if (components == fixed_components) {
+          more_components.assign(fixed_components,
+                                 fixed_components + component_count);
+        }
+        component_capacity *= 2;
+        more_components.resize(component_capacity);
+        components = &more_components[0];
+      }
       components[component_count] = dst;
       ++component_count;
       while (src <= sep) {
@@ -167,11 +233,33 @@ int ReadFile(const string& path, string* contents, string* err) {
     return -errno;
   }
 
-  char buf[64 << 10];
-  size_t len;
-  while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
-    contents->append(buf, len);
+  // Read straight into |contents|, sized up front, rather than through
+  // stdio's buffer and then a local one.  Asking for a byte more than the
+  // file's size finds the end in one read.  (With text-mode translation
+  // on Windows the file may read shorter than its size.)
+  setvbuf(f, NULL, _IONBF, 0);
+  size_t start = contents->size();
+  size_t size = 0;
+  if (fseek(f, 0, SEEK_END) == 0) {
+    long end = ftell(f);
+    if (end > 0)
+      size = end;
+    fseek(f, 0, SEEK_SET);
+  }
+  contents->resize(start + size + 1);
+  size_t used = 0;
+  for (;;) {
+    if (start + used == contents->size())
+      contents->resize(contents->size() + (64 << 10));
+    size_t len = fread(&(*contents)[start + used], 1,
+                       contents->size() - start - used, f);
+    if (len == 0)
+      break;
+    used += len;
   }
+  contents->resize(start + used);
+  METRIC_COUNT("files read", 1);
+  METRIC_COUNT("bytes read", used);
   if (ferror(f)) {
     err->assign(strerror(errno));  // XXX errno?
     contents->clear();
@@ -182,6 +270,61 @@ int ReadFile(const string& path, string* contents, string* err) {
   return 0;
 }
 
+MappedFile::MappedFile() : data_(NULL), size_(0) {}
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+int MappedFile::Open(const string& path, string* err) {
+  Close();
+#ifdef _WIN32
+  int ret = ::ReadFile(path, &contents_, err);
+  if (ret < 0)
+    return ret;
+  data_ = contents_.data();
+  size_ = contents_.size();
+  return 0;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    err->assign(strerror(errno));
+    return -errno;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int saved_errno = errno;
+    err->assign(strerror(saved_errno));
+    close(fd);
+    return -saved_errno;
+  }
+  if (st.st_size > 0) {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      int saved_errno = errno;
+      err->assign(strerror(saved_errno));
+      close(fd);
+      return -saved_errno;
+    }
+    data_ = (const char*)data;
+    size_ = st.st_size;
+  }
+  close(fd);
+  return 0;
+#endif
+}
+
+void MappedFile::Close() {
+#ifdef _WIN32
+  contents_.clear();
+#else
+  if (data_)
+    munmap((void*)data_, size_);
+#endif
+  data_ = NULL;
+  size_ = 0;
+}
+
 void SetCloseOnExec(int fd) {
 #ifndef _WIN32
   int flags = fcntl(fd, F_GETFD);
@@ -209,6 +352,152 @@ int64_t GetTimeMillis() {
 #endif
 }
 
+double GetLoadAverage() {
+#ifdef _WIN32
+  // Windows has no equivalent.
+  return -1;
+#else
+  double load;
+  if (getloadavg(&load, 1) != 1)
+    return -1;
+  return load;
+#endif
+}
+
+int64_t GetAvailableMemory() {
+#if defined(_WIN32)
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  if (!GlobalMemoryStatusEx(&status))
+    return -1;
+  return status.ullAvailPhys;
+#elif defined(linux)
+  // MemAvailable accounts for reclaimable caches, unlike MemFree.
+  FILE* f = fopen("/proc/meminfo", "r");
+  if (!f)
+    return -1;
+  int64_t available = -1;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    long long kb;
+    if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1) {
+      available = (int64_t)kb * 1024;
+      break;
+    }
+  }
+  fclose(f);
+  return available;
+#elif defined(__APPLE__)
+  vm_statistics64_data_t stats;
+  mach_msg_type_number_t count = HOST_VM_INFO64_COUNT;
+  if (host_statistics64(mach_host_self(), HOST_VM_INFO64,
+                        (host_info64_t)&stats, &count) != KERN_SUCCESS)
+    return -1;
+  return (int64_t)(stats.free_count + stats.inactive_count) * getpagesize();
+#elif defined(__FreeBSD__)
+  u_int free_count, inactive_count;
+  size_t size = sizeof(u_int);
+  if (sysctlbyname("vm.stats.vm.v_free_count", &free_count, &size,
+                   NULL, 0) != 0 ||
+      sysctlbyname("vm.stats.vm.v_inactive_count", &inactive_count, &size,
+                   NULL, 0) != 0)
+    return -1;
+  return (int64_t)(free_count + inactive_count) * getpagesize();
+#else
+  return -1;
+#endif
+}
+
+int GetProcessorCount() {
+#if defined(linux)
+  return get_nprocs();
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+  int processors = 0;
+  size_t processors_size = sizeof(processors);
+  int name[] = {CTL_HW, HW_NCPU};
+  if (sysctl(name, sizeof(name) / sizeof(int),
+             &processors, &processors_size,
+             NULL, 0) < 0) {
+    return 0;
+  }
+  return processors;
+#elif defined(_WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  return 0;
+#endif
+}
+
+bool GetCpuTimes(int64_t* busy, int64_t* total) {
+#if defined(_WIN32)
+  FILETIME idle_time, kernel_time, user_time;
+  if (!GetSystemTimes(&idle_time, &kernel_time, &user_time))
+    return false;
+  ULARGE_INTEGER idle, kernel, user;
+  idle.LowPart = idle_time.dwLowDateTime;
+  idle.HighPart = idle_time.dwHighDateTime;
+  kernel.LowPart = kernel_time.dwLowDateTime;
+  kernel.HighPart = kernel_time.dwHighDateTime;
+  user.LowPart = user_time.dwLowDateTime;
+  user.HighPart = user_time.dwHighDateTime;
+  // Kernel time includes the idle time.
+  *total = kernel.QuadPart + user.QuadPart;
+  *busy = *total - idle.QuadPart;
+  return true;
+#elif defined(linux)
+  FILE* f = fopen("/proc/stat", "r");
+  if (!f)
+    return false;
+  // The first line sums up all processors: user, nice, system, idle,
+  // iowait, irq, softirq and steal time.
+  long long times[8] = { 0 };
+  int fields = fscanf(f, "cpu %lld %lld %lld %lld %lld %lld %lld %lld",
+                      &times[0], &times[1], &times[2], &times[3], &times[4],
+                      &times[5], &times[6], &times[7]);
+  fclose(f);
+  if (fields < 4)
+    return false;
+  *total = 0;
+  for (int i = 0; i < 8; ++i)
+    *total += times[i];
+  // A processor waiting for I/O is as good as idle.
+  *busy = *total - times[3] - times[4];
+  return true;
+#elif defined(__APPLE__)
+  host_cpu_load_info_data_t load;
+  mach_msg_type_number_t count = HOST_CPU_LOAD_INFO_COUNT;
+  if (host_statistics(mach_host_self(), HOST_CPU_LOAD_INFO,
+                      (host_info_t)&load, &count) != KERN_SUCCESS)
+    return false;
+  *busy = (int64_t)load.cpu_ticks[CPU_STATE_USER] +
+      load.cpu_ticks[CPU_STATE_SYSTEM] + load.cpu_ticks[CPU_STATE_NICE];
+  *total = *busy + load.cpu_ticks[CPU_STATE_IDLE];
+  return true;
+#else
+  return false;
+#endif
+}
+
+int GetRunQueueLength() {
+#if defined(linux)
+  // The fourth field is "running/total" scheduling entities.
+  FILE* f = fopen("/proc/loadavg", "r");
+  if (!f)
+    return -1;
+  int running = 0;
+  int fields = fscanf(f, "%*f %*f %*f %d/", &running);
+  fclose(f);
+  if (fields != 1)
+    return -1;
+  // We are running while reading it.
+  return running > 0 ? running - 1 : 0;
+#else
+  return -1;
+#endif
+}
+
 const char* SpellcheckStringV(const string& text,
                               const vector<const char*>& words) {
   const bool kAllowReplacements = true;
@@ -286,3 +575,21 @@ string StripAnsiEscapeCodes(const string& in) {
   }
   return stripped;
 }
+
+void AppendJSONString(const string& str, string* out) {
+  out->push_back('"');
+  for (string::const_iterator i = str.begin(); i != str.end(); ++i) {
+    unsigned char c = *i;
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out->append(escaped);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
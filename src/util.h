@@ -42,14 +42,46 @@ bool CanonicalizePath(string* path, string* err);
 
 bool CanonicalizePath(char* path, int* len, string* err);
 
+/// Return the directory containing \a path, without trailing slashes:
+/// "" for a bare filename, and the root for a file in it.
+string DirName(const string& path);
+
+/// Return the directory for temporary files: $TMPDIR if set, else /tmp
+/// (%TEMP% if set, else "." on Windows).
+string GetTempDir();
+
 /// Create a directory (mode 0777 on Unix).
 /// Portability abstraction.
 int MakeDir(const string& path);
 
-/// Read a file to a string.
+/// Read a file, appending it to \a contents.
 /// Returns -errno and fills in \a err on error.
 int ReadFile(const string& path, string* contents, string* err);
 
+/// A read-only view of a file's contents.  The file is mmap()ed where
+/// the platform supports it and read into memory otherwise, so callers
+/// can parse it in place without copying.
+struct MappedFile {
+  MappedFile();
+  ~MappedFile();
+
+  /// Map \a path.  Returns -errno and fills in \a err on error.
+  int Open(const string& path, string* err);
+
+  /// Release the mapping.
+  void Close();
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const char* data_;
+  size_t size_;
+#ifdef _WIN32
+  string contents_;
+#endif
+};
+
 /// Mark a file descriptor to not be inherited on exec()s.
 void SetCloseOnExec(int fd);
 
@@ -58,6 +90,25 @@ void SetCloseOnExec(int fd);
 /// time.
 int64_t GetTimeMillis();
 
+/// Get the one-minute load average of the system, or a negative value if
+/// it isn't available.
+double GetLoadAverage();
+
+/// Get the number of bytes of memory available for new processes without
+/// swapping, or a negative value if it isn't known.
+int64_t GetAvailableMemory();
+
+/// Get the number of processors, or 0 if it isn't known.
+int GetProcessorCount();
+
+/// Get the time all processors have spent busy, and in all, in some unit
+/// counting up from an arbitrary start.  Returns false if unknown.
+bool GetCpuTimes(int64_t* busy, int64_t* total);
+
+/// Get the number of threads running or waiting for a processor, not
+/// counting the caller, or a negative value if it isn't known.
+int GetRunQueueLength();
+
 /// Given a misspelled string and a list of correct spellings, returns
 /// the closest match or NULL if there is no close enough match.
 const char* SpellcheckStringV(const string& text, const vector<const char*>& words);
@@ -68,6 +119,9 @@ const char* SpellcheckString(const string& text, ...);
 /// Removes all Ansi escape codes (http://www.termsys.demon.co.uk/vtansi.htm).
 string StripAnsiEscapeCodes(const string& in);
 
+/// Append \a str to \a out as a JSON string literal, quotes included.
+void AppendJSONString(const string& str, string* out);
+
 #ifdef _MSC_VER
 #define snprintf _snprintf
 #define fileno _fileno
@@ -56,6 +56,20 @@ TEST(CanonicalizePath, PathSamples) {
   EXPECT_EQ("../bar.h", path);
 }
 
+TEST(DirName, Samples) {
+  EXPECT_EQ("", DirName("foo.h"));
+  EXPECT_EQ("foo", DirName("foo/bar.h"));
+  EXPECT_EQ("foo/bar", DirName("foo/bar/baz.h"));
+  EXPECT_EQ("foo", DirName("foo//bar.h"));
+  EXPECT_EQ("foo/bar", DirName("foo/bar/"));
+  EXPECT_EQ("/", DirName("/foo.h"));
+  EXPECT_EQ("/", DirName("//foo.h"));
+#ifdef _WIN32
+  EXPECT_EQ("foo", DirName("foo\\bar.h"));
+  EXPECT_EQ("foo/bar", DirName("foo/bar\\/baz.h"));
+#endif
+}
+
 TEST(CanonicalizePath, UpDir) {
   std::string path, err;
   path = "../../foo/bar.h";
@@ -74,6 +88,59 @@ TEST(CanonicalizePath, AbsolutePath) {
   EXPECT_EQ("/usr/include/stdio.h", path);
 }
 
+TEST(CanonicalizePath, AlreadyCanonical) {
+  // These all take the fast path, or just miss it.
+  const char* kPaths[] = {
+    "a", "foo/bar.h", "/usr/include/stdio.h", "../../foo/bar.h",
+    "/../foo", "foo.bar/baz..h", "foo/.hidden", ".hidden/foo", "../.hidden",
+    "some/long/path/to/a/header/file/that/spans/several/blocks.h",
+  };
+  for (size_t i = 0; i < sizeof(kPaths) / sizeof(kPaths[0]); ++i) {
+    string path = kPaths[i];
+    string err;
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ(kPaths[i], path);
+  }
+}
+
+TEST(CanonicalizePath, NotCanonical) {
+  string path, err;
+  // Each of these only has one thing wrong with it, past the first block
+  // of 16 bytes.
+  path = "some/long/path/to/a//header.h";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("some/long/path/to/a/header.h", path);
+
+  path = "some/long/path/to/a/./header.h";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("some/long/path/to/a/header.h", path);
+
+  path = "some/long/path/to/a/../header.h";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("some/long/path/to/header.h", path);
+
+  path = "some/long/path/to/a/dir/";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("some/long/path/to/a/dir", path);
+
+  path = "..//foo";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("../foo", path);
+}
+
+TEST(CanonicalizePath, ManyComponents) {
+  // More components than fit in the fixed array.
+  string path, expected, err;
+  for (int i = 0; i < 100; ++i) {
+    path += "a/./";
+    expected += "a/";
+  }
+  path += "b";
+  expected += "b";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ(expected, path);
+}
+
 TEST(StripAnsiEscapeCodes, EscapeAtEnd) {
   string stripped = StripAnsiEscapeCodes("foo\33");
   EXPECT_EQ("foo", stripped);
@@ -90,3 +157,30 @@ TEST(StripAnsiEscapeCodes, StripColors) {
   EXPECT_EQ("affixmgr.cxx:286:15: warning: using the result... [-Wparentheses]",
             stripped);
 }
+
+TEST(ReadFile, LargeFile) {
+  // Bigger than the chunks ReadFile() grows its buffer by.
+  const char kTestFile[] = "ReadFileTest-tempfile";
+  string content;
+  for (int i = 0; content.size() < 200000; ++i)
+    content += i % 7 ? 'x' : '\n';
+  FILE* f = fopen(kTestFile, "wb");
+  ASSERT_TRUE(f);
+  ASSERT_EQ(content.size(), fwrite(content.data(), 1, content.size(), f));
+  ASSERT_EQ(0, fclose(f));
+
+  // The file is appended to what's already there.
+  string contents = "prefix";
+  string err;
+  EXPECT_EQ(0, ReadFile(kTestFile, &contents, &err));
+  EXPECT_EQ("", err);
+  EXPECT_TRUE("prefix" + content == contents);
+  remove(kTestFile);
+}
+
+#ifdef linux
+TEST(SystemLoad, Available) {
+  EXPECT_GE(GetLoadAverage(), 0.0);
+  EXPECT_GT(GetAvailableMemory(), 0);
+}
+#endif